@@ -0,0 +1,16 @@
+% Write the numerical phantom of the Bloch simulation test (phantom.bin)
+%
+% 5x5 isochromats in the x-y plane with proton density and T2 increasing
+% along x, T1 and the off-resonance increasing along y.
+
+fov=220e-3; n=5;
+[I,J]=ndgrid(1:n,1:n);
+x=(I-3)*fov/8;
+y=(J-3)*fov/8;
+z=zeros(n);
+pd=0.5+0.1*I;
+t1=0.6+0.2*J;
+t2=0.03+0.02*I;
+dB0=10*(J-3);
+
+mr.writePhantom('phantom.bin', x, y, z, pd, t1, t2, dB0);
@@ -6,10 +6,11 @@
 od = cd(fileparts(which(mfilename)));
 addpath(genpath('../matlab'));
 
-% list of sequences to execute
+% list of sequences (and the test phantom) to write
 fid
 gre
 epi_rs
+phantom
 
 % just in case the change of the cwd persists in the parent shell
 cd(od);
\ No newline at end of file
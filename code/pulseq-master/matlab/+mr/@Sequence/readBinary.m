@@ -50,14 +50,14 @@ while true
         case binaryCodes.section.blocks
             obj.blockEvents = readBlocks(fid);
         case binaryCodes.section.rf
-            format = {'float64','int32','int32','float64','float64'};
-            obj.rfLibrary = readEvents(fid,format,1);
+            format = {'float64','int32','int32','int64','float64','float64'};
+            obj.rfLibrary = readEvents(fid,format,[1 1 1 1e-6 1 1]);
         case binaryCodes.section.gradients
-            format = {'float64','int32'};
-            obj.gradLibrary = readEvents(fid,format,1,'g',obj.gradLibrary);
+            format = {'float64','int32','int64'};
+            obj.gradLibrary = readEvents(fid,format,[1 1 1e-6],'g',obj.gradLibrary);
         case binaryCodes.section.trapezoids
-            format = {'float64','int64','int64','int64'};
-            obj.gradLibrary = readEvents(fid,format,[1 1e-6 1e-6 1e-6],'t',obj.gradLibrary);
+            format = {'float64','int64','int64','int64','int64'};
+            obj.gradLibrary = readEvents(fid,format,[1 1e-6 1e-6 1e-6 1e-6],'t',obj.gradLibrary);
         case binaryCodes.section.adc
             format = {'int64','int64','int64','float64','float64'};
             obj.adcLibrary = readEvents(fid,format,[1 1e-9 1e-6 1 1]);
@@ -48,7 +48,8 @@ if ~isempty(obj.rfLibrary.keys)
         fwrite(fid, k, 'int32');
         fwrite(fid, data(1), 'float64');  % amp
         fwrite(fid, data(2:3), 'int32');  % mag, phase shape ids
-        fwrite(fid, data(4:5), 'float64');  % freq, phase offsets
+        fwrite(fid, round(1e6*data(4)), 'int64');  % delay (us)
+        fwrite(fid, data(5:6), 'float64');  % freq, phase offsets
     end
 end
 
@@ -64,6 +65,7 @@ if any(arbGradMask)
         fwrite(fid, k, 'int32');
         fwrite(fid, data(1), 'float64');  % amp
         fwrite(fid, data(2), 'int32');    % mag shape id
+        fwrite(fid, round(1e6*data(3)), 'int64');  % delay (us)
     end
 end
 
@@ -76,7 +78,7 @@ if any(trapGradMask)
         data(2:end) = round(1e6*data(2:end));
         fwrite(fid, k, 'int32');
         fwrite(fid, data(1), 'float64');  % amp
-        fwrite(fid, data(2:4), 'int64');  % rise, flat, fall
+        fwrite(fid, data(2:5), 'int64');  % rise, flat, fall, delay
     end
 end
 
@@ -10,3 +10,4 @@
 %   makeSincPulse   - makeSincPulse Create a slice selective since pulse.
 %   makeTrapezoid   - makeTrapezoid Create a trapezoid gradient event.
 %   opts            - Set gradient limits of the MR system.
+%   writePhantom    - writePhantom Write a numerical phantom for the C++ Bloch simulator.
@@ -0,0 +1,34 @@
+function writePhantom(filename, x, y, z, pd, t1, t2, dB0)
+%writePhantom Write a numerical phantom for the C++ Bloch simulator.
+%   writePhantom(filename, x, y, z, pd, t1, t2, dB0) Write the isochromats
+%   with positions x, y, z (m), proton density pd, relaxation times t1 and
+%   t2 (s, 0 for no relaxation) and off-resonance dB0 (Hz) to a binary file
+%   read by Phantom::load(). All arguments are arrays with one element per
+%   isochromat; dB0 may be omitted.
+%
+%   Example: export 2-D maps of PD, T1 and T2 on a grid with field of view fov
+%
+%       [n,m]=size(PD);
+%       [X,Y]=ndgrid(((1:n)-n/2-1)*fov/n, ((1:m)-m/2-1)*fov/m);
+%       mask=PD>0;
+%       mr.writePhantom('phantom.bin', X(mask), Y(mask), 0*X(mask), ...
+%                       PD(mask), T1(mask), T2(mask));
+%
+%   See also  Sequence.write
+
+if nargin<8
+    dB0=zeros(size(x));
+end
+data={x, y, z, pd, t1, t2, dB0};
+n=numel(x);
+for i=1:length(data)
+    assert(numel(data{i})==n, 'All phantom arrays must have the same number of elements');
+end
+
+fid=fopen(filename, 'w', 'ieee-le');
+fwrite(fid, [1 double('phantom')], 'uint8');
+fwrite(fid, n, 'int64');
+for i=1:length(data)
+    fwrite(fid, data{i}(:), 'float32');
+end
+fclose(fid);
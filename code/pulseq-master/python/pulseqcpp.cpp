@@ -0,0 +1,1184 @@
+/** @file pulseqcpp.cpp */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "ExternalSequence.h"
+#include "BlockArrays.h"
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+/*
+ * Python extension module wrapping ExternalSequence, SequenceWriter and EventIndex.
+ *
+ * Block tables, event libraries and decoded shapes are returned as read-only
+ * arrays sharing memory with the C++ sequence. If NumPy is installed they are
+ * NumPy arrays, otherwise memoryviews. The module only needs the Python
+ * headers to build, NumPy is imported at run time.
+ *
+ * ~~~~~~~~~~~~~{.py}
+ * import pulseqcpp
+ * seq = pulseqcpp.load('gre.seq')
+ * ids = seq.block_events            # [block, event], columns as in pulseqcpp.EVENTS
+ * rf = seq.rf                       # dict of arrays indexed by RF event ID
+ * amp = seq.rf['amplitude'][ids[:, pulseqcpp.RF]]
+ * ~~~~~~~~~~~~~
+ *
+ * Sequences are written with SequenceWriter, events are given by the fields of
+ * the library dicts. EventIndex gives the event libraries of Python code the
+ * same lookup by content.
+ *
+ * ~~~~~~~~~~~~~{.py}
+ * writer = pulseqcpp.SequenceWriter('fid.seq')
+ * mag = writer.add_shape(magnitude)
+ * phase = writer.add_shape(phase)
+ * rf = writer.add_rf(amplitude=250.0, magShape=mag, phaseShape=phase)
+ * writer.add_block(rf=rf)
+ * writer.close()
+ *
+ * index = pulseqcpp.EventIndex(pulseqcpp.LIBRARY_TOLERANCE)
+ * id = index.find_or_insert([amplitude, rise, flat, fall, delay])
+ * ~~~~~~~~~~~~~
+ */
+
+// * ------------------------------------------------------------------ *
+// * Array view                                                         *
+// * ------------------------------------------------------------------ *
+
+/**
+ * @brief Read-only strided array exporting the buffer protocol
+ *
+ * Refers to memory owned by a Sequence object (kept alive by `owner`) or by a
+ * decoded shape (kept alive by `shape`).
+ */
+struct ArrayView
+{
+	PyObject_HEAD
+	PyObject *owner;              /**< @brief Object owning the memory */
+	DecodedShape shape;           /**< @brief Shape owning the memory */
+	const char *data;             /**< @brief First element */
+	int ndim;                     /**< @brief Number of dimensions (1 or 2) */
+	Py_ssize_t shape_[2];         /**< @brief Number of elements per dimension */
+	Py_ssize_t strides[2];        /**< @brief Distance between elements per dimension (bytes) */
+	Py_ssize_t itemsize;          /**< @brief Size of an element (bytes) */
+	const char *format;           /**< @brief Element format (struct module syntax) */
+};
+
+/**
+ * @brief Element format of a C++ type
+ */
+template<typename T> struct BufferFormat;
+template<> struct BufferFormat<float>         { static const char *get() { return "f"; } };
+template<> struct BufferFormat<double>        { static const char *get() { return "d"; } };
+template<> struct BufferFormat<int>           { static const char *get() { return "i"; } };
+template<> struct BufferFormat<long>          { static const char *get() { return "l"; } };
+template<> struct BufferFormat<long long>     { static const char *get() { return "q"; } };
+template<> struct BufferFormat<unsigned char> { static const char *get() { return "B"; } };
+
+static PyTypeObject ArrayViewType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static PyObject *numpyAsArray = NULL;    /**< @brief numpy.asarray, Py_None if NumPy is not available */
+
+/***********************************************************/
+static void ArrayView_dealloc(ArrayView *self)
+{
+	self->shape.~DecodedShape();
+	Py_XDECREF(self->owner);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/***********************************************************/
+static int ArrayView_getbuffer(ArrayView *self, Py_buffer *view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "array is read-only");
+		return -1;
+	}
+	bool contiguous = (self->strides[self->ndim-1]==self->itemsize) &&
+		(self->ndim==1 || self->strides[0]==self->shape_[1]*self->itemsize);
+	if (!contiguous && (flags & PyBUF_STRIDES)!=PyBUF_STRIDES) {
+		PyErr_SetString(PyExc_BufferError, "array is not contiguous");
+		return -1;
+	}
+	Py_ssize_t length = self->itemsize;
+	for (int i=0; i<self->ndim; i++)
+		length *= self->shape_[i];
+
+	view->buf = (void*)self->data;
+	view->obj = (PyObject*)self;
+	Py_INCREF(self);
+	view->len = length;
+	view->readonly = 1;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? (char*)self->format : NULL;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND) ? self->shape_ : NULL;
+	view->strides = ((flags & PyBUF_STRIDES)==PyBUF_STRIDES) ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs ArrayView_buffer = { (getbufferproc)ArrayView_getbuffer, NULL };
+
+/**
+ * @brief Wrap an array view as NumPy array (or memoryview without NumPy)
+ *
+ * Steals the reference to `view`.
+ */
+static PyObject *toArray(ArrayView *view)
+{
+	if (view==NULL)
+		return NULL;
+	if (numpyAsArray==NULL) {
+		PyObject *numpy = PyImport_ImportModule("numpy");
+		if (numpy!=NULL) {
+			numpyAsArray = PyObject_GetAttrString(numpy, "asarray");
+			Py_DECREF(numpy);
+		}
+		if (numpyAsArray==NULL) {
+			PyErr_Clear();
+			numpyAsArray = Py_None;
+			Py_INCREF(Py_None);
+		}
+	}
+	PyObject *array = (numpyAsArray==Py_None) ? PyMemoryView_FromObject((PyObject*)view)
+		: PyObject_CallFunctionObjArgs(numpyAsArray, (PyObject*)view, NULL);
+	Py_DECREF(view);
+	return array;
+}
+
+/**
+ * @brief Create an array view of `length` elements with a distance of `stride` bytes
+ *
+ * Views with `columns`>0 are two-dimensional, the columns being contiguous.
+ */
+static ArrayView *newView(PyObject *owner, const void *data, Py_ssize_t length, Py_ssize_t stride, Py_ssize_t columns,
+	const char *format, Py_ssize_t itemsize)
+{
+	static const double empty = 0.0;
+	ArrayView *view = PyObject_New(ArrayView, &ArrayViewType);
+	if (view==NULL)
+		return NULL;
+	new (&view->shape) DecodedShape();
+	view->owner = owner;
+	Py_XINCREF(owner);
+	view->data = (data!=NULL) ? (const char*)data : (const char*)&empty;
+	view->itemsize = itemsize;
+	view->format = format;
+	view->ndim = (columns>0) ? 2 : 1;
+	view->shape_[0] = length;
+	view->strides[0] = stride;
+	view->shape_[1] = columns;
+	view->strides[1] = itemsize;
+	return view;
+}
+
+/**
+ * @brief Create an array view of elements of type T
+ */
+template<typename T>
+static ArrayView *newView(PyObject *owner, const T *data, Py_ssize_t length, Py_ssize_t stride, Py_ssize_t columns=0)
+{
+	return newView(owner, data, length, stride, columns, BufferFormat<T>::get(), sizeof(T));
+}
+
+// * ------------------------------------------------------------------ *
+// * Sequence                                                           *
+// * ------------------------------------------------------------------ *
+
+/**
+ * @brief Python object holding a loaded sequence
+ *
+ * The sequence is loaded once by the constructor and never modified, so the
+ * memory shared with array views stays valid while they exist.
+ */
+struct Sequence
+{
+	PyObject_HEAD
+	ExternalSequence *seq;        /**< @brief Loaded sequence */
+};
+
+static PyTypeObject SequenceType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/**
+ * @brief Column of an event library
+ */
+struct LibraryField
+{
+	const char *name;             /**< @brief Key in the returned dict */
+	size_t offset;                /**< @brief Offset in the event structure */
+	const char *format;           /**< @brief Element format */
+	Py_ssize_t itemsize;          /**< @brief Size of an element */
+	Py_ssize_t columns;           /**< @brief Number of columns (0: scalar field) */
+};
+
+#define FIELD(type, member, valueType) { #member, offsetof(type, member), BufferFormat<valueType>::get(), sizeof(valueType), 0 }
+
+static const LibraryField rfFields[] = {
+	FIELD(RFEvent, amplitude, float),
+	FIELD(RFEvent, magShape, int),
+	FIELD(RFEvent, phaseShape, int),
+	FIELD(RFEvent, freqOffset, float),
+	FIELD(RFEvent, phaseOffset, float),
+	FIELD(RFEvent, delay, int),
+	{ NULL }
+};
+static const LibraryField gradFields[] = {
+	FIELD(GradEvent, amplitude, float),
+	FIELD(GradEvent, delay, int),
+	FIELD(GradEvent, rampUpTime, long),
+	FIELD(GradEvent, flatTime, long),
+	FIELD(GradEvent, rampDownTime, long),
+	FIELD(GradEvent, shape, int),
+	{ NULL }
+};
+static const LibraryField adcFields[] = {
+	FIELD(ADCEvent, numSamples, int),
+	FIELD(ADCEvent, dwellTime, int),
+	FIELD(ADCEvent, delay, int),
+	FIELD(ADCEvent, freqOffset, float),
+	FIELD(ADCEvent, phaseOffset, float),
+	{ NULL }
+};
+static const LibraryField controlFields[] = {
+	{ "type", offsetof(ControlEvent, type), "i", sizeof(int), 0 },
+	FIELD(ControlEvent, duration, long),
+	FIELD(ControlEvent, triggerType, int),
+	{ "rotMatrix", offsetof(ControlEvent, rotMatrix), "d", sizeof(double), 9 },
+	{ NULL }
+};
+static const LibraryField delayFields[] = {
+	{ "delay", 0, "l", sizeof(long), 0 },
+	{ NULL }
+};
+
+#undef FIELD
+
+static_assert(sizeof(ControlEvent::Type)==sizeof(int), "control type is exported as int");
+
+/**
+ * @brief Return a dict of arrays, one per field of the library entries
+ *
+ * All arrays are indexed by event ID and include the key `defined`.
+ */
+template<typename T>
+static PyObject *libraryDict(Sequence *self, const EventLibrary<T> &library, const LibraryField *fields)
+{
+	PyObject *dict = PyDict_New();
+	if (dict==NULL)
+		return NULL;
+	Py_ssize_t length = library.maxId()+1;
+	const char *base = (const char*)library.data();
+	for (const LibraryField *field=fields; field->name!=NULL; field++) {
+		PyObject *array = toArray(newView((PyObject*)self, base+field->offset, length, sizeof(T), field->columns,
+			field->format, field->itemsize));
+		if (array==NULL || PyDict_SetItemString(dict, field->name, array)<0) {
+			Py_XDECREF(array);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(array);
+	}
+	PyObject *defined = toArray(newView((PyObject*)self, library.defined(), length, 1));
+	if (defined==NULL || PyDict_SetItemString(dict, "defined", defined)<0) {
+		Py_XDECREF(defined);
+		Py_DECREF(dict);
+		return NULL;
+	}
+	Py_DECREF(defined);
+	return dict;
+}
+
+/**
+ * @brief Return the decoded samples of a shape as array, None if the ID is 0
+ */
+static PyObject *shapeArray(Sequence *self, int shapeId, ShapeUsage usage)
+{
+	if (shapeId==0)
+		Py_RETURN_NONE;
+	DecodedShape shape = self->seq->GetDecodedShape(shapeId, usage);
+	if (!shape) {
+		PyErr_Format(PyExc_ValueError, "shape %d cannot be decoded", shapeId);
+		return NULL;
+	}
+	ArrayView *view = newView((PyObject*)NULL, shape->empty() ? NULL : &(*shape)[0], (Py_ssize_t)shape->size(), sizeof(float));
+	if (view!=NULL)
+		view->shape = shape;
+	return toArray(view);
+}
+
+/***********************************************************/
+static PyObject *Sequence_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	Sequence *self = (Sequence*)type->tp_alloc(type, 0);
+	if (self!=NULL)
+		self->seq = NULL;
+	return (PyObject*)self;
+}
+
+/***********************************************************/
+static void Sequence_dealloc(Sequence *self)
+{
+	delete self->seq;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/***********************************************************/
+static int Sequence_init(Sequence *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "path", "threads", "cache", NULL };
+	const char *path;
+	int numThreads = 1;
+	const char *cacheDirectory = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|iz", (char**)keywords, &path, &numThreads, &cacheDirectory))
+		return -1;
+	if (self->seq!=NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "sequence is already loaded");
+		return -1;
+	}
+
+	ExternalSequence *seq = new ExternalSequence();
+	seq->SetLoadThreads(numThreads);
+	if (cacheDirectory!=NULL)
+		seq->SetCacheMode(true, cacheDirectory);
+	bool ok;
+	std::string file(path);
+	Py_BEGIN_ALLOW_THREADS
+	ok = seq->load(file);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		delete seq;
+		PyErr_Format(PyExc_IOError, "failed to load sequence '%s'", path);
+		return -1;
+	}
+	self->seq = seq;
+	return 0;
+}
+
+/**
+ * @brief Return the loaded sequence or raise an exception
+ */
+static ExternalSequence *loaded(Sequence *self)
+{
+	if (self->seq==NULL)
+		PyErr_SetString(PyExc_RuntimeError, "sequence is not loaded");
+	return self->seq;
+}
+
+/***********************************************************/
+static PyObject *Sequence_getNumBlocks(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return PyLong_FromLong(self->seq->GetNumberOfBlocks());
+}
+
+/***********************************************************/
+static PyObject *Sequence_getNumShapes(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return PyLong_FromLong(self->seq->GetNumberOfShapes());
+}
+
+/***********************************************************/
+static PyObject *Sequence_getDuration(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return PyLong_FromLongLong(self->seq->GetTotalDuration());
+}
+
+/***********************************************************/
+static PyObject *Sequence_getDefinitions(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	PyObject *dict = PyDict_New();
+	if (dict==NULL)
+		return NULL;
+	const std::map<std::string, std::vector<double> > &definitions = self->seq->GetDefinitions();
+	for (std::map<std::string, std::vector<double> >::const_iterator it=definitions.begin(); it!=definitions.end(); ++it) {
+		PyObject *values = PyTuple_New(it->second.size());
+		for (size_t i=0; values!=NULL && i<it->second.size(); i++)
+			PyTuple_SET_ITEM(values, i, PyFloat_FromDouble(it->second[i]));
+		if (values==NULL || PyDict_SetItemString(dict, it->first.c_str(), values)<0) {
+			Py_XDECREF(values);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(values);
+	}
+	return dict;
+}
+
+/***********************************************************/
+static PyObject *Sequence_getBlockEvents(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	const ImageArray<EventIDs> &blocks = self->seq->GetBlockTable();
+	return toArray(newView((PyObject*)self, blocks.empty() ? NULL : blocks[0].id,
+		(Py_ssize_t)blocks.size(), sizeof(EventIDs), NUM_EVENTS));
+}
+
+/***********************************************************/
+static PyObject *Sequence_getBlockStartTimes(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	const ImageArray<long long> &times = self->seq->GetBlockStartTimes();
+	return toArray(newView((PyObject*)self, times.empty() ? NULL : &times[0],
+		(Py_ssize_t)times.size(), sizeof(long long)));
+}
+
+/***********************************************************/
+static PyObject *Sequence_getRF(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return libraryDict(self, self->seq->GetRFLibrary(), rfFields);
+}
+
+/***********************************************************/
+static PyObject *Sequence_getGradients(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return libraryDict(self, self->seq->GetGradientLibrary(), gradFields);
+}
+
+/***********************************************************/
+static PyObject *Sequence_getADC(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return libraryDict(self, self->seq->GetADCLibrary(), adcFields);
+}
+
+/***********************************************************/
+static PyObject *Sequence_getControls(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return libraryDict(self, self->seq->GetControlLibrary(), controlFields);
+}
+
+/***********************************************************/
+static PyObject *Sequence_getDelays(Sequence *self, void *)
+{
+	if (!loaded(self)) return NULL;
+	return libraryDict(self, self->seq->GetDelayLibrary(), delayFields);
+}
+
+/***********************************************************/
+static PyObject *Sequence_shape(Sequence *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "id", "usage", NULL };
+	int shapeId;
+	const char *usageName = "gradient";
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|s", (char**)keywords, &shapeId, &usageName))
+		return NULL;
+	if (!loaded(self)) return NULL;
+
+	ShapeUsage usage;
+	std::string name(usageName);
+	if (name=="gradient")
+		usage = SHAPE_GRADIENT;
+	else if (name=="rf_magnitude")
+		usage = SHAPE_RF_MAGNITUDE;
+	else if (name=="rf_phase")
+		usage = SHAPE_RF_PHASE;
+	else {
+		PyErr_Format(PyExc_ValueError, "unknown shape usage '%s' (gradient, rf_magnitude or rf_phase)", usageName);
+		return NULL;
+	}
+	if (shapeId<=0 || shapeId>self->seq->GetNumberOfShapes()) {
+		PyErr_Format(PyExc_IndexError, "shape %d does not exist", shapeId);
+		return NULL;
+	}
+	return shapeArray(self, shapeId, usage);
+}
+
+/**
+ * @brief Add a value to a dict, consuming the reference
+ */
+static bool setItem(PyObject *dict, const char *key, PyObject *value)
+{
+	if (value==NULL)
+		return false;
+	int result = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+	return result==0;
+}
+
+/***********************************************************/
+static PyObject *Sequence_block(Sequence *self, PyObject *args)
+{
+	int index;
+	if (!PyArg_ParseTuple(args, "i", &index))
+		return NULL;
+	if (!loaded(self)) return NULL;
+	BlockView block;
+	if (!self->seq->GetBlock(index, block)) {
+		PyErr_Format(PyExc_IndexError, "block %d does not exist", index);
+		return NULL;
+	}
+
+	static const char *eventNames[NUM_EVENTS] = { "delay", "rf", "gx", "gy", "gz", "adc", "ctrl" };
+	PyObject *dict = PyDict_New();
+	if (dict==NULL)
+		return NULL;
+	PyObject *events = PyDict_New();
+	bool ok = setItem(dict, "events", events);
+	for (int i=0; ok && i<NUM_EVENTS; i++)
+		ok = setItem(events, eventNames[i], PyLong_FromLong(block.GetEventIndex((Event)i)));
+	ok = ok && setItem(dict, "index", PyLong_FromLong(block.GetIndex()))
+		&& setItem(dict, "duration", PyLong_FromLong(block.GetDuration()))
+		&& setItem(dict, "delay", PyLong_FromLong(block.GetDelay()))
+		&& setItem(dict, "start", PyLong_FromLongLong(self->seq->GetBlockStartTime(index)));
+
+	// Decoded shapes, shared with the shape cache of the sequence
+	if (ok && block.isRF()) {
+		ok = setItem(dict, "rf_magnitude", shapeArray(self, block.GetRFEvent().magShape, SHAPE_RF_MAGNITUDE))
+			&& setItem(dict, "rf_phase", shapeArray(self, block.GetRFEvent().phaseShape, SHAPE_RF_PHASE));
+	}
+	for (int i=0; ok && i<NUM_GRADS; i++) {
+		if (block.isArbitraryGradient(i)) {
+			std::string key = std::string(eventNames[GX+i]) + "_waveform";
+			ok = setItem(dict, key.c_str(), shapeArray(self, block.GetGradEvent(i).shape, SHAPE_GRADIENT));
+		}
+	}
+	if (!ok) {
+		Py_DECREF(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+/***********************************************************/
+static void BlockArrays_destroy(PyObject *capsule)
+{
+	delete (BlockArrays*)PyCapsule_GetPointer(capsule, "pulseqcpp.BlockArrays");
+}
+
+/**
+ * @brief Add an array of a BlockArrays field to a dict
+ */
+template<typename T>
+static bool setArray(PyObject *dict, const char *key, PyObject *owner, const std::vector<T> &values)
+{
+	return setItem(dict, key, toArray(newView(owner, values.empty() ? NULL : &values[0], (Py_ssize_t)values.size(), sizeof(T))));
+}
+
+/***********************************************************/
+static PyObject *Sequence_blockArrays(Sequence *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "first", "last", "threads", NULL };
+	int first = 0, last = -1, numThreads = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iii", (char**)keywords, &first, &last, &numThreads))
+		return NULL;
+	if (!loaded(self)) return NULL;
+
+	BlockArrays *table = new BlockArrays();
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = table->fill(*self->seq, first, last, numThreads);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		delete table;
+		PyErr_Format(PyExc_IndexError, "invalid block range [%d,%d)", first, last);
+		return NULL;
+	}
+	// The arrays share the memory of the table, which is released with the capsule
+	PyObject *owner = PyCapsule_New(table, "pulseqcpp.BlockArrays", BlockArrays_destroy);
+	if (owner==NULL) {
+		delete table;
+		return NULL;
+	}
+
+	static const char *eventNames[NUM_EVENTS] = { "delay", "rf", "gx", "gy", "gz", "adc", "ctrl" };
+	PyObject *dict = PyDict_New();
+	ok = (dict!=NULL) && setItem(dict, "first", PyLong_FromLong(table->first))
+		&& setArray(dict, "start", owner, table->start)
+		&& setArray(dict, "duration", owner, table->duration)
+		&& setArray(dict, "delay", owner, table->delay)
+		&& setArray(dict, "rf_amplitude", owner, table->rfAmplitude)
+		&& setArray(dict, "rf_freq_offset", owner, table->rfFreqOffset)
+		&& setArray(dict, "rf_phase_offset", owner, table->rfPhaseOffset)
+		&& setArray(dict, "rf_mag_shape", owner, table->rfMagShape)
+		&& setArray(dict, "rf_phase_shape", owner, table->rfPhaseShape)
+		&& setArray(dict, "rf_delay", owner, table->rfDelay)
+		&& setArray(dict, "rf_duration", owner, table->rfDuration)
+		&& setArray(dict, "adc_num_samples", owner, table->adcNumSamples)
+		&& setArray(dict, "adc_dwell_time", owner, table->adcDwellTime)
+		&& setArray(dict, "adc_delay", owner, table->adcDelay)
+		&& setArray(dict, "adc_duration", owner, table->adcDuration)
+		&& setArray(dict, "adc_freq_offset", owner, table->adcFreqOffset)
+		&& setArray(dict, "adc_phase_offset", owner, table->adcPhaseOffset);
+	for (int e=0; ok && e<NUM_EVENTS; e++)
+		ok = setArray(dict, (std::string(eventNames[e]) + "_id").c_str(), owner, table->eventId[e]);
+	for (int c=0; ok && c<NUM_GRADS; c++) {
+		std::string axis(eventNames[GX+c]);
+		ok = setArray(dict, (axis + "_amplitude").c_str(), owner, table->gradAmplitude[c])
+			&& setArray(dict, (axis + "_shape").c_str(), owner, table->gradShape[c])
+			&& setArray(dict, (axis + "_delay").c_str(), owner, table->gradDelay[c])
+			&& setArray(dict, (axis + "_rise_time").c_str(), owner, table->gradRampUp[c])
+			&& setArray(dict, (axis + "_flat_time").c_str(), owner, table->gradFlatTime[c])
+			&& setArray(dict, (axis + "_fall_time").c_str(), owner, table->gradRampDown[c])
+			&& setArray(dict, (axis + "_duration").c_str(), owner, table->gradDuration[c]);
+	}
+	Py_DECREF(owner);
+	if (!ok) {
+		Py_XDECREF(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+/***********************************************************/
+static PyObject *Sequence_save(Sequence *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "path", "binary", NULL };
+	const char *path;
+	int binary = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p", (char**)keywords, &path, &binary))
+		return NULL;
+	if (!loaded(self)) return NULL;
+	bool ok;
+	std::string file(path);
+	Py_BEGIN_ALLOW_THREADS
+	ok = binary ? self->seq->saveBinary(file) : self->seq->save(file);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		PyErr_Format(PyExc_IOError, "failed to write sequence '%s'", path);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyGetSetDef Sequence_getset[] = {
+	{ (char*)"num_blocks", (getter)Sequence_getNumBlocks, NULL, (char*)"Number of blocks", NULL },
+	{ (char*)"num_shapes", (getter)Sequence_getNumShapes, NULL, (char*)"Number of shapes (largest shape ID)", NULL },
+	{ (char*)"duration", (getter)Sequence_getDuration, NULL, (char*)"Total duration (us)", NULL },
+	{ (char*)"definitions", (getter)Sequence_getDefinitions, NULL, (char*)"Dict of the [DEFINITIONS] section", NULL },
+	{ (char*)"block_events", (getter)Sequence_getBlockEvents, NULL, (char*)"Event IDs of all blocks, int32 array [block, event] with columns as in EVENTS", NULL },
+	{ (char*)"block_start_times", (getter)Sequence_getBlockStartTimes, NULL, (char*)"Start time of all blocks and the total duration (us), int64 array", NULL },
+	{ (char*)"rf", (getter)Sequence_getRF, NULL, (char*)"RF library, dict of arrays indexed by event ID", NULL },
+	{ (char*)"gradients", (getter)Sequence_getGradients, NULL, (char*)"Gradient library, dict of arrays indexed by event ID", NULL },
+	{ (char*)"adc", (getter)Sequence_getADC, NULL, (char*)"ADC library, dict of arrays indexed by event ID", NULL },
+	{ (char*)"controls", (getter)Sequence_getControls, NULL, (char*)"Control library (triggers and rotations), dict of arrays indexed by event ID", NULL },
+	{ (char*)"delays", (getter)Sequence_getDelays, NULL, (char*)"Delay library (us), dict of arrays indexed by event ID", NULL },
+	{ NULL }
+};
+
+static PyMethodDef Sequence_methods[] = {
+	{ "shape", (PyCFunction)(void(*)(void))Sequence_shape, METH_VARARGS | METH_KEYWORDS,
+	  "shape(id, usage='gradient')\n\nDecoded samples of a shape, usage is 'gradient', 'rf_magnitude' or 'rf_phase'." },
+	{ "block", (PyCFunction)Sequence_block, METH_VARARGS,
+	  "block(index)\n\nDict describing a block, including its decoded RF and arbitrary gradient shapes." },
+	{ "block_arrays", (PyCFunction)(void(*)(void))Sequence_blockArrays, METH_VARARGS | METH_KEYWORDS,
+	  "block_arrays(first=0, last=-1, threads=0)\n\nDict of arrays with one element per block of [first,last), e.g. 'rf_amplitude',\n"
+	  "'gx_amplitude' or 'adc_num_samples' (see BlockArrays), computed in parallel." },
+	{ "save", (PyCFunction)(void(*)(void))Sequence_save, METH_VARARGS | METH_KEYWORDS,
+	  "save(path, binary=False)\n\nWrite the sequence in text or binary format." },
+	{ NULL }
+};
+
+// * ------------------------------------------------------------------ *
+// * Writing                                                            *
+// * ------------------------------------------------------------------ *
+
+/**
+ * @brief Read a number or a sequence of numbers
+ */
+static bool toDoubles(PyObject *object, std::vector<double> &values)
+{
+	if (PyNumber_Check(object)) {
+		values.assign(1, PyFloat_AsDouble(object));
+		return !PyErr_Occurred();
+	}
+	PyObject *items = PySequence_Fast(object, "expected a number or a sequence of numbers");
+	if (items==NULL)
+		return false;
+	Py_ssize_t length = PySequence_Fast_GET_SIZE(items);
+	values.resize(length);
+	for (Py_ssize_t i=0; i<length; i++)
+		values[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(items, i));
+	Py_DECREF(items);
+	return !PyErr_Occurred();
+}
+
+/**
+ * @brief Set the fields of a library entry from keyword arguments named as the keys of libraryDict()
+ *
+ * Fields that are not given keep their default values.
+ */
+template<typename T>
+static bool entryFromKeywords(T &entry, PyObject *kwds, const LibraryField *fields)
+{
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+	while (kwds!=NULL && PyDict_Next(kwds, &pos, &key, &value)) {
+		const char *name = PyUnicode_AsUTF8(key);
+		if (name==NULL)
+			return false;
+		const LibraryField *field = fields;
+		while (field->name!=NULL && strcmp(field->name, name)!=0)
+			field++;
+		if (field->name==NULL) {
+			PyErr_Format(PyExc_TypeError, "unknown field '%s'", name);
+			return false;
+		}
+		std::vector<double> values;
+		if (!toDoubles(value, values))
+			return false;
+		if ((Py_ssize_t)values.size()!=MAX(field->columns, (Py_ssize_t)1)) {
+			PyErr_Format(PyExc_ValueError, "field '%s' has %zd values", name, MAX(field->columns, (Py_ssize_t)1));
+			return false;
+		}
+		char *target = (char*)&entry + field->offset;
+		for (size_t i=0; i<values.size(); i++, target+=field->itemsize) {
+			switch (field->format[0]) {
+				case 'f': *(float*)target = (float)values[i]; break;
+				case 'd': *(double*)target = values[i]; break;
+				case 'i': *(int*)target = (int)values[i]; break;
+				case 'l': *(long*)target = (long)values[i]; break;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Python object writing a sequence file with SequenceWriter
+ */
+struct Writer
+{
+	PyObject_HEAD
+	SequenceWriter *writer;       /**< @brief Open writer, NULL after close() */
+};
+
+static PyTypeObject WriterType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/***********************************************************/
+static PyObject *Writer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	Writer *self = (Writer*)type->tp_alloc(type, 0);
+	if (self!=NULL)
+		self->writer = NULL;
+	return (PyObject*)self;
+}
+
+/***********************************************************/
+static void Writer_dealloc(Writer *self)
+{
+	delete self->writer;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/***********************************************************/
+static int Writer_init(Writer *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "path", "binary", "version", NULL };
+	const char *path;
+	int binary = 0;
+	int version[3] = { 1, 2, 1 };
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p(iii)", (char**)keywords, &path, &binary,
+		&version[0], &version[1], &version[2]))
+		return -1;
+	if (self->writer!=NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "writer is already open");
+		return -1;
+	}
+	SequenceWriter *writer = new SequenceWriter();
+	writer->SetVersion(version[0], version[1], version[2]);
+	if (!writer->open(path, binary ? SequenceWriter::BINARY : SequenceWriter::TEXT)) {
+		delete writer;
+		PyErr_Format(PyExc_IOError, "failed to create sequence '%s'", path);
+		return -1;
+	}
+	self->writer = writer;
+	return 0;
+}
+
+/**
+ * @brief Return the open writer or raise an exception
+ */
+static SequenceWriter *opened(Writer *self)
+{
+	if (self->writer==NULL)
+		PyErr_SetString(PyExc_RuntimeError, "writer is closed");
+	return self->writer;
+}
+
+/**
+ * @brief Return the ID of an added entry or raise an exception if it was rejected (ID 0)
+ */
+static PyObject *addedId(int id, const char *what)
+{
+	if (id==0) {
+		PyErr_Format(PyExc_ValueError, "%s rejected by the writer", what);
+		return NULL;
+	}
+	return PyLong_FromLong(id);
+}
+
+/***********************************************************/
+static PyObject *Writer_setDefinition(Writer *self, PyObject *args)
+{
+	const char *key;
+	PyObject *object;
+	if (!PyArg_ParseTuple(args, "sO", &key, &object))
+		return NULL;
+	if (!opened(self)) return NULL;
+	std::vector<double> values;
+	if (!toDoubles(object, values))
+		return NULL;
+	if (!self->writer->SetDefinition(key, values)) {
+		PyErr_SetString(PyExc_RuntimeError, "definitions must be set before the first block");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/***********************************************************/
+static PyObject *Writer_addShape(Writer *self, PyObject *args)
+{
+	PyObject *object;
+	if (!PyArg_ParseTuple(args, "O", &object))
+		return NULL;
+	if (!opened(self)) return NULL;
+	std::vector<double> values;
+	if (!toDoubles(object, values))
+		return NULL;
+	std::vector<float> samples(values.begin(), values.end());
+	return addedId(self->writer->AddShape(samples), "shape");
+}
+
+/***********************************************************/
+static PyObject *Writer_addRF(Writer *self, PyObject *args, PyObject *kwds)
+{
+	if (!opened(self)) return NULL;
+	RFEvent rf;
+	if (!PyArg_ParseTuple(args, "") || !entryFromKeywords(rf, kwds, rfFields))
+		return NULL;
+	return addedId(self->writer->AddRF(rf), "RF event");
+}
+
+/***********************************************************/
+static PyObject *Writer_addGradient(Writer *self, PyObject *args, PyObject *kwds)
+{
+	if (!opened(self)) return NULL;
+	GradEvent grad;
+	if (!PyArg_ParseTuple(args, "") || !entryFromKeywords(grad, kwds, gradFields))
+		return NULL;
+	return addedId(self->writer->AddGradient(grad), "gradient event");
+}
+
+/***********************************************************/
+static PyObject *Writer_addADC(Writer *self, PyObject *args, PyObject *kwds)
+{
+	if (!opened(self)) return NULL;
+	ADCEvent adc;
+	if (!PyArg_ParseTuple(args, "") || !entryFromKeywords(adc, kwds, adcFields))
+		return NULL;
+	return addedId(self->writer->AddADC(adc), "ADC event");
+}
+
+/***********************************************************/
+static PyObject *Writer_addControl(Writer *self, PyObject *args, PyObject *kwds)
+{
+	if (!opened(self)) return NULL;
+	ControlEvent control = ControlEvent();
+	if (!PyArg_ParseTuple(args, "") || !entryFromKeywords(control, kwds, controlFields))
+		return NULL;
+	return addedId(self->writer->AddControl(control), "control event");
+}
+
+/***********************************************************/
+static PyObject *Writer_addDelay(Writer *self, PyObject *args)
+{
+	long delay;
+	if (!PyArg_ParseTuple(args, "l", &delay))
+		return NULL;
+	if (!opened(self)) return NULL;
+	return addedId(self->writer->AddDelay(delay), "delay");
+}
+
+/***********************************************************/
+static PyObject *Writer_addBlock(Writer *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "delay", "rf", "gx", "gy", "gz", "adc", "ctrl", NULL };
+	EventIDs events = {};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiiii", (char**)keywords, &events.id[DELAY], &events.id[RF],
+		&events.id[GX], &events.id[GY], &events.id[GZ], &events.id[ADC], &events.id[CTRL]))
+		return NULL;
+	if (!opened(self)) return NULL;
+	if (!self->writer->AddBlock(events)) {
+		PyErr_SetString(PyExc_ValueError, "block references undefined events or cannot be written");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/***********************************************************/
+static PyObject *Writer_close(Writer *self, PyObject *)
+{
+	if (!opened(self)) return NULL;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = self->writer->close();
+	Py_END_ALLOW_THREADS
+	delete self->writer;
+	self->writer = NULL;
+	if (!ok) {
+		PyErr_SetString(PyExc_IOError, "failed to write sequence");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+/***********************************************************/
+static PyObject *Writer_getNumBlocks(Writer *self, void *)
+{
+	if (!opened(self)) return NULL;
+	return PyLong_FromLongLong(self->writer->GetNumberOfBlocks());
+}
+
+static PyGetSetDef Writer_getset[] = {
+	{ (char*)"num_blocks", (getter)Writer_getNumBlocks, NULL, (char*)"Number of blocks written so far", NULL },
+	{ NULL }
+};
+
+static PyMethodDef Writer_methods[] = {
+	{ "set_definition", (PyCFunction)Writer_setDefinition, METH_VARARGS,
+	  "set_definition(key, values)\n\nSet a definition, before the first block is added." },
+	{ "add_shape", (PyCFunction)Writer_addShape, METH_VARARGS,
+	  "add_shape(samples)\n\nCompress a shape (samples as stored in the file) and return its ID." },
+	{ "add_rf", (PyCFunction)(void(*)(void))Writer_addRF, METH_VARARGS | METH_KEYWORDS,
+	  "add_rf(**fields)\n\nAdd an RF event given by the fields of Sequence.rf, e.g. amplitude=..., magShape=...,\n"
+	  "and return its ID. An event matching an existing one returns the existing ID." },
+	{ "add_gradient", (PyCFunction)(void(*)(void))Writer_addGradient, METH_VARARGS | METH_KEYWORDS,
+	  "add_gradient(**fields)\n\nAdd a gradient event given by the fields of Sequence.gradients and return its ID." },
+	{ "add_adc", (PyCFunction)(void(*)(void))Writer_addADC, METH_VARARGS | METH_KEYWORDS,
+	  "add_adc(**fields)\n\nAdd an ADC event given by the fields of Sequence.adc and return its ID." },
+	{ "add_control", (PyCFunction)(void(*)(void))Writer_addControl, METH_VARARGS | METH_KEYWORDS,
+	  "add_control(**fields)\n\nAdd a trigger or rotation given by the fields of Sequence.controls and return its ID." },
+	{ "add_delay", (PyCFunction)Writer_addDelay, METH_VARARGS,
+	  "add_delay(delay)\n\nAdd a delay (us) and return its ID." },
+	{ "add_block", (PyCFunction)(void(*)(void))Writer_addBlock, METH_VARARGS | METH_KEYWORDS,
+	  "add_block(delay=0, rf=0, gx=0, gy=0, gz=0, adc=0, ctrl=0)\n\nWrite a block referencing events by ID." },
+	{ "close", (PyCFunction)Writer_close, METH_NOARGS,
+	  "close()\n\nWrite the libraries and close the file." },
+	{ NULL }
+};
+
+// * ------------------------------------------------------------------ *
+// * Event index                                                        *
+// * ------------------------------------------------------------------ *
+
+/**
+ * @brief Python object holding an EventIndex
+ *
+ * Lets the event libraries of Python code find entries by content in
+ * constant time, with the tolerances of the C++ libraries.
+ */
+struct Index
+{
+	PyObject_HEAD
+	EventIndex *index;            /**< @brief Index of the keys */
+	int maxId;                    /**< @brief Largest ID inserted */
+};
+
+static PyTypeObject IndexType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/***********************************************************/
+static PyObject *Index_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	Index *self = (Index*)type->tp_alloc(type, 0);
+	if (self!=NULL) {
+		self->index = new EventIndex();
+		self->maxId = 0;
+	}
+	return (PyObject*)self;
+}
+
+/***********************************************************/
+static void Index_dealloc(Index *self)
+{
+	delete self->index;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/***********************************************************/
+static int Index_init(Index *self, PyObject *args, PyObject *kwds)
+{
+	static const char *keywords[] = { "tolerance", NULL };
+	PyObject *object = NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", (char**)keywords, &object))
+		return -1;
+	std::vector<double> tolerance(1, 0.0);
+	if (object!=NULL && !toDoubles(object, tolerance))
+		return -1;
+	self->index->SetTolerance(tolerance);
+	self->maxId = 0;
+	return 0;
+}
+
+/***********************************************************/
+static PyObject *Index_find(Index *self, PyObject *args)
+{
+	PyObject *object;
+	std::vector<double> key;
+	if (!PyArg_ParseTuple(args, "O", &object) || !toDoubles(object, key))
+		return NULL;
+	return PyLong_FromLong(self->index->find(key.empty() ? NULL : &key[0], (int)key.size()));
+}
+
+/***********************************************************/
+static PyObject *Index_insert(Index *self, PyObject *args)
+{
+	PyObject *object;
+	int id;
+	std::vector<double> key;
+	if (!PyArg_ParseTuple(args, "Oi", &object, &id) || !toDoubles(object, key))
+		return NULL;
+	if (id<=0) {
+		PyErr_SetString(PyExc_ValueError, "IDs must be positive");
+		return NULL;
+	}
+	self->index->insert(key.empty() ? NULL : &key[0], (int)key.size(), id);
+	self->maxId = MAX(self->maxId, id);
+	Py_RETURN_NONE;
+}
+
+/***********************************************************/
+static PyObject *Index_findOrInsert(Index *self, PyObject *args)
+{
+	PyObject *object;
+	std::vector<double> key;
+	if (!PyArg_ParseTuple(args, "O", &object) || !toDoubles(object, key))
+		return NULL;
+	const double *data = key.empty() ? NULL : &key[0];
+	int id = self->index->find(data, (int)key.size());
+	if (id==0) {
+		id = ++self->maxId;
+		self->index->insert(data, (int)key.size(), id);
+	}
+	return PyLong_FromLong(id);
+}
+
+/***********************************************************/
+static PyObject *Index_clear(Index *self, PyObject *)
+{
+	self->index->clear();
+	self->maxId = 0;
+	Py_RETURN_NONE;
+}
+
+/***********************************************************/
+static Py_ssize_t Index_length(Index *self)
+{
+	return (Py_ssize_t)self->index->size();
+}
+
+static PySequenceMethods Index_sequence = { (lenfunc)Index_length };
+
+static PyMethodDef Index_methods[] = {
+	{ "find", (PyCFunction)Index_find, METH_VARARGS,
+	  "find(key)\n\nID of an entry matching the key (sequence of numbers) within the tolerances, 0 if there is none." },
+	{ "insert", (PyCFunction)Index_insert, METH_VARARGS,
+	  "insert(key, id)\n\nAdd the key of the entry with the given ID (> 0), replacing a previous key of the ID." },
+	{ "find_or_insert", (PyCFunction)Index_findOrInsert, METH_VARARGS,
+	  "find_or_insert(key)\n\nID of an entry matching the key, the key is added with the next free ID if there is none." },
+	{ "clear", (PyCFunction)Index_clear, METH_NOARGS,
+	  "clear()\n\nRemove all entries." },
+	{ NULL }
+};
+
+// * ------------------------------------------------------------------ *
+// * Module                                                             *
+// * ------------------------------------------------------------------ *
+
+/***********************************************************/
+static PyObject *module_load(PyObject *, PyObject *args, PyObject *kwds)
+{
+	return PyObject_Call((PyObject*)&SequenceType, args, kwds);
+}
+
+static PyMethodDef module_methods[] = {
+	{ "load", (PyCFunction)(void(*)(void))module_load, METH_VARARGS | METH_KEYWORDS,
+	  "load(path, threads=1, cache=None)\n\nLoad a sequence file (text or binary), threads=0 parses with all cores.\n"
+	  "cache gives the directory of the cache image ('' for the directory of the file), which is used\n"
+	  "instead of parsing if it matches the file and is written otherwise." },
+	{ NULL }
+};
+
+static PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT, "pulseqcpp",
+	"Fast reading and writing of Pulseq sequence files with the C++ ExternalSequence parser.\n\n"
+	"Arrays share memory with the loaded sequence and are read-only.",
+	-1, module_methods
+};
+
+/***********************************************************/
+PyMODINIT_FUNC PyInit_pulseqcpp(void)
+{
+	ArrayViewType.tp_name = "pulseqcpp.ArrayView";
+	ArrayViewType.tp_basicsize = sizeof(ArrayView);
+	ArrayViewType.tp_dealloc = (destructor)ArrayView_dealloc;
+	ArrayViewType.tp_as_buffer = &ArrayView_buffer;
+	ArrayViewType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ArrayViewType.tp_doc = "Read-only array sharing memory with a sequence";
+
+	SequenceType.tp_name = "pulseqcpp.Sequence";
+	SequenceType.tp_basicsize = sizeof(Sequence);
+	SequenceType.tp_dealloc = (destructor)Sequence_dealloc;
+	SequenceType.tp_flags = Py_TPFLAGS_DEFAULT;
+	SequenceType.tp_doc = "Sequence(path, threads=1)\n\nSequence loaded from a Pulseq file.";
+	SequenceType.tp_new = Sequence_new;
+	SequenceType.tp_init = (initproc)Sequence_init;
+	SequenceType.tp_getset = Sequence_getset;
+	SequenceType.tp_methods = Sequence_methods;
+
+	WriterType.tp_name = "pulseqcpp.SequenceWriter";
+	WriterType.tp_basicsize = sizeof(Writer);
+	WriterType.tp_dealloc = (destructor)Writer_dealloc;
+	WriterType.tp_flags = Py_TPFLAGS_DEFAULT;
+	WriterType.tp_doc = "SequenceWriter(path, binary=False, version=(1, 2, 1))\n\n"
+		"Writer of a sequence file, events and shapes are deduplicated as they are added.";
+	WriterType.tp_new = Writer_new;
+	WriterType.tp_init = (initproc)Writer_init;
+	WriterType.tp_getset = Writer_getset;
+	WriterType.tp_methods = Writer_methods;
+
+	IndexType.tp_name = "pulseqcpp.EventIndex";
+	IndexType.tp_basicsize = sizeof(Index);
+	IndexType.tp_dealloc = (destructor)Index_dealloc;
+	IndexType.tp_as_sequence = &Index_sequence;
+	IndexType.tp_flags = Py_TPFLAGS_DEFAULT;
+	IndexType.tp_doc = "EventIndex(tolerance=0)\n\nHash index of library entries given as sequences of numbers.\n"
+		"Values match within the tolerance of their position (a number or one per position, the last\n"
+		"one applying to all further positions), relative above 1 and absolute below.";
+	IndexType.tp_new = Index_new;
+	IndexType.tp_init = (initproc)Index_init;
+	IndexType.tp_methods = Index_methods;
+
+	if (PyType_Ready(&ArrayViewType)<0 || PyType_Ready(&SequenceType)<0 || PyType_Ready(&WriterType)<0 ||
+		PyType_Ready(&IndexType)<0)
+		return NULL;
+
+	PyObject *module = PyModule_Create(&module_def);
+	if (module==NULL)
+		return NULL;
+	Py_INCREF(&SequenceType);
+	PyModule_AddObject(module, "Sequence", (PyObject*)&SequenceType);
+	Py_INCREF(&WriterType);
+	PyModule_AddObject(module, "SequenceWriter", (PyObject*)&WriterType);
+	Py_INCREF(&IndexType);
+	PyModule_AddObject(module, "EventIndex", (PyObject*)&IndexType);
+	PyModule_AddObject(module, "LIBRARY_TOLERANCE", PyFloat_FromDouble(LIBRARY_TOLERANCE));
+
+	static const char *eventNames[NUM_EVENTS] = { "DELAY", "RF", "GX", "GY", "GZ", "ADC", "CTRL" };
+	PyObject *events = PyTuple_New(NUM_EVENTS);
+	for (int i=0; events!=NULL && i<NUM_EVENTS; i++) {
+		PyTuple_SET_ITEM(events, i, PyUnicode_FromString(eventNames[i]));
+		PyModule_AddIntConstant(module, eventNames[i], i);
+	}
+	PyModule_AddObject(module, "EVENTS", events);
+	return module;
+}
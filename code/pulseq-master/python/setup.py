@@ -0,0 +1,24 @@
+"""Build the pulseqcpp extension module.
+
+    python setup.py build_ext --inplace
+
+The module only needs a C++11 compiler and the Python headers. Without
+setuptools it can be built directly, e.g. on Linux:
+
+    c++ -O2 -std=c++11 -shared -fPIC -pthread -I../src $(python3-config --includes) \\
+        pulseqcpp.cpp ../src/ExternalSequence.cpp ../src/BlockArrays.cpp -o pulseqcpp$(python3-config --extension-suffix)
+"""
+
+from setuptools import setup, Extension
+
+pulseqcpp = Extension('pulseqcpp',
+                      sources=['pulseqcpp.cpp', '../src/ExternalSequence.cpp', '../src/BlockArrays.cpp'],
+                      include_dirs=['../src'],
+                      extra_compile_args=['-std=c++11', '-pthread'],
+                      extra_link_args=['-pthread'],
+                      language='c++')
+
+setup(name='pulseqcpp',
+      version='1.2.1',
+      description='Fast reading and writing of Pulseq sequence files with the C++ ExternalSequence parser',
+      ext_modules=[pulseqcpp])
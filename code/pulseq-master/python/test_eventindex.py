@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+"""Test of pulseqcpp.EventIndex, run by src/testparser.py
+
+Keys are placed on both sides of the boundaries of the hash grid, where a
+lookup has to probe the neighbouring cell. The grid has cells of CELL_WIDTH
+tolerances and probes values within CELL_MARGIN tolerances of a boundary
+(see EventIndex::cell() in ExternalSequence.cpp).
+"""
+
+import math
+import sys
+
+import pulseqcpp
+
+CELL_WIDTH = 64
+MAX_PROBE_VALUES = 8
+tol = 1e-3
+
+
+def boundary(k):
+    """Value at the k-th cell boundary, on the linear scale up to 1 and the logarithmic one above"""
+    u = k * CELL_WIDTH * tol
+    return u if abs(u) <= 1 else math.copysign(math.exp(abs(u) - 1), u)
+
+
+def near(k, side, distance=0.4):
+    """Value at `distance` tolerances below (side -1) or above (side 1) boundary k"""
+    b = boundary(k)
+    return b + side * distance * tol * max(1, abs(b))
+
+
+def main():
+    failures = []
+
+    def expect(name, value, expected):
+        if value != expected:
+            failures.append('{0}: {1} instead of {2}'.format(name, value, expected))
+
+    # Single values on both sides of a boundary, small, large and negative
+    for k in [1, 5, 20, 100, -3, -40]:
+        index = pulseqcpp.EventIndex(tol)
+        index.insert([near(k, -1)], 1)
+        expect('value at boundary {0}'.format(k), index.find([near(k, 1)]), 1)
+        expect('value beyond tolerance at boundary {0}'.format(k), index.find([near(k, 1, 0.7)]), 0)
+
+    # Keys with up to MAX_PROBE_VALUES values across a boundary are always found
+    index = pulseqcpp.EventIndex(tol)
+    below = [near(k, -1) for k in range(1, MAX_PROBE_VALUES + 3)]
+    index.insert(below, 1)
+    for n in range(MAX_PROBE_VALUES + 1):
+        key = [near(k, 1) for k in range(1, n + 1)] + below[n:]
+        expect('{0} values across boundaries'.format(n), index.find(key), 1)
+
+    # Beyond that an entry may be stored twice, but keys never match wrongly
+    above = [near(k, 1) for k in range(1, MAX_PROBE_VALUES + 3)]
+    id = index.find_or_insert(above)
+    expect('{0} values across boundaries'.format(len(above)) + ', ID', id in [1, 2], True)
+    expect('first key after overflow', index.find(below), 1)
+    expect('second key after overflow', index.find(above), id)
+    expect('entries after overflow', len(index), id)
+    expect('key beyond tolerance', index.find(above[:-1] + [near(MAX_PROBE_VALUES + 2, 1, 2.5)]), 0)
+
+    # Tolerances per position, the last one applying to all further positions
+    index = pulseqcpp.EventIndex([tol, 0])
+    index.insert([near(1, -1), 2.0, 3.0], 1)
+    expect('exact positions', index.find([near(1, 1), 2.0, 3.0]), 1)
+    expect('exact positions, changed', index.find([near(1, 1), 2.0, 3.0 + 1e-12]), 0)
+
+    for failure in failures:
+        print(failure)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,173 @@
+#!/usr/bin/env python
+"""Test of the pulseqcpp module, run by src/testparser.py
+
+    python test_pulseqcpp.py SEQUENCE LISTING
+
+Lists the blocks of SEQUENCE from the arrays of the module in the format of
+`parsemr --dump` and compares them with LISTING. Also checks the arrays of
+block_arrays() against the blocks returned by block(), and that the arrays are
+read-only and remain valid after the sequence is deleted.
+"""
+
+import gc
+import sys
+
+import pulseqcpp
+
+GRAD_RASTER_TIME = 10   # duration of an arbitrary gradient sample (us)
+RF_RASTER_TIME = 1      # duration of an RF shape sample (us)
+
+
+def shape_hash(seq, shape_id, usage):
+    """Length and FNV-1a hash of the bit patterns of a decoded shape, as print_shape() of parsemr"""
+    if shape_id <= 0:
+        return ' -'
+    samples = seq.shape(shape_id, usage)
+    h = 2166136261
+    for byte in bytes(samples.cast('B')):
+        h = ((h ^ byte) * 16777619) & 0xffffffff
+    return ' {0}:{1:08x}'.format(len(samples), h)
+
+
+def f(value):
+    """Format a float as printed by parsemr --dump"""
+    return '{0:.9g}'.format(value)
+
+
+def list_blocks(seq):
+    """List the blocks as print_block() of parsemr"""
+    events = seq.block_events.tolist()
+    start = seq.block_start_times.tolist()
+    rf, grad, adc, delays = seq.rf, seq.gradients, seq.adc, seq.delays
+    lines = []
+    for b, ids in enumerate(events):
+        line = '{0} t={1} d={2}'.format(b, start[b], start[b+1] - start[b])
+        if ids[pulseqcpp.DELAY] > 0:
+            line += ' delay {0}'.format(delays['delay'][ids[pulseqcpp.DELAY]])
+        i = ids[pulseqcpp.RF]
+        if i > 0:
+            line += ' rf ' + f(rf['amplitude'][i])
+            line += shape_hash(seq, rf['magShape'][i], 'rf_magnitude')
+            line += shape_hash(seq, rf['phaseShape'][i], 'rf_phase')
+            line += ' {0} {1} {2}'.format(f(rf['freqOffset'][i]), f(rf['phaseOffset'][i]), rf['delay'][i])
+        for axis, column in zip('xyz', [pulseqcpp.GX, pulseqcpp.GY, pulseqcpp.GZ]):
+            i = ids[column]
+            if i <= 0:
+                continue
+            if grad['shape'][i] > 0:
+                line += ' g{0} arb {1}'.format(axis, f(grad['amplitude'][i]))
+                line += shape_hash(seq, grad['shape'][i], 'gradient')
+                line += ' {0}'.format(grad['delay'][i])
+            else:
+                line += ' g{0} trap {1} {2} {3} {4} {5}'.format(axis, f(grad['amplitude'][i]), grad['rampUpTime'][i],
+                                                               grad['flatTime'][i], grad['rampDownTime'][i], grad['delay'][i])
+        i = ids[pulseqcpp.ADC]
+        if i > 0:
+            line += ' adc {0} {1} {2} {3} {4}'.format(adc['numSamples'][i], adc['dwellTime'][i], adc['delay'][i],
+                                                      f(adc['freqOffset'][i]), f(adc['phaseOffset'][i]))
+        lines.append(line + '\n')
+    return lines
+
+
+def read_listing(path):
+    """Return the block lines of a parsemr --dump listing"""
+    with open(path, 'r') as listing:
+        lines = listing.readlines()
+    return lines[lines.index('[BLOCKS]\n')+1:lines.index('[LIBRARIES]\n')]
+
+
+def block_fields(seq, b):
+    """Fields of block b as in block_arrays(), from block() and the library dicts"""
+    block = seq.block(b)
+    ids = block['events']
+    fields = {'start': block['start'], 'duration': block['duration'], 'delay': block['delay']}
+    for name, value in ids.items():
+        fields[name + '_id'] = value
+
+    rf = dict((name, values[ids['rf']]) for name, values in seq.rf.items())
+    fields.update({'rf_amplitude': rf['amplitude'], 'rf_freq_offset': rf['freqOffset'],
+                   'rf_phase_offset': rf['phaseOffset'], 'rf_mag_shape': rf['magShape'],
+                   'rf_phase_shape': rf['phaseShape'], 'rf_delay': rf['delay']})
+    fields['rf_duration'] = rf['delay'] + RF_RASTER_TIME * len(block['rf_magnitude']) if ids['rf'] > 0 else 0
+
+    for axis in 'xyz':
+        g = dict((name, values[ids['g' + axis]]) for name, values in seq.gradients.items())
+        for field, name in [('amplitude', 'amplitude'), ('shape', 'shape'), ('delay', 'delay'),
+                            ('rise_time', 'rampUpTime'), ('flat_time', 'flatTime'), ('fall_time', 'rampDownTime')]:
+            fields['g{0}_{1}'.format(axis, field)] = g[name]
+        if ids['g' + axis] <= 0:
+            duration = 0
+        elif g['shape'] > 0:
+            duration = g['delay'] + GRAD_RASTER_TIME * len(block['g{0}_waveform'.format(axis)])
+        else:
+            duration = g['delay'] + g['rampUpTime'] + g['flatTime'] + g['rampDownTime']
+        fields['g{0}_duration'.format(axis)] = duration
+
+    adc = dict((name, values[ids['adc']]) for name, values in seq.adc.items())
+    fields.update({'adc_num_samples': adc['numSamples'], 'adc_dwell_time': adc['dwellTime'],
+                   'adc_delay': adc['delay'], 'adc_freq_offset': adc['freqOffset'],
+                   'adc_phase_offset': adc['phaseOffset']})
+    fields['adc_duration'] = adc['delay'] + adc['numSamples'] * adc['dwellTime'] * 1e-3 if ids['adc'] > 0 else 0
+    return fields
+
+
+def check_block_arrays(seq, first, last, threads):
+    """Compare block_arrays() of blocks [first,last) with the fields of each block"""
+    arrays = seq.block_arrays(first, last, threads=threads)
+    ok = arrays['first'] == first
+    for b in range(first, last):
+        for name, value in block_fields(seq, b).items():
+            if arrays[name][b - first] != value:
+                print('block {0}: {1} is {2} instead of {3}'.format(b, name, arrays[name][b - first], value))
+                ok = False
+    return ok
+
+
+def check_read_only(array):
+    """Check that assigning to an element of an array fails"""
+    try:
+        array[(0,) * array.ndim] = 0
+    except TypeError:
+        return array.readonly
+    return False
+
+
+def main():
+    sequence, listing = sys.argv[1:3]
+    ok = True
+
+    seq = pulseqcpp.load(sequence)
+    if list_blocks(seq) != read_listing(listing):
+        print('blocks differ from ' + listing)
+        ok = False
+
+    # A range of blocks not starting at 0, split between threads
+    if not check_block_arrays(seq, seq.num_blocks // 4, 3 * seq.num_blocks // 4, 4):
+        ok = False
+
+    # Arrays of the block table, a library and a shape share memory with the sequence
+    events = seq.block_events
+    amplitude = seq.gradients['amplitude']
+    rf_id = next(ids[pulseqcpp.RF] for ids in events.tolist() if ids[pulseqcpp.RF] > 0)
+    shape = seq.shape(seq.rf['magShape'][rf_id], 'rf_magnitude')
+    arrays = [('block_events', events), ('gradients', amplitude), ('shape', shape)]
+    for name, array in arrays:
+        if not check_read_only(array):
+            print(name + ' is writable')
+            ok = False
+
+    # They remain valid (and unchanged) after the sequence is deleted
+    copies = [array.tolist() for name, array in arrays]
+    del seq
+    gc.collect()
+    other = pulseqcpp.load(sequence)    # may reuse the memory of the deleted one
+    for (name, array), copy in zip(arrays, copies):
+        if array.tolist() != copy:
+            print(name + ' changed after the sequence was deleted')
+            ok = False
+
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,447 @@
+#include "BlochSimulator.h"
+
+#include <math.h>		// exp, cos, sin, lrintf
+#include <string.h>		// memcmp, memcpy
+#include <algorithm>	// std::find
+#include <fstream>
+#include <map>
+#include <thread>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNELS
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static const char PHANTOM_MAGIC[8] = { 0x01, 'p', 'h', 'a', 'n', 't', 'o', 'm' };
+
+/***********************************************************/
+void Phantom::add(float px, float py, float pz, float ppd, float pt1, float pt2, float pdB0)
+{
+	x.push_back(px);
+	y.push_back(py);
+	z.push_back(pz);
+	pd.push_back(ppd);
+	t1.push_back(pt1);
+	t2.push_back(pt2);
+	dB0.push_back(pdB0);
+}
+
+/***********************************************************/
+bool Phantom::load(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	char magic[sizeof(PHANTOM_MAGIC)];
+	long long num = 0;
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, PHANTOM_MAGIC, sizeof(magic))!=0 ||
+		!in.read((char*)&num, sizeof(num)) || num<0) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: " << path << " is not a phantom file");
+		return false;
+	}
+	std::vector<float>* arrays[] = { &x, &y, &z, &pd, &t1, &t2, &dB0 };
+	for (int i=0; i<7; i++) {
+		arrays[i]->resize((size_t)num);
+		if (num>0 && !in.read((char*)&(*arrays[i])[0], num*sizeof(float))) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: phantom file " << path << " is truncated");
+			for (int j=0; j<7; j++)
+				arrays[j]->clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool Phantom::save(const std::string &path) const
+{
+	std::ofstream out(path.c_str(), std::ios::binary);
+	long long num = (long long)size();
+	out.write(PHANTOM_MAGIC, sizeof(PHANTOM_MAGIC));
+	out.write((const char*)&num, sizeof(num));
+	const std::vector<float>* arrays[] = { &x, &y, &z, &pd, &t1, &t2, &dB0 };
+	for (int i=0; i<7; i++) {
+		if (arrays[i]->size()!=size()) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: phantom arrays differ in size");
+			return false;
+		}
+		if (num>0)
+			out.write((const char*)&(*arrays[i])[0], num*sizeof(float));
+	}
+	return out.good();
+}
+
+// Polynomial coefficients of sin and cos on [-pi/4,pi/4]
+static const float SIN_C1 = -1.0f/6, SIN_C2 = 1.0f/120, SIN_C3 = -1.0f/5040;
+static const float COS_C1 = -1.0f/2, COS_C2 = 1.0f/24, COS_C3 = -1.0f/720, COS_C4 = 1.0f/40320;
+
+/**
+ * @brief Cosine and sine of the precession angle 2*pi*(x*kx + y*ky + z*kz + df*dt)
+ *
+ * The phase in cycles is reduced to a quarter turn and evaluated with
+ * polynomials (error below 1e-6). The SIMD and scalar paths give identical results.
+ */
+static void phaseRotation(size_t n, const float *x, const float *y, const float *z, const float *df,
+	float kx, float ky, float kz, float dt, float *c, float *s)
+{
+	size_t i=0;
+#ifdef HAVE_SSE2_KERNELS
+	const __m128 vkx = _mm_set1_ps(kx), vky = _mm_set1_ps(ky), vkz = _mm_set1_ps(kz), vdt = _mm_set1_ps(dt);
+	const __m128 four = _mm_set1_ps(4.0f), quarter = _mm_set1_ps(0.25f), twoPi = _mm_set1_ps((float)(2*M_PI)), one = _mm_set1_ps(1.0f);
+	const __m128i iOne = _mm_set1_epi32(1), iTwo = _mm_set1_epi32(2);
+	for (; i+4<=n; i+=4) {
+		__m128 cycles = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x+i), vkx), _mm_mul_ps(_mm_loadu_ps(y+i), vky)),
+			_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(z+i), vkz), _mm_mul_ps(_mm_loadu_ps(df+i), vdt)));
+		__m128 r = _mm_sub_ps(cycles, _mm_cvtepi32_ps(_mm_cvtps_epi32(cycles)));
+		__m128i q = _mm_cvtps_epi32(_mm_mul_ps(r, four));
+		__m128 t = _mm_mul_ps(_mm_sub_ps(r, _mm_mul_ps(_mm_cvtepi32_ps(q), quarter)), twoPi);
+		__m128 t2 = _mm_mul_ps(t, t);
+		__m128 sp = _mm_add_ps(_mm_set1_ps(SIN_C2), _mm_mul_ps(t2, _mm_set1_ps(SIN_C3)));
+		sp = _mm_mul_ps(t, _mm_add_ps(one, _mm_mul_ps(t2, _mm_add_ps(_mm_set1_ps(SIN_C1), _mm_mul_ps(t2, sp)))));
+		__m128 cp = _mm_add_ps(_mm_set1_ps(COS_C3), _mm_mul_ps(t2, _mm_set1_ps(COS_C4)));
+		cp = _mm_add_ps(_mm_set1_ps(COS_C2), _mm_mul_ps(t2, cp));
+		cp = _mm_add_ps(one, _mm_mul_ps(t2, _mm_add_ps(_mm_set1_ps(COS_C1), _mm_mul_ps(t2, cp))));
+		// Quadrant: swap for odd q, negate cos for q=1,2 and sin for q=2,3 (mod 4)
+		__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, iOne), iOne));
+		__m128 vc = _mm_or_ps(_mm_and_ps(swap, sp), _mm_andnot_ps(swap, cp));
+		__m128 vs = _mm_or_ps(_mm_and_ps(swap, cp), _mm_andnot_ps(swap, sp));
+		vc = _mm_xor_ps(vc, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, iOne), iTwo), 30)));
+		vs = _mm_xor_ps(vs, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, iTwo), 30)));
+		_mm_storeu_ps(c+i, vc);
+		_mm_storeu_ps(s+i, vs);
+	}
+#endif
+	for (; i<n; i++) {
+		float cycles = (x[i]*kx + y[i]*ky) + (z[i]*kz + df[i]*dt);
+		float r = cycles - (float)lrintf(cycles);
+		int q = (int)lrintf(r*4.0f);
+		float t = (r - (float)q*0.25f)*(float)(2*M_PI);
+		float t2 = t*t;
+		float sp = t*(1.0f + t2*(SIN_C1 + t2*(SIN_C2 + t2*SIN_C3)));
+		float cp = 1.0f + t2*(COS_C1 + t2*(COS_C2 + t2*(COS_C3 + t2*COS_C4)));
+		if (q&1) { float tmp = sp; sp = cp; cp = tmp; }
+		c[i] = ((q+1)&2) ? -cp : cp;
+		s[i] = (q&2) ? -sp : sp;
+	}
+}
+
+/**
+ * @brief Free precession and relaxation: Mxy *= exp(-i*phase)*E2, Mz = M0 + (Mz-M0)*E1
+ */
+static void precess(size_t n, float *mx, float *my, float *mz, const float *c, const float *s,
+	const float *e1, const float *e2, const float *m0)
+{
+	size_t i=0;
+#ifdef HAVE_SSE2_KERNELS
+	for (; i+4<=n; i+=4) {
+		__m128 vx = _mm_loadu_ps(mx+i), vy = _mm_loadu_ps(my+i);
+		__m128 vc = _mm_loadu_ps(c+i), vs = _mm_loadu_ps(s+i), ve2 = _mm_loadu_ps(e2+i);
+		_mm_storeu_ps(mx+i, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vx, vc), _mm_mul_ps(vy, vs)), ve2));
+		_mm_storeu_ps(my+i, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vy, vc), _mm_mul_ps(vx, vs)), ve2));
+		__m128 vm0 = _mm_loadu_ps(m0+i);
+		_mm_storeu_ps(mz+i, _mm_add_ps(vm0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(mz+i), vm0), _mm_loadu_ps(e1+i))));
+	}
+#endif
+	for (; i<n; i++) {
+		float x = mx[i], y = my[i];
+		mx[i] = (x*c[i] + y*s[i])*e2[i];
+		my[i] = (y*c[i] - x*s[i])*e2[i];
+		mz[i] = m0[i] + (mz[i]-m0[i])*e1[i];
+	}
+}
+
+/**
+ * @brief Apply the same rotation (row-major matrix) to all isochromats
+ */
+static void rotate(size_t n, float *mx, float *my, float *mz, const float R[9])
+{
+	size_t i=0;
+#ifdef HAVE_SSE2_KERNELS
+	const __m128 r0 = _mm_set1_ps(R[0]), r1 = _mm_set1_ps(R[1]), r2 = _mm_set1_ps(R[2]);
+	const __m128 r3 = _mm_set1_ps(R[3]), r4 = _mm_set1_ps(R[4]), r5 = _mm_set1_ps(R[5]);
+	const __m128 r6 = _mm_set1_ps(R[6]), r7 = _mm_set1_ps(R[7]), r8 = _mm_set1_ps(R[8]);
+	for (; i+4<=n; i+=4) {
+		__m128 x = _mm_loadu_ps(mx+i), y = _mm_loadu_ps(my+i), z = _mm_loadu_ps(mz+i);
+		_mm_storeu_ps(mx+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, x), _mm_mul_ps(r1, y)), _mm_mul_ps(r2, z)));
+		_mm_storeu_ps(my+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r3, x), _mm_mul_ps(r4, y)), _mm_mul_ps(r5, z)));
+		_mm_storeu_ps(mz+i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r6, x), _mm_mul_ps(r7, y)), _mm_mul_ps(r8, z)));
+	}
+#endif
+	for (; i<n; i++) {
+		float x = mx[i], y = my[i], z = mz[i];
+		mx[i] = (R[0]*x + R[1]*y) + R[2]*z;
+		my[i] = (R[3]*x + R[4]*y) + R[5]*z;
+		mz[i] = (R[6]*x + R[7]*y) + R[8]*z;
+	}
+}
+
+/**
+ * @brief Sum of the transverse magnetization (accumulated in double precision)
+ */
+static std::complex<double> sumTransverse(size_t n, const float *mx, const float *my)
+{
+	double re=0.0, im=0.0;
+	size_t i=0;
+#ifdef HAVE_SSE2_KERNELS
+	__m128d sx = _mm_setzero_pd(), sy = _mm_setzero_pd();
+	for (; i+4<=n; i+=4) {
+		__m128 x = _mm_loadu_ps(mx+i), y = _mm_loadu_ps(my+i);
+		sx = _mm_add_pd(sx, _mm_add_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(_mm_movehl_ps(x, x))));
+		sy = _mm_add_pd(sy, _mm_add_pd(_mm_cvtps_pd(y), _mm_cvtps_pd(_mm_movehl_ps(y, y))));
+	}
+	double buf[2];
+	_mm_storeu_pd(buf, sx);
+	re = buf[0] + buf[1];
+	_mm_storeu_pd(buf, sy);
+	im = buf[0] + buf[1];
+#endif
+	for (; i<n; i++) {
+		re += mx[i];
+		im += my[i];
+	}
+	return std::complex<double>(re, im);
+}
+
+/**
+ * @brief Magnetization of a range of isochromats
+ *
+ * Keeps the rotation of the last precession step and the relaxation factors
+ * of recent step durations, which are reused by the repeated steps of RF
+ * pulses and readouts.
+ */
+class Isochromats
+{
+public:
+	Isochromats(const Phantom &phantom, size_t begin, size_t end);
+
+	/** @brief Precess and relax for dt us with the gradient area k (1/m) */
+	void advance(double dt, const double k[NUM_GRADS]);
+
+	/** @brief Hard pulse rotating by `angle` about the transverse axis at `phase` (rad) */
+	void pulse(double angle, double phase);
+
+	/** @brief Sum of the transverse magnetization */
+	std::complex<double> signal() const;
+
+private:
+	static const size_t MAX_RELAXATION_CACHE = 64;
+	struct Relaxation { std::vector<float> e1, e2; };
+
+	size_t n;
+	const float *x, *y, *z, *df, *m0;
+	std::vector<float> r1, r2;          // relaxation rates (1/s)
+	std::vector<float> mx, my, mz;
+	std::vector<float> c, s;            // rotation of the last step
+	float lastKey[4];
+	bool haveRotation;
+	std::map<double,Relaxation> relaxation;
+};
+
+/***********************************************************/
+Isochromats::Isochromats(const Phantom &phantom, size_t begin, size_t end)
+	: n(end-begin), haveRotation(false)
+{
+	x = phantom.x.data() + begin;
+	y = phantom.y.data() + begin;
+	z = phantom.z.data() + begin;
+	df = phantom.dB0.data() + begin;
+	m0 = phantom.pd.data() + begin;
+	r1.resize(n);
+	r2.resize(n);
+	for (size_t i=0; i<n; i++) {
+		r1[i] = (phantom.t1[begin+i]>0) ? 1.0f/phantom.t1[begin+i] : 0.0f;
+		r2[i] = (phantom.t2[begin+i]>0) ? 1.0f/phantom.t2[begin+i] : 0.0f;
+	}
+	mx.assign(n, 0.0f);
+	my.assign(n, 0.0f);
+	mz.assign(m0, m0+n);
+	c.resize(n);
+	s.resize(n);
+}
+
+/***********************************************************/
+void Isochromats::advance(double dt, const double k[NUM_GRADS])
+{
+	if (dt<=0 || n==0)
+		return;
+	float key[4] = { (float)k[0], (float)k[1], (float)k[2], (float)(dt*1e-6) };
+	if (!haveRotation || memcmp(key, lastKey, sizeof(key))!=0) {
+		phaseRotation(n, x, y, z, df, key[0], key[1], key[2], key[3], &c[0], &s[0]);
+		memcpy(lastKey, key, sizeof(key));
+		haveRotation = true;
+	}
+
+	std::map<double,Relaxation>::iterator it = relaxation.find(dt);
+	if (it==relaxation.end()) {
+		if (relaxation.size()>=MAX_RELAXATION_CACHE)
+			relaxation.clear();
+		it = relaxation.insert(std::make_pair(dt, Relaxation())).first;
+		Relaxation &rel = it->second;
+		rel.e1.resize(n);
+		rel.e2.resize(n);
+		for (size_t i=0; i<n; i++) {
+			rel.e1[i] = (float)exp(-dt*1e-6*r1[i]);
+			rel.e2[i] = (float)exp(-dt*1e-6*r2[i]);
+		}
+	}
+	precess(n, &mx[0], &my[0], &mz[0], &c[0], &s[0], &it->second.e1[0], &it->second.e2[0], m0);
+}
+
+/***********************************************************/
+void Isochromats::pulse(double angle, double phase)
+{
+	if (n==0)
+		return;
+	// Rotation by -angle about the axis (cos(phase), sin(phase), 0), as in dM/dt = gamma*M x B
+	double nx = cos(phase), ny = sin(phase), ca = cos(angle), sa = sin(angle);
+	float R[9] = {
+		(float)(ca + (1-ca)*nx*nx), (float)((1-ca)*nx*ny),      (float)(-sa*ny),
+		(float)((1-ca)*nx*ny),      (float)(ca + (1-ca)*ny*ny), (float)(sa*nx),
+		(float)(sa*ny),             (float)(-sa*nx),            (float)ca
+	};
+	rotate(n, &mx[0], &my[0], &mz[0], R);
+}
+
+/***********************************************************/
+std::complex<double> Isochromats::signal() const
+{
+	if (n==0)
+		return std::complex<double>(0.0, 0.0);
+	return sumTransverse(n, &mx[0], &my[0]);
+}
+
+/***********************************************************/
+BlochSimulator::BlochSimulator(ExternalSequence &seq) : m_seq(seq), m_numThreads(1) {}
+
+/***********************************************************/
+bool BlochSimulator::simulateRange(const Phantom &phantom, size_t begin, size_t end, std::vector<std::complex<double> > &signal)
+{
+	Isochromats iso(phantom, begin, end);
+	BlockView block;
+	BlockIntegral integral;
+	const double SCALE = 1e-6;   // Hz/m*us -> 1/m
+
+	size_t adcIndex = 0;
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	for (int b=0; b<numBlocks; b++)
+	{
+		m_seq.GetBlock(b, block);
+		if (!integral.set(m_seq, block)) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradients of block " << b+1);
+			return false;
+		}
+		const double duration = (double)(m_seq.GetBlockStartTime(b+1) - m_seq.GetBlockStartTime(b));
+
+		// RF samples and ADC samples of the block in time order
+		DecodedShape mag, phase;
+		size_t numRF = 0;
+		if (block.isRF()) {
+			const RFEvent &rf = block.GetRFEvent();
+			mag = m_seq.GetDecodedShape(rf.magShape, SHAPE_RF_MAGNITUDE);
+			if (rf.phaseShape>0)
+				phase = m_seq.GetDecodedShape(rf.phaseShape, SHAPE_RF_PHASE);
+			if (!mag || (rf.phaseShape>0 && (!phase || phase->size()!=mag->size()))) {
+				ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode RF shapes of block " << b+1);
+				return false;
+			}
+			numRF = mag->size();
+		}
+		const RFEvent &rf = block.GetRFEvent();
+		const ADCEvent &adc = block.GetADCEvent();
+		const size_t numADC = block.isADC() ? (size_t)adc.numSamples : 0;
+		const double dwell = adc.dwellTime*1e-3;
+
+		double tCur = 0.0, areaCur[NUM_GRADS] = { 0.0, 0.0, 0.0 }, area[NUM_GRADS], k[NUM_GRADS];
+		size_t i = 0, j = 0;
+		while (true)
+		{
+			while (i<numRF && (*mag)[i]==0.0f)
+				i++;
+			double tRF = (i<numRF) ? rf.delay + (i+0.5)*RF_RASTER_TIME : INFINITY;
+			double tADC = (j<numADC) ? adc.delay + j*dwell : INFINITY;
+			double t = MIN(tRF, tADC);
+			if (t==INFINITY)
+				t = duration;
+
+			integral.at(t, area);
+			for (int c=0; c<NUM_GRADS; c++) {
+				k[c] = SCALE*(area[c]-areaCur[c]);
+				areaCur[c] = area[c];
+			}
+			iso.advance(t-tCur, k);
+			tCur = MAX(tCur, t);
+
+			if (tADC<=tRF && j<numADC) {
+				double rxPhase = adc.phaseOffset + 2*M_PI*adc.freqOffset*j*dwell*1e-6;
+				signal[adcIndex+j] += iso.signal()*std::polar(1.0, -rxPhase);
+				j++;
+			}
+			else if (i<numRF) {
+				double angle = 2*M_PI*rf.amplitude*(*mag)[i]*RF_RASTER_TIME*1e-6;
+				double txPhase = rf.phaseOffset + (phase ? (*phase)[i] : 0.0) + 2*M_PI*rf.freqOffset*(i+0.5)*RF_RASTER_TIME*1e-6;
+				iso.pulse(angle, txPhase);
+				i++;
+			}
+			else
+				break;
+		}
+		adcIndex += numADC;
+	}
+	return true;
+}
+
+/***********************************************************/
+bool BlochSimulator::simulate(const Phantom &phantom, std::vector<std::complex<float> > &signal)
+{
+	signal.clear();
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	if (m_seq.IsStreaming() || (numBlocks>0 && m_seq.GetBlockStartTime(numBlocks)<0)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: simulation requires a completely loaded sequence");
+		return false;
+	}
+	const std::vector<float>* arrays[] = { &phantom.y, &phantom.z, &phantom.pd, &phantom.t1, &phantom.t2, &phantom.dB0 };
+	for (int i=0; i<6; i++) {
+		if (arrays[i]->size()!=phantom.size()) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: phantom arrays differ in size");
+			return false;
+		}
+	}
+
+	size_t numSamples = 0;
+	for (const BlockView &block : m_seq.blocks())
+		if (block.isADC())
+			numSamples += block.GetADCEvent().numSamples;
+
+	// Split the isochromats into contiguous ranges (multiples of the SIMD width), one per thread
+	const size_t ALIGN = 4;
+	size_t numIso = phantom.size();
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, numIso/256));
+	std::vector<std::vector<std::complex<double> > > partial(numThreads);
+	std::vector<unsigned char> ok(numThreads, 1);
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		size_t begin = MIN(numIso, (numIso*i/numThreads + ALIGN-1)/ALIGN*ALIGN);
+		size_t end = (i+1<numThreads) ? MIN(numIso, (numIso*(i+1)/numThreads + ALIGN-1)/ALIGN*ALIGN) : numIso;
+		partial[i].assign(numSamples, std::complex<double>(0.0, 0.0));
+		if (i+1<numThreads)
+			threads.push_back(std::thread([=,&phantom,&partial,&ok]() { ok[i] = simulateRange(phantom, begin, end, partial[i]); }));
+		else
+			ok[i] = simulateRange(phantom, begin, end, partial[i]);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+	if (std::find(ok.begin(), ok.end(), 0)!=ok.end())
+		return false;
+
+	signal.resize(numSamples);
+	for (size_t j=0; j<numSamples; j++) {
+		std::complex<double> sum = partial[0][j];
+		for (int i=1; i<numThreads; i++)
+			sum += partial[i][j];
+		signal[j] = std::complex<float>(sum);
+	}
+	return true;
+}
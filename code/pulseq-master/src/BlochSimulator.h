@@ -0,0 +1,129 @@
+/** @file BlochSimulator.h */
+
+#include "ExternalSequence.h"
+#include "KspaceCalculator.h"
+
+#include <complex>
+
+#ifndef _BLOCH_SIMULATOR_H_
+#define _BLOCH_SIMULATOR_H_
+
+/**
+ * @brief Isochromats of a numerical phantom
+ *
+ * Properties are stored as one array per quantity (structure of arrays).
+ *
+ * The binary file format consists of the 8-byte magic `\1phantom`, the number
+ * of isochromats `N` as a 64-bit integer and seven arrays of `N` 32-bit floats:
+ * x, y, z (m), proton density, T1 (s), T2 (s) and off-resonance (Hz). All
+ * values are little endian. mr.writePhantom() writes this format from MATLAB.
+ */
+struct Phantom
+{
+	std::vector<float> x;      /**< @brief x position (m) */
+	std::vector<float> y;      /**< @brief y position (m) */
+	std::vector<float> z;      /**< @brief z position (m) */
+	std::vector<float> pd;     /**< @brief Proton density (equilibrium magnetization) */
+	std::vector<float> t1;     /**< @brief Longitudinal relaxation time (s, 0: none) */
+	std::vector<float> t2;     /**< @brief Transverse relaxation time (s, 0: none) */
+	std::vector<float> dB0;    /**< @brief Off-resonance frequency (Hz) */
+
+	/**
+	 * @brief Return the number of isochromats
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Append an isochromat
+	 */
+	void add(float x, float y, float z, float pd, float t1, float t2, float dB0);
+
+	/**
+	 * @brief Load a phantom from a binary file
+	 * @return true if successful
+	 */
+	bool load(const std::string &path);
+
+	/**
+	 * @brief Write the phantom to a binary file
+	 * @return true if successful
+	 */
+	bool save(const std::string &path) const;
+};
+
+inline size_t Phantom::size() const { return x.size(); }
+
+
+/**
+ * @brief Bloch simulation of a sequence on a numerical phantom
+ *
+ * Simulates the magnetization of every isochromat of a Phantom in the
+ * rotating frame and returns the signal of all ADC samples of the sequence.
+ *
+ *  - **Gradients** rotate the transverse magnetization by the phase accrued
+ *    between two events, computed from the exact gradient areas (BlockIntegral).
+ *  - **RF pulses** are applied as a hard pulse at the centre of every 1 us
+ *    sample of the decoded shapes, including phase and frequency offsets.
+ *  - **Relaxation** with T1 and T2 is applied between events.
+ *  - **ADC** sample `i` is taken at `delay + i*dwellTime` after the start of
+ *    its block (as in KspaceCalculator), the receiver phase and frequency
+ *    offsets are removed from the signal.
+ *
+ * Magnetization tips towards +y for an RF phase of zero, and the transverse
+ * magnetization of an isochromat at position r after a gradient area k
+ * acquires the phase exp(-i2πk·r), so the signal is sampled in the k-space
+ * returned by KspaceCalculator. Isochromats are stored as structure of arrays
+ * and processed with SIMD kernels; the phantom can be split between threads.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * Phantom phantom;
+ * phantom.load("brain.bin");
+ * BlochSimulator sim(seq);
+ * std::vector<std::complex<float> > signal;
+ * sim.simulate(phantom, signal);
+ * ~~~~~~~~~~~~~
+ */
+class BlochSimulator
+{
+public:
+	static const int RF_RASTER_TIME = 1;      /**< @brief Duration of an RF shape sample (us) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the simulator is in use.
+	 */
+	BlochSimulator(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the number of threads used for the simulation
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Simulate the sequence
+	 *
+	 * All isochromats start in equilibrium (Mz = proton density).
+	 *
+	 * @param phantom Isochromats to simulate
+	 * @param signal  Signal of every ADC sample in the order of the sequence
+	 * @return false if the sequence has no timing information or a shape cannot be decoded
+	 */
+	bool simulate(const Phantom &phantom, std::vector<std::complex<float> > &signal);
+
+protected:
+	/**
+	 * @brief Simulate the isochromats [begin,end) and add their signal
+	 */
+	bool simulateRange(const Phantom &phantom, size_t begin, size_t end, std::vector<std::complex<double> > &signal);
+
+	ExternalSequence &m_seq;     /**< @brief Sequence to simulate */
+	int m_numThreads;            /**< @brief Number of threads (0: all cores) */
+};
+
+inline void BlochSimulator::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+
+#endif	//_BLOCH_SIMULATOR_H_
@@ -0,0 +1,132 @@
+#include "BlockArrays.h"
+
+#include <thread>
+
+/***********************************************************/
+BlockArrays::BlockArrays()
+	: first(0)
+{
+}
+
+/***********************************************************/
+void BlockArrays::resize(size_t numBlocks)
+{
+	start.resize(numBlocks);
+	duration.resize(numBlocks);
+	for (int e=0; e<NUM_EVENTS; e++)
+		eventId[e].resize(numBlocks);
+	delay.resize(numBlocks);
+
+	rfAmplitude.resize(numBlocks);
+	rfFreqOffset.resize(numBlocks);
+	rfPhaseOffset.resize(numBlocks);
+	rfMagShape.resize(numBlocks);
+	rfPhaseShape.resize(numBlocks);
+	rfDelay.resize(numBlocks);
+	rfDuration.resize(numBlocks);
+
+	for (int c=0; c<NUM_GRADS; c++) {
+		gradAmplitude[c].resize(numBlocks);
+		gradShape[c].resize(numBlocks);
+		gradDelay[c].resize(numBlocks);
+		gradRampUp[c].resize(numBlocks);
+		gradFlatTime[c].resize(numBlocks);
+		gradRampDown[c].resize(numBlocks);
+		gradDuration[c].resize(numBlocks);
+	}
+
+	adcNumSamples.resize(numBlocks);
+	adcDwellTime.resize(numBlocks);
+	adcDelay.resize(numBlocks);
+	adcDuration.resize(numBlocks);
+	adcFreqOffset.resize(numBlocks);
+	adcPhaseOffset.resize(numBlocks);
+}
+
+/***********************************************************/
+bool BlockArrays::fill(const ExternalSequence &seq, int first, int last, int numThreads)
+{
+	int numBlocks = (int)seq.GetBlockTable().size();
+	if (last<0)
+		last = numBlocks;
+	if (first<0 || first>last || last>numBlocks) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Invalid block range ["
+			<< first << "," << last << ") for " << numBlocks << " blocks");
+		return false;
+	}
+	if (seq.GetBlockStartTimes().size()!=(size_t)numBlocks+1) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Blocks must be loaded to export them");
+		return false;
+	}
+
+	this->first = first;
+	resize(last-first);
+
+	// Contiguous ranges of blocks, one per thread
+	const int MIN_BLOCKS_PER_THREAD = 4096;
+	if (numThreads<=0)
+		numThreads = (int)std::thread::hardware_concurrency();
+	numThreads = MAX(1, MIN(numThreads, (last-first)/MIN_BLOCKS_PER_THREAD));
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		int begin = first + (int)((long long)(last-first)*i/numThreads);
+		int end   = first + (int)((long long)(last-first)*(i+1)/numThreads);
+		if (i+1<numThreads)
+			threads.push_back(std::thread([this,&seq,begin,end]() { fillRange(seq, begin, end); }));
+		else
+			fillRange(seq, begin, end);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+	return true;
+}
+
+/***********************************************************/
+void BlockArrays::fillRange(const ExternalSequence &seq, int begin, int end)
+{
+	const ImageArray<long long> &startTimes = seq.GetBlockStartTimes();
+	BlockView block;
+	for (int b=begin; b<end; b++) {
+		seq.GetBlock(b, block);
+		size_t i = b - first;
+
+		start[i]    = startTimes[b];
+		duration[i] = startTimes[b+1] - startTimes[b];
+		for (int e=0; e<NUM_EVENTS; e++)
+			eventId[e][i] = block.GetEventIndex((Event)e);
+		delay[i] = block.GetDelay();
+
+		const RFEvent &rf = block.GetRFEvent();
+		rfAmplitude[i]   = rf.amplitude;
+		rfFreqOffset[i]  = rf.freqOffset;
+		rfPhaseOffset[i] = rf.phaseOffset;
+		rfMagShape[i]    = rf.magShape;
+		rfPhaseShape[i]  = rf.phaseShape;
+		rfDelay[i]       = rf.delay;
+		rfDuration[i]    = block.isRF() ? rf.delay + RF_RASTER_TIME*seq.GetShapeLength(rf.magShape) : 0;
+
+		for (int c=0; c<NUM_GRADS; c++) {
+			const GradEvent &grad = block.GetGradEvent(c);
+			gradAmplitude[c][i] = grad.amplitude;
+			gradShape[c][i]     = grad.shape;
+			gradDelay[c][i]     = grad.delay;
+			gradRampUp[c][i]    = (int)grad.rampUpTime;
+			gradFlatTime[c][i]  = (int)grad.flatTime;
+			gradRampDown[c][i]  = (int)grad.rampDownTime;
+			if (block.isArbitraryGradient(c))
+				gradDuration[c][i] = grad.delay + GRAD_RASTER_TIME*seq.GetShapeLength(grad.shape);
+			else if (block.isTrapGradient(c))
+				gradDuration[c][i] = grad.delay + (int)(grad.rampUpTime + grad.flatTime + grad.rampDownTime);
+			else
+				gradDuration[c][i] = 0;
+		}
+
+		const ADCEvent &adc = block.GetADCEvent();
+		adcNumSamples[i]  = adc.numSamples;
+		adcDwellTime[i]   = adc.dwellTime;
+		adcDelay[i]       = adc.delay;
+		adcDuration[i]    = block.isADC() ? adc.delay + adc.numSamples*(double)adc.dwellTime*1e-3 : 0.0;
+		adcFreqOffset[i]  = adc.freqOffset;
+		adcPhaseOffset[i] = adc.phaseOffset;
+	}
+}
@@ -0,0 +1,100 @@
+/** @file BlockArrays.h */
+
+#include "ExternalSequence.h"
+
+#ifndef _BLOCK_ARRAYS_H_
+#define _BLOCK_ARRAYS_H_
+
+/**
+ * @brief Events of a range of blocks as structure of arrays
+ *
+ * Holds one contiguous array per event field with one element per block, so
+ * that a sequence can be processed with vectorized operations instead of
+ * calling GetBlock() for every block. Element `i` describes block `first+i`.
+ * Fields of events missing in a block are zero (the default event).
+ *
+ * Times are in us, except the ADC dwell time (ns). The durations of the events
+ * include their delay, i.e. they are the end of the event relative to the
+ * start of the block. The arrays are filled in parallel by splitting the block
+ * range between threads.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * BlockArrays table;
+ * table.fill(seq, 0, seq.GetNumberOfBlocks(), 0);
+ * for (size_t i=0; i<table.size(); i++)
+ *     numSamples += table.adcNumSamples[i];
+ * ~~~~~~~~~~~~~
+ */
+struct BlockArrays
+{
+	static const int GRAD_RASTER_TIME = 10;   /**< @brief Duration of an arbitrary gradient sample (us) */
+	static const int RF_RASTER_TIME = 1;      /**< @brief Duration of an RF shape sample (us) */
+
+	int first;                                 /**< @brief Index of the first block */
+
+	std::vector<long long> start;              /**< @brief Start time of the block */
+	std::vector<long long> duration;           /**< @brief Duration of the block */
+	std::vector<int> eventId[NUM_EVENTS];      /**< @brief Event IDs, indexed by Event type */
+	std::vector<long long> delay;              /**< @brief Delay event */
+
+	std::vector<float> rfAmplitude;            /**< @brief RF amplitude (Hz) */
+	std::vector<float> rfFreqOffset;           /**< @brief RF frequency offset (Hz) */
+	std::vector<float> rfPhaseOffset;          /**< @brief RF phase offset (rad) */
+	std::vector<int> rfMagShape;               /**< @brief ID of the RF magnitude shape */
+	std::vector<int> rfPhaseShape;             /**< @brief ID of the RF phase shape */
+	std::vector<int> rfDelay;                  /**< @brief Delay of the RF pulse */
+	std::vector<int> rfDuration;               /**< @brief End of the RF pulse (delay + RF_RASTER_TIME per shape sample) */
+
+	std::vector<float> gradAmplitude[NUM_GRADS];  /**< @brief Gradient amplitude (Hz/m) */
+	std::vector<int> gradShape[NUM_GRADS];        /**< @brief ID of the arbitrary gradient shape (0: trapezoid) */
+	std::vector<int> gradDelay[NUM_GRADS];        /**< @brief Delay of the gradient */
+	std::vector<int> gradRampUp[NUM_GRADS];       /**< @brief Ramp up time of trapezoids */
+	std::vector<int> gradFlatTime[NUM_GRADS];     /**< @brief Flat-top time of trapezoids */
+	std::vector<int> gradRampDown[NUM_GRADS];     /**< @brief Ramp down time of trapezoids */
+	std::vector<int> gradDuration[NUM_GRADS];     /**< @brief End of the gradient (delay + ramps and flat top, or GRAD_RASTER_TIME per shape sample) */
+
+	std::vector<int> adcNumSamples;            /**< @brief Number of ADC samples */
+	std::vector<int> adcDwellTime;             /**< @brief ADC dwell time (ns) */
+	std::vector<int> adcDelay;                 /**< @brief Delay of the ADC */
+	std::vector<double> adcDuration;           /**< @brief End of the ADC (delay + samples*dwell time) */
+	std::vector<float> adcFreqOffset;          /**< @brief ADC frequency offset (Hz) */
+	std::vector<float> adcPhaseOffset;         /**< @brief ADC phase offset (rad) */
+
+	/**
+	 * @brief Constructor
+	 */
+	BlockArrays();
+
+	/**
+	 * @brief Return the number of blocks
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Resize all arrays to the given number of blocks
+	 */
+	void resize(size_t numBlocks);
+
+	/**
+	 * @brief Fill the arrays with the blocks [first,last) of a sequence
+	 *
+	 * The sequence must be loaded completely (not in streaming mode).
+	 *
+	 * @param seq        Sequence to export
+	 * @param first      Index of the first block
+	 * @param last       Index past the last block (-1: end of the sequence)
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 * @return false if the range is invalid or the blocks are not loaded
+	 */
+	bool fill(const ExternalSequence &seq, int first=0, int last=-1, int numThreads=1);
+
+protected:
+	/**
+	 * @brief Fill the elements of the blocks [begin,end)
+	 */
+	void fillRange(const ExternalSequence &seq, int begin, int end);
+};
+
+inline size_t BlockArrays::size() const { return start.size(); }
+
+#endif	//_BLOCK_ARRAYS_H_
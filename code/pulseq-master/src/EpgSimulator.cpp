@@ -0,0 +1,489 @@
+#include "EpgSimulator.h"
+
+#include <math.h>		// exp, cos, sin, atan2, floor
+#include <string.h>		// memmove, memset
+#include <map>
+#include <thread>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_KERNELS
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Four tissues are processed together, with SSE2 or with plain loops
+static const size_t PACK_SIZE = 4;
+#ifdef HAVE_SSE2_KERNELS
+typedef __m128 Pack;
+static inline Pack load(const float *p) { return _mm_loadu_ps(p); }
+static inline void store(float *p, Pack a) { _mm_storeu_ps(p, a); }
+static inline Pack add(Pack a, Pack b) { return _mm_add_ps(a, b); }
+static inline Pack sub(Pack a, Pack b) { return _mm_sub_ps(a, b); }
+static inline Pack mul(Pack a, Pack b) { return _mm_mul_ps(a, b); }
+static inline Pack neg(Pack a) { return _mm_sub_ps(_mm_setzero_ps(), a); }
+#else
+struct Pack { float v[PACK_SIZE]; };
+static inline Pack load(const float *p) { Pack a; for (size_t i=0; i<PACK_SIZE; i++) a.v[i] = p[i]; return a; }
+static inline void store(float *p, Pack a) { for (size_t i=0; i<PACK_SIZE; i++) p[i] = a.v[i]; }
+static inline Pack add(Pack a, Pack b) { for (size_t i=0; i<PACK_SIZE; i++) a.v[i] += b.v[i]; return a; }
+static inline Pack sub(Pack a, Pack b) { for (size_t i=0; i<PACK_SIZE; i++) a.v[i] -= b.v[i]; return a; }
+static inline Pack mul(Pack a, Pack b) { for (size_t i=0; i<PACK_SIZE; i++) a.v[i] *= b.v[i]; return a; }
+static inline Pack neg(Pack a) { for (size_t i=0; i<PACK_SIZE; i++) a.v[i] = -a.v[i]; return a; }
+#endif
+
+/** @brief Complex product (ar + i*ai)*(br + i*bi) */
+static inline void cmul(Pack ar, Pack ai, Pack br, Pack bi, Pack &re, Pack &im)
+{
+	re = sub(mul(ar, br), mul(ai, bi));
+	im = add(mul(ar, bi), mul(ai, br));
+}
+
+/** @brief Complex multiply-accumulate (re + i*im) += (ar + i*ai)*(br + i*bi) */
+static inline void cmac(Pack ar, Pack ai, Pack br, Pack bi, Pack &re, Pack &im)
+{
+	re = add(re, sub(mul(ar, br), mul(ai, bi)));
+	im = add(im, add(mul(ar, bi), mul(ai, br)));
+}
+
+/**
+ * @brief Configuration states of a batch of tissues
+ *
+ * Row `k` of each state array holds the state of all tissues (padded to a
+ * multiple of PACK_SIZE). F(k) is stored for k = -maxStates..maxStates, Z(k)
+ * for k = 0..maxStates; Z(-k) is the complex conjugate of Z(k). Only the
+ * orders up to `order` can be non-zero.
+ */
+class EpgStates
+{
+public:
+	EpgStates(const EpgTissues &tissues, size_t begin, size_t end, int maxStates);
+
+	/** @brief Relaxation and off-resonance precession for dt us */
+	void relax(double dt);
+
+	/** @brief Shift the F states by the given number of orders */
+	void shift(int n);
+
+	/** @brief Instantaneous RF pulse */
+	void pulse(double angle, double phase);
+
+	/** @brief F(0) of tissue i */
+	std::complex<float> echo(size_t i) const;
+
+private:
+	static const size_t MAX_CACHE = 64;
+	struct Relaxation { std::vector<float> e1, e2r, e2i; };
+	struct Rotation { std::vector<float> c[9]; };
+
+	float* F(int k, int part) { return &m_F[part][(size_t)(k+m_maxStates)*m_stride]; }
+	float* Z(int k, int part) { return &m_Z[part][(size_t)k*m_stride]; }
+
+	size_t m_num, m_stride;
+	int m_maxStates, m_order;
+	std::vector<float> m_r1, m_r2, m_b1, m_df;
+	std::vector<float> m_F[2], m_Z[2];       // real and imaginary parts
+	std::map<double,Relaxation> m_relaxation;
+	std::map<std::pair<double,double>,Rotation> m_rotations;
+};
+
+/***********************************************************/
+EpgStates::EpgStates(const EpgTissues &tissues, size_t begin, size_t end, int maxStates)
+	: m_num(end-begin), m_maxStates(maxStates), m_order(0)
+{
+	m_stride = (m_num + PACK_SIZE-1)/PACK_SIZE*PACK_SIZE;
+	m_r1.assign(m_stride, 0.0f);
+	m_r2.assign(m_stride, 0.0f);
+	m_b1.assign(m_stride, 1.0f);
+	m_df.assign(m_stride, 0.0f);
+	for (size_t i=0; i<m_num; i++) {
+		float t1 = tissues.t1[begin+i], t2 = tissues.t2[begin+i];
+		m_r1[i] = (t1>0) ? 1.0f/t1 : 0.0f;
+		m_r2[i] = (t2>0) ? 1.0f/t2 : 0.0f;
+		if (!tissues.b1.empty())  m_b1[i] = tissues.b1[begin+i];
+		if (!tissues.dB0.empty()) m_df[i] = tissues.dB0[begin+i];
+	}
+	for (int part=0; part<2; part++) {
+		m_F[part].assign((2*maxStates+1)*m_stride, 0.0f);
+		m_Z[part].assign((maxStates+1)*m_stride, 0.0f);
+	}
+	std::fill(Z(0,0), Z(0,0)+m_stride, 1.0f);
+}
+
+/***********************************************************/
+void EpgStates::relax(double dt)
+{
+	if (dt<=0)
+		return;
+	std::map<double,Relaxation>::iterator it = m_relaxation.find(dt);
+	if (it==m_relaxation.end()) {
+		if (m_relaxation.size()>=MAX_CACHE)
+			m_relaxation.clear();
+		Relaxation &rel = m_relaxation[dt];
+		rel.e1.resize(m_stride);
+		rel.e2r.resize(m_stride);
+		rel.e2i.resize(m_stride);
+		for (size_t i=0; i<m_stride; i++) {
+			double e2 = exp(-dt*1e-6*m_r2[i]), phi = 2*M_PI*m_df[i]*dt*1e-6;
+			rel.e1[i] = (float)exp(-dt*1e-6*m_r1[i]);
+			rel.e2r[i] = (float)(e2*cos(phi));
+			rel.e2i[i] = (float)(-e2*sin(phi));
+		}
+		it = m_relaxation.find(dt);
+	}
+	const float *e1 = &it->second.e1[0], *e2r = &it->second.e2r[0], *e2i = &it->second.e2i[0];
+
+	// F(k) *= E2*exp(-i*phi), Z(k) *= E1, Z(0) += 1-E1
+	for (int k=-m_order; k<=m_order; k++) {
+		float *fr = F(k,0), *fi = F(k,1);
+		for (size_t i=0; i<m_stride; i+=PACK_SIZE) {
+			Pack re, im;
+			cmul(load(fr+i), load(fi+i), load(e2r+i), load(e2i+i), re, im);
+			store(fr+i, re);
+			store(fi+i, im);
+		}
+	}
+	for (int k=0; k<=m_order; k++) {
+		float *zr = Z(k,0), *zi = Z(k,1);
+		for (size_t i=0; i<m_stride; i+=PACK_SIZE) {
+			Pack e = load(e1+i);
+			store(zr+i, mul(load(zr+i), e));
+			store(zi+i, mul(load(zi+i), e));
+		}
+	}
+	float *z0 = Z(0,0);
+	for (size_t i=0; i<m_stride; i++)
+		z0[i] += 1.0f - e1[i];
+}
+
+/***********************************************************/
+void EpgStates::shift(int n)
+{
+	if (n==0)
+		return;
+	// Rows [-order,order] move to [-order+n,order+n], clipped to the stored orders
+	int from = -m_order, to = m_order;
+	int newOrder = MIN(m_maxStates, m_order + abs(n));
+	int first = MAX(from+n, -m_maxStates), last = MIN(to+n, m_maxStates);
+	for (int part=0; part<2; part++) {
+		if (first<=last)
+			memmove(F(first,part), F(first-n,part), (size_t)(last-first+1)*m_stride*sizeof(float));
+		// Clear the rows that were vacated
+		for (int k=-newOrder; k<=newOrder; k++)
+			if (k<first || k>last)
+				memset(F(k,part), 0, m_stride*sizeof(float));
+	}
+	m_order = newOrder;
+}
+
+/***********************************************************/
+void EpgStates::pulse(double angle, double phase)
+{
+	std::pair<double,double> key(angle, phase);
+	std::map<std::pair<double,double>,Rotation>::iterator it = m_rotations.find(key);
+	if (it==m_rotations.end()) {
+		if (m_rotations.size()>=MAX_CACHE)
+			m_rotations.clear();
+		Rotation &rot = m_rotations[key];
+		for (int j=0; j<9; j++)
+			rot.c[j].resize(m_stride);
+		// Coefficients of F' = A*F + B*conj(F(-k)) + C*Z and Z' = D*F + conj(D)*conj(F(-k)) + R8*Z
+		// from the rotation of BlochSimulator by -angle about (cos(phase), sin(phase), 0)
+		double nx = cos(phase), ny = sin(phase);
+		for (size_t i=0; i<m_stride; i++) {
+			double a = angle*m_b1[i], ca = cos(a), sa = sin(a);
+			double R0 = ca + (1-ca)*nx*nx, R1 = (1-ca)*nx*ny, R2 = -sa*ny;
+			double R3 = R1, R4 = ca + (1-ca)*ny*ny, R5 = sa*nx;
+			double R6 = sa*ny, R7 = -sa*nx, R8 = ca;
+			rot.c[0][i] = (float)(0.5*(R0+R4));   rot.c[1][i] = (float)(0.5*(R3-R1));   // A
+			rot.c[2][i] = (float)(0.5*(R0-R4));   rot.c[3][i] = (float)(0.5*(R3+R1));   // B
+			rot.c[4][i] = (float)R2;              rot.c[5][i] = (float)R5;              // C
+			rot.c[6][i] = (float)(0.5*R6);        rot.c[7][i] = (float)(-0.5*R7);       // D
+			rot.c[8][i] = (float)R8;
+		}
+		it = m_rotations.find(key);
+	}
+	const std::vector<float> *c = it->second.c;
+
+	for (int k=0; k<=m_order; k++) {
+		float *fr = F(k,0), *fi = F(k,1), *gr = F(-k,0), *gi = F(-k,1), *zr = Z(k,0), *zi = Z(k,1);
+		for (size_t i=0; i<m_stride; i+=PACK_SIZE) {
+			Pack Ar = load(&c[0][i]), Ai = load(&c[1][i]), Br = load(&c[2][i]), Bi = load(&c[3][i]);
+			Pack Cr = load(&c[4][i]), Ci = load(&c[5][i]), Dr = load(&c[6][i]), Di = load(&c[7][i]);
+			Pack R8 = load(&c[8][i]);
+			Pack Fr = load(fr+i), Fi = load(fi+i), Gr = load(gr+i), Gi = load(gi+i), Zr = load(zr+i), Zi = load(zi+i);
+			Pack nFi = neg(Fi), nGi = neg(Gi), nZi = neg(Zi), nDi = neg(Di);
+
+			Pack outFr, outFi, outGr, outGi, outZr, outZi;
+			cmul(Ar, Ai, Fr, Fi, outFr, outFi);            // F(k)' = A*F(k) + B*conj(F(-k)) + C*Z(k)
+			cmac(Br, Bi, Gr, nGi, outFr, outFi);
+			cmac(Cr, Ci, Zr, Zi, outFr, outFi);
+			cmul(Ar, Ai, Gr, Gi, outGr, outGi);            // F(-k)' = A*F(-k) + B*conj(F(k)) + C*conj(Z(k))
+			cmac(Br, Bi, Fr, nFi, outGr, outGi);
+			cmac(Cr, Ci, Zr, nZi, outGr, outGi);
+			cmul(Dr, Di, Fr, Fi, outZr, outZi);            // Z(k)' = D*F(k) + conj(D)*conj(F(-k)) + R8*Z(k)
+			cmac(Dr, nDi, Gr, nGi, outZr, outZi);
+			outZr = add(outZr, mul(R8, Zr));
+			outZi = add(outZi, mul(R8, Zi));
+
+			store(fr+i, outFr); store(fi+i, outFi);
+			store(gr+i, outGr); store(gi+i, outGi);
+			store(zr+i, outZr); store(zi+i, outZi);
+		}
+	}
+}
+
+/***********************************************************/
+std::complex<float> EpgStates::echo(size_t i) const
+{
+	size_t row = (size_t)m_maxStates*m_stride;
+	return std::complex<float>(m_F[0][row+i], m_F[1][row+i]);
+}
+
+/***********************************************************/
+void EpgTissues::add(float pt1, float pt2, float pb1, float pdB0)
+{
+	t1.push_back(pt1);
+	t2.push_back(pt2);
+	b1.push_back(pb1);
+	dB0.push_back(pdB0);
+}
+
+/***********************************************************/
+EpgSimulator::EpgSimulator(ExternalSequence &seq)
+	: m_seq(seq), m_numThreads(1), m_maxStates(DEFAULT_MAX_STATES), m_axis(-1), m_unit(0.0),
+	  m_usedAxis(0), m_usedUnit(0.0), m_numEchoes(0) {}
+
+/***********************************************************/
+void EpgSimulator::SetDephasing(int channel, double unit)
+{
+	m_axis = (channel>=0 && channel<NUM_GRADS) ? channel : -1;
+	m_unit = (unit>0) ? unit : 0.0;
+}
+
+/***********************************************************/
+bool EpgSimulator::collectEvents()
+{
+	struct RfPulse { double center, angle, phase; };
+	std::map<int,RfPulse> pulses;
+
+	m_events.clear();
+	m_numEchoes = 0;
+	for (int c=0; c<NUM_GRADS; c++)
+		m_readoutMoment[c] = 0.0;
+	BlockView block;
+	BlockIntegral integral;
+	double dt = 0.0, moment[NUM_GRADS] = { 0.0, 0.0, 0.0 };
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	for (int b=0; b<numBlocks; b++)
+	{
+		m_seq.GetBlock(b, block);
+		if (!integral.set(m_seq, block)) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradients of block " << b+1);
+			return false;
+		}
+		const double duration = (double)(m_seq.GetBlockStartTime(b+1) - m_seq.GetBlockStartTime(b));
+
+		// Centre, flip angle and phase of the RF pulse
+		double tRF = INFINITY, tADC = INFINITY;
+		std::map<int,RfPulse>::iterator pulse = pulses.end();
+		if (block.isRF()) {
+			int id = block.GetEventIndex(RF);
+			pulse = pulses.find(id);
+			if (pulse==pulses.end()) {
+				const RFEvent &rf = block.GetRFEvent();
+				DecodedShape mag = m_seq.GetDecodedShape(rf.magShape, SHAPE_RF_MAGNITUDE), phase;
+				if (rf.phaseShape>0)
+					phase = m_seq.GetDecodedShape(rf.phaseShape, SHAPE_RF_PHASE);
+				if (!mag || (rf.phaseShape>0 && (!phase || phase->size()!=mag->size()))) {
+					ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode shapes of RF event " << id);
+					return false;
+				}
+				std::complex<double> sum(0.0, 0.0);
+				for (size_t i=0; i<mag->size(); i++) {
+					double p = (phase ? (*phase)[i] : 0.0) + 2*M_PI*rf.freqOffset*(i+0.5)*KspaceCalculator::RF_RASTER_TIME*1e-6;
+					sum += std::polar((double)(*mag)[i], p);
+				}
+				RfPulse info;
+				info.center = KspaceCalculator::GetRfCenter(*mag);
+				info.angle = 2*M_PI*rf.amplitude*abs(sum)*KspaceCalculator::RF_RASTER_TIME*1e-6;
+				info.phase = rf.phaseOffset + arg(sum);
+				pulse = pulses.insert(std::make_pair(id, info)).first;
+			}
+			tRF = block.GetRFEvent().delay + pulse->second.center;
+		}
+		const ADCEvent &adc = block.GetADCEvent();
+		if (block.isADC()) {
+			tADC = adc.delay + (adc.numSamples/2)*adc.dwellTime*1e-3;
+			double start[NUM_GRADS], end[NUM_GRADS];
+			integral.at(adc.delay, start);
+			integral.at(adc.delay + adc.numSamples*adc.dwellTime*1e-3, end);
+			for (int c=0; c<NUM_GRADS; c++)
+				m_readoutMoment[c] += fabs(end[c]-start[c]);
+		}
+
+		// Events in time order, the remaining time and moment carry over to the next block
+		double tCur = 0.0, areaCur[NUM_GRADS] = { 0.0, 0.0, 0.0 }, area[NUM_GRADS];
+		while (true)
+		{
+			bool rfFirst = (tRF<=tADC);
+			double t = MIN(tRF, tADC);
+			bool blockEnd = (t==INFINITY);
+			if (blockEnd)
+				t = duration;
+			integral.at(t, area);
+			for (int c=0; c<NUM_GRADS; c++) {
+				moment[c] += area[c]-areaCur[c];
+				areaCur[c] = area[c];
+			}
+			dt += t-tCur;
+			tCur = t;
+			if (blockEnd)
+				break;
+
+			EpgEvent ev;
+			ev.dt = dt;
+			for (int c=0; c<NUM_GRADS; c++)
+				ev.moment[c] = moment[c]*1e-6;
+			ev.shift = 0;
+			ev.rf = rfFirst;
+			if (rfFirst) {
+				ev.angle = pulse->second.angle;
+				ev.phase = pulse->second.phase;
+				tRF = INFINITY;
+			}
+			else {
+				ev.angle = 0.0;
+				ev.phase = adc.phaseOffset + 2*M_PI*adc.freqOffset*(adc.numSamples/2)*adc.dwellTime*1e-9;
+				tADC = INFINITY;
+				m_numEchoes++;
+			}
+			m_events.push_back(ev);
+			dt = 0.0;
+			for (int c=0; c<NUM_GRADS; c++)
+				moment[c] = 0.0;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+void EpgSimulator::quantizeMoments()
+{
+	// Readout axis, or the axis with the largest moments between events
+	m_usedAxis = m_axis;
+	if (m_usedAxis<0) {
+		double total[NUM_GRADS] = { m_readoutMoment[0], m_readoutMoment[1], m_readoutMoment[2] };
+		if (total[0]+total[1]+total[2]==0.0) {
+			for (size_t i=0; i<m_events.size(); i++)
+				for (int c=0; c<NUM_GRADS; c++)
+					total[c] += fabs(m_events[i].moment[c]);
+		}
+		m_usedAxis = 0;
+		for (int c=1; c<NUM_GRADS; c++)
+			if (total[c]>total[m_usedAxis])
+				m_usedAxis = c;
+	}
+
+	// Smallest moment of which all moments are integer multiples (within 5%),
+	// a balanced axis (no moments above 1e-3/m) is not dephased at all
+	m_usedUnit = m_unit;
+	if (m_usedUnit<=0) {
+		double largest = 0.0;
+		for (size_t i=0; i<m_events.size(); i++)
+			largest = MAX(largest, fabs(m_events[i].moment[m_usedAxis]));
+		double smallest = (largest>1e-3) ? largest : 0.0;
+		for (size_t i=0; i<m_events.size(); i++) {
+			double m = fabs(m_events[i].moment[m_usedAxis]);
+			if (m>1e-3*largest && m<smallest)
+				smallest = m;
+		}
+		m_usedUnit = (smallest>0) ? smallest : 1.0;
+		for (int d=1; d<=8 && smallest>0; d++) {
+			double unit = smallest/d;
+			bool integer = true;
+			for (size_t i=0; i<m_events.size() && integer; i++) {
+				double n = m_events[i].moment[m_usedAxis]/unit;
+				integer = fabs(n-floor(n+0.5))<0.05;
+			}
+			if (integer) {
+				m_usedUnit = unit;
+				break;
+			}
+		}
+	}
+
+	// Shifts of the rounded total moment, so that rounding errors do not accumulate
+	double total = 0.0;
+	long applied = 0;
+	for (size_t i=0; i<m_events.size(); i++) {
+		total += m_events[i].moment[m_usedAxis]/m_usedUnit;
+		long n = (long)floor(total+0.5) - applied;
+		m_events[i].shift = (int)MAX(-m_maxStates-1, MIN(n, m_maxStates+1));
+		applied += n;
+	}
+}
+
+/***********************************************************/
+void EpgSimulator::simulateRange(const EpgTissues &tissues, size_t begin, size_t end, std::vector<std::complex<float> > &echoes)
+{
+	EpgStates states(tissues, begin, end, m_maxStates);
+	const size_t numTissues = tissues.size();
+	size_t echo = 0;
+	for (size_t e=0; e<m_events.size(); e++)
+	{
+		const EpgEvent &ev = m_events[e];
+		states.relax(ev.dt);
+		states.shift(ev.shift);
+		if (ev.rf)
+			states.pulse(ev.angle, ev.phase);
+		else {
+			std::complex<float> rx = std::polar(1.0f, (float)-ev.phase);
+			for (size_t i=begin; i<end; i++)
+				echoes[echo*numTissues + i] = states.echo(i-begin)*rx;
+			echo++;
+		}
+	}
+}
+
+/***********************************************************/
+bool EpgSimulator::simulate(const EpgTissues &tissues, std::vector<std::complex<float> > &echoes)
+{
+	echoes.clear();
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	if (m_seq.IsStreaming() || (numBlocks>0 && m_seq.GetBlockStartTime(numBlocks)<0)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: simulation requires a completely loaded sequence");
+		return false;
+	}
+	const size_t numTissues = tissues.size();
+	if (tissues.t2.size()!=numTissues || (!tissues.b1.empty() && tissues.b1.size()!=numTissues) ||
+		(!tissues.dB0.empty() && tissues.dB0.size()!=numTissues)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: tissue arrays differ in size");
+		return false;
+	}
+	if (!collectEvents())
+		return false;
+	quantizeMoments();
+	if (numTissues==0)
+		return true;	// nothing to simulate, the states of an empty range are not defined
+	echoes.resize(m_numEchoes*numTissues);
+
+	// Split the tissues into ranges of whole packs, one per thread
+	size_t numPacks = (numTissues + PACK_SIZE-1)/PACK_SIZE;
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, numPacks/16));
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		size_t begin = MIN(numTissues, numPacks*i/numThreads*PACK_SIZE);
+		size_t end = MIN(numTissues, numPacks*(i+1)/numThreads*PACK_SIZE);
+		if (i+1<numThreads)
+			threads.push_back(std::thread([=,&tissues,&echoes]() { simulateRange(tissues, begin, end, echoes); }));
+		else
+			simulateRange(tissues, begin, end, echoes);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+	return true;
+}
@@ -0,0 +1,178 @@
+/** @file EpgSimulator.h */
+
+#include "ExternalSequence.h"
+#include "KspaceCalculator.h"
+
+#include <complex>
+
+#ifndef _EPG_SIMULATOR_H_
+#define _EPG_SIMULATOR_H_
+
+/**
+ * @brief Tissue parameters simulated in one batch
+ *
+ * Parameters are stored as one array per quantity (structure of arrays).
+ */
+struct EpgTissues
+{
+	std::vector<float> t1;     /**< @brief Longitudinal relaxation time (s, 0: none) */
+	std::vector<float> t2;     /**< @brief Transverse relaxation time (s, 0: none) */
+	std::vector<float> b1;     /**< @brief Scaling of the flip angles */
+	std::vector<float> dB0;    /**< @brief Off-resonance frequency (Hz) */
+
+	/**
+	 * @brief Return the number of tissues
+	 */
+	size_t size() const;
+
+	/**
+	 * @brief Append a parameter set
+	 */
+	void add(float t1, float t2, float b1=1.0f, float dB0=0.0f);
+};
+
+inline size_t EpgTissues::size() const { return t1.size(); }
+
+
+/**
+ * @brief Extended phase graph (EPG) simulation of a sequence
+ *
+ * Simulates the echo amplitudes of a sequence for a batch of tissue parameter
+ * sets, e.g. to build a dictionary for MR fingerprinting. The magnetization
+ * is described by the configuration states F(k) (k = -N..N) and Z(k)
+ * (k = 0..N) of the dephasing along one gradient axis:
+ *
+ *  - **RF pulses** are instantaneous rotations at the centre of the pulse with
+ *    the flip angle and phase of the complex pulse shape (scaled by B1).
+ *  - **Gradients** shift the states by their moment along the dephasing axis
+ *    in multiples of the dephasing unit. Moments on the other axes are ignored.
+ *  - **Relaxation** and off-resonance are applied between events.
+ *  - **ADC** events return F(0) at the echo time, sample `numSamples/2` of the
+ *    readout, without the receiver phase.
+ *
+ * Rotations follow the convention of BlochSimulator, so the echo amplitudes
+ * equal the signal of an isochromat ensemble spread uniformly over one cycle
+ * of the dephasing unit. By default the dephasing axis is the readout axis
+ * (the axis with the largest gradient moments during the ADC events), and the
+ * unit is the smallest moment of which all moments between events are (nearly)
+ * integer multiples.
+ *
+ * The states of all tissues are stored as contiguous arrays and updated with
+ * SIMD kernels; the batch can be split between threads.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * EpgTissues tissues;
+ * for (float t1 : T1) for (float t2 : T2) tissues.add(t1, t2);
+ * EpgSimulator epg(seq);
+ * std::vector<std::complex<float> > echoes;   // [echo][tissue]
+ * epg.simulate(tissues, echoes);
+ * ~~~~~~~~~~~~~
+ */
+class EpgSimulator
+{
+public:
+	static const int DEFAULT_MAX_STATES = 128;  /**< @brief Default highest dephasing order */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the simulator is in use.
+	 */
+	EpgSimulator(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the number of threads used for the simulation
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Set the highest dephasing order kept, higher states are discarded
+	 */
+	void SetMaxStates(int maxStates);
+
+	/**
+	 * @brief Set the dephasing axis and unit
+	 *
+	 * @param channel Gradient axis (0: x, 1: y, 2: z)
+	 * @param unit    Gradient moment shifting the states by one (1/m), 0: detect automatically
+	 */
+	void SetDephasing(int channel, double unit);
+
+	/**
+	 * @brief Simulate the sequence for all tissues
+	 *
+	 * All tissues start in equilibrium (Z(0) = 1).
+	 *
+	 * @param tissues Parameter sets to simulate
+	 * @param echoes  Echo amplitudes, `echoes[e*tissues.size() + t]` is echo `e` of tissue `t`, empty without tissues
+	 * @return false if the sequence has no timing information or a shape cannot be decoded
+	 */
+	bool simulate(const EpgTissues &tissues, std::vector<std::complex<float> > &echoes);
+
+	/**
+	 * @brief Return the number of echoes (ADC events) of the last simulation
+	 */
+	size_t GetNumEchoes() const;
+
+	/**
+	 * @brief Return the dephasing axis of the last simulation
+	 */
+	int GetDephasingAxis() const;
+
+	/**
+	 * @brief Return the dephasing unit of the last simulation (1/m)
+	 */
+	double GetDephasingUnit() const;
+
+protected:
+	/**
+	 * @brief Event of the simulation
+	 */
+	struct EpgEvent
+	{
+		double dt;                  /**< @brief Time since the previous event (us) */
+		double moment[NUM_GRADS];   /**< @brief Gradient moment since the previous event (1/m) */
+		int shift;                  /**< @brief State shift since the previous event */
+		bool rf;                    /**< @brief RF pulse (true) or echo (false) */
+		double angle;               /**< @brief Flip angle (rad) */
+		double phase;               /**< @brief Phase of the RF pulse or of the receiver (rad) */
+	};
+
+	/**
+	 * @brief Collect the RF pulses and echoes of the sequence
+	 */
+	bool collectEvents();
+
+	/**
+	 * @brief Choose the dephasing axis and unit and quantize the moments
+	 */
+	void quantizeMoments();
+
+	/**
+	 * @brief Simulate the tissues [begin,end) and store their echoes
+	 */
+	void simulateRange(const EpgTissues &tissues, size_t begin, size_t end, std::vector<std::complex<float> > &echoes);
+
+	ExternalSequence &m_seq;     /**< @brief Sequence to simulate */
+	int m_numThreads;            /**< @brief Number of threads (0: all cores) */
+	int m_maxStates;             /**< @brief Highest dephasing order */
+	int m_axis;                  /**< @brief Dephasing axis (-1: automatic) */
+	double m_unit;               /**< @brief Dephasing unit (1/m, 0: automatic) */
+	int m_usedAxis;              /**< @brief Dephasing axis of the last simulation */
+	double m_usedUnit;           /**< @brief Dephasing unit of the last simulation */
+
+	std::vector<EpgEvent> m_events; /**< @brief RF pulses and echoes */
+	size_t m_numEchoes;          /**< @brief Number of echoes */
+	double m_readoutMoment[NUM_GRADS]; /**< @brief Gradient moments during the ADC events */
+};
+
+inline void EpgSimulator::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+inline void EpgSimulator::SetMaxStates(int maxStates) { m_maxStates = MAX(maxStates, 1); }
+inline size_t EpgSimulator::GetNumEchoes() const { return m_numEchoes; }
+inline int EpgSimulator::GetDephasingAxis() const { return m_usedAxis; }
+inline double EpgSimulator::GetDephasingUnit() const { return m_usedUnit; }
+
+#endif	//_EPG_SIMULATOR_H_
@@ -1,7 +1,10 @@
 #include "ExternalSequence.h"
 
-#include <stdio.h>		// sscanf
-#include <cstring>		// strlen etc
+#include <stdio.h>
+#include <stdlib.h>		// strtod, strtof
+#include <cstring>		// memcpy etc
+#include <cfloat>		// FLT_MIN, FLT_MAX
+#include <climits>		// INT_MAX
 #include <iomanip>		// std::setw etc
 
 #include <algorithm>	// for std::max_element
@@ -9,9 +12,10 @@
 #include <math.h>		// fabs etc
 
 #include <functional> // for bind1st
+#include <atomic>
+#include <thread>
 
 ExternalSequence::PrintFunPtr ExternalSequence::print_fun = &ExternalSequence::defaultPrint;
-const int ExternalSequence::MAX_LINE_SIZE = 256;
 const char ExternalSequence::COMMENT_CHAR = '#';
 
 // Define the path separator depending on the compile target
@@ -24,6 +28,21 @@ const char ExternalSequence::COMMENT_CHAR = '#';
 #define PATH_SEPARATOR "\\"
 #endif
 
+// Memory-mapped file access is available on POSIX platforms
+#if !defined(VXWORKS) && (defined(__unix__) || defined(__APPLE__))
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Vectorized shape decompression on x86 (SSE2 baseline, AVX selected at runtime)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /***********************************************************/
 ExternalSequence::ExternalSequence()
 {
@@ -32,12 +51,31 @@ ExternalSequence::ExternalSequence()
 	version_minor=0;
 	version_revision=0;
 	version_combined=0;
+	m_parseBegin=NULL;
+	m_numLoadThreads=1;
+	m_streamingMode=false;
+	m_blocksStreamed=false;
+	m_blockLine=0;
+	m_lazyShapes=true;
+	m_deferShapes=false;
+	m_profiling=false;
+	m_tracing=false;
+	m_decodeCalls=0;
+	m_cacheEnabled=false;
+	m_cacheDecodedShapes=false;
+	m_cacheVerifyImage=false;
+	m_sourceSize=0;
+	m_sourceTime=0;
 }
 
 
 /***********************************************************/
 ExternalSequence::~ExternalSequence(){}
 
+/***********************************************************/
+// Messages of parser threads are collected and printed in file order
+static thread_local std::vector<std::string> *t_messageBuffer = NULL;
+
 /***********************************************************/
 void ExternalSequence::print_msg(MessageType level, std::ostream& ss) {
 	if (MSG_LEVEL>=level) {
@@ -48,778 +86,3372 @@ void ExternalSequence::print_msg(MessageType level, std::ostream& ss) {
 		std::ostringstream oss;
 		oss.width(2*(level-1)); oss << "";
 		oss << static_cast<std::ostringstream&>(ss).str();
-		print_fun(oss.str().c_str());
+		if (t_messageBuffer)
+			t_messageBuffer->push_back(oss.str());
+		else
+			print_fun(oss.str().c_str());
 #endif
 	}
 }
 
-/***********************************************************/
-bool ExternalSequence::load(std::string path)
+/**
+ * @brief Measure a phase of load() or decoding while profiling is enabled
+ *
+ * The phase ends with stop() or the destruction of the timer. Without
+ * profiling the timer only tests the flag of the sequence.
+ */
+class PhaseTimer
 {
-	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "Reading external sequence files");
+public:
+	PhaseTimer(ExternalSequence *seq, LoadPhase phase, const char *name=NULL)
+		: m_seq(seq->m_profiling ? seq : NULL), m_phase(phase), m_name(name)
+	{
+		if (m_seq)
+			m_start = std::chrono::steady_clock::now();
+	}
+	~PhaseTimer() { stop(); }
 
-	char buffer[MAX_LINE_SIZE];
-	char tmpStr[MAX_LINE_SIZE];
+	void stop()
+	{
+		if (!m_seq)
+			return;
+		m_seq->recordPhase(m_phase, m_name ? m_name : LoadStats::GetPhaseName(m_phase), m_start, std::chrono::steady_clock::now());
+		m_seq = NULL;
+	}
 
-	// **********************************************************************************************************************
-	// ************************ READ SHAPES ***********************************
+private:
+	ExternalSequence *m_seq;
+	LoadPhase m_phase;
+	const char *m_name;
+	std::chrono::steady_clock::time_point m_start;
+};
 
-	// Try single file mode (everything in .seq file)
-	std::ifstream data_file;
-	bool isSingleFileMode = true;
-	std::string filepath = path;
-	if (filepath.substr(filepath.size()-4) != std::string(".seq")) {
-		filepath = path + PATH_SEPARATOR + "external.seq";
-	}
-	// Open in binary mode to ensure all end-of-line characters are processed
-	data_file.open(filepath.c_str(), std::ios::in | std::ios::binary);
-	data_file.seekg(0, std::ios::beg);
+/** @brief Return the phase of a text or binary section */
+static LoadPhase sectionPhase(const std::string &section)
+{
+	if (section=="[VERSION]" || section=="[DEFINITIONS]")
+		return PHASE_DEFINITIONS;
+	if (section=="[BLOCKS]")
+		return PHASE_BLOCKS;
+	if (section=="[SHAPES]")
+		return PHASE_SHAPES;
+	return PHASE_EVENTS;
+}
 
-	if (!data_file.good())
-	{
-		// Try separate file mode (blocks.seq, events.seq, shapes.seq)
-		filepath = path + PATH_SEPARATOR + "shapes.seq";
-		data_file.open(filepath.c_str(), std::ios::in | std::ios::binary);
-		data_file.seekg(0, std::ios::beg);
-		isSingleFileMode = false;
+/***********************************************************/
+MappedFile::MappedFile() : m_data(NULL), m_size(0), m_isMapped(false) {}
+
+/***********************************************************/
+MappedFile::~MappedFile() { close(); }
+
+/***********************************************************/
+bool MappedFile::open(const std::string &path)
+{
+	close();
+#ifdef HAVE_MMAP
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd<0)
+		return false;
+	struct stat st;
+	if (fstat(fd,&st)!=0 || !S_ISREG(st.st_mode)) {
+		::close(fd);
+		return false;
 	}
-	if (!data_file.good())
-	{
-		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read file " << filepath);
+	m_size = (size_t)st.st_size;
+	if (m_size>0) {
+		void *addr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr!=MAP_FAILED) {
+			madvise(addr, m_size, MADV_SEQUENTIAL);
+			m_data = static_cast<const char*>(addr);
+			m_isMapped = true;
+		}
+	}
+	::close(fd);
+	if (m_isMapped || m_size==0) {
+		if (m_size==0) m_data = "";
+		return true;
+	}
+#endif
+	// Fall back to reading the whole file into memory
+	std::ifstream is(path.c_str(), std::ios::in | std::ios::binary);
+	if (!is.good())
+		return false;
+	is.seekg(0, std::ios::end);
+	std::streamoff length = is.tellg();
+	is.seekg(0, std::ios::beg);
+	if (length<0)
+		return false;
+	m_buffer.resize((size_t)length+1);
+	if (length>0 && !is.read(&m_buffer[0], length))
+		return false;
+	m_data = &m_buffer[0];
+	m_size = (size_t)length;
+	return true;
+}
+
+/***********************************************************/
+void MappedFile::close()
+{
+#ifdef HAVE_MMAP
+	if (m_isMapped)
+		munmap(const_cast<char*>(m_data), m_size);
+#endif
+	std::vector<char>().swap(m_buffer);
+	m_data = NULL;
+	m_size = 0;
+	m_isMapped = false;
+}
+
+/** @brief Get the size and modification time (ns) of a regular file */
+static bool fileStatus(const std::string &path, long long &size, long long &time)
+{
+#ifdef HAVE_MMAP
+	struct stat st;
+	if (stat(path.c_str(),&st)!=0 || !S_ISREG(st.st_mode))
+		return false;
+	size = (long long)st.st_size;
+#if defined(__APPLE__)
+	time = (long long)st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+	time = (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#endif
+	return true;
+#else
+	return false;	// cache images are not supported without the file status
+#endif
+}
+
+
+// * ------------------------------------------------------------------ *
+// * Tokenizer for the text format                                      *
+// * ------------------------------------------------------------------ *
+// The functions below work directly on the (memory-mapped) file content.
+// Number parsers take the end of the current line as bound, skip leading
+// blanks and on success advance the position past the number, mirroring
+// the behaviour of the corresponding sscanf() conversions.
+
+/** @brief Return pointer to the end of the line starting at `p` (first CR/LF or end of file) */
+static inline const char* lineEnd(const char *p, const char *end)
+{
+	while (p<end && *p!='\n' && *p!='\r') ++p;
+	return p;
+}
+
+/** @brief Return pointer to the start of the next line given the end of the current one */
+static inline const char* nextLine(const char *eol, const char *end)
+{
+	if (eol<end && *eol++=='\r' && eol<end && *eol=='\n')
+		++eol;
+	return eol;
+}
+
+static inline bool isBlank(char c) { return c==' ' || c=='\t' || c=='\v' || c=='\f'; }
+static inline bool isDigit(char c) { return c>='0' && c<='9'; }
+
+static inline void skipBlanks(const char *&p, const char *end)
+{
+	while (p<end && isBlank(*p)) ++p;
+}
+
+/** @brief Parse a decimal integer (equivalent to %d / %ld) */
+template<typename T>
+static inline bool readInteger(const char *&p, const char *end, T &value)
+{
+	const char *q = p;
+	skipBlanks(q,end);
+	bool negative = false;
+	if (q<end && (*q=='+' || *q=='-')) negative = (*q++=='-');
+	if (q>=end || !isDigit(*q))
 		return false;
+	long long v = 0;
+	while (q<end && isDigit(*q)) {
+		if (v>(LLONG_MAX-9)/10)
+			return false;	// too many digits
+		v = v*10 + (*q++ - '0');
 	}
-	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Building index" );
+	if (negative) v = -v;
+	if ((long long)(T)v!=v)
+		return false;	// out of the range of T
+	value = (T)v;
+	p = q;
+	return true;
+}
 
-	// Save locations of section tags
-	buildFileIndex(data_file);
+/** @brief Parse a whitespace-delimited word (equivalent to %s) */
+static inline bool readWord(const char *&p, const char *end, std::string &word)
+{
+	skipBlanks(p,end);
+	const char *start = p;
+	while (p<end && !isBlank(*p)) ++p;
+	word.assign(start,p);
+	return (p>start);
+}
 
-	// Read version section
-	if (m_fileIndex.find("[VERSION]") != m_fileIndex.end()) {
-		print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "decoding VERSION section");
-		// Version is a recommended but not a compulsory section
-		// very basic reading code, repeated keywords will overwrite previous values, no serious error checking
-		data_file.seekg(m_fileIndex["[VERSION]"], std::ios::beg);
-		skipComments(data_file,buffer);			// load up some data and ignore comments & empty lines
-		while (data_file.good() && buffer[0]!='[')
-		{
-			print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "buffer: \n" << buffer << std::endl );
-			if (0==strncmp(buffer,"major",5)) {
-				    if (1!=sscanf(buffer+5, "%d", &version_major)) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_major");
-					return false;
-				}
-			    print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "major=" << version_major);		
-			} else if (0==strncmp(buffer,"minor",5)) {
-				if (1!=sscanf(buffer+5, "%d", &version_minor)) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_minor");
-					return false;
-				}
-				print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "minor=" << version_minor);
-			}
-			else if (0==strncmp(buffer,"revision",8)) {
-				if (1!=sscanf(buffer+8, "%d", &version_revision)) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_revision \n" << buffer << std::endl );
-					return false;
-				}
-				print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "revision=" << version_revision);
-			}
-			else
-			{
-				print_msg(WARNING_MSG, std::ostringstream().flush() << "*** WARNING: unknown field in the [VERSION] block");
-				return false;
+static const double POW10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * @brief Convert a plain decimal number using double arithmetic only
+ *
+ * Succeeds if the decimal mantissa fits into 53 bits and the power of ten is
+ * exactly representable, in which case a single multiplication or division
+ * yields the correctly rounded result (Clinger's fast path). Anything else
+ * (long mantissas, large exponents, inf/nan, hex floats) is left to the C library.
+ */
+static inline bool fastDecimal(const char *&p, const char *end, double &value)
+{
+	const char *q = p;
+	bool negative = false;
+	if (q<end && (*q=='+' || *q=='-')) negative = (*q++=='-');
+
+	unsigned long long mantissa = 0;
+	int numDigits = 0, exponent = 0;
+	bool anyDigits = false;
+	while (q<end && isDigit(*q)) {
+		anyDigits = true;
+		if (mantissa>0 || *q!='0') {
+			if (++numDigits>19) return false;
+			mantissa = mantissa*10 + (*q-'0');
+		}
+		++q;
+	}
+	if (q<end && *q=='.') {
+		++q;
+		while (q<end && isDigit(*q)) {
+			anyDigits = true;
+			if (mantissa>0 || *q!='0') {
+				if (++numDigits>19) return false;
+				mantissa = mantissa*10 + (*q-'0');
 			}
-			//getline(data_file, buffer, MAX_LINE_SIZE);
-			skipComments(data_file,buffer);			// load up some data and ignore comments & empty lines
+			--exponent;
+			++q;
 		}
-		version_combined=version_major*1000000L+version_minor*1000L+version_revision;
 	}
-	
-	// Read shapes section
-	// ------------------------
-	if (m_fileIndex.find("[SHAPES]") == m_fileIndex.end()) {
-		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Required: [SHAPES] section");
+	if (!anyDigits || (q<end && (*q=='x' || *q=='X')))
 		return false;
+	if (q<end && (*q=='e' || *q=='E')) {
+		const char *e = q+1;
+		bool negativeExp = false;
+		if (e<end && (*e=='+' || *e=='-')) negativeExp = (*e++=='-');
+		if (e<end && isDigit(*e)) {
+			int exp = 0;
+			while (e<end && isDigit(*e)) {
+				if (exp<10000) exp = exp*10 + (*e-'0');
+				++e;
+			}
+			exponent += negativeExp ? -exp : exp;
+			q = e;
+		}
 	}
-	data_file.seekg(m_fileIndex["[SHAPES]"], std::ios::beg);
-	skipComments(data_file,buffer);			// Ignore comments & empty lines
+	if (mantissa>(1ULL<<53) || exponent<-22 || exponent>22) {
+		if (mantissa!=0) return false;
+		exponent = 0;
+	}
+	double v = (double)mantissa;
+	v = (exponent<0) ? v/POW10[-exponent] : v*POW10[exponent];
+	value = negative ? -v : v;
+	p = q;
+	return true;
+}
 
-	int shapeId, numSamples;
-	float sample;
+/** @brief Convert the number at `p` with the C library (slow path) */
+template<typename T>
+static inline bool libraryDecimal(const char *&p, const char *end, T &value)
+{
+	char token[64];
+	size_t n = 0;
+	while (p+n<end && n<sizeof(token)-1 && !isBlank(p[n])) {
+		token[n] = p[n];
+		++n;
+	}
+	token[n] = '\0';
+	char *tokenEnd;
+	value = (sizeof(T)==sizeof(float)) ? (T)strtof(token,&tokenEnd) : (T)strtod(token,&tokenEnd);
+	if (tokenEnd==token)
+		return false;
+	p += (tokenEnd-token);
+	return true;
+}
 
-	m_shapeLibrary.clear();
-	while (data_file.good() && buffer[0]=='s')
-	{
-		if (2!=sscanf(buffer, "%s%d", tmpStr, &shapeId)) {
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'shapeId'\n" << buffer << std::endl );
-			return false;
-		}
-		getline(data_file, buffer, MAX_LINE_SIZE);
-		if (2!=sscanf(buffer, "%s%d", tmpStr, &numSamples)) {
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'numSamples'\n" << buffer << std::endl );
-			return false;
+/** @brief Parse a double-precision number (equivalent to %lf) */
+static inline bool readDouble(const char *&p, const char *end, double &value)
+{
+	skipBlanks(p,end);
+	if (fastDecimal(p,end,value))
+		return true;
+	return libraryDecimal(p,end,value);
+}
+
+/**
+ * @brief Parse a single-precision number (equivalent to %f)
+ *
+ * The double result of the fast path is rounded once more to float. This is
+ * only ambiguous if the double lies exactly halfway between two floats, or in
+ * the subnormal or overflow range, those cases go through strtof().
+ */
+static inline bool readFloat(const char *&p, const char *end, float &value)
+{
+	skipBlanks(p,end);
+	const char *start = p;
+	double v;
+	if (fastDecimal(p,end,v)) {
+		double a = fabs(v);
+		unsigned long long bits;
+		memcpy(&bits,&v,sizeof(bits));
+		if ((a==0.0 || (a>=FLT_MIN && a<=FLT_MAX)) && (bits & 0x1FFFFFFFULL)!=0x10000000ULL) {
+			value = (float)v;
+			return true;
 		}
+		p = start;
+	}
+	return libraryDecimal(p,end,value);
+}
 
-		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Reading shape " << shapeId );
+/** @brief Return true if the line [p,eol) is a section header, e.g. [RF] */
+static inline bool isSectionHeader(const char *p, const char *eol)
+{
+	return (eol>p && p[0]=='[' && eol[-1]==']');
+}
 
-		CompressedShape shape;
-		shape.samples.clear();
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='s' || strlen(buffer)==0) {
-				break;
-			}
-			if (1!=sscanf(buffer, "%f", &sample)) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'sample'\n" << buffer << std::endl );
-				return false;
-			}
-			shape.samples.push_back(sample);
-		}
-		shape.numUncompressedSamples=numSamples;
+/** @brief Decode a line of the [BLOCKS] section */
+static inline bool readBlockLine(const char *p, const char *eol, EventIDs &events)
+{
+	int blockIdx;
+	events.id[CTRL] = 0;	// optional column
+
+	if (!readInteger(p,eol,blockIdx) ||
+		!readInteger(p,eol,events.id[DELAY]) ||                                 // Delay
+		!readInteger(p,eol,events.id[RF]) ||                                    // RF
+		!readInteger(p,eol,events.id[GX]) || !readInteger(p,eol,events.id[GY]) ||
+		!readInteger(p,eol,events.id[GZ]) ||                                    // Gradients
+		!readInteger(p,eol,events.id[ADC])                                      // ADCs
+		)
+		return false;
+	readInteger(p,eol,events.id[CTRL]);                                         // Control
+	return true;
+}
 
-		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Shape index " << shapeId << " has " << shape.samples.size()
-			<< " compressed and " << shape.numUncompressedSamples << " uncompressed samples" );
 
-		m_shapeLibrary[shapeId] = shape;
+// * ------------------------------------------------------------------ *
+// * Binary file format                                                 *
+// * ------------------------------------------------------------------ *
+
+static const char BINARY_MAGIC[8] = { 0x01, 'p', 'u', 'l', 's', 'e', 'q', 0x02 };
+static const unsigned long long BINARY_SECTION_PREFIX = 0xFFFFFFFF00000000ULL;
+
+/**
+ * @brief Section codes of the binary format (lower 32 bits)
+ */
+enum BinarySection {
+	BINARY_DEFINITIONS = 1,
+	BINARY_BLOCKS,
+	BINARY_RF,
+	BINARY_GRADIENTS,
+	BINARY_TRAP,
+	BINARY_ADC,
+	BINARY_DELAYS,
+	BINARY_SHAPES
+};
+static const char* BINARY_SECTION_NAMES[] = { "", "[DEFINITIONS]", "[BLOCKS]", "[RF]",
+	"[GRADIENTS]", "[TRAP]", "[ADC]", "[DELAYS]", "[SHAPES]" };
+
+/** @brief Number of event IDs per block in the binary block table (no control column) */
+static const int BINARY_BLOCK_EVENTS = CTRL;
+
+/**
+ * @brief Sequential reader for the binary format
+ *
+ * Values are stored little-endian without alignment and are copied out of
+ * the mapping with memcpy. Reading past the end clears the `ok` flag.
+ */
+struct BinaryReader
+{
+	const char *pos;
+	const char *end;
+	bool ok;
+
+	BinaryReader(const char *begin, const char *e) : pos(begin), end(e), ok(true) {}
 
-		skipComments(data_file,buffer);			// Ignore comments & empty lines
+	bool has(unsigned long long numBytes) {
+		if ((unsigned long long)(end-pos)<numBytes) ok = false;
+		return ok;
 	}
-	data_file.clear();	// In case EOF reached
+	bool hasElements(long long count, size_t size) {	// without overflowing count*size
+		if (count<0 || (unsigned long long)count>(unsigned long long)(end-pos)/size) ok = false;
+		return ok;
+	}
+	template<typename T> T read() {
+		T value = T();
+		if (has(sizeof(T))) {
+			memcpy(&value,pos,sizeof(T));
+			pos += sizeof(T);
+		}
+		return value;
+	}
+};
 
-	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- SHAPES READ numShapes: " << m_shapeLibrary.size() );
+/** @brief Write a value in its binary representation */
+template<typename T>
+static inline void writeBinary(std::ostream &os, T value)
+{
+	os.write(reinterpret_cast<const char*>(&value),sizeof(T));
+}
 
+/** @brief Write the section code and number of entries */
+static inline void writeSectionHeader(std::ostream &os, BinarySection section, size_t numEntries)
+{
+	writeBinary<unsigned long long>(os, BINARY_SECTION_PREFIX | section);
+	writeBinary<long long>(os, (long long)numEntries);
+}
 
-	// **********************************************************************************************************************
-	// ************************ READ EVENTS ********************
-	if (!isSingleFileMode) {
-		filepath = path + PATH_SEPARATOR + "events.seq";
-		data_file.close();
-		data_file.open(filepath.c_str(), std::ios::in | std::ios::binary);
-		data_file.seekg(0, std::ios::beg);
+/** @brief Write the magic number and the version */
+static void writeBinaryHeader(std::ostream &os, int major, int minor, int revision)
+{
+	os.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+	writeBinary<long long>(os, major);
+	writeBinary<long long>(os, minor);
+	writeBinary<long long>(os, revision);
+}
 
-		if (!data_file.good())
-		{
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read file " << filepath);
+/**
+ * @brief Write the definitions section (if there are definitions)
+ * @return false if a definition has too many values
+ */
+static bool writeBinaryDefinitions(std::ostream &os, const std::map<std::string,std::vector<double> > &definitions)
+{
+	if (definitions.empty())
+		return true;
+	writeSectionHeader(os, BINARY_DEFINITIONS, definitions.size());
+	for (std::map<std::string,std::vector<double> >::const_iterator it=definitions.begin(); it!=definitions.end(); ++it) {
+		if (it->second.size()>127) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: too many values for definition " << it->first);
 			return false;
 		}
-		buildFileIndex(data_file);
+		os.write(it->first.c_str(), it->first.size()+1);
+		writeBinary<signed char>(os, 2);
+		writeBinary<signed char>(os, (signed char)it->second.size());
+		for (unsigned int j=0; j<it->second.size(); j++)
+			writeBinary<double>(os, it->second[j]);
 	}
+	return true;
+}
 
-	// Read RF section
-	// ------------------------
-	if (m_fileIndex.find("[RF]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[RF]"], std::ios::beg);
+/**
+ * @brief Write the event and shape sections
+ *
+ * Fields added by later revisions are written depending on the version, as
+ * in text files. Control events have no binary representation.
+ */
+static void writeBinaryLibraries(std::ostream &os, int version,
+	const EventLibrary<RFEvent> &rfLibrary, const EventLibrary<GradEvent> &gradLibrary,
+	const EventLibrary<ADCEvent> &adcLibrary, const EventLibrary<long> &delayLibrary,
+	const EventLibrary<CompressedShape> &shapeLibrary)
+{
+	const bool hasRfDelay   = (version>=1002000L);
+	const bool hasGradDelay = (version>=1001001L);
+
+	if (!rfLibrary.empty()) {
+		writeSectionHeader(os, BINARY_RF, rfLibrary.size());
+		for (int id=1; id<=rfLibrary.maxId(); id++) {
+			if (!rfLibrary.count(id)) continue;
+			const RFEvent &rf = rfLibrary[id];
+			writeBinary<int>(os, id);
+			writeBinary<double>(os, rf.amplitude);
+			writeBinary<int>(os, rf.magShape);
+			writeBinary<int>(os, rf.phaseShape);
+			if (hasRfDelay) writeBinary<long long>(os, rf.delay);
+			writeBinary<double>(os, rf.freqOffset);
+			writeBinary<double>(os, rf.phaseOffset);
+		}
+	}
 
-		int rfId;
-		m_rfLibrary.clear();
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
-			}
-			RFEvent event;
-			if (version_combined<1002000L)
-			{
-				if (6!=sscanf(buffer, "%d%f%d%d%f%f", &rfId, &(event.amplitude),
-							&(event.magShape),&(event.phaseShape),
-							&(event.freqOffset), &(event.phaseOffset)
-							)) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode RF event\n" << buffer << std::endl );
-				return false;
-			}
-				event.delay=0;
-			}
-			else
-			{
-				if (7!=sscanf(buffer, "%d%f%d%d%d%f%f", &rfId, &(event.amplitude),
-							&(event.magShape),&(event.phaseShape), &(event.delay),
-							&(event.freqOffset), &(event.phaseOffset)
-							)) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode RF event\n" << buffer << std::endl );
-					return false;
-				}
-			}
-			m_rfLibrary[rfId] = event;
+	size_t numArbitrary = 0;
+	for (int id=1; id<=gradLibrary.maxId(); id++)
+		if (gradLibrary.count(id) && gradLibrary[id].shape>0) numArbitrary++;
+	if (numArbitrary>0) {
+		writeSectionHeader(os, BINARY_GRADIENTS, numArbitrary);
+		for (int id=1; id<=gradLibrary.maxId(); id++) {
+			const GradEvent &grad = gradLibrary[id];
+			if (!gradLibrary.count(id) || grad.shape==0) continue;
+			writeBinary<int>(os, id);
+			writeBinary<double>(os, grad.amplitude);
+			writeBinary<int>(os, grad.shape);
+			if (hasGradDelay) writeBinary<long long>(os, grad.delay);
+		}
+	}
+	if (gradLibrary.size()>numArbitrary) {
+		writeSectionHeader(os, BINARY_TRAP, gradLibrary.size()-numArbitrary);
+		for (int id=1; id<=gradLibrary.maxId(); id++) {
+			const GradEvent &grad = gradLibrary[id];
+			if (!gradLibrary.count(id) || grad.shape>0) continue;
+			writeBinary<int>(os, id);
+			writeBinary<double>(os, grad.amplitude);
+			writeBinary<long long>(os, grad.rampUpTime);
+			writeBinary<long long>(os, grad.flatTime);
+			writeBinary<long long>(os, grad.rampDownTime);
+			if (hasGradDelay) writeBinary<long long>(os, grad.delay);
 		}
 	}
-	
-	// Read *arbitrary* gradient section
-	// -------------------------------
-	m_gradLibrary.clear();
-	if (m_fileIndex.find("[GRADIENTS]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[GRADIENTS]"], std::ios::beg);
 
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
-			}
-			int gradId;
-			GradEvent event;
-			if ( version_combined>=1001001L )
-			{
-				if (4!=sscanf(buffer, "%d%f%d%d", &gradId, &(event.amplitude), &(event.shape), &(event.delay))) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradient event\n" << buffer << std::endl );
-					return false;
-				}
-			}
-			else
-			{
-				if (3!=sscanf(buffer, "%d%f%d", &gradId, &(event.amplitude), &(event.shape))) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradient event\n" << buffer << std::endl );
-					return false;
-				}
-				event.delay=0;
-			}
-			m_gradLibrary[gradId] = event;
+	if (!adcLibrary.empty()) {
+		writeSectionHeader(os, BINARY_ADC, adcLibrary.size());
+		for (int id=1; id<=adcLibrary.maxId(); id++) {
+			if (!adcLibrary.count(id)) continue;
+			const ADCEvent &adc = adcLibrary[id];
+			writeBinary<int>(os, id);
+			writeBinary<long long>(os, adc.numSamples);
+			writeBinary<long long>(os, adc.dwellTime);
+			writeBinary<long long>(os, adc.delay);
+			writeBinary<double>(os, adc.freqOffset);
+			writeBinary<double>(os, adc.phaseOffset);
 		}
 	}
 
-	// Read *trapezoid* gradient section
-	// -------------------------------
-	if (m_fileIndex.find("[TRAP]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[TRAP]"], std::ios::beg);
+	if (!delayLibrary.empty()) {
+		writeSectionHeader(os, BINARY_DELAYS, delayLibrary.size());
+		for (int id=1; id<=delayLibrary.maxId(); id++) {
+			if (!delayLibrary.count(id)) continue;
+			writeBinary<int>(os, id);
+			writeBinary<long long>(os, delayLibrary[id]);
+		}
+	}
 
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
-			}
-			int gradId;
-			GradEvent event;
-			if ( version_combined>=1001001L )
-			{
-				if (6!=sscanf(buffer, "%d%f%ld%ld%ld%d", &gradId, &(event.amplitude),
-					&(event.rampUpTime),&(event.flatTime),&(event.rampDownTime),&(event.delay))) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode trapezoid gradient entry" << buffer << std::endl );
-					return false;
-				}					
-			}
-			else
-			{
-				if (5!=sscanf(buffer, "%d%f%ld%ld%ld", &gradId, &(event.amplitude),
-							&(event.rampUpTime),&(event.flatTime),&(event.rampDownTime))) {
-					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode trapezoid gradient entry" << buffer << std::endl );
-					return false;
-				}
-				event.delay=0;
-			}
-			
-			event.shape=0;
-			m_gradLibrary[gradId] = event;
+	if (!shapeLibrary.empty()) {
+		writeSectionHeader(os, BINARY_SHAPES, shapeLibrary.size());
+		for (int id=1; id<=shapeLibrary.maxId(); id++) {
+			if (!shapeLibrary.count(id)) continue;
+			const CompressedShape &shape = shapeLibrary[id];
+			writeBinary<int>(os, id);
+			writeBinary<long long>(os, shape.numUncompressedSamples);
+			writeBinary<long long>(os, (long long)shape.samples.size());
+			for (unsigned int j=0; j<shape.samples.size(); j++)
+				writeBinary<double>(os, shape.samples[j]);
 		}
 	}
+}
 
-	// Sort gradients based on index
-	// -----------------------------
-	//std::sort(m_gradLibrary.begin(),m_gradLibrary.end(),compareGradEvents);
 
+/***********************************************************/
+bool ExternalSequence::parseBinaryFile(const MappedFile &file)
+{
+	BinaryReader in(file.begin()+sizeof(BINARY_MAGIC), file.end());
+
+	version_major    = (int)in.read<long long>();
+	version_minor    = 0;
+	version_revision = 0;
+	// Early writers stored only the major version (e.g. examples/gre_binary.bin)
+	unsigned long long next = 0;
+	if (in.has(sizeof(next)))
+		memcpy(&next,in.pos,sizeof(next));
+	if ((next & BINARY_SECTION_PREFIX)!=BINARY_SECTION_PREFIX) {
+		version_minor    = (int)in.read<long long>();
+		version_revision = (int)in.read<long long>();
+	}
+	version_combined=version_major*1000000L+version_minor*1000L+version_revision;
+	if (!in.ok) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: truncated binary file header");
+		return false;
+	}
+	print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "decoding binary file version " << version_major
+		<< "." << version_minor << "." << version_revision);
 
-	// Read ADC section
-	// -------------------------------
-	if (m_fileIndex.find("[ADC]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[ADC]"], std::ios::beg);
+	// Fields added by later revisions, see the text parsers
+	const bool hasRfDelay   = (version_combined>=1002000L);
+	const bool hasGradDelay = (version_combined>=1001001L);
 
-		int adcId;
-		m_adcLibrary.clear();
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
-			}
-			ADCEvent event;
-			if (6!=sscanf(buffer, "%d%d%d%d%f%f", &adcId, &(event.numSamples),
-						&(event.dwellTime),&(event.delay),&(event.freqOffset),&(event.phaseOffset))) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode ADC event\n" << buffer << std::endl );
-				return false;
-			}
-			m_adcLibrary[adcId] = event;
+	while (in.ok && in.pos<in.end)
+	{
+		unsigned long long code = in.read<unsigned long long>();
+		long long numEntries = in.read<long long>();
+		int section = (int)(code & 0xFFFFFFFFULL);
+		if (!in.ok || numEntries<0) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: truncated binary section header");
+			return false;
 		}
-	}
-
-	// Read delays section
-	// -------------------------------
-	if (m_fileIndex.find("[DELAYS]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[DELAYS]"], std::ios::beg);
+		if ((code & BINARY_SECTION_PREFIX)!=BINARY_SECTION_PREFIX || section<BINARY_DEFINITIONS || section>BINARY_SHAPES) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: unknown binary section code 0x" << std::hex << code);
+			return false;
+		}
+		m_fileIndex[BINARY_SECTION_NAMES[section]] = in.pos-file.begin();
+		PhaseTimer timer(this, sectionPhase(BINARY_SECTION_NAMES[section]), BINARY_SECTION_NAMES[section]);
 
-		int delayId;
-		long delay;
-		m_delayLibrary.clear();
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
+		switch (section)
+		{
+		case BINARY_DEFINITIONS:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				std::string key;
+				for (char c=in.read<char>(); in.ok && c!='\0'; c=in.read<char>())
+					key += c;
+				signed char type = in.read<signed char>();
+				signed char num = in.read<signed char>();
+				if (type!=1 && type!=2) {
+					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: unknown type of definition " << key);
+					return false;
+				}
+				std::vector<double> values;
+				for (int j=0; j<num; j++)
+					values.push_back(type==1 ? (double)in.read<long long>() : in.read<double>());
+				m_definitions[key] = values;
 			}
-			if (2!=sscanf(buffer, "%d%ld", &delayId, &delay)) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode delay event\n" << buffer << std::endl );
-				return false;
+			break;
+		case BINARY_BLOCKS:
+			// The block table is stored as consecutive event IDs, copy it as is
+			if (in.hasElements(numEntries, BINARY_BLOCK_EVENTS*sizeof(int))) {
+				std::vector<EventIDs> &blocks = m_blocks.vector();
+				size_t offset = blocks.size();
+				blocks.resize(offset+numEntries);
+				for (long long i=0; i<numEntries; i++) {
+					EventIDs &events = blocks[offset+i];
+					memcpy(events.id, in.pos, BINARY_BLOCK_EVENTS*sizeof(int));
+					events.id[CTRL] = 0;
+					in.pos += BINARY_BLOCK_EVENTS*sizeof(int);
+				}
 			}
-			m_delayLibrary[delayId] = delay;
-		}
-	}
-
-	// Read triggers section
-	// -------------------------------
-	m_controlLibrary.clear();
-	if (m_fileIndex.find("[TRIGGERS]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[TRIGGERS]"], std::ios::beg);
-
-		int controlId;
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
+			break;
+		case BINARY_RF:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int rfId = in.read<int>();
+				RFEvent event;
+				event.amplitude   = (float)in.read<double>();
+				event.magShape    = in.read<int>();
+				event.phaseShape  = in.read<int>();
+				event.delay       = hasRfDelay ? (int)in.read<long long>() : 0;
+				event.freqOffset  = (float)in.read<double>();
+				event.phaseOffset = (float)in.read<double>();
+				if (!m_rfLibrary.insert(rfId,event)) in.ok = false;
 			}
-			ControlEvent event;
-			event.type = ControlEvent::TRIGGER;
-			if (3!=sscanf(buffer, "%d%d%ld", &controlId, &(event.triggerType), &(event.duration))) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode trigger event\n" << buffer << std::endl );
-				return false;
+			break;
+		case BINARY_GRADIENTS:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int gradId = in.read<int>();
+				GradEvent event;
+				event.amplitude = (float)in.read<double>();
+				event.shape     = in.read<int>();
+				event.delay     = hasGradDelay ? (int)in.read<long long>() : 0;
+				if (!m_gradLibrary.insert(gradId,event)) in.ok = false;
 			}
-			m_controlLibrary[controlId] = event;
-		}
-	}
-	
-	// Read gradient rotation section
-	// -------------------------------
-	if (m_fileIndex.find("[ROTATIONS]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[ROTATIONS]"], std::ios::beg);
-
-		int controlId;
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
+			break;
+		case BINARY_TRAP:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int gradId = in.read<int>();
+				GradEvent event;
+				event.amplitude    = (float)in.read<double>();
+				event.rampUpTime   = (long)in.read<long long>();
+				event.flatTime     = (long)in.read<long long>();
+				event.rampDownTime = (long)in.read<long long>();
+				event.delay        = hasGradDelay ? (int)in.read<long long>() : 0;
+				event.shape        = 0;
+				if (!m_gradLibrary.insert(gradId,event)) in.ok = false;
 			}
-			ControlEvent event;
-			event.type = ControlEvent::ROTATION;
-			if (10!=sscanf(buffer, "%d%lf%lf%lf%lf%lf%lf%lf%lf%lf", &controlId, 
-						&event.rotMatrix[0], &event.rotMatrix[1], &event.rotMatrix[2],
-						&event.rotMatrix[3], &event.rotMatrix[4], &event.rotMatrix[5],
-						&event.rotMatrix[6], &event.rotMatrix[7], &event.rotMatrix[8])) {
-				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode rotation event\n" << buffer << std::endl );
-				return false;
+			break;
+		case BINARY_ADC:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int adcId = in.read<int>();
+				ADCEvent event;
+				event.numSamples  = (int)in.read<long long>();
+				event.dwellTime   = (int)in.read<long long>();
+				event.delay       = (int)in.read<long long>();
+				event.freqOffset  = (float)in.read<double>();
+				event.phaseOffset = (float)in.read<double>();
+				if (!m_adcLibrary.insert(adcId,event)) in.ok = false;
 			}
-			m_controlLibrary[controlId] = event;
-		}
-	}
-	
-	
-	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- EVENTS READ: "
-		<<" RF: " << m_rfLibrary.size()
-		<<" GRAD: " << m_gradLibrary.size()
-		<<" ADC: " << m_adcLibrary.size()
-		<<" DELAY: " << m_delayLibrary.size()
-		<<" CONTROL: " << m_controlLibrary.size());
+			break;
+		case BINARY_DELAYS:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int delayId = in.read<int>();
+				if (!m_delayLibrary.insert(delayId,(long)in.read<long long>())) in.ok = false;
+			}
+			break;
+		case BINARY_SHAPES:
+			for (long long i=0; i<numEntries && in.ok; i++) {
+				int shapeId = in.read<int>();
+				long long numUncompressed = in.read<long long>();
+				long long numCompressed = in.read<long long>();
+				if (!in.hasElements(numCompressed, sizeof(double)))
+					break;
+				if (numUncompressed<0 || numUncompressed>INT_MAX) {
+					print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: shape " << shapeId
+						<< " has an invalid number of samples " << numUncompressed);
+					return false;
+				}
 
+				print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Reading shape " << shapeId );
 
-	// **********************************************************************************************************************
-	// ************************ READ BLOCKS ********************
-	if (!isSingleFileMode) {
-		filepath = path + PATH_SEPARATOR + "blocks.seq";
-		data_file.close();
-		data_file.open(filepath.c_str(), std::ios::in | std::ios::binary);
-		data_file.seekg(0, std::ios::beg);
+				CompressedShape *shape = m_shapeLibrary.insert(shapeId);
+				if (!shape) {
+					in.ok = false;
+					break;
+				}
+				shape->numUncompressedSamples = (int)numUncompressed;
+				shape->samples.resize(numCompressed);
+				for (long long j=0; j<numCompressed; j++)
+					shape->samples[j] = (float)in.read<double>();
 
-		if (!data_file.good())
-		{
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read file " << filepath);
+				print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Shape index " << shapeId << " has " << shape->samples.size()
+					<< " compressed and " << shape->numUncompressedSamples << " uncompressed samples" );
+			}
+			break;
+		}
+		if (!in.ok) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: binary section " << BINARY_SECTION_NAMES[section] << " is truncated or corrupt");
 			return false;
 		}
-		buildFileIndex(data_file);
 	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::saveBinary(std::string path)
+{
+	if (!m_controlLibrary.empty()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: trigger and rotation events cannot be stored in binary files");
+		return false;
+	}
+	for (int id=1; id<=m_shapeLibrary.maxId(); id++) {
+		if (m_shapeLibrary.count(id) && !loadShapeSamples(*m_shapeLibrary.find(id)))
+			return false;
+	}
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.good()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to open file " << path);
+		return false;
+	}
+
+	writeBinaryHeader(out, version_major, version_minor, version_revision);
+	if (!writeBinaryDefinitions(out, m_definitions))
+		return false;
+
+	writeSectionHeader(out, BINARY_BLOCKS, m_blocks.size());
+	for (unsigned int i=0; i<m_blocks.size(); i++)
+		out.write(reinterpret_cast<const char*>(m_blocks[i].id), BINARY_BLOCK_EVENTS*sizeof(int));
+
+	writeBinaryLibraries(out, version_combined, m_rfLibrary, m_gradLibrary, m_adcLibrary, m_delayLibrary, m_shapeLibrary);
+
+	out.close();
+	if (out.fail()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write file " << path);
+		return false;
+	}
+	return true;
+}
+
+
+// * ------------------------------------------------------------------ *
+// * Text file format (writing)                                         *
+// * ------------------------------------------------------------------ *
+
+/** @brief Format a float with the fewest digits that read back exactly (at least 6) */
+static inline const char* formatFloat(char *buf, float value)
+{
+	for (int precision=6; precision<9; precision++) {
+		snprintf(buf, 32, "%.*g", precision, value);
+		if (strtof(buf,NULL)==value)
+			return buf;
+	}
+	snprintf(buf, 32, "%.9g", value);
+	return buf;
+}
+
+/** @brief Format a double with 15 digits, or 17 if needed to read back exactly */
+static inline const char* formatDouble(char *buf, double value)
+{
+	snprintf(buf, 32, "%.15g", value);
+	if (strtod(buf,NULL)!=value)
+		snprintf(buf, 32, "%.17g", value);
+	return buf;
+}
+
+/** @brief Append the decimal representation of an integer */
+static inline char* appendInteger(char *p, long long value)
+{
+	char digits[24];
+	int n = 0;
+	unsigned long long v = (value<0) ? 0ULL-(unsigned long long)value : (unsigned long long)value;
+	do {
+		digits[n++] = (char)('0' + v%10);
+		v /= 10;
+	} while (v>0);
+	if (value<0)
+		*p++ = '-';
+	while (n>0)
+		*p++ = digits[--n];
+	return p;
+}
+
+/** @brief Write the file header and the [VERSION] section */
+static void writeTextHeader(std::ostream &os, int major, int minor, int revision)
+{
+	os << "# Pulseq sequence file\n";
+	os << "# Created by the ExternalSequence library\n\n";
+	os << "[VERSION]\n";
+	os << "major " << major << "\n";
+	os << "minor " << minor << "\n";
+	os << "revision " << revision << "\n\n";
+}
+
+/** @brief Write the [DEFINITIONS] section (if there are definitions) */
+static void writeTextDefinitions(std::ostream &os, const std::map<std::string,std::vector<double> > &definitions)
+{
+	if (definitions.empty())
+		return;
+	char buf[32];
+	os << "[DEFINITIONS]\n";
+	for (std::map<std::string,std::vector<double> >::const_iterator it=definitions.begin(); it!=definitions.end(); ++it) {
+		os << it->first;
+		for (unsigned int j=0; j<it->second.size(); j++)
+			os << " " << formatDouble(buf, it->second[j]);
+		os << "\n";
+	}
+	os << "\n";
+}
+
+/** @brief Write the header of the [BLOCKS] section */
+static void writeTextBlocksHeader(std::ostream &os)
+{
+	os << "# Format of blocks:\n";
+	os << "#  #  D RF  GX  GY  GZ ADC (CTRL)\n";
+	os << "[BLOCKS]\n";
+}
+
+/** @brief Write a line of the [BLOCKS] section, the control column only if used */
+static inline void writeTextBlock(std::ostream &os, long long index, const int *events)
+{
+	static const Event COLUMNS[] = { DELAY, RF, GX, GY, GZ, ADC };
+	char line[8*24];
+	char *p = appendInteger(line, index);
+	for (int i=0; i<6; i++) {
+		*p++ = ' ';
+		p = appendInteger(p, events[COLUMNS[i]]);
+	}
+	if (events[CTRL]!=0) {
+		*p++ = ' ';
+		p = appendInteger(p, events[CTRL]);
+	}
+	*p++ = '\n';
+	os.write(line, p-line);
+}
+
+/**
+ * @brief Write the event and shape sections
+ *
+ * Same layout as the MATLAB toolbox, fields added by later revisions are
+ * written depending on the version.
+ */
+static void writeTextLibraries(std::ostream &os, int version,
+	const EventLibrary<RFEvent> &rfLibrary, const EventLibrary<GradEvent> &gradLibrary,
+	const EventLibrary<ADCEvent> &adcLibrary, const EventLibrary<long> &delayLibrary,
+	const EventLibrary<ControlEvent> &controlLibrary, const EventLibrary<CompressedShape> &shapeLibrary)
+{
+	const bool hasRfDelay   = (version>=1002000L);
+	const bool hasGradDelay = (version>=1001001L);
+	char buf[32];
+
+	if (!rfLibrary.empty()) {
+		os << "# Format of RF events:\n";
+		if (hasRfDelay) {
+			os << "# id amplitude mag_id phase_id delay freq phase\n";
+			os << "# ..        Hz   ....     ....    us   Hz   rad\n";
+		} else {
+			os << "# id amplitude mag_id phase_id freq phase\n";
+			os << "# ..        Hz   ....     ....   Hz   rad\n";
+		}
+		os << "[RF]\n";
+		for (int id=1; id<=rfLibrary.maxId(); id++) {
+			if (!rfLibrary.count(id)) continue;
+			const RFEvent &rf = rfLibrary[id];
+			os << id << " " << formatFloat(buf, rf.amplitude) << " " << rf.magShape << " " << rf.phaseShape;
+			if (hasRfDelay) os << " " << rf.delay;
+			os << " " << formatFloat(buf, rf.freqOffset);
+			os << " " << formatFloat(buf, rf.phaseOffset) << "\n";
+		}
+		os << "\n";
+	}
+
+	size_t numArbitrary = 0;
+	for (int id=1; id<=gradLibrary.maxId(); id++)
+		if (gradLibrary.count(id) && gradLibrary[id].shape>0) numArbitrary++;
+	if (numArbitrary>0) {
+		os << "# Format of arbitrary gradients:\n";
+		os << (hasGradDelay ? "# id amplitude shape_id delay\n" : "# id amplitude shape_id\n");
+		os << (hasGradDelay ? "# ..      Hz/m     ....    us\n" : "# ..      Hz/m     ....\n");
+		os << "[GRADIENTS]\n";
+		for (int id=1; id<=gradLibrary.maxId(); id++) {
+			const GradEvent &grad = gradLibrary[id];
+			if (!gradLibrary.count(id) || grad.shape==0) continue;
+			os << id << " " << formatFloat(buf, grad.amplitude) << " " << grad.shape;
+			if (hasGradDelay) os << " " << grad.delay;
+			os << "\n";
+		}
+		os << "\n";
+	}
+	if (gradLibrary.size()>numArbitrary) {
+		os << "# Format of trapezoid gradients:\n";
+		os << (hasGradDelay ? "# id amplitude rise flat fall delay\n" : "# id amplitude rise flat fall\n");
+		os << (hasGradDelay ? "# ..      Hz/m   us   us   us    us\n" : "# ..      Hz/m   us   us   us\n");
+		os << "[TRAP]\n";
+		for (int id=1; id<=gradLibrary.maxId(); id++) {
+			const GradEvent &grad = gradLibrary[id];
+			if (!gradLibrary.count(id) || grad.shape>0) continue;
+			os << id << " " << formatFloat(buf, grad.amplitude) << " " << grad.rampUpTime
+				<< " " << grad.flatTime << " " << grad.rampDownTime;
+			if (hasGradDelay) os << " " << grad.delay;
+			os << "\n";
+		}
+		os << "\n";
+	}
+
+	if (!adcLibrary.empty()) {
+		os << "# Format of ADC events:\n";
+		os << "# id num dwell delay freq phase\n";
+		os << "# ..  ..    ns    us   Hz   rad\n";
+		os << "[ADC]\n";
+		for (int id=1; id<=adcLibrary.maxId(); id++) {
+			if (!adcLibrary.count(id)) continue;
+			const ADCEvent &adc = adcLibrary[id];
+			os << id << " " << adc.numSamples << " " << adc.dwellTime << " " << adc.delay;
+			os << " " << formatFloat(buf, adc.freqOffset);
+			os << " " << formatFloat(buf, adc.phaseOffset) << "\n";
+		}
+		os << "\n";
+	}
+
+	if (!delayLibrary.empty()) {
+		os << "# Format of delays:\n";
+		os << "# id delay (us)\n";
+		os << "[DELAYS]\n";
+		for (int id=1; id<=delayLibrary.maxId(); id++) {
+			if (!delayLibrary.count(id)) continue;
+			os << id << " " << delayLibrary[id] << "\n";
+		}
+		os << "\n";
+	}
+
+	// Trigger and rotation events share the control library
+	size_t numTriggers = 0;
+	for (int id=1; id<=controlLibrary.maxId(); id++)
+		if (controlLibrary.count(id) && controlLibrary[id].type==ControlEvent::TRIGGER) numTriggers++;
+	if (numTriggers>0) {
+		os << "# Format of triggers:\n";
+		os << "# id type duration (us)\n";
+		os << "[TRIGGERS]\n";
+		for (int id=1; id<=controlLibrary.maxId(); id++) {
+			const ControlEvent &control = controlLibrary[id];
+			if (!controlLibrary.count(id) || control.type!=ControlEvent::TRIGGER) continue;
+			os << id << " " << control.triggerType << " " << control.duration << "\n";
+		}
+		os << "\n";
+	}
+	if (controlLibrary.size()>numTriggers) {
+		os << "# Format of rotations:\n";
+		os << "# id rotation matrix (row major)\n";
+		os << "[ROTATIONS]\n";
+		for (int id=1; id<=controlLibrary.maxId(); id++) {
+			const ControlEvent &control = controlLibrary[id];
+			if (!controlLibrary.count(id) || control.type!=ControlEvent::ROTATION) continue;
+			os << id;
+			for (int i=0; i<9; i++)
+				os << " " << formatDouble(buf, control.rotMatrix[i]);
+			os << "\n";
+		}
+		os << "\n";
+	}
+
+	if (!shapeLibrary.empty()) {
+		os << "# Sequence Shapes\n";
+		os << "[SHAPES]\n\n";
+		for (int id=1; id<=shapeLibrary.maxId(); id++) {
+			if (!shapeLibrary.count(id)) continue;
+			const CompressedShape &shape = shapeLibrary[id];
+			os << "shape_id " << id << "\n";
+			os << "num_samples " << shape.numUncompressedSamples << "\n";
+			for (unsigned int j=0; j<shape.samples.size(); j++)
+				os << formatFloat(buf, shape.samples[j]) << "\n";
+			os << "\n";
+		}
+	}
+}
+
+
+/***********************************************************/
+bool ExternalSequence::save(std::string path)
+{
+	for (int id=1; id<=m_shapeLibrary.maxId(); id++) {
+		if (m_shapeLibrary.count(id) && !loadShapeSamples(*m_shapeLibrary.find(id)))
+			return false;
+	}
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.good()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to open file " << path);
+		return false;
+	}
+
+	writeTextHeader(out, version_major, version_minor, version_revision);
+	writeTextDefinitions(out, m_definitions);
+
+	// Blocks are read through a stream, which also covers streamed sequences
+	writeTextBlocksHeader(out);
+	BlockStream stream(*this);
+	BlockView block;
+	int events[NUM_EVENTS];
+	long long numBlocks = 0;
+	while (stream.next(block)) {
+		for (int i=0; i<NUM_EVENTS; i++)
+			events[i] = block.GetEventIndex((Event)i);
+		writeTextBlock(out, ++numBlocks, events);
+	}
+	if (stream.failed())
+		return false;
+	out << "\n";
+
+	writeTextLibraries(out, version_combined, m_rfLibrary, m_gradLibrary, m_adcLibrary,
+		m_delayLibrary, m_controlLibrary, m_shapeLibrary);
+
+	out.close();
+	if (out.fail()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write file " << path);
+		return false;
+	}
+	return true;
+}
+
+
+// * ------------------------------------------------------------------ *
+// * Sequence writer                                                    *
+// * ------------------------------------------------------------------ *
+
+/***********************************************************/
+SequenceWriter::SequenceWriter() : m_format(TEXT), m_blocksStarted(false), m_numBlocks(0), m_countPos(0)
+{
+	SetVersion(1, 2, 1);
+}
+
+/***********************************************************/
+SequenceWriter::~SequenceWriter()
+{
+	if (m_file.is_open())
+		close();
+}
+
+/***********************************************************/
+bool SequenceWriter::open(const std::string &path, Format format)
+{
+	if (m_file.is_open())
+		close();
+
+	m_definitions.clear();
+	m_rfLibrary.clear();
+	m_gradLibrary.clear();
+	m_adcLibrary.clear();
+	m_controlLibrary.clear();
+	m_delayLibrary.clear();
+	m_shapeLibrary.clear();
+	m_blocksStarted = false;
+	m_numBlocks = 0;
+	m_format = format;
+	m_path = path;
+
+	m_file.clear();
+	m_file.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!m_file.good()) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to open file " << path);
+		return false;
+	}
+	if (m_format==BINARY)
+		writeBinaryHeader(m_file, m_version[0], m_version[1], m_version[2]);
+	else
+		writeTextHeader(m_file, m_version[0], m_version[1], m_version[2]);
+	return true;
+}
+
+/***********************************************************/
+bool SequenceWriter::SetDefinition(const std::string &key, const std::vector<double> &values)
+{
+	if (m_blocksStarted) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: definition " << key
+			<< " must be set before the first block");
+		return false;
+	}
+	if (m_format==BINARY && values.size()>127) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: too many values for definition " << key);
+		return false;
+	}
+	m_definitions[key] = values;
+	return true;
+}
+
+/***********************************************************/
+template<typename T>
+int SequenceWriter::findOrInsert(EventLibrary<T> &library, const T &entry)
+{
+	int id = library.findOrInsert(entry);
+	if (id==0)
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: more than "
+			<< EventLibrary<T>::MAX_ID << " distinct library entries");
+	return id;
+}
+
+/***********************************************************/
+int SequenceWriter::AddShape(const float *samples, int numSamples)
+{
+	if (numSamples<=0) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: shapes must have at least one sample");
+		return 0;
+	}
+	CompressedShape shape;
+	ExternalSequence::compressShape(samples, numSamples, shape);
+	return findOrInsert(m_shapeLibrary, shape);
+}
+
+/***********************************************************/
+int SequenceWriter::AddRF(const RFEvent &rf)
+{
+	if ((rf.magShape!=0 && !m_shapeLibrary.count(rf.magShape)) || (rf.phaseShape!=0 && !m_shapeLibrary.count(rf.phaseShape))) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: RF event references undefined shapes "
+			<< rf.magShape << " " << rf.phaseShape);
+		return 0;
+	}
+	return findOrInsert(m_rfLibrary, rf);
+}
+
+/***********************************************************/
+int SequenceWriter::AddGradient(const GradEvent &grad)
+{
+	if (grad.shape!=0 && !m_shapeLibrary.count(grad.shape)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: gradient event references undefined shape "
+			<< grad.shape);
+		return 0;
+	}
+	return findOrInsert(m_gradLibrary, grad);
+}
+
+/***********************************************************/
+int SequenceWriter::AddADC(const ADCEvent &adc)
+{
+	return findOrInsert(m_adcLibrary, adc);
+}
+
+/***********************************************************/
+int SequenceWriter::AddDelay(long delay)
+{
+	return findOrInsert(m_delayLibrary, delay);
+}
+
+/***********************************************************/
+int SequenceWriter::AddControl(const ControlEvent &control)
+{
+	if (m_format==BINARY) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: trigger and rotation events cannot be stored in binary files");
+		return 0;
+	}
+	return findOrInsert(m_controlLibrary, control);
+}
+
+/***********************************************************/
+bool SequenceWriter::beginBlocks()
+{
+	if (m_blocksStarted)
+		return true;
+	if (!m_file.is_open()) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: no sequence file open for writing");
+		return false;
+	}
+	if (m_format==BINARY) {
+		if (!writeBinaryDefinitions(m_file, m_definitions))
+			return false;
+		// The number of blocks is patched in by close()
+		writeBinary<unsigned long long>(m_file, BINARY_SECTION_PREFIX | BINARY_BLOCKS);
+		m_countPos = m_file.tellp();
+		writeBinary<long long>(m_file, 0);
+	} else {
+		writeTextDefinitions(m_file, m_definitions);
+		writeTextBlocksHeader(m_file);
+	}
+	m_blocksStarted = true;
+	return true;
+}
+
+/***********************************************************/
+bool SequenceWriter::AddBlock(const EventIDs &events)
+{
+	if (!beginBlocks())
+		return false;
+
+	if (!ExternalSequence::checkBlockReferences(events, m_rfLibrary, m_gradLibrary, m_adcLibrary, m_delayLibrary, m_controlLibrary)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Block " << m_numBlocks+1
+			<< " contains references to undefined events" );
+		return false;
+	}
+
+	if (m_format==BINARY)
+		m_file.write(reinterpret_cast<const char*>(events.id), BINARY_BLOCK_EVENTS*sizeof(int));
+	else
+		writeTextBlock(m_file, m_numBlocks+1, events.id);
+	m_numBlocks++;
+	return m_file.good();
+}
+
+/***********************************************************/
+bool SequenceWriter::close()
+{
+	if (!m_file.is_open())
+		return false;
+
+	bool ok = beginBlocks();
+	const int version = m_version[0]*1000000 + m_version[1]*1000 + m_version[2];
+	if (m_format==BINARY) {
+		writeBinaryLibraries(m_file, version, m_rfLibrary, m_gradLibrary, m_adcLibrary, m_delayLibrary, m_shapeLibrary);
+		if (m_blocksStarted) {
+			m_file.seekp(m_countPos);
+			writeBinary<long long>(m_file, m_numBlocks);
+		}
+	} else {
+		m_file << "\n";
+		writeTextLibraries(m_file, version, m_rfLibrary, m_gradLibrary, m_adcLibrary,
+			m_delayLibrary, m_controlLibrary, m_shapeLibrary);
+	}
+
+	m_file.close();
+	if (m_file.fail()) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write file " << m_path);
+		return false;
+	}
+	return ok;
+}
+
+
+/***********************************************************/
+bool ExternalSequence::load(std::string path)
+{
+	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "Reading external sequence files");
+
+	if (m_profiling) {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_stats = LoadStats();
+		m_trace.clear();
+		m_traceThreads.clear();
+		m_decodeCalls = 0;
+		m_profileEpoch = std::chrono::steady_clock::now();
+	}
+
+	// Start from empty libraries, load() may be called repeatedly
+	m_fileIndex.clear();
+	m_blocks.clear();
+	m_blockStartTimes.clear();
+	m_definitions.clear();
+	m_rfLibrary.clear();
+	m_gradLibrary.clear();
+	m_adcLibrary.clear();
+	m_delayLibrary.clear();
+	m_controlLibrary.clear();
+	m_shapeLibrary.clear();
+	m_shapeCache.clear();
+	m_shapeFile.close();
+	m_blockFile.clear();
+	m_blocksStreamed = false;
+	m_imageShapes.clear();
+	m_cacheFile.close();
+	m_sourcePath.clear();
+
+	// Try single file mode (everything in .seq file). The file containing the
+	// shapes stays mapped, shape samples are parsed on first use.
+	MappedFile &data_file = m_shapeFile;
+	bool isSingleFileMode = true;
+	std::string filepath = path;
+	PhaseTimer openTimer(this, PHASE_OPEN);
+	if (!data_file.open(filepath))
+	{
+		filepath = path + PATH_SEPARATOR + "external.seq";
+	}
+	if (!data_file.isOpen() && !data_file.open(filepath))
+	{
+		// Try separate file mode (blocks.seq, events.seq, shapes.seq)
+		filepath = path + PATH_SEPARATOR + "shapes.seq";
+		isSingleFileMode = false;
+		if (!data_file.open(filepath))
+		{
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read file " << filepath);
+			return false;
+		}
+	}
+	openTimer.stop();
+
+	// Use the cache image of a single file instead of parsing it
+	std::string cachePath;
+	if (isSingleFileMode && fileStatus(filepath, m_sourceSize, m_sourceTime)) {
+		m_sourcePath = filepath;
+		if (m_cacheEnabled && !m_streamingMode)
+			cachePath = GetCachePath(filepath, m_cacheDirectory);
+	}
+	if (!cachePath.empty() && loadCache(cachePath, data_file)) {
+		data_file.close();	// shapes are read from the image
+		print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- CACHE IMAGE READ: " << cachePath
+			<< " blocks: " << m_blocks.size() << " shapes: " << m_shapeLibrary.size());
+		finishLoad();
+		return true;
+	}
+
+	if (m_profiling)
+		m_stats.bytesRead += data_file.size();
+	if (data_file.size()>=sizeof(BINARY_MAGIC) && 0==memcmp(data_file.begin(),BINARY_MAGIC,sizeof(BINARY_MAGIC)))
+	{
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Reading binary file" );
+		bool ok = parseBinaryFile(data_file);
+		data_file.close();	// all samples have been copied
+		if (!ok)
+			return false;
+	}
+	else
+	{
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Building index" );
+
+		// Decode all sections of the file in one pass
+		m_deferShapes = m_lazyShapes;
+		bool ok = parseFile(data_file);
+		m_deferShapes = false;
+		if (!ok)
+			return false;
+		if (m_fileIndex.count("[BLOCKS]"))
+			m_blockFile = filepath;
+	}
+
+	if (m_fileIndex.find("[SHAPES]") == m_fileIndex.end()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Required: [SHAPES] section");
+		return false;
+	}
+
+	if (!isSingleFileMode) {
+		const char* files[] = { "events.seq", "blocks.seq" };
+		MappedFile events_file;
+		for (int i=0; i<2; i++) {
+			filepath = path + PATH_SEPARATOR + files[i];
+			PhaseTimer eventsOpenTimer(this, PHASE_OPEN);
+			if (!events_file.open(filepath))
+			{
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read file " << filepath);
+				return false;
+			}
+			eventsOpenTimer.stop();
+			if (m_profiling)
+				m_stats.bytesRead += events_file.size();
+			if (!parseFile(events_file))
+				return false;
+			if (m_blockFile.empty() && m_fileIndex.count("[BLOCKS]"))
+				m_blockFile = filepath;
+		}
+	}
+
+	if (m_fileIndex.find("[BLOCKS]") == m_fileIndex.end()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Required: [BLOCKS] section");
+		return false;
+	}
+
+	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- SHAPES READ numShapes: " << m_shapeLibrary.size() );
+
+	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- EVENTS READ: "
+		<<" RF: " << m_rfLibrary.size()
+		<<" GRAD: " << m_gradLibrary.size()
+		<<" ADC: " << m_adcLibrary.size()
+		<<" DELAY: " << m_delayLibrary.size()
+		<<" CONTROL: " << m_controlLibrary.size());
 
-
-	// Read definition section
-	// ------------------------
-	unsigned int numBlocks = 0;
 	if (m_fileIndex.find("[DEFINITIONS]") != m_fileIndex.end()) {
-		data_file.seekg(m_fileIndex["[DEFINITIONS]"], std::ios::beg);
+		std::ostringstream out;
+		out << "-- " << "DEFINITIONS READ: " << m_definitions.size() << " : ";
+		for (std::map<std::string,std::vector<double> >::iterator it=m_definitions.begin(); it!=m_definitions.end(); ++it)
+		{
+			out<< it->first << " ";
+			for (int i=0; i<it->second.size(); i++)
+				out << it->second[i] << " ";
+		}
 
-		// Read each definition line
-		m_definitions.clear();
-		while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-			if (buffer[0]=='[' || strlen(buffer)==0) {
-				break;
+		print_msg(DEBUG_HIGH_LEVEL, out);
+	}
+
+	PhaseTimer checkTimer(this, PHASE_CHECK);
+	if (!checkShapeReferences())
+		return false;
+
+	// Blocks usually precede the event sections in the file, so references
+	// can only be checked once everything has been read
+	for (unsigned int i=0; i<m_blocks.size(); i++) {
+		const EventIDs &events = m_blocks[i];
+		if (!checkBlockReferences(events)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Block " << i+1
+				<< " contains references to undefined events" );
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "***        RF:" << events.id[RF] << " GX:" << events.id[GX] << " GY:" << events.id[GY] << " GZ:" << events.id[GZ] << " ADC:" << events.id[ADC] << " DELAY:" << events.id[DELAY] << " CTRL:" << events.id[CTRL]);
+			return false;
+		}
+	}
+	checkTimer.stop();
+
+	m_blocksStreamed = m_streamingMode && !m_blockFile.empty();
+	if (m_blocksStreamed)
+		print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- BLOCKS STREAMED FROM: " << m_blockFile);
+	else
+		print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- BLOCKS READ: " << m_blocks.size());
+	PhaseTimer timingTimer(this, PHASE_TIMING);
+	buildTimingTable();
+	timingTimer.stop();
+
+	// Num_Blocks definition (if defined) is used to check the correct number of blocks are read
+	unsigned int numBlocks = 0;
+	if (numBlocks>0 && m_blocks.size()!=numBlocks) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Expected " << numBlocks
+		    << " blocks but read " << m_blocks.size() << " blocks");
+		return false;
+	}
+
+	if (!cachePath.empty() && !SaveCache(cachePath, m_cacheDecodedShapes))
+		print_msg(WARNING_MSG, std::ostringstream().flush() << "*** WARNING: Failed to write cache image " << cachePath);
+	finishLoad();
+	return true;
+};
+
+
+/***********************************************************/
+void ExternalSequence::finishLoad()
+{
+	std::vector<double> def = GetDefinition("Scan_ID");
+	int scanID = def.empty() ? 0: (int)def[0];
+	print_msg(NORMAL_MSG, std::ostringstream().flush() << "==========================================" );
+	print_msg(NORMAL_MSG, std::ostringstream().flush() << "===== EXTERNAL SEQUENCE #" << std::setw(5) << scanID << " ===========" );
+	print_msg(NORMAL_MSG, std::ostringstream().flush() << "==========================================" );
+
+	if (m_profiling) {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_stats.loadTime  = std::chrono::duration<double>(std::chrono::steady_clock::now()-m_profileEpoch).count();
+		m_stats.numShapes = m_shapeLibrary.size();
+		m_stats.numEvents = m_rfLibrary.size() + m_gradLibrary.size() + m_adcLibrary.size()
+			+ m_delayLibrary.size() + m_controlLibrary.size();
+		m_stats.numBlocks = m_blocks.size();
+	}
+}
+
+
+/***********************************************************/
+bool ExternalSequence::parseFile(const MappedFile &file)
+{
+	int numThreads = m_numLoadThreads>0 ? m_numLoadThreads : (int)std::thread::hardware_concurrency();
+	if (numThreads>1)
+		return parseFileParallel(file,numThreads);
+
+	const char *pos = file.begin();
+	const char *end = file.end();
+	m_parseBegin = pos;
+	ShapeList shapes;
+
+	while (pos<end) {
+		const char *eol = lineEnd(pos,end);
+		if (!isSectionHeader(pos,eol)) {
+			pos = nextLine(eol,end);
+			continue;
+		}
+		std::string section(pos,eol);
+		pos = nextLine(eol,end);
+		m_fileIndex[section] = pos-file.begin();
+
+		PhaseTimer timer(this, sectionPhase(section), section.c_str());
+		const char *sectionBegin = pos;
+		bool ok = true;
+		if      (section=="[VERSION]")     ok = parseVersion(pos,end);
+		else if (section=="[DEFINITIONS]") ok = parseDefinitions(pos,end);
+		else if (section=="[BLOCKS]" && m_streamingMode) m_blockLine = lineNumber(pos);
+		else if (section=="[BLOCKS]")      ok = parseBlocks(pos,end,m_blocks.vector());
+		else if (section=="[RF]")          ok = parseRF(pos,end);
+		else if (section=="[GRADIENTS]")   ok = parseGradients(pos,end);
+		else if (section=="[TRAP]")        ok = parseTrapezoids(pos,end);
+		else if (section=="[ADC]")         ok = parseADC(pos,end);
+		else if (section=="[DELAYS]")      ok = parseDelays(pos,end);
+		else if (section=="[TRIGGERS]")    ok = parseTriggers(pos,end);
+		else if (section=="[ROTATIONS]")   ok = parseRotations(pos,end);
+		else if (section=="[SHAPES]")      ok = parseShapes(pos,end,shapes);
+		storeShapes(shapes);
+		if (!ok)
+			return false;
+		if (m_profiling)
+			countLines(sectionBegin,pos);
+	}
+	return true;
+}
+
+/***********************************************************/
+// Part of a text file decoded by one thread: a section or a chunk of lines of
+// the [BLOCKS] and [SHAPES] sections
+struct ParseUnit
+{
+	std::string section;                    // section header
+	int sectionIndex;                       // index of the section in the file
+	const char *begin;                      // first line
+	const char *end;                        // end of the last line
+	const char *stop;                       // position where parsing stopped
+	bool ok;                                // true if decoded successfully
+	std::vector<std::string> messages;      // messages printed while parsing
+	std::vector<EventIDs> blocks;           // [BLOCKS] entries
+	std::vector<std::pair<int,CompressedShape> > shapes;  // [SHAPES] entries
+};
+
+// Minimum size of a chunk of the [BLOCKS] or [SHAPES] section
+static const size_t MIN_CHUNK_SIZE = 1<<16;
+
+/** @brief Return the start of the first line at or after `p` */
+static inline const char* alignToLine(const char *p, const char *begin, const char *end)
+{
+	if (p<=begin || p>=end || p[-1]=='\n')
+		return p;
+	return nextLine(lineEnd(p,end),end);
+}
+
+/***********************************************************/
+bool ExternalSequence::parseFileParallel(const MappedFile &file, int numThreads)
+{
+	const char *begin = file.begin();
+	const char *end = file.end();
+	m_parseBegin = begin;
+	PhaseTimer indexTimer(this, PHASE_INDEX);
+
+	// Locate the section headers (the only lines starting with '[')
+	std::vector<std::string> sections;
+	std::vector<const char*> sectionBegin, sectionEnd;
+	bool versionFirst = true;
+	for (const char *p=begin; p<end; ) {
+		const char *bracket = (const char*)memchr(p,'[',end-p);
+		if (!bracket)
+			break;
+		p = bracket+1;
+		if (bracket>begin && bracket[-1]!='\n' && bracket[-1]!='\r')
+			continue;
+		const char *eol = lineEnd(bracket,end);
+		if (!isSectionHeader(bracket,eol))
+			continue;
+		std::string section(bracket,eol);
+		if (!sectionEnd.empty())
+			sectionEnd.back() = bracket;
+		p = nextLine(eol,end);
+		sections.push_back(section);
+		sectionBegin.push_back(p);
+		sectionEnd.push_back(end);
+		m_fileIndex[section] = p-begin;
+		// Event sections depend on the version, which must then be known in advance
+		if (section=="[VERSION]")
+			versionFirst = versionFirst && m_fileIndex.count("[RF]")==0 && m_fileIndex.count("[GRADIENTS]")==0
+				&& m_fileIndex.count("[TRAP]")==0;
+	}
+	if (!versionFirst) {
+		m_fileIndex.clear();
+		indexTimer.stop();
+		return parseFile(file);		// rare: parse serially
+	}
+
+	// Split into units, large [BLOCKS] and [SHAPES] sections are split into line-aligned chunks
+	std::vector<ParseUnit> units;
+	for (size_t i=0; i<sections.size(); i++) {
+		size_t size = sectionEnd[i]-sectionBegin[i];
+		size_t numChunks = 1;
+		if ((sections[i]=="[BLOCKS]" && !m_streamingMode) || sections[i]=="[SHAPES]")
+			numChunks = MAX(1, MIN(size/MIN_CHUNK_SIZE, (size_t)numThreads*4));
+		const char *chunkBegin = sectionBegin[i];
+		for (size_t k=1; k<=numChunks; k++) {
+			const char *chunkEnd = sectionEnd[i];
+			if (k<numChunks) {
+				chunkEnd = alignToLine(MAX(chunkBegin, sectionBegin[i] + size*k/numChunks), begin, sectionEnd[i]);
+				// Shapes are split before the next 'shape_id' line
+				while (sections[i]=="[SHAPES]" && chunkEnd<sectionEnd[i] && chunkEnd[0]!='s')
+					chunkEnd = nextLine(lineEnd(chunkEnd,end),end);
+			}
+			if (chunkEnd<=chunkBegin && k<numChunks)
+				continue;
+			units.push_back(ParseUnit());
+			ParseUnit &unit = units.back();
+			unit.section = sections[i];
+			unit.sectionIndex = i;
+			unit.begin = unit.stop = chunkBegin;
+			unit.end = chunkEnd;
+			unit.ok = true;
+			chunkBegin = chunkEnd;
+		}
+	}
+
+	indexTimer.stop();
+
+	// Decode a unit, messages are collected to be printed in file order
+	auto parseUnit = [this](ParseUnit &unit) {
+		PhaseTimer timer(this, sectionPhase(unit.section), unit.section.c_str());
+		t_messageBuffer = &unit.messages;
+		const char *pos = unit.begin;
+		const char *end = unit.end;
+		bool ok = true;
+		if      (unit.section=="[VERSION]")     ok = parseVersion(pos,end);
+		else if (unit.section=="[DEFINITIONS]") ok = parseDefinitions(pos,end);
+		else if (unit.section=="[BLOCKS]")      ok = parseBlocks(pos,end,unit.blocks);
+		else if (unit.section=="[RF]")          ok = parseRF(pos,end);
+		else if (unit.section=="[GRADIENTS]")   ok = parseGradients(pos,end);
+		else if (unit.section=="[TRAP]")        ok = parseTrapezoids(pos,end);
+		else if (unit.section=="[ADC]")         ok = parseADC(pos,end);
+		else if (unit.section=="[DELAYS]")      ok = parseDelays(pos,end);
+		else if (unit.section=="[TRIGGERS]")    ok = parseTriggers(pos,end);
+		else if (unit.section=="[ROTATIONS]")   ok = parseRotations(pos,end);
+		else if (unit.section=="[SHAPES]")      ok = parseShapes(pos,end,unit.shapes);
+		unit.stop = pos;
+		unit.ok = ok;
+		t_messageBuffer = NULL;
+	};
+
+	// Sections writing to the same library are decoded by the same job in file order,
+	// each chunk is a job of its own. The version is decoded before everything else.
+	std::vector<std::vector<size_t> > jobs;
+	std::map<std::string,size_t> libraryJob;
+	for (size_t i=0; i<units.size(); i++) {
+		const std::string &section = units[i].section;
+		if (section=="[VERSION]") {
+			parseUnit(units[i]);
+			continue;
+		}
+		if (section=="[BLOCKS]" && m_streamingMode) {
+			m_blockLine = lineNumber(units[i].begin);
+			continue;
+		}
+		std::string library = section;
+		if (section=="[TRAP]")      library = "[GRADIENTS]";
+		if (section=="[ROTATIONS]") library = "[TRIGGERS]";
+		if (section=="[BLOCKS]" || section=="[SHAPES]" || libraryJob.count(library)==0) {
+			libraryJob[library] = jobs.size();
+			jobs.push_back(std::vector<size_t>());
+		}
+		jobs[libraryJob[library]].push_back(i);
+	}
+
+	std::atomic<size_t> nextJob(0);
+	auto worker = [&]() {
+		for (size_t j; (j=nextJob++)<jobs.size(); ) {
+			for (size_t k=0; k<jobs[j].size(); k++) {
+				ParseUnit &unit = units[jobs[j][k]];
+				parseUnit(unit);
+				if (!unit.ok)
+					break;		// remaining sections of this library are not reached
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i=1; i<MIN(numThreads,(int)jobs.size()); i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	// Print messages and merge the results in file order. A chunk that stopped
+	// early ends its section, as the remaining lines are not read by parseFile().
+	PhaseTimer mergeTimer(this, PHASE_MERGE);
+	size_t numBlocks = m_blocks.size();
+	for (size_t i=0; i<units.size(); i++)
+		numBlocks += units[i].blocks.size();
+	m_blocks.vector().reserve(numBlocks);
+	int skipSection = -1;
+	for (size_t i=0; i<units.size(); i++) {
+		ParseUnit &unit = units[i];
+		if (unit.sectionIndex==skipSection)
+			continue;
+		for (size_t k=0; k<unit.messages.size(); k++)
+			print_fun(unit.messages[k].c_str());
+		if (!unit.ok)
+			return false;
+		m_blocks.vector().insert(m_blocks.vector().end(), unit.blocks.begin(), unit.blocks.end());
+		storeShapes(unit.shapes);
+		if (m_profiling)
+			countLines(unit.begin,unit.stop);
+		if (unit.stop<unit.end)
+			skipSection = unit.sectionIndex;
+	}
+	return true;
+}
+
+/***********************************************************/
+void ExternalSequence::storeShapes(ShapeList &shapes)
+{
+	for (size_t i=0; i<shapes.size(); i++)
+		*m_shapeLibrary.insert(shapes[i].first) = std::move(shapes[i].second);
+	shapes.clear();
+}
+
+/***********************************************************/
+bool ExternalSequence::loadShapeSamples(CompressedShape &shape)
+{
+	std::lock_guard<std::mutex> lock(m_shapeMutex);
+	if (shape.image) {
+		shape.samples.assign(shape.image, shape.image+shape.numImageSamples);
+		shape.image = NULL;
+		shape.numImageSamples = 0;
+		return true;
+	}
+	if (!shape.text)
+		return true;	// already parsed
+
+	float sample;
+	const char *end = shape.textEnd;
+	for (const char *pos=shape.text, *eol; pos<end; pos=nextLine(eol,end)) {
+		eol = lineEnd(pos,end);
+		const char *p = pos;
+		if (!readFloat(p,eol,sample)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'sample' in line "
+				<< 1+std::count(m_shapeFile.begin(),pos,'\n') << "\n" << std::string(pos,eol) << std::endl );
+			shape.samples.clear();
+			return false;
+		}
+		shape.samples.push_back(sample);
+	}
+	shape.text = shape.textEnd = NULL;
+	return true;
+}
+
+/***********************************************************/
+int ExternalSequence::lineNumber(const char *pos) const
+{
+	return 1 + (int)std::count(m_parseBegin, pos, '\n');
+}
+
+/***********************************************************/
+bool ExternalSequence::parseVersion(const char *&pos, const char *end)
+{
+	print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "decoding VERSION section");
+	// Version is a recommended but not a compulsory section
+	// very basic reading code, repeated keywords will overwrite previous values, no serious error checking
+	while (pos<end)
+	{
+		const char *eol = lineEnd(pos,end);
+		if (eol==pos || pos[0]==COMMENT_CHAR) {    // ignore comments & empty lines
+			pos = nextLine(eol,end);
+			continue;
+		}
+		if (pos[0]=='[')
+			break;
+		std::string line(pos,eol);
+		const char *p = pos;
+		print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "buffer: \n" << line << std::endl );
+		if (0==line.compare(0,5,"major")) {
+			p += 5;
+			if (!readInteger(p, eol, version_major)) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_major in line " << lineNumber(pos));
+				return false;
+			}
+			print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "major=" << version_major);
+		} else if (0==line.compare(0,5,"minor")) {
+			p += 5;
+			if (!readInteger(p, eol, version_minor)) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_minor in line " << lineNumber(pos));
+				return false;
+			}
+			print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "minor=" << version_minor);
+		}
+		else if (0==line.compare(0,8,"revision")) {
+			p += 8;
+			if (!readInteger(p, eol, version_revision)) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode version_revision in line " << lineNumber(pos) << "\n" << line << std::endl );
+				return false;
+			}
+			print_msg(DEBUG_MEDIUM_LEVEL, std::ostringstream().flush() << "revision=" << version_revision);
+		}
+		else
+		{
+			print_msg(WARNING_MSG, std::ostringstream().flush() << "*** WARNING: unknown field in the [VERSION] block");
+			return false;
+		}
+		pos = nextLine(eol,end);
+	}
+	version_combined=version_major*1000000L+version_minor*1000L+version_revision;
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseDefinitions(const char *&pos, const char *end)
+{
+	// Read each definition line
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		std::string key;
+		readWord(p,eol,key);
+		double value;
+		std::vector<double> values;
+		while (readDouble(p,eol,value)) {
+			values.push_back(value);
+		}
+		m_definitions[key] = values;
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseBlocks(const char *&pos, const char *end, std::vector<EventIDs> &blocks)
+{
+	EventIDs events;
+
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		if (!readBlockLine(pos,eol,events)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode event table in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+
+		// Add event IDs to list of blocks
+		blocks.push_back(events);
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseRF(const char *&pos, const char *end)
+{
+	int rfId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		RFEvent event;
+		bool ok = readInteger(p,eol,rfId) && readFloat(p,eol,event.amplitude)
+			&& readInteger(p,eol,event.magShape) && readInteger(p,eol,event.phaseShape);
+		if (version_combined<1002000L)
+			event.delay=0;
+		else
+			ok = ok && readInteger(p,eol,event.delay);
+		ok = ok && readFloat(p,eol,event.freqOffset) && readFloat(p,eol,event.phaseOffset);
+		if (!ok || !m_rfLibrary.insert(rfId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode RF event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseGradients(const char *&pos, const char *end)
+{
+	int gradId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		GradEvent event;
+		bool ok = readInteger(p,eol,gradId) && readFloat(p,eol,event.amplitude) && readInteger(p,eol,event.shape);
+		if ( version_combined>=1001001L )
+			ok = ok && readInteger(p,eol,event.delay);
+		else
+			event.delay=0;
+		if (!ok || !m_gradLibrary.insert(gradId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradient event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseTrapezoids(const char *&pos, const char *end)
+{
+	int gradId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		GradEvent event;
+		bool ok = readInteger(p,eol,gradId) && readFloat(p,eol,event.amplitude)
+			&& readInteger(p,eol,event.rampUpTime) && readInteger(p,eol,event.flatTime) && readInteger(p,eol,event.rampDownTime);
+		if ( version_combined>=1001001L )
+			ok = ok && readInteger(p,eol,event.delay);
+		else
+			event.delay=0;
+		event.shape=0;
+		if (!ok || !m_gradLibrary.insert(gradId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode trapezoid gradient entry in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseADC(const char *&pos, const char *end)
+{
+	int adcId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		ADCEvent event;
+		if (!readInteger(p,eol,adcId) || !readInteger(p,eol,event.numSamples) ||
+			!readInteger(p,eol,event.dwellTime) || !readInteger(p,eol,event.delay) ||
+			!readFloat(p,eol,event.freqOffset) || !readFloat(p,eol,event.phaseOffset) ||
+			!m_adcLibrary.insert(adcId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode ADC event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseDelays(const char *&pos, const char *end)
+{
+	int delayId;
+	long delay;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		if (!readInteger(p,eol,delayId) || !readInteger(p,eol,delay) || !m_delayLibrary.insert(delayId,delay)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode delay event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseTriggers(const char *&pos, const char *end)
+{
+	int controlId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		ControlEvent event;
+		event.type = ControlEvent::TRIGGER;
+		if (!readInteger(p,eol,controlId) || !readInteger(p,eol,event.triggerType) || !readInteger(p,eol,event.duration) ||
+			!m_controlLibrary.insert(controlId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode trigger event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseRotations(const char *&pos, const char *end)
+{
+	int controlId;
+	for (const char *eol; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='['; pos=nextLine(eol,end)) {
+		const char *p = pos;
+		ControlEvent event;
+		event.type = ControlEvent::ROTATION;
+		bool ok = readInteger(p,eol,controlId);
+		for (int i=0; i<9 && ok; i++)
+			ok = readDouble(p,eol,event.rotMatrix[i]);
+		if (!ok || !m_controlLibrary.insert(controlId,event)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode rotation event in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::parseShapes(const char *&pos, const char *end, ShapeList &shapes)
+{
+	std::string tmpStr;
+	int shapeId, numSamples;
+	float sample;
+
+	for (;;)
+	{
+		// Ignore comments & empty lines
+		const char *eol = lineEnd(pos,end);
+		while (pos<end && (eol==pos || pos[0]==COMMENT_CHAR)) {
+			pos = nextLine(eol,end);
+			eol = lineEnd(pos,end);
+		}
+		if (pos>=end || pos[0]!='s')
+			break;
+
+		const char *p = pos;
+		if (!readWord(p,eol,tmpStr) || !readInteger(p,eol,shapeId) || shapeId<=0 || shapeId>m_shapeLibrary.MAX_ID) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'shapeId' in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+		pos = nextLine(eol,end);
+		eol = lineEnd(pos,end);
+		p = pos;
+		if (!readWord(p,eol,tmpStr) || !readInteger(p,eol,numSamples) || numSamples<0) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'numSamples' in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+			return false;
+		}
+
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Reading shape " << shapeId );
+
+		// Samples follow one per line until an empty line or the next shape
+		shapes.push_back(std::make_pair(shapeId,CompressedShape()));
+		CompressedShape &shape = shapes.back().second;
+		pos = nextLine(eol,end);
+		const char *text = pos;
+		size_t numCompressed = 0;
+		for (; pos<end && (eol=lineEnd(pos,end))!=pos && pos[0]!='s'; pos=nextLine(eol,end)) {
+			numCompressed++;
+			if (m_deferShapes)
+				continue;	// parsed on first use
+			p = pos;
+			if (!readFloat(p,eol,sample)) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode 'sample' in line " << lineNumber(pos) << "\n" << std::string(pos,eol) << std::endl );
+				return false;
+			}
+			shape.samples.push_back(sample);
+		}
+		shape.numUncompressedSamples=numSamples;
+		if (m_deferShapes && numCompressed>0) {
+			shape.text = text;
+			shape.textEnd = pos;
+		}
+
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Shape index " << shapeId << " has " << numCompressed
+			<< " compressed and " << shape.numUncompressedSamples << " uncompressed samples" );
+	}
+	return true;
+}
+
+/***********************************************************/
+SeqBlock*	ExternalSequence::GetBlock(int index) {
+	SeqBlock *block = new SeqBlock();
+	GetBlock(index,*block);
+	return block;
+}
+
+/***********************************************************/
+bool ExternalSequence::GetBlock(int index, SeqBlock &block) {
+	BlockView view;
+	if (!GetBlock(index,view))
+		return false;
+
+	// Copy event IDs
+	std::copy(view.events,view.events+NUM_EVENTS,&block.events[0]);
+
+	block.index    = index;
+	block.delay    = view.delay;
+	block.duration = view.duration;
+
+	// Copy event structures so e.g. gradient type can be determined
+	block.rf      = *view.rf;
+	block.adc     = *view.adc;
+	block.control = *view.control;
+	for (unsigned int i=0; i<NUM_GRADS; i++)
+		block.grad[i] = *view.grad[i];
+
+	// Shapes are only valid after decodeBlock()
+	block.free();
+
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::GetBlock(int index, BlockView &view) const {
+	if (index<0 || index>=(int)m_blocks.size())
+		return false;
+
+	fillBlockView(m_blocks[index].id, index, view);
+	return true;
+}
+
+/***********************************************************/
+void ExternalSequence::fillBlockView(const int *events, int index, BlockView &view) const
+{
+	view.index  = index;
+	view.events = events;
+
+	// Undefined IDs (including 0) refer to the default entries of the libraries
+	view.rf      = &m_rfLibrary[events[RF]];
+	view.adc     = &m_adcLibrary[events[ADC]];
+	view.control = &m_controlLibrary[events[CTRL]];
+	view.delay   = m_delayLibrary[events[DELAY]];
+	for (unsigned int i=0; i<NUM_GRADS; i++)
+		view.grad[i] = &m_gradLibrary[events[GX+i]];
+
+	// Durations of loaded blocks are tabulated
+	if ((size_t)index+1<m_blockStartTimes.size())
+		view.duration = (long)(m_blockStartTimes[index+1]-m_blockStartTimes[index]);
+	else
+		view.duration = blockDuration(events);
+}
+
+/***********************************************************/
+long ExternalSequence::blockDuration(const int *events) const
+{
+	long duration = 0;
+	if (events[RF]>0) {
+		const RFEvent &rf = m_rfLibrary[events[RF]];
+		duration = MAX(duration, rf.delay + (long)m_shapeLibrary[rf.magShape].numUncompressedSamples);
+	}
+
+	for (int iC=0; iC<NUM_GRADS; iC++)
+	{
+		if (events[GX+iC]<=0)
+			continue;
+		const GradEvent &grad = m_gradLibrary[events[GX+iC]];
+		if (grad.shape>0)	// arbitrary gradient
+			duration = MAX(duration, (long)(10*m_shapeLibrary[grad.shape].numUncompressedSamples) + grad.delay);
+		else if (grad.shape==0)	// trapezoid
+			duration = MAX(duration, grad.rampUpTime + grad.flatTime + grad.rampDownTime + grad.delay);
+	}
+	if (events[ADC]>0) {
+		const ADCEvent &adc = m_adcLibrary[events[ADC]];
+		duration = MAX(duration, adc.delay + (adc.numSamples*adc.dwellTime)/1000);
+	}
+	const ControlEvent &control = m_controlLibrary[events[CTRL]];
+	if (events[CTRL]>0 && control.type==ControlEvent::TRIGGER) {
+		duration = MAX(duration, control.duration );
+	}
+
+	// handling of delays has changed in revision 1.2.0
+	long delay = m_delayLibrary[events[DELAY]];
+	if (version_combined<1002000L)
+		return duration + delay;
+	else
+		return MAX(duration, delay);
+}
+
+/***********************************************************/
+void ExternalSequence::buildTimingTable()
+{
+	// Durations are the differences of consecutive start times
+	std::vector<long long> &startTimes = m_blockStartTimes.vector();
+	startTimes.resize(m_blocks.size()+1);
+	long long time = 0;
+	for (size_t i=0; i<m_blocks.size(); i++) {
+		startTimes[i] = time;
+		time += blockDuration(m_blocks[i].id);
+	}
+	startTimes[m_blocks.size()] = time;
+}
+
+/***********************************************************/
+int ExternalSequence::FindBlockAtTime(double time) const
+{
+	if (m_blockStartTimes.empty() || !(time>=0) || time>=m_blockStartTimes.back())
+		return -1;
+	// Last block starting at or before the given time (skips blocks of zero duration)
+	const long long *it = std::upper_bound(m_blockStartTimes.begin(), m_blockStartTimes.end(), time);
+	return (int)(it-m_blockStartTimes.begin()) - 1;
+}
+
+/***********************************************************/
+BlockStream::BlockStream(const ExternalSequence &seq, int windowSize)
+	: m_seq(&seq), m_bufferPos(0), m_bufferEnd(0), m_windowSize(MAX(windowSize,1)), m_windowPos(0),
+	  m_index(0), m_line(seq.m_blockLine), m_endOfSection(false), m_failed(false)
+{
+	if (!m_seq->m_blocksStreamed)
+		return;
+	std::map<std::string,size_t>::const_iterator section = m_seq->m_fileIndex.find("[BLOCKS]");
+	m_file.open(m_seq->m_blockFile.c_str(), std::ios::in | std::ios::binary);
+	if (!m_file.is_open() || section==m_seq->m_fileIndex.end() || !m_file.seekg(section->second)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to read blocks from file " << m_seq->m_blockFile);
+		m_endOfSection = true;
+		m_failed = true;
+		return;
+	}
+	m_buffer.resize(1<<16);
+	m_window.reserve(m_windowSize);
+}
+
+/***********************************************************/
+bool BlockStream::next(BlockView &view)
+{
+	if (m_windowPos>=m_window.size() && !fill())
+		return false;
+	m_seq->fillBlockView(m_window[m_windowPos++].id, m_index++, view);
+	return true;
+}
+
+/***********************************************************/
+bool BlockStream::fill()
+{
+	m_window.clear();
+	m_windowPos = 0;
+
+	// Sequence loaded completely
+	if (!m_seq->m_blocksStreamed) {
+		size_t first = MIN((size_t)m_index, m_seq->m_blocks.size());
+		size_t last = MIN(first+m_windowSize, m_seq->m_blocks.size());
+		m_window.assign(m_seq->m_blocks.begin()+first, m_seq->m_blocks.begin()+last);
+		return !m_window.empty();
+	}
+
+	while (!m_endOfSection) {
+		parseBuffer();
+		if (m_window.size()>=m_windowSize || m_endOfSection)
+			break;
+
+		// Keep the incomplete last line and read more data
+		size_t remaining = m_bufferEnd-m_bufferPos;
+		if (!m_file) {
+			m_endOfSection = true;	// end of file
+			break;
+		}
+		memmove(&m_buffer[0], &m_buffer[m_bufferPos], remaining);
+		if (remaining==m_buffer.size())
+			m_buffer.resize(2*m_buffer.size());	// line longer than the buffer
+		m_file.read(&m_buffer[remaining], m_buffer.size()-remaining);
+		m_bufferPos = 0;
+		m_bufferEnd = remaining + (size_t)m_file.gcount();
+	}
+	return !m_window.empty();
+}
+
+/***********************************************************/
+void BlockStream::parseBuffer()
+{
+	if (m_bufferEnd==0)
+		return;
+	const char *pos = &m_buffer[0] + m_bufferPos;
+	const char *end = &m_buffer[0] + m_bufferEnd;
+
+	// Only complete lines are parsed until the end of file is reached
+	// (a CR at the end of the buffer may be followed by LF)
+	if (m_file) {
+		if (end>pos && end[-1]=='\r') --end;
+		while (end>pos && end[-1]!='\n' && end[-1]!='\r') --end;
+	}
+
+	EventIDs events;
+	for (const char *eol; pos<end && m_window.size()<m_windowSize; pos=nextLine(eol,end), m_line++) {
+		eol = lineEnd(pos,end);
+		if (eol==pos || pos[0]=='[') {
+			m_endOfSection = true;
+			break;
+		}
+		if (!readBlockLine(pos,eol,events)) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode event table in line " << m_line << "\n" << std::string(pos,eol) << std::endl );
+			m_endOfSection = m_failed = true;
+			break;
+		}
+		if (!m_seq->checkBlockReferences(events)) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Block " << m_index+m_window.size()+1
+				<< " contains references to undefined events" );
+			m_endOfSection = m_failed = true;
+			break;
+		}
+		m_window.push_back(events);
+	}
+	m_bufferPos = pos - &m_buffer[0];
+}
+
+/***********************************************************/
+bool ExternalSequence::decodeBlock(SeqBlock *block)
+{
+	if (m_profiling)
+		m_decodeCalls.fetch_add(1, std::memory_order_relaxed);
+	int *events = &block->events[0];
+	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Decoding block " << block->index << " events: "
+		<< events[0]+1 << " " << events[1]+1 << " " << events[2]+1 << " "
+		<< events[3]+1 << " " << events[4]+1 );
+
+	bool ok = true;
+
+	// Decode RF
+	if (block->isRF())
+	{
+		block->rfAmplitude = GetDecodedShape(block->rf.magShape, SHAPE_RF_MAGNITUDE);
+		block->rfPhase     = GetDecodedShape(block->rf.phaseShape, SHAPE_RF_PHASE);
+		ok = (block->rfAmplitude && block->rfPhase);
+	}
+
+	// Decode gradients
+	for (int iC=0; iC<NUM_GRADS; iC++)
+	{
+		if (block->isArbitraryGradient(iC))	// is arbitrary gradient?
+		{
+			block->gradWaveforms[iC] = GetDecodedShape(block->grad[iC].shape, SHAPE_GRADIENT);
+			ok = ok && block->gradWaveforms[iC];
+		}
+	}
+
+	return ok;
+}
+
+/***********************************************************/
+DecodedShape ExternalSequence::GetDecodedShape(int shapeId, ShapeUsage usage)
+{
+	DecodedShape cached = m_shapeCache.find(shapeId, usage);
+	if (cached)
+		return cached;
+	if (!m_shapeLibrary.count(shapeId))
+		return DecodedShape();
+
+	// Copy the shape decompressed by the cache image, it has already been checked
+	size_t imageIndex = (size_t)shapeId*NUM_SHAPE_USAGES+usage;
+	if (imageIndex<m_imageShapes.size() && m_imageShapes[imageIndex]) {
+		const float *samples = m_imageShapes[imageIndex];
+		DecodedShape decoded(new std::vector<float>(samples, samples+m_shapeLibrary[shapeId].numUncompressedSamples));
+		m_shapeCache.insert(shapeId, usage, decoded);
+		return decoded;
+	}
+
+	// Decompress the shape
+	PhaseTimer timer(this, PHASE_DECODE);
+	CompressedShape& shape = *m_shapeLibrary.find(shapeId);
+	if (!loadShapeSamples(shape))
+		return DecodedShape();
+
+	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Loaded shape with "
+		<< shape.samples.size() << " compressed samples" );
+	if (shape.numUncompressedSamples<0) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: shape " << shapeId << " has an invalid number of samples "
+			<< shape.numUncompressedSamples);
+		return DecodedShape();
+	}
+
+	std::vector<float> *waveform = new std::vector<float>(shape.numUncompressedSamples);
+	DecodedShape decoded(waveform);
+	if (!waveform->empty() && !shape.samples.empty() && !decompressShape(shape,&(*waveform)[0])) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decompress shape " << shapeId);
+		return DecodedShape();
+	}
+
+	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Shape uncompressed to "
+		<< shape.numUncompressedSamples << " samples" );
+
+	if (usage==SHAPE_GRADIENT)
+		checkGradient(*waveform);
+	else
+		checkRF(*waveform, usage);
+
+	m_shapeCache.insert(shapeId, usage, decoded);
+	if (m_profiling) {
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_stats.shapesDecoded++;
+		m_stats.samplesDecoded += waveform->size();
+	}
+	return decoded;
+}
+
+/***********************************************************/
+typedef void (*FillFunction)(float *out, int count, float value);
+
+#ifdef HAVE_X86_SIMD
+static void fillSSE2(float *out, int count, float value)
+{
+	const __m128 v = _mm_set1_ps(value);
+	int i=0;
+	for (; i+4<=count; i+=4)
+		_mm_storeu_ps(out+i, v);
+	for (; i<count; i++)
+		out[i] = value;
+}
+
+__attribute__((target("avx")))
+static void fillAVX(float *out, int count, float value)
+{
+	const __m256 v = _mm256_set1_ps(value);
+	int i=0;
+	for (; i+16<=count; i+=16) {
+		_mm256_storeu_ps(out+i, v);
+		_mm256_storeu_ps(out+i+8, v);
+	}
+	for (; i+8<=count; i+=8)
+		_mm256_storeu_ps(out+i, v);
+	for (; i<count; i++)
+		out[i] = value;
+}
+#else
+static void fillScalar(float *out, int count, float value)
+{
+	for (int i=0; i<count; i++)
+		out[i] = value;
+}
+#endif
+
+/**
+ * @brief Select the fastest fill routine supported by the CPU
+ */
+static FillFunction selectFillFunction()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		return &fillAVX;
+	return &fillSSE2;
+#else
+	return &fillScalar;
+#endif
+}
+
+/**
+ * @brief Integrate a run of constant derivative values
+ *
+ * Writes the running sum after each of the `count` additions of `delta`. The
+ * additions are performed in the same order as a plain cumulative sum, so the
+ * result is bit-identical. A zero derivative leaves the sum unchanged after
+ * the first addition, such runs are written with a vectorized fill.
+ *
+ * @return the running sum after the run
+ */
+static inline float integrateRun(float *out, int count, float delta, float sum, FillFunction fill)
+{
+	if (delta==0.0f) {
+		sum += delta;
+		fill(out, count, sum);
+		return sum;
+	}
+	for (int i=0; i<count; i++) {
+		sum += delta;
+		out[i] = sum;
+	}
+	return sum;
+}
+
+/***********************************************************/
+bool ExternalSequence::decompressShape(const CompressedShape& encoded, float *shape)
+{
+	static const FillFunction fill = selectFillFunction();
+
+	const float *packed = encoded.samples.empty() ? NULL : &encoded.samples[0];
+	const int numPacked = encoded.samples.size();
+	const int numSamples = encoded.numUncompressedSamples;
+	if (numSamples<0) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: invalid number of samples " << numSamples
+			<< " of compressed shape");
+		return false;
+	}
+
+	// The compressed samples are the run-length encoded derivative of the shape:
+	// two equal values are followed by the number of additional repetitions.
+	// Expansion and cumulative sum are done in a single pass.
+	float sum = -0.0f;	// additive identity (keeps the sign of a leading zero)
+	int countPack=0;
+	int countUnpack=0;
+	while (countPack<numPacked)
+	{
+		const float value = packed[countPack];
+		int rep = 1;
+		if (countPack+1<numPacked && packed[countPack+1]==value)
+		{
+			if (countPack+2>=numPacked) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: compressed shape ends within a run (sample "
+					<< countPack+1 << " of " << numPacked << ")");
+				return false;
 			}
-			std::istringstream ss(buffer);
-			std::string key;
-			ss >> key;
-			double value;
-			std::vector<double> values;
-			while (ss >> value) {
-				values.push_back(value);
+			const float count = packed[countPack+2];
+			if (!(count>=0.0f && count<=(float)numSamples)) {
+				print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: invalid run length " << count
+					<< " in compressed shape (sample " << countPack+3 << ")");
+				return false;
 			}
-			m_definitions[key] = values;
+			rep = ((int)count)+2;
+			countPack += 3;
 		}
-
-		std::ostringstream out;
-		out << "-- " << "DEFINITIONS READ: " << m_definitions.size() << " : ";
-		for (std::map<std::string,std::vector<double> >::iterator it=m_definitions.begin(); it!=m_definitions.end(); ++it)
+		else
 		{
-			out<< it->first << " ";
-			for (int i=0; i<it->second.size(); i++)
-				out << it->second[i] << " ";
+			countPack++;
 		}
 
-		print_msg(DEBUG_HIGH_LEVEL, out);
+		if (rep>numSamples-countUnpack) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: compressed shape expands to more than "
+				<< numSamples << " samples");
+			return false;
+		}
+		sum = integrateRun(shape+countUnpack, rep, value, sum, fill);
+		countUnpack += rep;
+	}
 
-	} // if definitions exist
+	// Missing samples have zero derivative (as with a zero-initialized buffer)
+	if (countUnpack<numSamples)
+		integrateRun(shape+countUnpack, numSamples-countUnpack, 0.0f, sum, fill);
 
-	// Read blocks section
-	// ------------------------
-	if (m_fileIndex.find("[BLOCKS]") == m_fileIndex.end()) {
-		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Required: [BLOCKS] section");
-		return false;
-	}
-	data_file.seekg(m_fileIndex["[BLOCKS]"], std::ios::beg);
+	return true;
+}
 
-	int blockIdx;
-	EventIDs events;
+/***********************************************************/
+void ExternalSequence::compressShape(const float *samples, int numSamples, CompressedShape &encoded)
+{
+	// Quantize the samples to 1e-8 so that the derivative is exactly integer
+	// and the cumulative sum of the derivative never drifts (as mr.compressShape)
+	static const double QUANTUM = 1e-8;
+
+	encoded.numUncompressedSamples = MAX(numSamples,0);
+	encoded.samples.clear();
+	encoded.text = NULL;
+	encoded.textEnd = NULL;
+	encoded.image = NULL;
+	encoded.numImageSamples = 0;
+
+	// Runs are formed from the stored (single-precision) derivative values, so
+	// that consecutive values of the encoded shape never look like a run
+	long long previous = 0;
+	int i = 0;
+	while (i<numSamples) {
+		const long long current = llround(samples[i]/QUANTUM);
+		const float value = (float)((current-previous)*QUANTUM);
+		previous = current;
+		int run = 1;
+		while (i+run<numSamples) {
+			const long long next = llround(samples[i+run]/QUANTUM);
+			if ((float)((next-previous)*QUANTUM)!=value)
+				break;
+			previous = next;
+			run++;
+		}
+		i += run;
 
-	// Read blocks
-	m_blocks.clear();
-	while (getline(data_file, buffer, MAX_LINE_SIZE)) {
-		if (buffer[0]=='[' || strlen(buffer)==0) {
-			break;
+		encoded.samples.push_back(value);
+		if (run>=2) {
+			encoded.samples.push_back(value);
+			encoded.samples.push_back((float)(run-2));
 		}
+	}
+}
 
-		memset(events.id, 0, NUM_EVENTS*sizeof(int));
+/***********************************************************/
+bool ExternalSequence::checkBlockReferences(const EventIDs& events, const EventLibrary<RFEvent> &rfLibrary,
+	const EventLibrary<GradEvent> &gradLibrary, const EventLibrary<ADCEvent> &adcLibrary,
+	const EventLibrary<long> &delayLibrary, const EventLibrary<ControlEvent> &controlLibrary)
+{
+	bool error;
+	error = (events.id[RF]>0    && rfLibrary.count(events.id[RF])==0);
+	error|= (events.id[GX]>0    && gradLibrary.count(events.id[GX])==0);
+	error|= (events.id[GY]>0    && gradLibrary.count(events.id[GY])==0);
+	error|= (events.id[GZ]>0    && gradLibrary.count(events.id[GZ])==0);
+	error|= (events.id[ADC]>0   && adcLibrary.count(events.id[ADC])==0);
+	error|= (events.id[DELAY]>0 && delayLibrary.count(events.id[DELAY])==0);
+	error|= (events.id[CTRL]>0  && controlLibrary.count(events.id[CTRL])==0);
+	
+	return (!error);
+}
 
-		if (7<sscanf(buffer, "%d%d%d%d%d%d%d%d", &blockIdx,
-				&events.id[DELAY],                              // Delay
-				&events.id[RF],                                 // RF
-				&events.id[GX],&events.id[GY],&events.id[GZ],   // Gradients
-				&events.id[ADC],                                // ADCs
-				&events.id[CTRL]                                // Control
-				)
-				) {
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode event table\n" << buffer << std::endl );
+/***********************************************************/
+bool ExternalSequence::checkShapeReferences()
+{
+	for (int id=1; id<=m_rfLibrary.maxId(); id++) {
+		const RFEvent &rf = m_rfLibrary[id];
+		if (m_rfLibrary.count(id) && ((rf.magShape!=0 && !m_shapeLibrary.count(rf.magShape)) ||
+			(rf.phaseShape!=0 && !m_shapeLibrary.count(rf.phaseShape)))) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: RF event " << id
+				<< " references undefined shapes " << rf.magShape << " " << rf.phaseShape);
 			return false;
 		}
-
-		if (!checkBlockReferences(events)) {
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Block " << blockIdx
-				<< " contains references to undefined events" );
-			print_msg(ERROR_MSG, std::ostringstream().flush() << "***        RF:" << events.id[RF] << " GX:" << events.id[GX] << " GY:" << events.id[GY] << " GZ:" << events.id[GZ] << " ADC:" << events.id[DELAY] << " GX:" << events.id[DELAY] << " CTRL:" << events.id[CTRL]);
+	}
+	for (int id=1; id<=m_gradLibrary.maxId(); id++) {
+		const GradEvent &grad = m_gradLibrary[id];
+		if (m_gradLibrary.count(id) && grad.shape!=0 && !m_shapeLibrary.count(grad.shape)) {
+			print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: gradient event " << id
+				<< " references undefined shape " << grad.shape);
 			return false;
 		}
-		// Add event IDs to list of blocks
-		m_blocks.push_back(events);
 	}
-	data_file.close();
+	return true;
+}
+
+/***********************************************************/
+void ExternalSequence::checkGradient(std::vector<float>& waveform)
+{
+	for (unsigned j=0; j<waveform.size(); j++)
+	{
+		if (waveform[j]>1.0)  waveform[j]= 1.0;
+		if (waveform[j]<-1.0) waveform[j]=-1.0;
+	}
+	// Ensure last point is zero // MZ: no, its wrong! trapezoid gradients have a non-zero at the end!
+	// if (waveform.size()>0) waveform[waveform.size()-1]=0.0;
+}
 
-	print_msg(DEBUG_HIGH_LEVEL, std::ostringstream().flush() << "-- BLOCKS READ: " << m_blocks.size());
 
-	// Num_Blocks definition (if defined) is used to check the correct number of blocks are read
-	if (numBlocks>0 && m_blocks.size()!=numBlocks) {
-		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Expected " << numBlocks
-		    << " blocks but read " << m_blocks.size() << " blocks");
-		return false;
+/***********************************************************/
+void ExternalSequence::checkRF(std::vector<float>& waveform, ShapeUsage usage)
+{
+	if (usage==SHAPE_RF_PHASE)
+	{
+		// Phase shapes are stored in units of 2pi
+		for (unsigned int i=0; i<waveform.size(); i++)
+		{
+			waveform[i] *= (float)TWO_PI;
+			if (waveform[i]>TWO_PI-1.e-4) waveform[i]=(float)(TWO_PI-1.e-4);
+			if (waveform[i]<0) waveform[i]=0.0;
+		}
+		return;
 	}
-	std::vector<double> def = GetDefinition("Scan_ID");
-	int scanID = def.empty() ? 0: (int)def[0];
-	print_msg(NORMAL_MSG, std::ostringstream().flush() << "==========================================" );
-	print_msg(NORMAL_MSG, std::ostringstream().flush() << "===== EXTERNAL SEQUENCE #" << std::setw(5) << scanID << " ===========" );
-	print_msg(NORMAL_MSG, std::ostringstream().flush() << "==========================================" );
+	for (unsigned int i=0; i<waveform.size(); i++)
+	{
+		if (waveform[i]>1.0) waveform[i]=1.0;
+		if (waveform[i]<0.0) waveform[i]=0.0;
+	}
+}
 
-	return true;
-};
 
+/***********************************************************/
+DecodedShape ShapeCache::find(int shapeId, ShapeUsage usage)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t key = (size_t)shapeId*NUM_SHAPE_USAGES + usage;
+	if (shapeId>=0 && key<m_entries.size() && m_entries[key].shape) {
+		m_entries[key].lastUse = ++m_tick;
+		m_hits++;
+		return m_entries[key].shape;
+	}
+	m_misses++;
+	return DecodedShape();
+}
 
 /***********************************************************/
-void ExternalSequence::skipComments(std::ifstream &fileStream, char *buffer)
+void ShapeCache::insert(int shapeId, ShapeUsage usage, const DecodedShape &shape)
 {
-	while (getline(fileStream, buffer, MAX_LINE_SIZE)) {
-		if (buffer[0]!=COMMENT_CHAR && strlen(buffer)>0) {
-			break;
-		}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (shapeId<0 || !shape)
+		return;
+	size_t key = (size_t)shapeId*NUM_SHAPE_USAGES + usage;
+	if (key>=m_entries.size()) {
+		Entry empty = { DecodedShape(), 0 };
+		m_entries.resize(key+1,empty);
 	}
-};
+	Entry &entry = m_entries[key];
+	if (entry.shape)
+		m_numSamples -= entry.shape->size();
+	entry.shape = shape;
+	entry.lastUse = ++m_tick;
+	m_numSamples += shape->size();
+	evict();
+}
 
+/***********************************************************/
+void ShapeCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<Entry>().swap(m_entries);
+	m_numSamples = 0;
+	m_tick = 0;
+	m_hits = 0;
+	m_misses = 0;
+}
 
 /***********************************************************/
-void ExternalSequence::buildFileIndex(std::ifstream &fileStream)
+void ShapeCache::setMaxSamples(size_t maxSamples)
 {
-	char buffer[MAX_LINE_SIZE];
-	
-	while (getline(fileStream, buffer, MAX_LINE_SIZE)) {
-		std::string line = std::string(buffer);
-		if (line[0]=='[' && line[line.length()-1]==']') {
-			m_fileIndex[line] = fileStream.tellg();
-			
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxSamples = maxSamples;
+	evict();
+}
+
+/***********************************************************/
+void ShapeCache::evict()
+{
+	// Linear search for the oldest entry, this only happens on a cache miss
+	// and the number of distinct shapes is small
+	while (m_maxSamples>0 && m_numSamples>m_maxSamples) {
+		Entry *oldest = NULL;
+		for (size_t i=0; i<m_entries.size(); i++) {
+			if (m_entries[i].shape && (!oldest || m_entries[i].lastUse<oldest->lastUse))
+				oldest = &m_entries[i];
 		}
+		if (!oldest || oldest->lastUse==m_tick)
+			break;	// keep the most recent shape even if it exceeds the limit
+		m_numSamples -= oldest->shape->size();
+		oldest->shape.reset();
 	}
-	fileStream.clear();		// reset EOF flag
-	fileStream.seekg(0, std::ios::beg);
-};
+}
+
+
+// * ------------------------------------------------------------------ *
+// * Event index                                                        *
+// * ------------------------------------------------------------------ *
+
+// Width of the grid cells in units of the tolerance, and the distance from a
+// cell boundary (in the same units) within which the neighbouring cell is probed
+static const double CELL_WIDTH  = 64.0;
+static const double CELL_MARGIN = 2.0;
 
 /***********************************************************/
-SeqBlock*	ExternalSequence::GetBlock(int index) {
-	SeqBlock *block = new SeqBlock();
+EventIndex::EventIndex() {}
 
-	// Copy event IDs
-	EventIDs events = m_blocks[index];
-	std::copy(events.id,events.id+NUM_EVENTS,&block->events[0]);
-
-	// Set some defaults
-	block->index = index;
-	block->delay = 0;
-	block->adc.numSamples = 0;
-
-	// Set event structures (if applicable) so e.g. gradient type can be determined
-	if (events.id[RF]>0)     block->rf      = m_rfLibrary[events.id[RF]];
-	if (events.id[ADC]>0)    block->adc     = m_adcLibrary[events.id[ADC]];
-	if (events.id[DELAY]>0)  block->delay   = m_delayLibrary[events.id[DELAY]];
-	if (events.id[CTRL]>0)   block->control = m_controlLibrary[events.id[CTRL]];
-	for (unsigned int i=0; i<NUM_GRADS; i++)
-		if (events.id[GX+i]>0) block->grad[i] = m_gradLibrary[events.id[GX+i]];
+/***********************************************************/
+void EventIndex::SetTolerance(const std::vector<double> &tolerance)
+{
+	m_tolerance = tolerance;
+	clear();
+}
 
-	// Calculate duration of block
-	long duration = 0;
-	if (block->isRF()) {
-		RFEvent &rf = block->GetRFEvent();
-		duration = MAX(duration, (long)m_shapeLibrary[rf.magShape].numUncompressedSamples);
-	}
+/***********************************************************/
+void EventIndex::SetTolerance(double tolerance)
+{
+	m_tolerance.assign(1,tolerance);
+	clear();
+}
 
-	for (int iC=0; iC<NUM_GRADS; iC++)
-	{
-		GradEvent &grad = block->GetGradEvent(iC);
-		if (block->isArbitraryGradient(iC))
-			duration = MAX(duration, (long)(10*m_shapeLibrary[grad.shape].numUncompressedSamples) + grad.delay);
-		else if (block->isTrapGradient(iC))
-			duration = MAX(duration, grad.rampUpTime + grad.flatTime + grad.rampDownTime + grad.delay);
-	}
-	if (block->isADC()) {
-		ADCEvent &adc = block->GetADCEvent();
-		duration = MAX(duration, adc.delay + (adc.numSamples*adc.dwellTime)/1000);
-	}
-	if (block->isTrigger()) {
-		ControlEvent &ctrl = block->GetControlEvent();
-		duration = MAX(duration, ctrl.duration );
+/***********************************************************/
+void EventIndex::clear()
+{
+	m_keys.clear();
+	m_entries.clear();
+	m_cells.clear();
+}
+
+/***********************************************************/
+long long EventIndex::cell(double value, double tolerance, int &neighbour) const
+{
+	neighbour = 0;
+	value += 0.0;	// negative zero
+	if (tolerance>0.0 && fabs(value)<=DBL_MAX) {
+		// Logarithmic scale above 1, where the tolerance is relative. Values
+		// within the tolerance are less than CELL_MARGIN apart on this scale.
+		const double u = (fabs(value)<=1.0) ? value : ((value>0.0) ? 1.0+log(value) : -1.0-log(-value));
+		const double x = u/(CELL_WIDTH*tolerance);
+		if (fabs(x)<1e18) {
+			const double c = floor(x);
+			const double offset = (x-c)*CELL_WIDTH;
+			if (offset<CELL_MARGIN)
+				neighbour = -1;
+			else if (offset>CELL_WIDTH-CELL_MARGIN)
+				neighbour = 1;
+			return (long long)c;
+		}
 	}
+	// Exact matching: the value itself
+	long long bits;
+	memcpy(&bits,&value,sizeof(bits));
+	return bits;
+}
 
-	// handling of delays has changed in revision 1.2.0
-	if (version_combined<1002000L)
-		block->duration = duration + block->delay;
-	else
-		block->duration = MAX(duration, block->delay);
+/***********************************************************/
+size_t EventIndex::hashCells(const long long *cells, int length, const int *flip, const int *dir, int numFlip, unsigned mask) const
+{
+	unsigned long long hash = 14695981039346656037ULL ^ (unsigned long long)length;
+	int next = 0;
+	for (int i=0; i<length; i++) {
+		long long c = cells[i];
+		if (next<numFlip && flip[next]==i) {
+			if (mask & (1u<<next))
+				c += dir[next];
+			next++;
+		}
+		hash = (hash ^ (unsigned long long)c) * 1099511628211ULL;
+	}
+	// Mix the high bits into the low bits used by the hash table
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return (size_t)hash;
+}
 
-	return block;
+/***********************************************************/
+bool EventIndex::matches(const double *a, const double *b, int length) const
+{
+	for (int i=0; i<length; i++) {
+		if (a[i]==b[i])
+			continue;
+		const double scale = MAX(1.0, MAX(fabs(a[i]),fabs(b[i])));
+		if (!(fabs(a[i]-b[i])<=tolerance(i)*scale))
+			return false;
+	}
+	return true;
 }
 
 /***********************************************************/
-bool ExternalSequence::decodeBlock(SeqBlock *block)
+int EventIndex::find(const double *key, int length) const
 {
-	int *events = &block->events[0];
-	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Decoding block " << block->index << " events: "
-		<< events[0]+1 << " " << events[1]+1 << " " << events[2]+1 << " "
-		<< events[3]+1 << " " << events[4]+1 );
+	// Cells of all values, values close to a cell boundary are probed in both cells
+	long long buffer[64];
+	std::vector<long long> heap;
+	long long *cells = buffer;
+	if (length>64) {
+		heap.resize(length);
+		cells = &heap[0];
+	}
+	int flip[MAX_PROBE_VALUES], dir[MAX_PROBE_VALUES];
+	int numFlip = 0;
+	for (int i=0; i<length; i++) {
+		int neighbour;
+		cells[i] = cell(key[i], tolerance(i), neighbour);
+		if (neighbour!=0 && numFlip<MAX_PROBE_VALUES) {
+			flip[numFlip] = i;
+			dir[numFlip] = neighbour;
+			numFlip++;
+		}
+	}
 
-	std::vector<float> waveform;
+	typedef std::unordered_multimap<size_t,int>::const_iterator Iterator;
+	for (unsigned mask=0; mask<(1u<<numFlip); mask++) {
+		std::pair<Iterator,Iterator> range = m_cells.equal_range(hashCells(cells, length, flip, dir, numFlip, mask));
+		for (Iterator it=range.first; it!=range.second; ++it) {
+			const Entry &entry = m_entries[it->second];
+			if (entry.length==length && matches(m_keys.empty() ? NULL : &m_keys[entry.offset], key, length))
+				return it->second;
+		}
+	}
+	return 0;
+}
 
-	// Decode RF
-	if (block->isRF())
-	{
-		// Decompress the shape for this channel
-		CompressedShape& shape = m_shapeLibrary[block->rf.magShape];
-		waveform.resize(shape.numUncompressedSamples);
-		decompressShape(shape,&waveform[0]);
-
-		/*
-		// detect zero-padding 
-		int nStart;
-		for (nStart=0; nStart<shape.numUncompressedSamples; ++nStart)
-			if (0.0 != waveform[nStart])
-				break;
-		int nEnd;
-		for (nEnd=shape.numUncompressedSamples; nEnd>0; --nEnd)
-		{
-			//print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Tail 0 detection: nEnd=" << nEnd << " waveform[nEnd-1]=" << waveform[nEnd-1] );
-			if (fabs(waveform[nEnd-1]) > 1e-6)
+/***********************************************************/
+void EventIndex::insert(const double *key, int length, int id)
+{
+	if (id<=0)
+		return;
+	bool replace = (size_t)id<m_entries.size() && m_entries[id].length>=0;
+	if (replace) {
+		// Replace the previous key of this ID
+		typedef std::unordered_multimap<size_t,int>::iterator Iterator;
+		std::pair<Iterator,Iterator> range = m_cells.equal_range(m_entries[id].hash);
+		for (Iterator it=range.first; it!=range.second; ++it) {
+			if (it->second==id) {
+				m_cells.erase(it);
 				break;
+			}
 		}
-		// mz: now only copy the inner non-zero part
-		//block->rfAmplitude = std::vector<float>(waveform);
-		block->rfAmplitude = std::vector<float>(waveform.begin()+nStart, waveform.begin()+nEnd);
-		// mz: and take notice of optimizations
-		block->rf.rfZeroHead = nStart;
-		block->rf.rfZeroTail = shape.numUncompressedSamples - nEnd;
-		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "shape length was "<< shape.numUncompressedSamples << "0 detection foung " << block->rf.rfZeroHead << " head zeros and " << block->rf.rfZeroTail << " trailing zeros, new length is " << block->rfAmplitude.size() );
+	}
+	if ((size_t)id>=m_entries.size()) {
+		Entry undefined = { 0, -1, 0 };
+		m_entries.resize(id+1, undefined);
+	}
+	std::vector<long long> cells(length);
+	for (int i=0; i<length; i++) {
+		int neighbour;
+		cells[i] = cell(key[i], tolerance(i), neighbour);
+	}
+	// A replaced key is overwritten in place if the new one fits, so that
+	// replacing keys does not grow m_keys
+	Entry &entry = m_entries[id];
+	if (!replace || length>entry.length) {
+		entry.offset = m_keys.size();
+		m_keys.resize(m_keys.size()+length);
+	}
+	std::copy(key, key+length, m_keys.begin()+entry.offset);
+	entry.length = length;
+	entry.hash = hashCells(cells.empty() ? NULL : &cells[0], length, NULL, NULL, 0, 0);
+	m_cells.insert(std::make_pair(entry.hash, id));
+}
+
+// * ------------------------------------------------------------------ *
+// * Cache image                                                        *
+// * ------------------------------------------------------------------ *
+
+static const char CACHE_MAGIC[8] = { 0x01, 'p', 'u', 'l', 's', 'e', 'q', 0x03 };
+static const int CACHE_FORMAT_VERSION = 3;
+static const unsigned int CACHE_BYTE_ORDER = 0x01020304;
+
+/**
+ * @brief Sections of a cache image, each an array of fixed-size elements
+ */
+enum CacheSection {
+	CACHE_DEFINITIONS,        // definitions in the binary format (bytes)
+	CACHE_BLOCKS,             // block table (EventIDs)
+	CACHE_BLOCK_TIMES,        // block start times and total duration (long long)
+	CACHE_RF,                 // event libraries, entries indexed by ID ...
+	CACHE_RF_DEFINED,         // ... followed by the flags of defined IDs
+	CACHE_GRADIENTS,
+	CACHE_GRADIENTS_DEFINED,
+	CACHE_ADC,
+	CACHE_ADC_DEFINED,
+	CACHE_DELAYS,
+	CACHE_DELAYS_DEFINED,
+	CACHE_CONTROLS,
+	CACHE_CONTROLS_DEFINED,
+	CACHE_SHAPES,             // compressed shapes (CacheShape)
+	CACHE_SHAPE_SAMPLES,      // compressed samples of all shapes (float)
+	CACHE_DECODED,            // decompressed shapes (CacheShape)
+	CACHE_DECODED_SAMPLES,    // decompressed samples of all shapes (float)
+	NUM_CACHE_SECTIONS
+};
 
-		CompressedShape& shapePhase = m_shapeLibrary[block->rf.phaseShape];
-		waveform.resize(shapePhase.numUncompressedSamples);
-		decompressShape(shapePhase,&waveform[0]);
+/**
+ * @brief Shape stored in a cache image
+ */
+struct CacheShape
+{
+	int id;                        /**< @brief Shape ID */
+	int numSamples;                /**< @brief Number of samples after decompression */
+	int usage;                     /**< @brief ShapeUsage of a decompressed shape, -1 for compressed shapes */
+	int reserved;
+	unsigned long long offset;     /**< @brief Position of the first sample in the samples section */
+	unsigned long long count;      /**< @brief Number of samples stored */
+};
 
-		// Scale phase by 2pi
-		std::transform(waveform.begin(), waveform.end(), waveform.begin(), std::bind1st(std::multiplies<float>(),TWO_PI));
-		//block->rfPhase = std::vector<float>(waveform);
-		// mz: now only copy the inner non-zero part
-		block->rfPhase = std::vector<float>(waveform.begin()+nStart, waveform.begin()+nEnd);
-		*/
+/**
+ * @brief Header at the start of a cache image
+ *
+ * Sections are located by their offset from the start of the file, so the
+ * image does not depend on the address it is mapped to.
+ */
+struct CacheHeader
+{
+	char magic[8];                        /**< @brief CACHE_MAGIC */
+	int formatVersion;                    /**< @brief CACHE_FORMAT_VERSION */
+	unsigned int byteOrder;               /**< @brief CACHE_BYTE_ORDER in the byte order of the writer */
+	int layout[8];                        /**< @brief Sizes of the stored structures, see cacheLayout() */
+	long long sourceSize;                 /**< @brief Size of the sequence file */
+	long long sourceTime;                 /**< @brief Modification time of the sequence file (ns) */
+	unsigned long long sourceHash;        /**< @brief contentHash() of the sequence file */
+	int version[4];                       /**< @brief Version of the sequence (major, minor, revision, combined) */
+	unsigned long long imageSize;         /**< @brief Size of the image */
+	unsigned long long imageHash;         /**< @brief ContentHasher of the sections, checked on request */
+	unsigned long long headerHash;        /**< @brief contentHash() of the header with headerHash 0, always checked */
+	unsigned long long offset[NUM_CACHE_SECTIONS];  /**< @brief Start of each section, aligned to 8 bytes */
+	unsigned long long count[NUM_CACHE_SECTIONS];   /**< @brief Number of elements of each section */
+};
 
-		//MZ: original Kelvin's code follows
-		block->rfAmplitude = std::vector<float>(waveform);
+/** @brief Size of the elements of each section */
+static const size_t CACHE_ELEMENT_SIZE[NUM_CACHE_SECTIONS] = { 1, sizeof(EventIDs), sizeof(long long),
+	sizeof(RFEvent), 1, sizeof(GradEvent), 1, sizeof(ADCEvent), 1, sizeof(long), 1, sizeof(ControlEvent), 1,
+	sizeof(CacheShape), sizeof(float), sizeof(CacheShape), sizeof(float) };
 
-		CompressedShape& shapePhase = m_shapeLibrary[block->rf.phaseShape];
-		waveform.resize(shapePhase.numUncompressedSamples);
-		decompressShape(shapePhase,&waveform[0]);
+/** @brief Get the sizes of the stored structures, images of a different layout are not used */
+static void cacheLayout(int *layout)
+{
+	const size_t sizes[8] = { sizeof(CacheHeader), sizeof(CacheShape), sizeof(EventIDs), sizeof(RFEvent),
+		sizeof(GradEvent), sizeof(ADCEvent), sizeof(ControlEvent), sizeof(long) };
+	for (int i=0; i<8; i++)
+		layout[i] = (int)sizes[i];
+}
 
-		// Scale phase by 2pi
-		//std::transform(waveform.begin(), waveform.end(), waveform.begin(), std::bind1st(std::multiplies<float>(),TWO_PI));
-		//block->rfPhase = std::vector<float>(waveform);
+/**
+ * @brief Hash of data given in pieces (FNV-1a over 64-bit words with an extra shift for mixing)
+ *
+ * The hash does not depend on how the data is split into pieces.
+ */
+struct ContentHasher
+{
+	unsigned long long hash;
+	unsigned long long size;
+	char tail[8];                 // bytes of an incomplete word
+	size_t tailSize;
+
+	ContentHasher() : hash(14695981039346656037ULL), size(0), tailSize(0) {}
+
+	void mix(const char *word) {
+		unsigned long long value;
+		memcpy(&value, word, 8);
+		hash = (hash^value)*1099511628211ULL;
+		hash ^= hash>>32;
 	}
 
-	// Decode gradients
-	for (int iC=GX; iC<ADC; iC++)
-	{
+	void add(const char *data, size_t n) {
+		size += n;
+		if (tailSize>0) {
+			size_t k = MIN(n, 8-tailSize);
+			memcpy(tail+tailSize, data, k);
+			tailSize += k;
+			data += k;
+			n -= k;
+			if (tailSize<8)
+				return;
+			mix(tail);
+			tailSize = 0;
+		}
+		for (; n>=8; data+=8, n-=8)
+			mix(data);
+		memcpy(tail, data, n);
+		tailSize = n;
+	}
 
-		if (block->isArbitraryGradient(iC-GX))	// is arbitrary gradient?
-		{
-			// Decompress the arbitrary shape for this channel
-			CompressedShape& shape = m_shapeLibrary[block->grad[iC-GX].shape];
+	unsigned long long finish() const {
+		unsigned long long result = hash;
+		for (size_t i=0; i<tailSize; i++)
+			result = (result^(unsigned char)tail[i])*1099511628211ULL;
+		return result^size;
+	}
+};
 
-			print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Loaded shape with "
-				<< shape.samples.size() << " compressed samples" );
+/** @brief Return the hash of the content computed by ContentHasher */
+static unsigned long long contentHash(const char *data, size_t size)
+{
+	ContentHasher hasher;
+	hasher.add(data, size);
+	return hasher.finish();
+}
 
-			waveform.resize(shape.numUncompressedSamples);
-			decompressShape(shape,&waveform[0]);
+/** @brief Return the hash of the header and section table of a cache image stored in the header */
+static unsigned long long headerHash(CacheHeader header)
+{
+	header.headerHash = 0;
+	return contentHash(reinterpret_cast<const char*>(&header), sizeof(header));
+}
 
-			print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Shape uncompressed to "
-				<< shape.numUncompressedSamples << " samples" );
+/**
+ * @brief Writer of the sections of a cache image
+ */
+struct CacheWriter
+{
+	std::ofstream out;
+	CacheHeader header;
+	unsigned long long offset;
+	ContentHasher hasher;         // of the sections
+
+	CacheWriter(const std::string &path) : out(path.c_str(), std::ios::out | std::ios::binary), offset(sizeof(CacheHeader)) {
+		memset(&header, 0, sizeof(header));
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));	// completed by finish()
+	}
 
-			block->gradWaveforms[iC-GX] = std::vector<float>(waveform);
-		}
+	void put(const char *data, size_t size) {
+		out.write(data, size);
+		hasher.add(data, size);
+		offset += size;
 	}
 
-	// Decode ADC
-	/*if (block->isADC())
-	{
-		block->adc = m_adcLibrary[events[ADC]];
+	void write(CacheSection section, const void *data, size_t count) {
+		static const char padding[8] = { 0 };
+		put(padding, (size_t)((8-offset%8)%8));
+		header.offset[section] = offset;
+		header.count[section] = count;
+		if (count>0)
+			put(static_cast<const char*>(data), count*CACHE_ELEMENT_SIZE[section]);
 	}
 
-	// Decode Delays
-	if (block->isDelay())
-	{
-		block->delay = m_delayLibrary[events[DELAY]];
-	}*/
+	template<typename T>
+	void write(CacheSection section, const EventLibrary<T> &library) {
+		write(section, library.data(), library.maxId()+1);
+		write((CacheSection)(section+1), library.defined(), library.maxId()+1);
+	}
 
-	checkGradient(*block);
-	checkRF(*block);
+	bool finish() {
+		header.imageSize = offset;
+		header.imageHash = hasher.finish();
+		header.headerHash = headerHash(header);
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.close();
+		return !out.fail();
+	}
+};
 
-	return true;
+/***********************************************************/
+void ExternalSequence::SetCacheMode(bool enable, const std::string &directory, bool decodedShapes, bool verifyImage)
+{
+	m_cacheEnabled = enable;
+	m_cacheDirectory = directory;
+	m_cacheDecodedShapes = decodedShapes;
+	m_cacheVerifyImage = verifyImage;
 }
 
 /***********************************************************/
-bool ExternalSequence::decompressShape(CompressedShape& encoded, float *shape)
+std::string ExternalSequence::GetCachePath(const std::string &sourcePath, const std::string &directory)
 {
-	float *packed = &encoded.samples[0];
-	int numPacked = encoded.samples.size();
-	int numSamples = encoded.numUncompressedSamples;
+	if (directory.empty())
+		return sourcePath + ".cache";
+
+	// Images of files with the same name are told apart by the hash of the path
+	size_t slash = sourcePath.find_last_of("/\\");
+	std::string name = (slash==std::string::npos) ? sourcePath : sourcePath.substr(slash+1);
+	char hash[32];
+	snprintf(hash, sizeof(hash), "%016llx", contentHash(sourcePath.data(), sourcePath.size()));
+	return directory + "/" + name + "." + hash + ".cache";	// '/' is accepted on all platforms
+}
 
-	int countPack=1;
-	int countUnpack=1;
-	while (countPack<numPacked)
-	{
+/***********************************************************/
+bool ExternalSequence::SaveCache(const std::string &path, bool decodedShapes)
+{
+	if (m_sourcePath.empty() || m_blocksStreamed) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: cache images require a sequence loaded completely from a single file");
+		return false;
+	}
+	long long size, time;
+	MappedFile source;
+	if (!fileStatus(m_sourcePath, size, time) || size!=m_sourceSize || time!=m_sourceTime || !source.open(m_sourcePath)) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: " << m_sourcePath << " has changed since it was loaded");
+		return false;
+	}
+	PhaseTimer timer(this, PHASE_CACHE);
+	unsigned long long sourceHash = contentHash(source.begin(), source.size());
+	source.close();
+
+	// Compressed samples of all shapes
+	std::vector<CacheShape> shapes, decoded;
+	std::vector<float> samples, decodedSamples;
+	for (int id=1; id<=m_shapeLibrary.maxId(); id++) {
+		if (!m_shapeLibrary.count(id))
+			continue;
+		CompressedShape &shape = *m_shapeLibrary.find(id);
+		if (!loadShapeSamples(shape))
+			return false;
+		CacheShape entry = { id, shape.numUncompressedSamples, -1, 0, samples.size(), shape.samples.size() };
+		shapes.push_back(entry);
+		samples.insert(samples.end(), shape.samples.begin(), shape.samples.end());
+	}
 
-		if (packed[countPack-1]!=packed[countPack])
-		{
-			shape[countUnpack-1]=((float)packed[countPack-1]);
-			countPack++; countUnpack++;
+	// Decompressed shapes in all usages of the event libraries
+	if (decodedShapes) {
+		std::vector<unsigned char> used((m_shapeLibrary.maxId()+1)*NUM_SHAPE_USAGES, 0);
+		for (int id=1; id<=m_rfLibrary.maxId(); id++) {
+			if (!m_rfLibrary.count(id))
+				continue;
+			const RFEvent &rf = m_rfLibrary[id];
+			if (m_shapeLibrary.count(rf.magShape))   used[rf.magShape*NUM_SHAPE_USAGES+SHAPE_RF_MAGNITUDE] = 1;
+			if (m_shapeLibrary.count(rf.phaseShape)) used[rf.phaseShape*NUM_SHAPE_USAGES+SHAPE_RF_PHASE] = 1;
 		}
-		else
-		{
-			int rep = ((int)packed[countPack+1])+2;
-			for (int i=countUnpack-1; i<=countUnpack+rep-2; i++)
-				shape[i]= ((float)packed[countPack-1]);
-			countPack += 3;
-			countUnpack += rep;
+		for (int id=1; id<=m_gradLibrary.maxId(); id++) {
+			if (m_gradLibrary.count(id) && m_shapeLibrary.count(m_gradLibrary[id].shape))
+				used[m_gradLibrary[id].shape*NUM_SHAPE_USAGES+SHAPE_GRADIENT] = 1;
 		}
+		for (size_t i=0; i<used.size(); i++) {
+			if (!used[i])
+				continue;
+			const int id = (int)(i/NUM_SHAPE_USAGES), usage = (int)(i%NUM_SHAPE_USAGES);
+			DecodedShape shape = GetDecodedShape(id, (ShapeUsage)usage);
+			if (!shape)
+				return false;
+			CacheShape entry = { id, (int)shape->size(), usage, 0, decodedSamples.size(), shape->size() };
+			decoded.push_back(entry);
+			decodedSamples.insert(decodedSamples.end(), shape->begin(), shape->end());
+		}
+	}
+
+	// Definitions as in the binary format
+	std::ostringstream definitions;
+	writeBinary<long long>(definitions, (long long)m_definitions.size());
+	for (std::map<std::string,std::vector<double> >::const_iterator it=m_definitions.begin(); it!=m_definitions.end(); ++it) {
+		writeBinary<long long>(definitions, (long long)it->first.size());
+		definitions.write(it->first.data(), it->first.size());
+		writeBinary<long long>(definitions, (long long)it->second.size());
+		for (size_t i=0; i<it->second.size(); i++)
+			writeBinary<double>(definitions, it->second[i]);
+	}
+	const std::string definitionData = definitions.str();
+
+	// Write a temporary file and replace the image, so that readers never see a partial image
+	std::ostringstream tempPath;
+	tempPath << path << ".tmp";
+#ifdef HAVE_MMAP
+	tempPath << getpid();
+#endif
+	CacheWriter writer(tempPath.str());
+	if (!writer.out.is_open()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write cache image " << path);
+		return false;
+	}
+	CacheHeader &header = writer.header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.formatVersion = CACHE_FORMAT_VERSION;
+	header.byteOrder = CACHE_BYTE_ORDER;
+	cacheLayout(header.layout);
+	header.sourceSize = size;
+	header.sourceTime = time;
+	header.sourceHash = sourceHash;
+	header.version[0] = version_major;
+	header.version[1] = version_minor;
+	header.version[2] = version_revision;
+	header.version[3] = version_combined;
+
+	writer.write(CACHE_DEFINITIONS, definitionData.data(), definitionData.size());
+	writer.write(CACHE_BLOCKS, m_blocks.data(), m_blocks.size());
+	writer.write(CACHE_BLOCK_TIMES, m_blockStartTimes.data(), m_blockStartTimes.size());
+	writer.write(CACHE_RF, m_rfLibrary);
+	writer.write(CACHE_GRADIENTS, m_gradLibrary);
+	writer.write(CACHE_ADC, m_adcLibrary);
+	writer.write(CACHE_DELAYS, m_delayLibrary);
+	writer.write(CACHE_CONTROLS, m_controlLibrary);
+	writer.write(CACHE_SHAPES, shapes.data(), shapes.size());
+	writer.write(CACHE_SHAPE_SAMPLES, samples.data(), samples.size());
+	writer.write(CACHE_DECODED, decoded.data(), decoded.size());
+	writer.write(CACHE_DECODED_SAMPLES, decodedSamples.data(), decodedSamples.size());
+	bool ok = writer.finish();
+	if (ok && rename(tempPath.str().c_str(), path.c_str())!=0) {
+		remove(path.c_str());	// rename does not replace files on all platforms
+		ok = (rename(tempPath.str().c_str(), path.c_str())==0);
+	}
+	if (!ok) {
+		remove(tempPath.str().c_str());
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write cache image " << path);
+		return false;
+	}
+	print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Wrote cache image " << path << " (" << writer.offset << " bytes)");
+	return true;
+}
+
+/***********************************************************/
+bool ExternalSequence::loadCache(const std::string &imagePath, const MappedFile &source)
+{
+	PhaseTimer timer(this, PHASE_CACHE);
+	MappedFile &image = m_cacheFile;
+	if (!image.open(imagePath))
+		return false;	// no image yet
+
+	// Check the header and the bounds of the sections
+	const char *base = image.begin();
+	const CacheHeader *header = reinterpret_cast<const CacheHeader*>(base);
+	const int maxId = EventLibrary<CompressedShape>::MAX_ID;
+	int layout[8];
+	cacheLayout(layout);
+	bool valid = image.size()>=sizeof(CacheHeader) && (size_t)base%8==0
+		&& 0==memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) && header->formatVersion==CACHE_FORMAT_VERSION
+		&& header->byteOrder==CACHE_BYTE_ORDER && 0==memcmp(header->layout, layout, sizeof(layout))
+		&& header->imageSize==image.size() && header->sourceSize==m_sourceSize;
+
+	// A damaged image (e.g. by a full disk or a crash of another writer) is parsed again.
+	// Hashing the sections reads the whole image, so it is only done on request.
+	const bool damaged = valid && (header->headerHash!=headerHash(*header) || (m_cacheVerifyImage
+		&& header->imageHash!=contentHash(base+sizeof(CacheHeader), image.size()-sizeof(CacheHeader))));
+	if (damaged) {
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Cache image " << imagePath << " is damaged");
+		image.close();
+		return false;
+	}
+	for (int s=0; s<NUM_CACHE_SECTIONS && valid; s++) {
+		const unsigned long long offset = header->offset[s], count = header->count[s];
+		valid = (offset%8==0 && offset>=sizeof(CacheHeader) && offset<=image.size()
+			&& count<=(image.size()-offset)/CACHE_ELEMENT_SIZE[s]);
+	}
+	valid = valid && header->count[CACHE_BLOCK_TIMES]==header->count[CACHE_BLOCKS]+1;
+	for (int s=CACHE_RF; s<=CACHE_CONTROLS && valid; s+=2)
+		valid = (header->count[s]>0 && header->count[s]==header->count[s+1] && header->count[s]<=(unsigned long long)maxId+1);
+
+	// The modification time identifies the sequence file, otherwise (e.g. for a copy) the content must match
+	const bool touched = valid && header->sourceTime!=m_sourceTime;
+	if (touched)
+		valid = (header->sourceHash==contentHash(source.begin(), source.size()));
+	if (!valid) {
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Cache image " << imagePath << " does not match the sequence");
+		image.close();
+		return false;
+	}
 
+	// Shapes must lie within the samples
+	const CacheShape *shapes = reinterpret_cast<const CacheShape*>(base+header->offset[CACHE_SHAPES]);
+	const float *samples = reinterpret_cast<const float*>(base+header->offset[CACHE_SHAPE_SAMPLES]);
+	const unsigned long long numShapes = header->count[CACHE_SHAPES], numSamples = header->count[CACHE_SHAPE_SAMPLES];
+	for (unsigned long long i=0; i<numShapes && valid; i++)
+		valid = (shapes[i].id>0 && shapes[i].id<=maxId && shapes[i].numSamples>=0
+			&& shapes[i].offset<=numSamples && shapes[i].count<=numSamples-shapes[i].offset);
+
+	std::map<std::string, std::vector<double> > definitions;
+	BinaryReader in(base+header->offset[CACHE_DEFINITIONS], base+header->offset[CACHE_DEFINITIONS]+header->count[CACHE_DEFINITIONS]);
+	long long numDefinitions = in.read<long long>();
+	for (long long i=0; i<numDefinitions && in.ok; i++) {
+		long long length = in.read<long long>();
+		if (length<0 || !in.has((unsigned long long)length))
+			break;
+		std::string key(in.pos, (size_t)length);
+		in.pos += length;
+		long long num = in.read<long long>();
+		if (num<0 || !in.has((unsigned long long)num*sizeof(double)))
+			break;
+		std::vector<double> &values = definitions[key];
+		for (long long j=0; j<num; j++)
+			values.push_back(in.read<double>());
 	}
-	if (countPack==numPacked) {
-		shape[countUnpack-1]=((float)packed[countPack-1]);
+	valid = valid && in.ok && in.pos==in.end;
+	if (!valid) {
+		print_msg(DEBUG_LOW_LEVEL, std::ostringstream().flush() << "Cache image " << imagePath << " is invalid");
+		image.close();
+		return false;
+	}
+
+	// The block table and shape samples are used in place, the libraries are copied
+	version_major    = header->version[0];
+	version_minor    = header->version[1];
+	version_revision = header->version[2];
+	version_combined = header->version[3];
+	m_definitions.swap(definitions);
+	m_blocks.assign(reinterpret_cast<const EventIDs*>(base+header->offset[CACHE_BLOCKS]), (size_t)header->count[CACHE_BLOCKS]);
+	m_blockStartTimes.assign(reinterpret_cast<const long long*>(base+header->offset[CACHE_BLOCK_TIMES]), (size_t)header->count[CACHE_BLOCK_TIMES]);
+	m_rfLibrary.assign(reinterpret_cast<const RFEvent*>(base+header->offset[CACHE_RF]),
+		reinterpret_cast<const unsigned char*>(base+header->offset[CACHE_RF_DEFINED]), (int)header->count[CACHE_RF]-1);
+	m_gradLibrary.assign(reinterpret_cast<const GradEvent*>(base+header->offset[CACHE_GRADIENTS]),
+		reinterpret_cast<const unsigned char*>(base+header->offset[CACHE_GRADIENTS_DEFINED]), (int)header->count[CACHE_GRADIENTS]-1);
+	m_adcLibrary.assign(reinterpret_cast<const ADCEvent*>(base+header->offset[CACHE_ADC]),
+		reinterpret_cast<const unsigned char*>(base+header->offset[CACHE_ADC_DEFINED]), (int)header->count[CACHE_ADC]-1);
+	m_delayLibrary.assign(reinterpret_cast<const long*>(base+header->offset[CACHE_DELAYS]),
+		reinterpret_cast<const unsigned char*>(base+header->offset[CACHE_DELAYS_DEFINED]), (int)header->count[CACHE_DELAYS]-1);
+	m_controlLibrary.assign(reinterpret_cast<const ControlEvent*>(base+header->offset[CACHE_CONTROLS]),
+		reinterpret_cast<const unsigned char*>(base+header->offset[CACHE_CONTROLS_DEFINED]), (int)header->count[CACHE_CONTROLS]-1);
+	for (unsigned long long i=0; i<numShapes; i++) {
+		CompressedShape *shape = m_shapeLibrary.insert(shapes[i].id);
+		shape->numUncompressedSamples = shapes[i].numSamples;
+		shape->image = samples+shapes[i].offset;
+		shape->numImageSamples = (size_t)shapes[i].count;
 	}
 
-	// Cumulative sum
-	for (int i=1; i<numSamples; i++) {
-		shape[i]=shape[i]+shape[i-1];
+	// Decompressed shapes are used if they match the length of their shape
+	const CacheShape *decoded = reinterpret_cast<const CacheShape*>(base+header->offset[CACHE_DECODED]);
+	const float *decodedSamples = reinterpret_cast<const float*>(base+header->offset[CACHE_DECODED_SAMPLES]);
+	for (unsigned long long i=0; i<header->count[CACHE_DECODED]; i++) {
+		const CacheShape &entry = decoded[i];
+		if (!m_shapeLibrary.count(entry.id) || entry.usage<0 || entry.usage>=NUM_SHAPE_USAGES
+			|| entry.count!=(unsigned long long)m_shapeLibrary[entry.id].numUncompressedSamples
+			|| entry.offset>header->count[CACHE_DECODED_SAMPLES] || entry.count>header->count[CACHE_DECODED_SAMPLES]-entry.offset)
+			continue;
+		size_t index = (size_t)entry.id*NUM_SHAPE_USAGES+entry.usage;
+		if (index>=m_imageShapes.size())
+			m_imageShapes.resize(index+1, NULL);
+		m_imageShapes[index] = decodedSamples+entry.offset;
 	}
 
+	if (m_profiling)
+		m_stats.bytesRead += image.size();
+	timer.stop();
+
+	// Store the new modification time, so that the next load does not hash the file again
+	if (touched && !SaveCache(imagePath, m_cacheDecodedShapes))
+		print_msg(WARNING_MSG, std::ostringstream().flush() << "*** WARNING: Failed to write cache image " << imagePath);
 	return true;
-};
+}
+
+// * ------------------------------------------------------------------ *
+// * Profiling                                                          *
+// * ------------------------------------------------------------------ *
 
 /***********************************************************/
-bool ExternalSequence::checkBlockReferences(EventIDs& events)
+LoadStats::LoadStats()
+	: loadTime(0), bytesRead(0), linesParsed(0), numShapes(0), numEvents(0), numBlocks(0),
+	  decodeCalls(0), shapesDecoded(0), samplesDecoded(0), cacheHits(0), cacheMisses(0)
 {
-	bool error;
-	error = (events.id[RF]>0    && m_rfLibrary.count(events.id[RF])==0);
-	error|= (events.id[GX]>0    && m_gradLibrary.count(events.id[GX])==0);
-	error|= (events.id[GY]>0    && m_gradLibrary.count(events.id[GY])==0);
-	error|= (events.id[GZ]>0    && m_gradLibrary.count(events.id[GZ])==0);
-	error|= (events.id[ADC]>0   && m_adcLibrary.count(events.id[ADC])==0);
-	error|= (events.id[DELAY]>0 && m_delayLibrary.count(events.id[DELAY])==0);
-	error|= (events.id[CTRL]>0  && m_controlLibrary.count(events.id[CTRL])==0);
-	
-	return (!error);
+	std::fill(phaseTime, phaseTime+NUM_LOAD_PHASES, 0.0);
 }
 
 /***********************************************************/
-void ExternalSequence::checkGradient(SeqBlock& block)
+const char* LoadStats::GetPhaseName(LoadPhase phase)
 {
-	for (unsigned int i=0; i<NUM_GRADS; i++)
-	{
-		std::vector<float> &waveform = block.gradWaveforms[i];
-		for (unsigned j=0; j<waveform.size(); j++)
-		{
-			if (waveform[j]>1.0)  waveform[j]= 1.0;
-			if (waveform[j]<-1.0) waveform[j]=-1.0;
-		}
-		// Ensure last point is zero // MZ: no, its wrong! trapezoid gradients have a non-zero at the end!
-		// if (waveform.size()>0) waveform[waveform.size()-1]=0.0;
-	}
+	static const char* names[NUM_LOAD_PHASES] = { "open", "index", "definitions", "events", "shapes",
+		"blocks", "merge", "check", "timing", "decode", "cache" };
+	return (phase>=0 && phase<NUM_LOAD_PHASES) ? names[phase] : "";
 }
 
-
 /***********************************************************/
-void ExternalSequence::checkRF(SeqBlock& block)
+void ExternalSequence::recordPhase(LoadPhase phase, const std::string &name, std::chrono::steady_clock::time_point start,
+	std::chrono::steady_clock::time_point stop)
 {
-	for (unsigned int i=0; i<block.rfAmplitude.size(); i++)
-	{
-		if (block.rfAmplitude[i]>1.0) block.rfAmplitude[i]=1.0;
-		if (block.rfAmplitude[i]<0.0) block.rfAmplitude[i]=0.0;
-		if (block.rfPhase[i]>TWO_PI-1.e-4) block.rfPhase[i]=(float)(TWO_PI-1.e-4);
-		if (block.rfPhase[i]<0) block.rfPhase[i]=0.0;
-	}
+	std::lock_guard<std::mutex> lock(m_statsMutex);
+	m_stats.phaseTime[phase] += std::chrono::duration<double>(stop-start).count();
+	if (!m_tracing)
+		return;
+
+	std::thread::id id = std::this_thread::get_id();
+	size_t thread = std::find(m_traceThreads.begin(), m_traceThreads.end(), id) - m_traceThreads.begin();
+	if (thread==m_traceThreads.size())
+		m_traceThreads.push_back(id);
+	TraceEvent event;
+	event.name     = name;
+	event.phase    = phase;
+	event.thread   = (int)thread;
+	event.start    = std::chrono::duration<double,std::micro>(start-m_profileEpoch).count();
+	event.duration = std::chrono::duration<double,std::micro>(stop-start).count();
+	m_trace.push_back(event);
 }
 
+/***********************************************************/
+void ExternalSequence::countLines(const char *begin, const char *end)
+{
+	if (end<=begin)
+		return;
+	long long lines = std::count(begin, end, '\n') + (end[-1]!='\n' ? 1 : 0);
+	std::lock_guard<std::mutex> lock(m_statsMutex);
+	m_stats.linesParsed += lines;
+}
 
 /***********************************************************/
-bool ExternalSequence::getline(std::istream& is, char *buffer, int MAX_SIZE)
+LoadStats ExternalSequence::GetStats() const
 {
-	//std::cout << "ExternalSequence::getline()" << std::endl;
+	std::lock_guard<std::mutex> lock(m_statsMutex);
+	LoadStats stats = m_stats;
+	stats.decodeCalls = m_decodeCalls.load();
+	stats.cacheHits   = m_profiling ? m_shapeCache.hits() : 0;
+	stats.cacheMisses = m_profiling ? m_shapeCache.misses() : 0;
+	return stats;
+}
 
-	int i=0;	// Current position in buffer
-	for(;;) {
-		char c = (char)is.get();
+/***********************************************************/
+bool ExternalSequence::WriteTrace(const std::string &path) const
+{
+	std::ofstream out(path.c_str());
+	if (!out.is_open()) {
+		print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Failed to write trace " << path);
+		return false;
+	}
 
-		switch (c) {
-			case '\n':
-				buffer[i]='\0';
-				//std::cout << "ExternalSequence::getline() EOL i:" << i << std::endl;
-				//std::cout << "buffer: " << buffer << std::endl;
-				return true;
-			case '\r':
-				if(is.peek() == '\n') {
-					is.get();       // Discard character
-				}
-				buffer[i]='\0';
-				//std::cout << "ExternalSequence::getline() CR i:" << i << std::endl;
-				//std::cout << "buffer: " << buffer << std::endl;
-				return true;
-			case EOF:
-				if(i==0)
-					is.seekg(-1);   // Create error on stream
-				buffer[i]='\0';     // In case last line has no line ending
-				//std::cout << "ExternalSequence::getline() EOF i:" << i << std::endl;
-				return (i!=0);
-			default:
-				buffer[i++] = c;
-				if (i>=MAX_SIZE)
-				{
-					return true;
-				}
+	std::lock_guard<std::mutex> lock(m_statsMutex);
+	out << "{\"traceEvents\": [\n";
+	for (size_t i=0; i<m_traceThreads.size(); i++)
+		out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i
+			<< ", \"args\": {\"name\": \"" << (i==0 ? "load" : "parser") << " thread " << i << "\"}},\n";
+	char buffer[64];
+	for (size_t i=0; i<m_trace.size(); i++) {
+		const TraceEvent &event = m_trace[i];
+		out << "{\"name\": \"";
+		for (size_t k=0; k<event.name.size(); k++) {
+			if (event.name[k]=='"' || event.name[k]=='\\')
+				out << '\\';
+			out << event.name[k];
 		}
+		out << "\", \"cat\": \"" << LoadStats::GetPhaseName(event.phase) << "\", \"ph\": \"X\"";
+		snprintf(buffer, sizeof(buffer), "%.3f", event.start);
+		out << ", \"ts\": " << buffer;
+		snprintf(buffer, sizeof(buffer), "%.3f", event.duration);
+		out << ", \"dur\": " << buffer << ", \"pid\": 1, \"tid\": " << event.thread << "}";
+		out << ((i+1<m_trace.size()) ? ",\n" : "\n");
 	}
+	out << "],\n\"displayTimeUnit\": \"ms\"}\n";
+	return out.good();
 }
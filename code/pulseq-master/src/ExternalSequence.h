@@ -6,6 +6,12 @@
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #ifndef _EXTERNAL_SEQUENCE_H_
 #define _EXTERNAL_SEQUENCE_H_
@@ -57,6 +63,27 @@ enum Event {
 const int NUM_EVENTS=LAST_UNUSED;
 const int NUM_GRADS=ADC-GX;
 
+/**
+ * @brief Purpose of a decompressed shape
+ *
+ * Decoded samples are limited to the valid range of their purpose, so the
+ * same shape ID may be decoded differently for each of them.
+ */
+enum ShapeUsage {
+	SHAPE_RF_MAGNITUDE,     /**< RF magnitude in [0,1] */
+	SHAPE_RF_PHASE,         /**< RF phase in rad, scaled from [0,1] to [0,2pi) */
+	SHAPE_GRADIENT,         /**< Arbitrary gradient in [-1,1] */
+	NUM_SHAPE_USAGES        // this entry should be last in the list
+};
+
+/**
+ * @brief Decompressed shape samples
+ *
+ * Samples are immutable once decoded and shared between all blocks using them.
+ */
+typedef std::shared_ptr<const std::vector<float> > DecodedShape;
+
+
 /**
  * @brief RF event data
  *
@@ -156,7 +183,7 @@ public:
 	/**
 	 * @brief Constructor
 	 */
-	SeqBlock() { gradWaveforms.resize(NUM_GRADS); }
+	SeqBlock() {}
 
 	/**
 	 * @brief Return `true` if block has RF event
@@ -228,7 +255,7 @@ public:
 	/**
 	 * @brief Directly get a pointer to the samples of the arbitrary gradient
 	 */
-	float* GetGradientPtr(int channel);
+	const float* GetGradientPtr(int channel);
 
 	/**
 	 * @brief Return the RF event
@@ -243,12 +270,12 @@ public:
 	/**
 	 * @brief Directly get a pointer to the samples of the RF amplitude shape
 	 */
-	float* GetRFAmplitudePtr();
+	const float* GetRFAmplitudePtr();
 
 	/**
-	 * @brief Directly get a pointer to the samples of the RF phase shape
+	 * @brief Directly get a pointer to the samples of the RF phase shape (rad)
 	 */
-	float* GetRFPhasePtr();
+	const float* GetRFPhasePtr();
 
 	/**
 	 * @brief Return the ADC event
@@ -266,7 +293,10 @@ public:
 	std::string GetTypeString();
 
 	/**
-	 * @brief Free the memory associated with decompressed shapes of this block
+	 * @brief Release the decompressed shapes of this block
+	 *
+	 * The samples are shared with other blocks and the shape cache of the
+	 * sequence, memory is freed once the last reference is gone.
 	 */
 	void   free();
 protected:
@@ -285,11 +315,11 @@ protected:
 	// Below is only valid once decompressed:
 
 	// RF
-	std::vector<float> rfAmplitude;  /**< @brief RF amplitude shape (uncompressed) */
-	std::vector<float> rfPhase;      /**< @brief RF phase shape (uncompressed) */
+	DecodedShape rfAmplitude;  /**< @brief RF amplitude shape (uncompressed) */
+	DecodedShape rfPhase;      /**< @brief RF phase shape (uncompressed) */
 
 	// Gradient waveforms
-	std::vector< std::vector<float> > gradWaveforms;    /**< @brief Arbitrary gradient shapes for each channel (uncompressed) */
+	DecodedShape gradWaveforms[NUM_GRADS];    /**< @brief Arbitrary gradient shapes for each channel (uncompressed) */
 
 };
 
@@ -334,21 +364,85 @@ inline std::string SeqBlock::GetTypeString() {
 	return type;
 }
 
-inline float*    SeqBlock::GetGradientPtr(int channel) { return (gradWaveforms[channel].size()>0) ? &gradWaveforms[channel][0] : NULL; }
-inline int       SeqBlock::GetGradientLength(int channel) {	return gradWaveforms[channel].size(); }
+inline const float* SeqBlock::GetGradientPtr(int channel) { return (GetGradientLength(channel)>0) ? &(*gradWaveforms[channel])[0] : NULL; }
+inline int       SeqBlock::GetGradientLength(int channel) { return gradWaveforms[channel] ? (int)gradWaveforms[channel]->size() : 0; }
 
-inline float*    SeqBlock::GetRFAmplitudePtr() { return &rfAmplitude[0]; }
-inline float*    SeqBlock::GetRFPhasePtr() { return &rfPhase[0]; }
-inline int       SeqBlock::GetRFLength() { return rfAmplitude.size(); }
+inline const float* SeqBlock::GetRFAmplitudePtr() { return (GetRFLength()>0) ? &(*rfAmplitude)[0] : NULL; }
+inline const float* SeqBlock::GetRFPhasePtr() { return (rfPhase && !rfPhase->empty()) ? &(*rfPhase)[0] : NULL; }
+inline int       SeqBlock::GetRFLength() { return rfAmplitude ? (int)rfAmplitude->size() : 0; }
 
 inline void      SeqBlock::free() {
-	// Force the memory to be freed
-	std::vector<float>().swap(rfAmplitude);
-	std::vector<float>().swap(rfPhase);
-	std::vector<std::vector<float> >().swap(gradWaveforms);
+	rfAmplitude.reset();
+	rfPhase.reset();
+	for (int i=0; i<NUM_GRADS; i++)
+		gradWaveforms[i].reset();
  }
 
 
+/**
+ * @brief Lightweight view of a sequence block
+ *
+ * Refers directly to the events stored in the libraries of the parent
+ * ExternalSequence and has no storage for decompressed shapes. Filling a
+ * view does not allocate memory, which makes it the preferred type for
+ * scanning through the blocks of a sequence. A view remains valid as long
+ * as the sequence is not reloaded.
+ *
+ * @see ExternalSequence::blocks()
+ */
+class BlockView
+{
+	friend class ExternalSequence;
+public:
+	bool    isRF() const;                          /**< @brief Return `true` if block has RF event */
+	bool    isTrapGradient(int channel) const;     /**< @brief Return `true` if block has trapezoid event on given channel */
+	bool    isArbitraryGradient(int channel) const;/**< @brief Return `true` if block has arbitrary event on given channel */
+	bool    isADC() const;                         /**< @brief Return `true` if block has ADC readout event */
+	bool    isDelay() const;                       /**< @brief Return `true` if block has delay */
+	bool    isTrigger() const;                     /**< @brief Return `true` if block has a trigger command */
+	bool    isRotation() const;                    /**< @brief Return `true` if block has a gradient rotation command */
+
+	int     GetIndex() const;                      /**< @brief Return index of this block */
+	int     GetEventIndex(Event type) const;       /**< @brief Return ID of the corresponding given event type */
+	long    GetDelay() const;                      /**< @brief Return delay of block */
+	long    GetDuration() const;                   /**< @brief Return duration of block */
+
+	const GradEvent&    GetGradEvent(int channel) const; /**< @brief Return the gradient event of the given channel */
+	const RFEvent&      GetRFEvent() const;              /**< @brief Return the RF event */
+	const ADCEvent&     GetADCEvent() const;             /**< @brief Return the ADC event */
+	const ControlEvent& GetControlEvent() const;         /**< @brief Return the control command event */
+
+protected:
+	int index;                      /**< @brief Index of this block */
+	const int *events;              /**< @brief Event IDs (pointer into the block table) */
+	long delay;                     /**< @brief delay of this block (in us) */
+	long duration;                  /**< @brief duration of this block (in us) */
+
+	const RFEvent *rf;              /**< @brief RF event (default event if none) */
+	const GradEvent *grad[NUM_GRADS]; /**< @brief gradient events (default event if none) */
+	const ADCEvent *adc;            /**< @brief ADC event (default event if none) */
+	const ControlEvent *control;    /**< @brief control event (default event if none) */
+};
+
+inline bool      BlockView::isRF() const { return (events[RF]>0); }
+inline bool      BlockView::isTrapGradient(int channel) const { return ((events[channel+GX]>0) & (grad[channel]->shape==0)); }
+inline bool      BlockView::isArbitraryGradient(int channel) const { return ((events[channel+GX]>0) & (grad[channel]->shape>0)); }
+inline bool      BlockView::isADC() const { return (events[ADC]>0); }
+inline bool      BlockView::isDelay() const { return (events[DELAY]>0); }
+inline bool      BlockView::isRotation() const { return (events[CTRL]>0 && control->type==ControlEvent::ROTATION); }
+inline bool      BlockView::isTrigger() const { return (events[CTRL]>0) && control->type==ControlEvent::TRIGGER; }
+
+inline int       BlockView::GetIndex() const { return index; }
+inline int       BlockView::GetEventIndex(Event type) const { return events[type]; }
+inline long      BlockView::GetDelay() const { return delay; }
+inline long      BlockView::GetDuration() const { return duration; }
+
+inline const GradEvent&    BlockView::GetGradEvent(int channel) const { return *grad[channel]; }
+inline const RFEvent&      BlockView::GetRFEvent() const { return *rf; }
+inline const ADCEvent&     BlockView::GetADCEvent() const { return *adc; }
+inline const ControlEvent& BlockView::GetControlEvent() const { return *control; }
+
+
 /**
  * @brief Compressed shape data
  *
@@ -358,260 +452,1701 @@ inline void      SeqBlock::free() {
  */
 struct CompressedShape
 {
-	int numUncompressedSamples;    /**< @brief Number of samples *after* decompression */
+	int numUncompressedSamples = 0;    /**< @brief Number of samples *after* decompression */
 	std::vector<float> samples;    /**< @brief Compressed samples */
+	const char *text = NULL;       /**< @brief Sample lines in the mapped file, NULL once parsed into `samples` */
+	const char *textEnd = NULL;    /**< @brief End of the sample lines in the mapped file */
+	const float *image = NULL;     /**< @brief Samples in the mapped cache image, NULL once copied into `samples` */
+	size_t numImageSamples = 0;    /**< @brief Number of samples in the cache image */
 };
 
 
 /**
- * @brief Data representing the entire MR sequence
- *
- * This class defines an abstract sequence consisting of arbitrary *blocks*
- * The basic structure of the sequence consists of three hierarchical levels:
- *     1. **Block** - list of integer indices pointing to simultaneous events for RF, gradients, ADC.
- *     2. **Event** - Basic event with one of the following types:
- *                   + *delay* - Simple delay
- *                   + *RF* - contains amplitude, frequency offset, and two indices pointing to basic shape for amp & phase
- *                   + *Trapezoid gradient* - contains amplitude, ramp up, flat top, ramp down times
- *                   + *Arbitrary gradient* - contains amplitude and index to basic shape
- *                   + *ADC readout* - contains number of samples, dwell time, delay, frequency & phase offsets
- *     3. **Shape** - List of compressed samples defining a basic shape (arbitrary RF or gradient)
+ * @brief Cache of decompressed shapes
  *
- * @author Kelvin Layton <kelvin.layton@uniklinik-freiburg.de>
- * @date May 2014
+ * Stores the decoded samples of each shape ID and usage so that shapes used by
+ * many blocks are decompressed only once. The total number of cached samples
+ * can be limited, in which case the least recently used shapes are dropped.
+ * Blocks holding a dropped shape keep their reference. All member functions
+ * are thread-safe.
  */
-
-class ExternalSequence
+class ShapeCache
 {
-  public:
-
+public:
 	/**
 	 * @brief Constructor
 	 */
-	ExternalSequence();
+	ShapeCache() : m_numSamples(0), m_maxSamples(0), m_tick(0), m_hits(0), m_misses(0) {}
 
 	/**
-	 * @brief Destructor
+	 * @brief Return the cached shape or an empty pointer if not cached
 	 */
-	~ExternalSequence();
+	DecodedShape find(int shapeId, ShapeUsage usage);
 
 	/**
-	 * @brief Load the sequence from file
-	 *
-	 * Reads the sequence files into the class members, the sequence is stored in
-	 * compressed format. The given path refer to either:
-	 *  1. A single file with all sequence definitions
-	 *  2. A directory containing a single file (e.g. external.seq)
-	 *  3. A directory containing three files (blocks.seq, events.seq, shapes.seq)
-	 *
-	 * @param  path location of file or directory
+	 * @brief Add a decoded shape to the cache (evicting old shapes if necessary)
 	 */
-	bool load(std::string path);
+	void insert(int shapeId, ShapeUsage usage, const DecodedShape &shape);
 
+	/**
+	 * @brief Remove all shapes and reset the statistics
+	 */
+	void clear();
 
 	/**
-	 * @brief Report the version of the loaded sequence
-	 *
-	 * Returns the version of the loaded PulSeq file combined to a single integer
-	 * The format is MMmmmmrrrr where M is the major version number, m is the minor
-	 * version number and r is the revision
-	 *
+	 * @brief Limit the total number of cached samples (0: unlimited)
 	 */
-	int GetVersion() { return version_combined; }
+	void setMaxSamples(size_t maxSamples);
 
+	size_t numSamples() const { return m_numSamples; }  /**< @brief Return the number of cached samples */
+	size_t hits() const { return m_hits; }              /**< @brief Return the number of successful lookups */
+	size_t misses() const { return m_misses; }          /**< @brief Return the number of failed lookups */
 
+private:
 	/**
-	 * @brief Display an output message
-	 *
-	 * Display a message only if the MSG_LEVEL is sufficiently high.
-	 * This function calls the low-level output function, which can be overridden
-	 * using SetPutMsgFunction().
-	 *
-	 * @param  level  type of message
-	 * @param  ss     string stream containing the message
+	 * @brief Drop least recently used shapes until the limit is met
 	 */
-	static void print_msg(MessageType level, std::ostream& ss);
+	void evict();
+
+	struct Entry
+	{
+		DecodedShape shape;                  /**< @brief Decoded samples (empty if not cached) */
+		unsigned long long lastUse;          /**< @brief Time stamp of last access */
+	};
+	std::vector<Entry> m_entries;            /**< @brief Entries indexed by shapeId*NUM_SHAPE_USAGES+usage */
+	std::atomic<size_t> m_numSamples;        /**< @brief Total number of cached samples */
+	size_t m_maxSamples;                     /**< @brief Limit of cached samples (0: unlimited) */
+	unsigned long long m_tick;               /**< @brief Access counter used as time stamp */
+	std::atomic<size_t> m_hits;              /**< @brief Number of successful lookups */
+	std::atomic<size_t> m_misses;            /**< @brief Number of failed lookups */
+	std::mutex m_mutex;                      /**< @brief Protects all members, the counters are atomic to be read without it */
+};
+
+
+/**
+ * @brief Default tolerance for matching the values of library entries
+ */
+const double LIBRARY_TOLERANCE = 1e-6;
+
+/**
+ * @brief Hash index of library entries with tolerance-aware keys
+ *
+ * Maps the content of library entries, given as arrays of numbers, to their
+ * IDs. Two keys match if they have the same length and all values agree
+ * within the tolerance of their position: |a-b| <= tol*max(1,|a|,|b|), i.e.
+ * relative for large and absolute for small values. A tolerance of zero
+ * requires identical values.
+ *
+ * Keys are hashed by the cells of a grid (logarithmic above 1) that is much
+ * coarser than the tolerance. A lookup probes the cell of the key and, for
+ * values close to a cell boundary, the neighbouring cell, so finding and
+ * adding an entry takes constant time on average. Only the first
+ * MAX_PROBE_VALUES values close to a boundary are probed both ways; beyond
+ * that an entry might be stored twice, which never affects correctness.
+ *
+ * The index works on plain arrays of doubles. The pulseqcpp Python module
+ * exposes it as pulseqcpp.EventIndex, together with SequenceWriter. The MATLAB
+ * toolbox has no MEX wrapper yet, mr.EventLibrary keeps its own lookup.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * EventIndex index;
+ * index.SetTolerance(1e-6);
+ * int id = index.find(data, length);
+ * if (id==0)
+ *     index.insert(data, length, id=++numEvents);
+ * ~~~~~~~~~~~~~
+ */
+class EventIndex
+{
+public:
+	static const int MAX_PROBE_VALUES = 8;   /**< @brief Values probed in two cells at most */
 
 	/**
-	 * @brief A pointer-type to the low-level print function
+	 * @brief Constructor (exact matching)
 	 */
-	typedef void (*PrintFunPtr)(const std::string &str);
+	EventIndex();
 
 	/**
-	 * @brief Set the output print function
+	 * @brief Set the tolerance of each position and clear the index
 	 *
-	 * Set the low-level output function to be used for printing or logging messages.
-	 * If no function is specified messages will be printed to cout
-	 *
-	 * @param  fun  Pointer to function
+	 * Value `i` of a key uses `tolerance[i]`, the last tolerance applies to all
+	 * further values. Zero tolerances require identical values.
 	 */
-	static void SetPrintFunction(PrintFunPtr fun);
+	void SetTolerance(const std::vector<double> &tolerance);
 
 	/**
-	 * @brief Lookup the custom definition
-	 *
-	 * Search the list of user-specified definitions through the [DEFINITIONS] section.
-	 * If the definition key is not found, an empty vector is returned.
-	 *
-	 * @param key  the definition name
-	 * @return a list of values (or empty vector)
+	 * @brief Set the same tolerance for all values and clear the index
 	 */
-	std::vector<double> GetDefinition(std::string key);
+	void SetTolerance(double tolerance);
 
 	/**
-	 * @brief Return number of sequence blocks
+	 * @brief Return the ID of an entry matching the key, 0 if there is none
 	 */
-	int  GetNumberOfBlocks(void);
+	int  find(const double *key, int length) const;
 
 	/**
-	 * @brief Construct a sequence block from the library events
+	 * @brief Add the key of the entry with the given ID (> 0)
 	 *
-	 * Events are loaded from the library. However, arbitrary waveforms are
-	 * not decoded until decodeBlock() is called.
-	 *
-	 * @see decodeBlock()
+	 * A previous key of the same ID is replaced, in place if it is not shorter.
 	 */
-	SeqBlock*  GetBlock(int blockIndex);
+	void insert(const double *key, int length, int id);
 
 	/**
-	 * @brief Decode a block by looking up indexed events
-	 *
-	 * This involves assigning the block's event objects from the libraries
-	 * as well as decompressing arbitrary RF and gradient shapes.
-	 *
-	 * @return true if successful
+	 * @brief Remove all entries (keeping the tolerances)
 	 */
-	bool decodeBlock(SeqBlock *block);
+	void clear();
 
-  private:
+	/**
+	 * @brief Return the number of entries
+	 */
+	size_t size() const;
 
-	static const int MAX_LINE_SIZE;	/**< @brief Maximum length of line */
-	static const char COMMENT_CHAR;	/**< @brief Character defining the start of a comment line */
+private:
+	/**
+	 * @brief Hash of the cells of a key
+	 *
+	 * The positions in `flip` (with the corresponding bit set in `mask`) use the
+	 * neighbouring cell in direction `dir`.
+	 */
+	size_t hashCells(const long long *cells, int length, const int *flip, const int *dir, int numFlip, unsigned mask) const;
 
-	// *** Private helper functions ***
+	/**
+	 * @brief Return the grid cell of a value and the direction of a nearby neighbour cell (0: none)
+	 */
+	long long cell(double value, double tolerance, int &neighbour) const;
 
 	/**
-	 * @brief Read a line from the input stream *independent of line ending*.
-	 *
-	 * Unlike istream::getline(), this function safely handles three
-	 * different line endings:
-	 *  - Unix/OSX (\\n)
-	 *  - Windows (\\r\\n)
-	 *  - Old Mac (\\r)
-	 *
-	 * @param stream the input file stream to read from
-	 * @param buffer the output line buffer (null terminated)
-	 * @param MAX_SIZE maximum size of the buffer
+	 * @brief Return `true` if the keys match within the tolerances
 	 */
-	// MZ: VC2008 / VD13 do not seem to properly handle the errors streams
-	//static std::istream& 
-	static bool getline(std::istream& stream, char *buffer, const int MAX_SIZE);
+	bool matches(const double *a, const double *b, int length) const;
+
+	double tolerance(int position) const;    /**< @brief Return the tolerance of a position */
+
+	struct Entry
+	{
+		size_t offset;      /**< @brief Position of the key in m_keys */
+		int length;         /**< @brief Length of the key (-1: undefined ID) */
+		size_t hash;        /**< @brief Hash of the cells of the key */
+	};
+	std::vector<double> m_tolerance;                /**< @brief Tolerance of each position */
+	std::vector<double> m_keys;                     /**< @brief Keys of all entries */
+	std::vector<Entry> m_entries;                   /**< @brief Entries indexed by ID */
+	std::unordered_multimap<size_t,int> m_cells;    /**< @brief Hash of the cells of each key to its ID */
+};
+
+inline size_t EventIndex::size() const { return m_cells.size(); }
+inline double EventIndex::tolerance(int position) const {
+	return m_tolerance.empty() ? 0.0 : m_tolerance[MIN((size_t)position, m_tolerance.size()-1)];
+}
+
+
+/**
+ * @brief Content of a library entry as a key for the EventIndex
+ *
+ * Specialized for every type of library entry: `tolerance()` returns the
+ * tolerance of each value and `build()` fills the values of an entry.
+ * Floating point quantities (amplitudes, frequencies, phases) match within
+ * LIBRARY_TOLERANCE, times, counts and shape IDs must be identical.
+ */
+template<typename T> struct LibraryKey;
+
+
+/**
+ * @brief Library of events or shapes indexed by ID
+ *
+ * Pulseq IDs are small positive integers that are usually assigned consecutively.
+ * Entries are therefore stored densely in a vector at the position given by their
+ * ID, with a separate array flagging which IDs are defined. A lookup is a single
+ * index operation and never modifies the library: an undefined ID yields the
+ * default-constructed entry kept at position 0 (which is not a valid ID).
+ *
+ * Entries can also be looked up by content, which deduplicates events while a
+ * sequence is assembled. The content index (see EventIndex and LibraryKey) is
+ * built on the first lookup and kept up to date by findOrInsert(); inserting
+ * by ID or modifying an entry through find() makes the next lookup rebuild it.
+ */
+template<typename T>
+class EventLibrary
+{
+public:
+	static const int MAX_ID = 1<<24;    /**< @brief Largest accepted ID */
 
 	/**
-	 * @brief Search the file stream for section headers e.g. [RF], [GRAD] etc
-	 *
-	 * Searches forward in the stream for sections enclosed in square brackets
-	 * and writes to index
+	 * @brief Constructor
 	 */
-	void buildFileIndex(std::ifstream &stream);
+	EventLibrary() { clear(); }
 
 	/**
-	 * @brief Skip the comments and empty lines in the given input stream.
-	 *
-	 * @param stream the input file stream to process
-	 * @param buffer return output buffer of next non-comment line
+	 * @brief Remove all entries
 	 */
-	void skipComments(std::ifstream &stream, char* buffer);
+	void clear();
 
 	/**
-	 * @brief Decompress a run-length compressed shape
-	 *
-	 * @param encoded Compressed shape structure
-	 * @param shape array of floating-point values (must be preallocated!)
+	 * @brief Define the entry with the given ID (reset to default values)
+	 * @return pointer to the entry or NULL if the ID is not in [1,MAX_ID]
 	 */
-	bool decompressShape(CompressedShape& encoded, float *shape);
+	T*   insert(int id);
 
+	/**
+	 * @brief Define the entry with the given ID
+	 * @return false if the ID is not in [1,MAX_ID]
+	 */
+	bool insert(int id, const T& entry);
 
 	/**
-	 * @brief Check the IDs contains references to valid events in the library
-	 *
-	 * @param  events The event IDs to check
-	 * @return true if event references are ok
-	 * @see checkRF(), checkGradient()
+	 * @brief Return 1 if an entry with the given ID is defined, 0 otherwise
 	 */
-	bool checkBlockReferences(EventIDs& events);
+	int  count(int id) const;
 
 	/**
-	 * @brief Check the shapes defining the arbitrary gradient events (if present)
-	 *
-	 * Check the *decompressed* amplitude of the given block is
-	 * between [0 1].
-	 * @param  block The sequence block to check
-	 * @see checkRF()
+	 * @brief Return the entry with the given ID (default entry if undefined)
 	 */
-	void checkGradient(SeqBlock& block);
+	const T& operator[](int id) const;
 
 	/**
-	 * @brief Check the shapes defining the RF event (if present)
-	 *
-	 * Check the *decompressed* RF amplitude of the given block is
-	 * between [0 1] and the phase between [0 2pi].
-	 * @param  block The sequence block to check
-	 * @see checkGradient()
+	 * @brief Return a pointer to the entry with the given ID or NULL if undefined
 	 */
-	void checkRF(SeqBlock& block);
+	T*   find(int id);
 
-	// *** Static helper function ***
+	/**
+	 * @brief Return the number of defined entries
+	 */
+	size_t size() const;
 
 	/**
-	 * @brief Print string to standard output (with newline character)
+	 * @brief Return `true` if no entries are defined
 	 */
-	static void defaultPrint(const std::string &str);
+	bool   empty() const;
 
-	// *** Static members ***
+	/**
+	 * @brief Return the upper bound of defined IDs, i.e. loop over [1,maxId()]
+	 */
+	int    maxId() const;
 
-	static PrintFunPtr print_fun;              /**< @brief Pointer to output print function */
+	/**
+	 * @brief Return the entries indexed by ID (maxId()+1 entries, position 0 holds the default entry)
+	 */
+	const T* data() const;
 
-	// *** Members ***
+	/**
+	 * @brief Return the flags of defined IDs (maxId()+1 values, nonzero if defined)
+	 */
+	const unsigned char* defined() const;
 
-	int version_major;
-	int version_minor;
-	int version_revision;
-	int version_combined;
+	/**
+	 * @brief Replace all entries by the given arrays in the layout of data() and defined()
+	 * @return false if `maxId` is not in [0,MAX_ID]
+	 */
+	bool   assign(const T *entries, const unsigned char *defined, int maxId);
 
-	std::map<std::string,int> m_fileIndex;     /**< @brief File location of sections, [RF], [ADC] etc */
+	/**
+	 * @brief Return the ID of an entry matching the given one, 0 if there is none
+	 */
+	int    lookup(const T& entry);
 
-	// Low level sequence blocks
-	std::vector<EventIDs> m_blocks;            /**< @brief List of sequence blocks */
+	/**
+	 * @brief Return the ID of an entry matching the given one, inserting it with the next free ID if there is none
+	 * @return the ID or 0 if the library is full
+	 */
+	int    findOrInsert(const T& entry);
 
-	// Global user-specified definitions
-	std::map<std::string, std::vector<double> >m_definitions;  /**< @brief Custom definitions provided through [DEFINITIONS] section) */
+private:
+	/**
+	 * @brief Build the content index of all defined entries
+	 */
+	void   buildIndex();
+
+	std::vector<T> m_entries;              /**< @brief Entries at the position of their ID */
+	std::vector<unsigned char> m_defined;  /**< @brief Flags for defined IDs */
+	size_t m_size;                         /**< @brief Number of defined entries */
+	EventIndex m_index;                    /**< @brief Index of the entries by content */
+	bool m_indexValid;                     /**< @brief The index reflects all entries */
+	std::vector<double> m_key;             /**< @brief Key of the entry being looked up */
+};
 
-	// List of events (referenced by blocks)
-	std::map<int,RFEvent>      m_rfLibrary;       /**< @brief Library of RF events */
-	std::map<int,GradEvent>    m_gradLibrary;     /**< @brief Library of gradient events */
-	std::map<int,ADCEvent>     m_adcLibrary;      /**< @brief Library of ADC readouts */
-	std::map<int,ControlEvent> m_controlLibrary;  /**< @brief Library of control commands */
-	std::map<int,long>         m_delayLibrary;    /**< @brief Library of delays */
+template<typename T>
+inline void EventLibrary<T>::clear() {
+	m_entries.assign(1,T());
+	m_defined.assign(1,0);
+	m_size = 0;
+	m_indexValid = false;
+}
+template<typename T>
+inline T* EventLibrary<T>::insert(int id) {
+	if (id<=0 || id>MAX_ID)
+		return NULL;
+	if ((size_t)id>=m_entries.size()) {
+		m_entries.resize(id+1);
+		m_defined.resize(id+1,0);
+	}
+	if (!m_defined[id]) {
+		m_defined[id] = 1;
+		m_size++;
+	}
+	m_indexValid = false;
+	m_entries[id] = T();
+	return &m_entries[id];
+}
+template<typename T>
+inline bool EventLibrary<T>::insert(int id, const T& entry) {
+	T* slot = insert(id);
+	if (slot) *slot = entry;
+	return (slot!=NULL);
+}
+template<typename T>
+inline int EventLibrary<T>::count(int id) const {
+	return (id>0 && (size_t)id<m_defined.size()) ? m_defined[id] : 0;
+}
+template<typename T>
+inline const T& EventLibrary<T>::operator[](int id) const {
+	return m_entries[count(id) ? id : 0];
+}
+template<typename T>
+inline T* EventLibrary<T>::find(int id) {
+	if (!count(id))
+		return NULL;
+	m_indexValid = false;	// the entry may be modified
+	return &m_entries[id];
+}
+template<typename T> inline size_t EventLibrary<T>::size() const { return m_size; }
+template<typename T> inline bool   EventLibrary<T>::empty() const { return m_size==0; }
+template<typename T> inline int    EventLibrary<T>::maxId() const { return (int)m_entries.size()-1; }
+template<typename T> inline const T* EventLibrary<T>::data() const { return &m_entries[0]; }
+template<typename T> inline const unsigned char* EventLibrary<T>::defined() const { return &m_defined[0]; }
+template<typename T>
+inline bool EventLibrary<T>::assign(const T *entries, const unsigned char *defined, int maxId) {
+	if (maxId<0 || maxId>MAX_ID)
+		return false;
+	m_entries.assign(entries, entries+maxId+1);
+	m_defined.assign(defined, defined+maxId+1);
+	m_entries[0] = T();
+	m_defined[0] = 0;
+	m_size = 0;
+	for (int id=1; id<=maxId; id++)
+		m_size += (m_defined[id]!=0);
+	m_indexValid = false;
+	return true;
+}
+template<typename T>
+inline void EventLibrary<T>::buildIndex() {
+	std::vector<double> tolerance;
+	LibraryKey<T>::tolerance(tolerance);
+	m_index.SetTolerance(tolerance);
+	for (int id=1; id<=maxId(); id++) {
+		if (!m_defined[id]) continue;
+		LibraryKey<T>::build(m_entries[id], m_key);
+		m_index.insert(m_key.empty() ? NULL : &m_key[0], (int)m_key.size(), id);
+	}
+	m_indexValid = true;
+}
+template<typename T>
+inline int EventLibrary<T>::lookup(const T& entry) {
+	if (!m_indexValid)
+		buildIndex();
+	LibraryKey<T>::build(entry, m_key);
+	return m_index.find(m_key.empty() ? NULL : &m_key[0], (int)m_key.size());
+}
+template<typename T>
+inline int EventLibrary<T>::findOrInsert(const T& entry) {
+	int id = lookup(entry);
+	if (id>0)
+		return id;
+	id = maxId()+1;
+	if (!insert(id,entry))
+		return 0;
+	m_index.insert(m_key.empty() ? NULL : &m_key[0], (int)m_key.size(), id);
+	m_indexValid = true;
+	return id;
+}
 
-	// List of basic shapes (referenced by events)
-	std::map<int,CompressedShape> m_shapeLibrary;    /**< @brief Library of compressed shapes */
+template<> struct LibraryKey<RFEvent> {
+	static void tolerance(std::vector<double> &tol) {
+		const double t[] = { LIBRARY_TOLERANCE, 0, 0, LIBRARY_TOLERANCE, LIBRARY_TOLERANCE, 0 };
+		tol.assign(t, t+6);
+	}
+	static void build(const RFEvent &rf, std::vector<double> &key) {
+		const double k[] = { rf.amplitude, (double)rf.magShape, (double)rf.phaseShape, rf.freqOffset, rf.phaseOffset, (double)rf.delay };
+		key.assign(k, k+6);
+	}
+};
+template<> struct LibraryKey<GradEvent> {
+	static void tolerance(std::vector<double> &tol) {
+		tol.assign(6, 0.0);
+		tol[0] = LIBRARY_TOLERANCE;
+	}
+	static void build(const GradEvent &grad, std::vector<double> &key) {
+		const double k[] = { grad.amplitude, (double)grad.delay, (double)grad.rampUpTime, (double)grad.flatTime,
+			(double)grad.rampDownTime, (double)grad.shape };
+		key.assign(k, k+6);
+	}
+};
+template<> struct LibraryKey<ADCEvent> {
+	static void tolerance(std::vector<double> &tol) {
+		const double t[] = { 0, 0, 0, LIBRARY_TOLERANCE, LIBRARY_TOLERANCE };
+		tol.assign(t, t+5);
+	}
+	static void build(const ADCEvent &adc, std::vector<double> &key) {
+		const double k[] = { (double)adc.numSamples, (double)adc.dwellTime, (double)adc.delay, adc.freqOffset, adc.phaseOffset };
+		key.assign(k, k+5);
+	}
+};
+template<> struct LibraryKey<long> {
+	static void tolerance(std::vector<double> &tol) { tol.assign(1, 0.0); }
+	static void build(long delay, std::vector<double> &key) { key.assign(1, (double)delay); }
+};
+template<> struct LibraryKey<ControlEvent> {
+	static void tolerance(std::vector<double> &tol) {
+		tol.assign(4, 0.0);
+		tol[3] = LIBRARY_TOLERANCE;	// rotation matrix
+	}
+	static void build(const ControlEvent &control, std::vector<double> &key) {
+		const bool trigger = (control.type==ControlEvent::TRIGGER);
+		key.assign(12, 0.0);
+		key[0] = control.type;
+		if (trigger) {
+			key[1] = control.triggerType;
+			key[2] = (double)control.duration;
+		}
+		for (int i=0; i<9 && !trigger; i++)
+			key[3+i] = control.rotMatrix[i];
+	}
+};
+template<> struct LibraryKey<CompressedShape> {
+	static void tolerance(std::vector<double> &tol) { tol.assign(1, 0.0); }
+	static void build(const CompressedShape &shape, std::vector<double> &key) {
+		key.resize(shape.samples.size()+1);
+		key[0] = shape.numUncompressedSamples;
+		for (size_t i=0; i<shape.samples.size(); i++)
+			key[i+1] = shape.samples[i];
+	}
 };
 
-// * ------------------------------------------------------------------ *
-// * Inline functions                                                   *
-// * ------------------------------------------------------------------ *
 
-inline int ExternalSequence::GetNumberOfBlocks(void){return m_blocks.size();}
-inline std::vector<double>	ExternalSequence::GetDefinition(std::string key){
-	if (m_definitions.count(key)>0)
-		return m_definitions[key];
-	else
-		return std::vector<double>();
-}
+/**
+ * @brief Read-only view of a file in memory
+ *
+ * The file is memory-mapped on POSIX platforms. Elsewhere (and if mapping
+ * fails) the content is read into a private buffer, so callers always get a
+ * contiguous block of characters.
+ */
+class MappedFile
+{
+public:
+	/**
+	 * @brief Constructor
+	 */
+	MappedFile();
 
-inline void ExternalSequence::defaultPrint(const std::string &str) { std::cout << str << std::endl; }
-inline void ExternalSequence::SetPrintFunction(PrintFunPtr fun) { print_fun=fun; }
+	/**
+	 * @brief Destructor (unmaps the file)
+	 */
+	~MappedFile();
+
+	/**
+	 * @brief Map the given file, closing any previously opened file
+	 * @return true if successful
+	 */
+	bool open(const std::string &path);
+
+	/**
+	 * @brief Unmap the file and release the memory
+	 */
+	void close();
+
+	/**
+	 * @brief Return pointer to the first character of the file
+	 */
+	const char* begin() const;
+
+	/**
+	 * @brief Return pointer past the last character of the file
+	 */
+	const char* end() const;
+
+	/**
+	 * @brief Return the size of the file in bytes
+	 */
+	size_t  size() const;
+
+	/**
+	 * @brief Return `true` if a file is open
+	 */
+	bool    isOpen() const;
+
+private:
+	MappedFile(const MappedFile&);              // non-copyable
+	MappedFile& operator=(const MappedFile&);
+
+	const char *m_data;           /**< @brief Start of file content */
+	size_t m_size;                /**< @brief Size of file content */
+	bool m_isMapped;              /**< @brief true if m_data points to a memory mapping */
+	std::vector<char> m_buffer;   /**< @brief Fallback storage if the file is not mapped */
+};
+
+inline const char* MappedFile::begin() const { return m_data; }
+inline const char* MappedFile::end() const { return m_data+m_size; }
+inline size_t      MappedFile::size() const { return m_size; }
+inline bool        MappedFile::isOpen() const { return m_data!=NULL; }
+
+
+/**
+ * @brief Array held in memory or read in place from a cache image
+ *
+ * Provides the read access of a std::vector. The elements either belong to
+ * the array or refer to a mapped cache image (see ExternalSequence::SaveCache()),
+ * in which case vector() copies them into memory before they can be modified.
+ */
+template<typename T>
+class ImageArray
+{
+public:
+	/**
+	 * @brief Constructor, creates an empty array
+	 */
+	ImageArray() : m_image(NULL), m_imageSize(0) {}
+
+	size_t   size() const;                    /**< @brief Return the number of elements */
+	bool     empty() const;                   /**< @brief Return `true` if there are no elements */
+	const T* data() const;                    /**< @brief Return pointer to the first element */
+	const T* begin() const;                   /**< @brief Return pointer to the first element */
+	const T* end() const;                     /**< @brief Return pointer past the last element */
+	const T& back() const;                    /**< @brief Return the last element */
+	const T& operator[](size_t i) const;      /**< @brief Return the element at the given position */
+
+	/**
+	 * @brief Return the elements as modifiable vector, copying them from the image if necessary
+	 */
+	std::vector<T>& vector();
+
+	/**
+	 * @brief Refer to elements in an image, which must remain mapped while in use
+	 */
+	void     assign(const T *image, size_t size);
+
+	/**
+	 * @brief Remove all elements
+	 */
+	void     clear();
+
+	/**
+	 * @brief Return `true` if the elements are read from an image
+	 */
+	bool     isImage() const;
+
+private:
+	std::vector<T> m_vector;      /**< @brief Elements held in memory */
+	const T *m_image;             /**< @brief Elements in the image, NULL if held in memory */
+	size_t m_imageSize;           /**< @brief Number of elements in the image */
+};
+
+template<typename T>
+inline size_t ImageArray<T>::size() const { return m_image ? m_imageSize : m_vector.size(); }
+template<typename T>
+inline bool ImageArray<T>::empty() const { return size()==0; }
+template<typename T>
+inline const T* ImageArray<T>::data() const { return m_image ? m_image : m_vector.data(); }
+template<typename T>
+inline const T* ImageArray<T>::begin() const { return data(); }
+template<typename T>
+inline const T* ImageArray<T>::end() const { return data()+size(); }
+template<typename T>
+inline const T& ImageArray<T>::back() const { return data()[size()-1]; }
+template<typename T>
+inline const T& ImageArray<T>::operator[](size_t i) const { return data()[i]; }
+template<typename T>
+inline std::vector<T>& ImageArray<T>::vector() {
+	if (m_image) {
+		m_vector.assign(m_image, m_image+m_imageSize);
+		m_image = NULL;
+		m_imageSize = 0;
+	}
+	return m_vector;
+}
+template<typename T>
+inline void ImageArray<T>::assign(const T *image, size_t size) {
+	std::vector<T>().swap(m_vector);
+	m_image = image;
+	m_imageSize = size;
+}
+template<typename T>
+inline void ImageArray<T>::clear() {
+	m_vector.clear();
+	m_image = NULL;
+	m_imageSize = 0;
+}
+template<typename T>
+inline bool ImageArray<T>::isImage() const { return m_image!=NULL; }
+
+
+/**
+ * @brief Phases of loading and decoding a sequence, see LoadStats
+ */
+enum LoadPhase {
+	PHASE_OPEN,             /**< Opening and mapping the files */
+	PHASE_INDEX,            /**< Locating the sections (parallel parser) */
+	PHASE_DEFINITIONS,      /**< [VERSION] and [DEFINITIONS] sections */
+	PHASE_EVENTS,           /**< Event sections: [RF], [GRADIENTS], [TRAP], [ADC], [DELAYS], [TRIGGERS], [ROTATIONS] */
+	PHASE_SHAPES,           /**< [SHAPES] section */
+	PHASE_BLOCKS,           /**< [BLOCKS] section */
+	PHASE_MERGE,            /**< Merging the results of the parser threads */
+	PHASE_CHECK,            /**< Checking the shape and block references */
+	PHASE_TIMING,           /**< Tabulating the block start times */
+	PHASE_DECODE,           /**< Decompressing shapes on first use */
+	PHASE_CACHE,            /**< Reading or writing the cache image */
+	NUM_LOAD_PHASES         // this entry should be last in the list
+};
+
+/**
+ * @brief Profile of loading and decoding a sequence
+ *
+ * Collected while profiling is enabled (see ExternalSequence::SetProfiling()).
+ * The statistics are reset by every call of load(), decoding statistics then
+ * accumulate until the next load. Phases run by several parser threads report
+ * the sum of their times.
+ */
+struct LoadStats
+{
+	double phaseTime[NUM_LOAD_PHASES];   /**< @brief Time spent in each phase (s) */
+	double loadTime;                     /**< @brief Wall time of the last load() (s) */
+	long long bytesRead;                 /**< @brief Size of the files read */
+	long long linesParsed;               /**< @brief Lines of the text sections read */
+	long long numShapes;                 /**< @brief Shapes in the library */
+	long long numEvents;                 /**< @brief Events in all event libraries */
+	long long numBlocks;                 /**< @brief Blocks loaded */
+	long long decodeCalls;               /**< @brief Calls of decodeBlock() */
+	long long shapesDecoded;             /**< @brief Shapes decompressed */
+	long long samplesDecoded;            /**< @brief Samples of the decompressed shapes */
+	long long cacheHits;                 /**< @brief Shape lookups served by the shape cache */
+	long long cacheMisses;               /**< @brief Shape lookups not found in the shape cache */
+
+	/**
+	 * @brief Constructor, all values are zero
+	 */
+	LoadStats();
+
+	/**
+	 * @brief Return the name of a phase
+	 */
+	static const char* GetPhaseName(LoadPhase phase);
+};
+
+
+class ExternalSequence;
+class PhaseTimer;
+
+/**
+ * @brief Forward iterator over the blocks of a sequence
+ *
+ * Holds a single BlockView that is refilled on every increment.
+ */
+class BlockIterator
+{
+public:
+	BlockIterator(const ExternalSequence *seq, int index);
+
+	const BlockView& operator*() const;
+	const BlockView* operator->() const;
+	BlockIterator&   operator++();
+	bool operator==(const BlockIterator &other) const;
+	bool operator!=(const BlockIterator &other) const;
+
+private:
+	const ExternalSequence *m_seq;   /**< @brief Parent sequence */
+	int m_index;                     /**< @brief Current block index */
+	BlockView m_view;                /**< @brief View of the current block */
+};
+
+/**
+ * @brief Range of sequence blocks [first,last)
+ *
+ * @see ExternalSequence::blocks()
+ */
+class BlockRange
+{
+public:
+	BlockRange(const ExternalSequence *seq, int first, int last) : m_seq(seq), m_first(first), m_last(last) {}
+
+	BlockIterator begin() const { return BlockIterator(m_seq,m_first); }
+	BlockIterator end() const { return BlockIterator(m_seq,m_last); }
+	int size() const { return m_last-m_first; }
+
+private:
+	const ExternalSequence *m_seq;   /**< @brief Parent sequence */
+	int m_first;                     /**< @brief Index of first block */
+	int m_last;                      /**< @brief Index past the last block */
+};
+
+/**
+ * @brief Sequential reader of the sequence blocks
+ *
+ * Pull-style reader that keeps a fixed-size window of blocks in memory. For
+ * sequences loaded in streaming mode the window is filled from the [BLOCKS]
+ * section of the file, so memory use does not depend on the number of blocks.
+ * For sequences loaded completely the blocks are taken from memory.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * BlockStream stream(seq);
+ * BlockView block;
+ * while (stream.next(block))
+ *     if (block.isADC()) numAdc++;
+ * ~~~~~~~~~~~~~
+ *
+ * @see ExternalSequence::SetStreamingMode()
+ */
+class BlockStream
+{
+public:
+	static const int DEFAULT_WINDOW_SIZE = 4096;  /**< @brief Default number of blocks held in memory */
+
+	/**
+	 * @brief Start reading the blocks of the given sequence
+	 *
+	 * The sequence must remain loaded while the stream is in use.
+	 */
+	BlockStream(const ExternalSequence &seq, int windowSize=DEFAULT_WINDOW_SIZE);
+
+	/**
+	 * @brief Read the next block
+	 *
+	 * The view remains valid until the next call.
+	 * @return false after the last block or on error (see failed())
+	 */
+	bool next(BlockView &view);
+
+	bool failed() const { return m_failed; }   /**< @brief Return `true` if reading stopped on an error */
+	int  count() const { return m_index; }     /**< @brief Return the number of blocks read so far */
+
+private:
+	/**
+	 * @brief Replace the window with the following blocks
+	 * @return false if no more blocks are available
+	 */
+	bool fill();
+
+	/**
+	 * @brief Parse complete lines from the read buffer into the window
+	 */
+	void parseBuffer();
+
+	const ExternalSequence *m_seq;   /**< @brief Parent sequence */
+	std::ifstream m_file;            /**< @brief File containing the [BLOCKS] section (streaming mode) */
+	std::vector<char> m_buffer;      /**< @brief Data read from the file */
+	size_t m_bufferPos;              /**< @brief Start of the unparsed data in the buffer */
+	size_t m_bufferEnd;              /**< @brief End of the valid data in the buffer */
+	std::vector<EventIDs> m_window;  /**< @brief Blocks held in memory */
+	size_t m_windowSize;             /**< @brief Maximum number of blocks in the window */
+	size_t m_windowPos;              /**< @brief Position of the next block in the window */
+	int m_index;                     /**< @brief Index of the next block */
+	int m_line;                      /**< @brief Line number of the next line to parse */
+	bool m_endOfSection;             /**< @brief No more lines to parse */
+	bool m_failed;                   /**< @brief Reading stopped on an error */
+};
+
+
+/**
+ * @brief Data representing the entire MR sequence
+ *
+ * This class defines an abstract sequence consisting of arbitrary *blocks*
+ * The basic structure of the sequence consists of three hierarchical levels:
+ *     1. **Block** - list of integer indices pointing to simultaneous events for RF, gradients, ADC.
+ *     2. **Event** - Basic event with one of the following types:
+ *                   + *delay* - Simple delay
+ *                   + *RF* - contains amplitude, frequency offset, and two indices pointing to basic shape for amp & phase
+ *                   + *Trapezoid gradient* - contains amplitude, ramp up, flat top, ramp down times
+ *                   + *Arbitrary gradient* - contains amplitude and index to basic shape
+ *                   + *ADC readout* - contains number of samples, dwell time, delay, frequency & phase offsets
+ *     3. **Shape** - List of compressed samples defining a basic shape (arbitrary RF or gradient)
+ *
+ * @author Kelvin Layton <kelvin.layton@uniklinik-freiburg.de>
+ * @date May 2014
+ */
+
+class ExternalSequence
+{
+	friend class BlockStream;
+	friend class PhaseTimer;
+	friend class SequenceWriter;
+  public:
+
+	/**
+	 * @brief Constructor
+	 */
+	ExternalSequence();
+
+	/**
+	 * @brief Destructor
+	 */
+	~ExternalSequence();
+
+	/**
+	 * @brief Load the sequence from file
+	 *
+	 * Reads the sequence files into the class members, the sequence is stored in
+	 * compressed format. The given path refer to either:
+	 *  1. A single file with all sequence definitions
+	 *  2. A directory containing a single file (e.g. external.seq)
+	 *  3. A directory containing three files (blocks.seq, events.seq, shapes.seq)
+	 *
+	 * Each file is memory-mapped and decoded in a single pass, see parseFile().
+	 * A single file may also be in the binary format, this is detected from the
+	 * magic number at the beginning of the file. With SetCacheMode() enabled, a
+	 * matching cache image of the file is mapped instead of parsing the file.
+	 *
+	 * @param  path location of file or directory
+	 */
+	bool load(std::string path);
+
+
+	/**
+	 * @brief Write the sequence to a binary file
+	 *
+	 * The layout follows the binary format of the specification: a magic header,
+	 * the version and one section per library. Fields that later revisions added
+	 * to the text format (RF delay in 1.2.0, gradient delays in 1.1.1) are
+	 * included depending on the version of the sequence, exactly as in text files.
+	 * Trigger and rotation events have no binary representation.
+	 *
+	 * @param  path output file name
+	 * @return true if successful
+	 * @see load()
+	 */
+	bool saveBinary(std::string path);
+
+
+	/**
+	 * @brief Write the sequence to a text file
+	 *
+	 * Sections are written in the order of the MATLAB toolbox and keep the event
+	 * and shape IDs of the loaded sequence. Numbers are written with the shortest
+	 * representation that reads back exactly, so loading the file reproduces the
+	 * libraries and blocks. Blocks of a sequence loaded in streaming mode are
+	 * copied from the source file through a BlockStream.
+	 *
+	 * @param  path output file name
+	 * @return true if successful
+	 * @see saveBinary(), SequenceWriter
+	 */
+	bool save(std::string path);
+
+
+	/**
+	 * @brief Enable or disable streaming of the [BLOCKS] section
+	 *
+	 * In streaming mode load() reads the definitions, event libraries and shapes
+	 * but only locates the [BLOCKS] section. Blocks are then read incrementally
+	 * with a BlockStream, so memory use does not depend on the number of blocks.
+	 * GetNumberOfBlocks() returns 0 and GetBlock() is unavailable for a streamed
+	 * sequence. Binary files are always loaded completely.
+	 *
+	 * @see IsStreaming()
+	 */
+	void SetStreamingMode(bool streaming);
+
+	/**
+	 * @brief Return `true` if the blocks of the loaded sequence are streamed from file
+	 */
+	bool IsStreaming() const;
+
+	/**
+	 * @brief Set the number of threads used to parse text sequence files
+	 *
+	 * With more than one thread, independent sections are parsed concurrently
+	 * and large [BLOCKS] and [SHAPES] sections are split into chunks.
+	 *
+	 * @param numThreads 1: serial parsing (default), 0: one thread per CPU core
+	 */
+	void SetLoadThreads(int numThreads);
+
+	/**
+	 * @brief Enable or disable parsing of shape samples on first use
+	 *
+	 * By default load() of a single text file only locates the samples of each
+	 * shape, which are parsed from the mapped file when the shape is first
+	 * decoded. With lazy loading disabled all samples are parsed in load().
+	 */
+	void SetLazyShapes(bool lazy);
+
+	/**
+	 * @brief Enable or disable profiling of load() and shape decoding
+	 *
+	 * Profiling collects the times of the phases of load() and counts of the
+	 * data parsed and decoded (see GetStats()). With `trace` the start and
+	 * duration of every phase, section and decompressed shape is also recorded
+	 * for WriteTrace(). Profiling is disabled by default and then only costs a
+	 * flag test per phase.
+	 *
+	 * @param enable Collect statistics
+	 * @param trace  Also record the events of a trace (implies `enable`)
+	 */
+	void SetProfiling(bool enable, bool trace=false);
+
+	/**
+	 * @brief Return the statistics collected since the last load() (see SetProfiling())
+	 */
+	LoadStats GetStats() const;
+
+	/**
+	 * @brief Write the recorded trace in the Chrome trace event format
+	 *
+	 * The JSON file can be opened with chrome://tracing or https://ui.perfetto.dev,
+	 * times are relative to the start of the last load().
+	 *
+	 * @return false if the file cannot be written
+	 */
+	bool WriteTrace(const std::string &path) const;
+
+	/**
+	 * @brief Enable or disable cache images in load()
+	 *
+	 * With the cache enabled, load() of a single sequence file first looks for
+	 * its cache image (see GetCachePath()). An image matching the size and
+	 * modification time of the file, or failing that the hash of its content,
+	 * is mapped and used in place without parsing. Otherwise, or if the image
+	 * is damaged, the file is parsed and the image is written for the next
+	 * load. Sequences in separate files
+	 * and sequences loaded in streaming mode are not cached.
+	 *
+	 * The hash of the header and section table is always checked. The hash of
+	 * the sections reads the whole image and is only checked with verifyImage.
+	 *
+	 * @param enable        Use and write cache images
+	 * @param directory     Directory of the images, empty for images next to the sequence files
+	 * @param decodedShapes Also store the decompressed shapes in the images
+	 * @param verifyImage   Also check the hash of the sections of the images
+	 * @see SaveCache()
+	 */
+	void SetCacheMode(bool enable, const std::string &directory="", bool decodedShapes=false, bool verifyImage=false);
+
+	/**
+	 * @brief Write a cache image of the loaded sequence
+	 *
+	 * The image starts with a header (magic number, format version, sizes of
+	 * the stored structures, byte order, the size, modification time and
+	 * content hash of the sequence file, a hash of the sections and a hash of
+	 * the header) and a table of sections. The sections
+	 * hold the block table, the block start times, the event libraries and the
+	 * compressed (optionally also the decompressed) shapes as arrays in their
+	 * memory layout, aligned to 8 bytes and located by offsets from the start
+	 * of the file, so the image can be mapped at any address. Images are read
+	 * only, a mapped image is shared by all processes using it.
+	 *
+	 * The image is written to a temporary file and renamed, so processes that
+	 * map the previous image keep a consistent copy.
+	 *
+	 * @param  path          output file name
+	 * @param  decodedShapes also store the decompressed shapes
+	 * @return false if the image cannot be written or the sequence was not
+	 *         loaded completely from a single file
+	 */
+	bool SaveCache(const std::string &path, bool decodedShapes=false);
+
+	/**
+	 * @brief Return the location of the cache image of a sequence file
+	 *
+	 * @param sourcePath Sequence file
+	 * @param directory  Directory of the images, empty for the directory of the sequence file
+	 */
+	static std::string GetCachePath(const std::string &sourcePath, const std::string &directory="");
+
+	/**
+	 * @brief Return `true` if the loaded sequence is read from a cache image
+	 */
+	bool IsCached() const;
+
+
+	/**
+	 * @brief Report the version of the loaded sequence
+	 *
+	 * Returns the version of the loaded PulSeq file combined to a single integer
+	 * The format is MMmmmmrrrr where M is the major version number, m is the minor
+	 * version number and r is the revision
+	 *
+	 */
+	int GetVersion() { return version_combined; }
+
+
+	/**
+	 * @brief Display an output message
+	 *
+	 * Display a message only if the MSG_LEVEL is sufficiently high.
+	 * This function calls the low-level output function, which can be overridden
+	 * using SetPutMsgFunction().
+	 *
+	 * @param  level  type of message
+	 * @param  ss     string stream containing the message
+	 */
+	static void print_msg(MessageType level, std::ostream& ss);
+
+	/**
+	 * @brief A pointer-type to the low-level print function
+	 */
+	typedef void (*PrintFunPtr)(const std::string &str);
+
+	/**
+	 * @brief Set the output print function
+	 *
+	 * Set the low-level output function to be used for printing or logging messages.
+	 * If no function is specified messages will be printed to cout
+	 *
+	 * @param  fun  Pointer to function
+	 */
+	static void SetPrintFunction(PrintFunPtr fun);
+
+	/**
+	 * @brief Lookup the custom definition
+	 *
+	 * Search the list of user-specified definitions through the [DEFINITIONS] section.
+	 * If the definition key is not found, an empty vector is returned.
+	 *
+	 * @param key  the definition name
+	 * @return a list of values (or empty vector)
+	 */
+	std::vector<double> GetDefinition(std::string key);
+
+	/**
+	 * @brief Return all custom definitions
+	 */
+	const std::map<std::string, std::vector<double> >& GetDefinitions() const;
+
+	/**
+	 * @brief Return number of sequence blocks
+	 */
+	int  GetNumberOfBlocks(void);
+
+	/**
+	 * @brief Return the start time of a block in us
+	 *
+	 * Start times are tabulated when the sequence is loaded (not available in
+	 * streaming mode). The start time of the block past the last one is the
+	 * total duration of the sequence.
+	 *
+	 * @return the start time or -1 if the index is out of range
+	 */
+	long long GetBlockStartTime(int blockIndex) const;
+
+	/**
+	 * @brief Return the start times of all blocks and the total duration in us
+	 */
+	const ImageArray<long long>& GetBlockStartTimes() const;
+
+	/**
+	 * @brief Return the total duration of the sequence in us
+	 */
+	long long GetTotalDuration() const;
+
+	/**
+	 * @brief Return the event IDs of all blocks (empty in streaming mode)
+	 *
+	 * The table is stored contiguously, block `i` references event `type`
+	 * through `GetBlockTable()[i].id[type]`.
+	 */
+	const ImageArray<EventIDs>& GetBlockTable() const;
+
+	/**
+	 * @brief Find the block that is active at the given time
+	 *
+	 * Binary search for the block with start <= time < start+duration, blocks
+	 * of zero duration are never returned.
+	 *
+	 * @param  time Time in us from the start of the sequence
+	 * @return index of the block or -1 if time is outside [0,GetTotalDuration())
+	 */
+	int  FindBlockAtTime(double time) const;
+
+	/**
+	 * @brief Construct a sequence block from the library events
+	 *
+	 * Events are loaded from the library. However, arbitrary waveforms are
+	 * not decoded until decodeBlock() is called. The caller owns the returned
+	 * block, use GetBlock(int,SeqBlock&) to reuse an existing block instead.
+	 *
+	 * @see decodeBlock()
+	 */
+	SeqBlock*  GetBlock(int blockIndex);
+
+	/**
+	 * @brief Fill the given sequence block from the library events
+	 *
+	 * Same as GetBlock(int) but reuses the caller's block. Previously decoded
+	 * shapes are released; decoding again takes them from the shape cache, so
+	 * filling and decoding blocks repeatedly does not copy any samples.
+	 *
+	 * @return false if the index is out of range
+	 */
+	bool  GetBlock(int blockIndex, SeqBlock &block);
+
+	/**
+	 * @brief Fill a lightweight view of the given block
+	 *
+	 * The view refers to the library events and never allocates memory.
+	 *
+	 * @return false if the index is out of range
+	 * @see blocks()
+	 */
+	bool  GetBlock(int blockIndex, BlockView &view) const;
+
+	/**
+	 * @brief Return a range over all blocks for use in range-based loops
+	 *
+	 * ~~~~~~~~~~~~~{.cpp}
+	 * for (const BlockView &block : seq.blocks())
+	 *     if (block.isADC()) numAdc++;
+	 * ~~~~~~~~~~~~~
+	 */
+	BlockRange blocks() const;
+
+	/**
+	 * @brief Return a range over the blocks [first,last)
+	 */
+	BlockRange blocks(int first, int last) const;
+
+	/**
+	 * @brief Decode a block by looking up indexed events
+	 *
+	 * This involves assigning the block's event objects from the libraries
+	 * as well as decompressing arbitrary RF and gradient shapes.
+	 *
+	 * @return true if successful
+	 */
+	bool decodeBlock(SeqBlock *block);
+
+	/**
+	 * @brief Return the decompressed samples of a shape
+	 *
+	 * Shapes are decoded on first use and kept in a cache shared by all blocks.
+	 * Samples are limited to the valid range of the given usage.
+	 *
+	 * @return the samples or an empty pointer if the shape does not exist
+	 */
+	DecodedShape GetDecodedShape(int shapeId, ShapeUsage usage);
+
+	/**
+	 * @brief Limit the number of samples kept in the shape cache (0: unlimited)
+	 */
+	void SetShapeCacheSize(size_t maxSamples);
+
+	/**
+	 * @brief Compress the samples of a shape
+	 *
+	 * Inverse of the decompression applied when shapes are decoded: the derivative
+	 * of the samples is quantized to 1e-8 (as in mr.compressShape) and run-length
+	 * encoded, two equal values being followed by the number of additional
+	 * repetitions. Constant and linear segments compress to three values.
+	 *
+	 * @param samples    Uncompressed samples
+	 * @param numSamples Number of samples
+	 * @param encoded    Compressed shape
+	 */
+	static void compressShape(const float *samples, int numSamples, CompressedShape &encoded);
+
+	/**
+	 * @brief Decompress a run-length compressed shape
+	 *
+	 * Runs are never expanded beyond `numUncompressedSamples`. The samples are
+	 * not limited to the range of a ShapeUsage (see GetDecodedShape()).
+	 *
+	 * @param encoded Compressed shape structure (with parsed `samples`)
+	 * @param shape array of floating-point values (must be preallocated!)
+	 * @return false if the compressed data is malformed
+	 */
+	static bool decompressShape(const CompressedShape& encoded, float *shape);
+
+	/**
+	 * @brief Return the event libraries of the loaded sequence
+	 *
+	 * The libraries give direct access to the events in the order of their IDs,
+	 * e.g. for bindings sharing the event tables without copying them.
+	 */
+	const EventLibrary<RFEvent>& GetRFLibrary() const;
+	const EventLibrary<GradEvent>& GetGradientLibrary() const;       /**< @brief Return the library of gradient events */
+	const EventLibrary<ADCEvent>& GetADCLibrary() const;             /**< @brief Return the library of ADC events */
+	const EventLibrary<ControlEvent>& GetControlLibrary() const;     /**< @brief Return the library of control events */
+	const EventLibrary<long>& GetDelayLibrary() const;               /**< @brief Return the library of delays */
+
+	/**
+	 * @brief Return the number of shapes (upper bound of the shape IDs)
+	 */
+	int  GetNumberOfShapes() const;
+
+	/**
+	 * @brief Return the number of samples of a shape after decompression (0 if undefined)
+	 */
+	int  GetShapeLength(int shapeId) const;
+
+  private:
+
+	static const char COMMENT_CHAR;	/**< @brief Character defining the start of a comment line */
+
+	// *** Private helper functions ***
+
+	/**
+	 * @brief Parse all sections of a memory-mapped sequence file in a single pass
+	 *
+	 * Lines are scanned once from beginning to end. Whenever a section header
+	 * (e.g. [RF], [SHAPES]) is found, its location is recorded in the file index
+	 * and the section is decoded in place by the corresponding parse function.
+	 * Lines are terminated by any of the three common line endings (\\n, \\r\\n, \\r).
+	 *
+	 * @param file the mapped sequence file
+	 * @return true if all sections were decoded successfully
+	 */
+	bool parseFile(const MappedFile &file);
+
+	/**
+	 * @brief Parse a memory-mapped sequence file in the binary format
+	 *
+	 * The block table and event sections are copied directly from the mapping.
+	 *
+	 * @param file the mapped sequence file (including the magic number)
+	 * @return true if all sections were decoded successfully
+	 */
+	bool parseBinaryFile(const MappedFile &file);
+
+	/**
+	 * @brief Decode all sections of a text file using several threads
+	 *
+	 * Produces the same libraries and messages as parseFile().
+	 * @return true if all sections were decoded successfully
+	 */
+	bool parseFileParallel(const MappedFile &file, int numThreads);
+
+	/**
+	 * @brief Fill a view of the block with the given event IDs
+	 */
+	void fillBlockView(const int *events, int index, BlockView &view) const;
+
+	/**
+	 * @brief Calculate the duration of the block with the given event IDs (in us)
+	 */
+	long blockDuration(const int *events) const;
+
+	/**
+	 * @brief Tabulate the start times of all blocks
+	 */
+	void buildTimingTable();
+
+	/**
+	 * @brief Print the scan ID and complete the statistics at the end of load()
+	 */
+	void finishLoad();
+
+	/**
+	 * @brief Return the line number of a position in the file being parsed
+	 */
+	int lineNumber(const char *pos) const;
+
+	/**
+	 * @brief Shapes read from the [SHAPES] section in file order
+	 */
+	typedef std::vector<std::pair<int,CompressedShape> > ShapeList;
+
+	/**
+	 * @brief Move decoded shapes to the shape library
+	 */
+	void storeShapes(ShapeList &shapes);
+
+	/**
+	 * @brief Parse the samples of a shape that were left in the mapped file
+	 *
+	 * The samples of text files are only located while loading and parsed on
+	 * first use. Thread-safe.
+	 * @return false if a sample cannot be decoded
+	 */
+	bool loadShapeSamples(CompressedShape &shape);
+
+	/**
+	 * @brief Decode the [VERSION] section
+	 *
+	 * Each section parser starts at the first line after the header and returns
+	 * with `pos` pointing to the line that terminated the section.
+	 */
+	bool parseVersion(const char *&pos, const char *end);
+	bool parseDefinitions(const char *&pos, const char *end);  /**< @brief Decode the [DEFINITIONS] section */
+	bool parseBlocks(const char *&pos, const char *end, std::vector<EventIDs> &blocks);  /**< @brief Decode the [BLOCKS] section */
+	bool parseRF(const char *&pos, const char *end);           /**< @brief Decode the [RF] section */
+	bool parseGradients(const char *&pos, const char *end);    /**< @brief Decode the [GRADIENTS] section */
+	bool parseTrapezoids(const char *&pos, const char *end);   /**< @brief Decode the [TRAP] section */
+	bool parseADC(const char *&pos, const char *end);          /**< @brief Decode the [ADC] section */
+	bool parseDelays(const char *&pos, const char *end);       /**< @brief Decode the [DELAYS] section */
+	bool parseTriggers(const char *&pos, const char *end);     /**< @brief Decode the [TRIGGERS] section */
+	bool parseRotations(const char *&pos, const char *end);    /**< @brief Decode the [ROTATIONS] section */
+	bool parseShapes(const char *&pos, const char *end, ShapeList &shapes);             /**< @brief Decode the [SHAPES] section */
+
+
+	/**
+	 * @brief Check the IDs contains references to valid events in the library
+	 *
+	 * @param  events The event IDs to check
+	 * @return true if event references are ok
+	 * @see checkRF(), checkGradient()
+	 */
+	bool checkBlockReferences(const EventIDs& events) const;
+
+	/**
+	 * @brief Check the IDs contains references to valid events in the given libraries
+	 *
+	 * Shared by ExternalSequence and SequenceWriter.
+	 * @return true if event references are ok
+	 */
+	static bool checkBlockReferences(const EventIDs& events, const EventLibrary<RFEvent> &rfLibrary,
+		const EventLibrary<GradEvent> &gradLibrary, const EventLibrary<ADCEvent> &adcLibrary,
+		const EventLibrary<long> &delayLibrary, const EventLibrary<ControlEvent> &controlLibrary);
+
+	/**
+	 * @brief Check the RF and gradient events reference shapes defined in the library
+	 *
+	 * @return true if shape references are ok
+	 * @see checkBlockReferences()
+	 */
+	bool checkShapeReferences();
+
+	/**
+	 * @brief Check the samples of an arbitrary gradient shape
+	 *
+	 * Limit the *decompressed* amplitude to [-1 1].
+	 * @param  waveform The decoded samples
+	 * @see checkRF()
+	 */
+	void checkGradient(std::vector<float>& waveform);
+
+	/**
+	 * @brief Check the samples of an RF shape
+	 *
+	 * Limit the *decompressed* RF amplitude to [0 1] or the phase to [0 2pi).
+	 * @param  waveform The decoded samples
+	 * @param  usage    Magnitude or phase
+	 * @see checkGradient()
+	 */
+	void checkRF(std::vector<float>& waveform, ShapeUsage usage);
+
+	// *** Static helper function ***
+
+	/**
+	 * @brief Print string to standard output (with newline character)
+	 */
+	static void defaultPrint(const std::string &str);
+
+	// *** Static members ***
+
+	static PrintFunPtr print_fun;              /**< @brief Pointer to output print function */
+
+	// *** Profiling ***
+
+	/**
+	 * @brief Event of a trace
+	 */
+	struct TraceEvent
+	{
+		std::string name;       /**< @brief Name of the event */
+		LoadPhase phase;        /**< @brief Phase the event belongs to */
+		int thread;             /**< @brief Index of the thread */
+		double start;           /**< @brief Start relative to the profiling epoch (us) */
+		double duration;        /**< @brief Duration (us) */
+	};
+
+	/**
+	 * @brief Add the time of a phase to the statistics (and the trace)
+	 */
+	void recordPhase(LoadPhase phase, const std::string &name, std::chrono::steady_clock::time_point start,
+		std::chrono::steady_clock::time_point stop);
+
+	/**
+	 * @brief Add the number of lines in [begin,end) to the statistics
+	 */
+	void countLines(const char *begin, const char *end);
+
+	// *** Cache image ***
+
+	/**
+	 * @brief Use the cache image of a sequence file if it matches the file
+	 *
+	 * @return false if the image does not exist, is outdated or invalid
+	 */
+	bool loadCache(const std::string &imagePath, const MappedFile &source);
+
+	bool m_cacheEnabled;                       /**< @brief Use and write cache images in load() */
+	bool m_cacheDecodedShapes;                 /**< @brief Store decompressed shapes in the images */
+	bool m_cacheVerifyImage;                   /**< @brief Check the hash of the sections of the images */
+	std::string m_cacheDirectory;              /**< @brief Directory of the images (empty: next to the sequence) */
+	std::string m_sourcePath;                  /**< @brief Single file of the loaded sequence (empty for separate files) */
+	long long m_sourceSize;                    /**< @brief Size of the source file when it was loaded */
+	long long m_sourceTime;                    /**< @brief Modification time of the source file when it was loaded (ns) */
+	MappedFile m_cacheFile;                    /**< @brief Cache image the loaded sequence refers to */
+	std::vector<const float*> m_imageShapes;   /**< @brief Decompressed shapes in the image, indexed by shapeId*NUM_SHAPE_USAGES+usage */
+
+	bool m_profiling;                          /**< @brief Collect statistics */
+	bool m_tracing;                            /**< @brief Record trace events */
+	LoadStats m_stats;                         /**< @brief Statistics since the last load() */
+	std::atomic<long long> m_decodeCalls;      /**< @brief Calls of decodeBlock() while profiling */
+	std::vector<TraceEvent> m_trace;           /**< @brief Recorded trace events */
+	std::vector<std::thread::id> m_traceThreads;  /**< @brief Threads of the trace events */
+	std::chrono::steady_clock::time_point m_profileEpoch;  /**< @brief Start of the last load() */
+	mutable std::mutex m_statsMutex;           /**< @brief Protects the statistics and the trace */
+
+	// *** Members ***
+
+	int version_major;
+	int version_minor;
+	int version_revision;
+	int version_combined;
+
+	std::map<std::string,size_t> m_fileIndex;  /**< @brief File location of sections, [RF], [ADC] etc */
+	const char *m_parseBegin;                  /**< @brief Start of the file being parsed (for line numbers) */
+	int m_numLoadThreads;                      /**< @brief Number of threads used for parsing (0: all cores) */
+	bool m_streamingMode;                      /**< @brief Do not load the [BLOCKS] section */
+	bool m_blocksStreamed;                     /**< @brief Blocks of the loaded sequence are read from file */
+	std::string m_blockFile;                   /**< @brief File containing the [BLOCKS] section */
+	int m_blockLine;                           /**< @brief Line number of the first block in the file */
+
+	// Low level sequence blocks
+	ImageArray<EventIDs> m_blocks;             /**< @brief List of sequence blocks */
+	ImageArray<long long> m_blockStartTimes;   /**< @brief Start time of each block and total duration (us) */
+
+	// Global user-specified definitions
+	std::map<std::string, std::vector<double> >m_definitions;  /**< @brief Custom definitions provided through [DEFINITIONS] section) */
+
+	// List of events (referenced by blocks)
+	EventLibrary<RFEvent>      m_rfLibrary;       /**< @brief Library of RF events */
+	EventLibrary<GradEvent>    m_gradLibrary;     /**< @brief Library of gradient events */
+	EventLibrary<ADCEvent>     m_adcLibrary;      /**< @brief Library of ADC readouts */
+	EventLibrary<ControlEvent> m_controlLibrary;  /**< @brief Library of control commands */
+	EventLibrary<long>         m_delayLibrary;    /**< @brief Library of delays */
+
+	// List of basic shapes (referenced by events)
+	EventLibrary<CompressedShape> m_shapeLibrary;    /**< @brief Library of compressed shapes */
+	ShapeCache m_shapeCache;                         /**< @brief Decompressed shapes */
+	MappedFile m_shapeFile;                          /**< @brief File with the [SHAPES] section, kept mapped for loadShapeSamples() */
+	bool m_lazyShapes;                               /**< @brief Parse shape samples of single text files on first use */
+	bool m_deferShapes;                              /**< @brief Leave shape samples in the file being parsed */
+	std::mutex m_shapeMutex;                         /**< @brief Protects parsing of shape samples */
+};
+
+// * ------------------------------------------------------------------ *
+// * Inline functions                                                   *
+// * ------------------------------------------------------------------ *
+
+inline int ExternalSequence::GetNumberOfBlocks(void){return m_blocks.size();}
+inline long long ExternalSequence::GetBlockStartTime(int blockIndex) const {
+	return (blockIndex>=0 && (size_t)blockIndex<m_blockStartTimes.size()) ? m_blockStartTimes[blockIndex] : -1;
+}
+inline long long ExternalSequence::GetTotalDuration() const {
+	return m_blockStartTimes.empty() ? 0 : m_blockStartTimes.back();
+}
+inline const ImageArray<long long>& ExternalSequence::GetBlockStartTimes() const { return m_blockStartTimes; }
+inline const ImageArray<EventIDs>& ExternalSequence::GetBlockTable() const { return m_blocks; }
+inline bool ExternalSequence::IsCached() const { return m_cacheFile.isOpen(); }
+inline const std::map<std::string, std::vector<double> >& ExternalSequence::GetDefinitions() const { return m_definitions; }
+inline const EventLibrary<RFEvent>& ExternalSequence::GetRFLibrary() const { return m_rfLibrary; }
+inline const EventLibrary<GradEvent>& ExternalSequence::GetGradientLibrary() const { return m_gradLibrary; }
+inline const EventLibrary<ADCEvent>& ExternalSequence::GetADCLibrary() const { return m_adcLibrary; }
+inline const EventLibrary<ControlEvent>& ExternalSequence::GetControlLibrary() const { return m_controlLibrary; }
+inline const EventLibrary<long>& ExternalSequence::GetDelayLibrary() const { return m_delayLibrary; }
+inline int ExternalSequence::GetNumberOfShapes() const { return m_shapeLibrary.maxId(); }
+inline int ExternalSequence::GetShapeLength(int shapeId) const { return m_shapeLibrary[shapeId].numUncompressedSamples; }
+inline std::vector<double>	ExternalSequence::GetDefinition(std::string key){
+	if (m_definitions.count(key)>0)
+		return m_definitions[key];
+	else
+		return std::vector<double>();
+}
+
+inline BlockRange ExternalSequence::blocks() const { return BlockRange(this,0,(int)m_blocks.size()); }
+inline BlockRange ExternalSequence::blocks(int first, int last) const {
+	return BlockRange(this,MAX(first,0),MIN(MAX(last,first),(int)m_blocks.size()));
+}
+
+inline BlockIterator::BlockIterator(const ExternalSequence *seq, int index) : m_seq(seq), m_index(index) {
+	m_seq->GetBlock(m_index,m_view);
+}
+inline const BlockView& BlockIterator::operator*() const { return m_view; }
+inline const BlockView* BlockIterator::operator->() const { return &m_view; }
+inline BlockIterator&   BlockIterator::operator++() {
+	m_seq->GetBlock(++m_index,m_view);
+	return *this;
+}
+inline bool BlockIterator::operator==(const BlockIterator &other) const { return m_index==other.m_index; }
+inline bool BlockIterator::operator!=(const BlockIterator &other) const { return m_index!=other.m_index; }
+
+inline bool ExternalSequence::checkBlockReferences(const EventIDs& events) const {
+	return checkBlockReferences(events, m_rfLibrary, m_gradLibrary, m_adcLibrary, m_delayLibrary, m_controlLibrary);
+}
+
+inline void ExternalSequence::SetStreamingMode(bool streaming) { m_streamingMode = streaming; }
+inline bool ExternalSequence::IsStreaming() const { return m_blocksStreamed; }
+
+inline void ExternalSequence::SetLoadThreads(int numThreads) { m_numLoadThreads = (numThreads<0) ? 1 : numThreads; }
+inline void ExternalSequence::SetLazyShapes(bool lazy) { m_lazyShapes = lazy; }
+inline void ExternalSequence::SetProfiling(bool enable, bool trace) { m_profiling = enable || trace; m_tracing = trace; }
+
+inline void ExternalSequence::SetShapeCacheSize(size_t maxSamples) { m_shapeCache.setMaxSamples(maxSamples); }
+
+inline void ExternalSequence::defaultPrint(const std::string &str) { std::cout << str << std::endl; }
+inline void ExternalSequence::SetPrintFunction(PrintFunPtr fun) { print_fun=fun; }
+
+
+/**
+ * @brief Incremental writer of sequence files
+ *
+ * Builds a sequence block by block and writes it in the text or the binary
+ * format. Events and shapes are deduplicated: adding an entry that matches one
+ * already in the library (see LibraryKey) returns the ID of the existing
+ * entry. Entries are found through the hash index of the libraries, so adding
+ * an event takes constant time however large the libraries grow. Shapes are
+ * given as uncompressed samples and compressed with
+ * ExternalSequence::compressShape().
+ *
+ * Blocks are written to the file as they are added and only the libraries are
+ * kept in memory until close() appends them, so memory use does not depend on
+ * the number of blocks. Definitions must therefore be set before the first
+ * block is added.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * SequenceWriter writer;
+ * writer.open("fid.seq");
+ * writer.SetDefinition("Name", name);
+ * RFEvent rf;
+ * rf.amplitude = 250.0;
+ * rf.magShape = writer.AddShape(magnitude);
+ * rf.phaseShape = writer.AddShape(phase);
+ * EventIDs block = {};
+ * block.id[RF] = writer.AddRF(rf);
+ * writer.AddBlock(block);
+ * writer.close();
+ * ~~~~~~~~~~~~~
+ */
+class SequenceWriter
+{
+public:
+	/**
+	 * @brief File formats
+	 */
+	enum Format {
+		TEXT,       /**< Text format (.seq) */
+		BINARY      /**< Binary format, without trigger and rotation events */
+	};
+
+	/**
+	 * @brief Constructor
+	 */
+	SequenceWriter();
+
+	/**
+	 * @brief Destructor (closes the file)
+	 */
+	~SequenceWriter();
+
+	/**
+	 * @brief Set the version written by the next open() (default 1.2.1)
+	 *
+	 * Fields added by later revisions (RF delay in 1.2.0, gradient delays in
+	 * 1.1.1) are omitted for older versions, as in files read by ExternalSequence.
+	 */
+	void SetVersion(int major, int minor, int revision);
+
+	/**
+	 * @brief Create the output file and start a new sequence with empty libraries
+	 * @return true if successful
+	 */
+	bool open(const std::string &path, Format format=TEXT);
+
+	/**
+	 * @brief Set a definition, see ExternalSequence::GetDefinition()
+	 * @return false if blocks have already been written
+	 */
+	bool SetDefinition(const std::string &key, const std::vector<double> &values);
+
+	/**
+	 * @brief Compress a shape and add it to the shape library
+	 *
+	 * Samples are given as stored in the file: RF magnitude in [0,1], RF phase
+	 * in [0,1] (units of 2pi) and arbitrary gradients in [-1,1].
+	 *
+	 * @return ID of the shape or 0 on error
+	 */
+	int AddShape(const float *samples, int numSamples);
+	int AddShape(const std::vector<float> &samples);   /**< @brief Compress a shape and add it to the shape library */
+
+	/**
+	 * @brief Add an RF event to the library
+	 * @return ID of the event or 0 if it references undefined shapes
+	 */
+	int AddRF(const RFEvent &rf);
+
+	/**
+	 * @brief Add a trapezoid (shape 0) or arbitrary gradient event to the library
+	 * @return ID of the event or 0 if it references an undefined shape
+	 */
+	int AddGradient(const GradEvent &grad);
+
+	int AddADC(const ADCEvent &adc);            /**< @brief Add an ADC event to the library, return its ID */
+	int AddDelay(long delay);                   /**< @brief Add a delay (us) to the library, return its ID */
+
+	/**
+	 * @brief Add a trigger or rotation event to the library
+	 * @return ID of the event or 0 if the file is written in the binary format
+	 */
+	int AddControl(const ControlEvent &control);
+
+	/**
+	 * @brief Write a block referencing events of the libraries
+	 * @return false if the block references undefined events or on write errors
+	 */
+	bool AddBlock(const EventIDs &events);
+
+	/**
+	 * @brief Write the libraries and close the file
+	 * @return true if the complete file was written successfully
+	 */
+	bool close();
+
+	/**
+	 * @brief Return the number of blocks written so far
+	 */
+	long long GetNumberOfBlocks() const;
+
+private:
+	SequenceWriter(const SequenceWriter&);              // non-copyable
+	SequenceWriter& operator=(const SequenceWriter&);
+
+	/**
+	 * @brief Write the definitions and the start of the [BLOCKS] section
+	 */
+	bool beginBlocks();
+
+	/**
+	 * @brief Return the ID of a matching entry of the library, inserting the entry if necessary
+	 */
+	template<typename T>
+	int findOrInsert(EventLibrary<T> &library, const T &entry);
+
+	std::ofstream m_file;          /**< @brief Output file */
+	std::string m_path;            /**< @brief Name of the output file */
+	Format m_format;               /**< @brief Format of the output file */
+	int m_version[3];              /**< @brief Major, minor and revision number */
+	bool m_blocksStarted;          /**< @brief The [BLOCKS] section has been started */
+	long long m_numBlocks;         /**< @brief Number of blocks written */
+	std::streampos m_countPos;     /**< @brief Position of the block count (binary format) */
+
+	std::map<std::string, std::vector<double> > m_definitions;  /**< @brief Definitions */
+
+	EventLibrary<RFEvent>      m_rfLibrary;       /**< @brief Library of RF events */
+	EventLibrary<GradEvent>    m_gradLibrary;     /**< @brief Library of gradient events */
+	EventLibrary<ADCEvent>     m_adcLibrary;      /**< @brief Library of ADC readouts */
+	EventLibrary<ControlEvent> m_controlLibrary;  /**< @brief Library of control commands */
+	EventLibrary<long>         m_delayLibrary;    /**< @brief Library of delays */
+	EventLibrary<CompressedShape> m_shapeLibrary; /**< @brief Library of compressed shapes */
+
+};
+
+inline void SequenceWriter::SetVersion(int major, int minor, int revision) {
+	m_version[0] = major;
+	m_version[1] = minor;
+	m_version[2] = revision;
+}
+inline int SequenceWriter::AddShape(const std::vector<float> &samples) {
+	return AddShape(samples.empty() ? NULL : &samples[0], (int)samples.size());
+}
+inline long long SequenceWriter::GetNumberOfBlocks() const { return m_numBlocks; }
 
 
 
@@ -0,0 +1,183 @@
+#include "GradientMonitor.h"
+#include "GradientRasterizer.h"
+
+#include <math.h>		// exp, fabs, sqrt, floor
+#include <algorithm>	// std::fill
+
+const double PnsModel::IEC_RHEOBASE = 20.0;
+const double PnsModel::IEC_CHRONAXIE = 360.0;
+const double PnsModel::IEC_EFFECTIVE_LENGTH = 0.2;
+
+/***********************************************************/
+PnsModel::PnsModel()
+	: limit(1.0)
+{
+	PnsFilter chronaxie = { IEC_CHRONAXIE, 1.0, false };
+	filters.push_back(chronaxie);
+	const double effectiveLength[NUM_GRADS] = { IEC_EFFECTIVE_LENGTH, IEC_EFFECTIVE_LENGTH, IEC_EFFECTIVE_LENGTH };
+	SetRheobase(IEC_RHEOBASE, effectiveLength);
+}
+
+/***********************************************************/
+void PnsModel::SetRheobase(double rheobase, const double effectiveLength[NUM_GRADS])
+{
+	// dB/dt (T/s) = slew rate (T/m/s) * effective length (m), thresholds in Hz/m/s
+	for (int c=0; c<NUM_GRADS; c++)
+		threshold[c] = rheobase/effectiveLength[c]*42.576e6;
+}
+
+/***********************************************************/
+GradientReport::GradientReport()
+	: peakPns(0), peakPnsTime(0), peakPnsBlock(-1), pnsOk(true)
+{
+	std::fill(peakPnsAxis, peakPnsAxis+NUM_GRADS, 0.0);
+}
+
+/***********************************************************/
+void GradientReport::print() const
+{
+	ExternalSequence::print_msg(pnsOk ? NORMAL_MSG : ERROR_MSG, std::ostringstream().flush() << (pnsOk ? "" : "*** ERROR: ")
+		<< "PNS " << 100*peakPns << "% at " << peakPnsTime << " s (block " << peakPnsBlock+1 << "), axes "
+		<< 100*peakPnsAxis[0] << "% " << 100*peakPnsAxis[1] << "% " << 100*peakPnsAxis[2] << "%");
+	for (size_t i=0; i<dutyCycles.size(); i++) {
+		const DutyCycleResult &result = dutyCycles[i];
+		std::ostringstream msg;
+		msg << (result.ok ? "" : "*** ERROR: ") << result.window.length << " s window at " << result.peakStart
+			<< " s (to block " << result.peakBlock+1 << "): duty cycle " << 100*result.peakDutyCycle << "%, Grms "
+			<< result.peakRms[0] << " " << result.peakRms[1] << " " << result.peakRms[2] << " Hz/m"
+			<< (result.ok ? " within limit " : " exceeds limit ") << 100*result.window.limit << "%";
+		ExternalSequence::print_msg(result.ok ? NORMAL_MSG : ERROR_MSG, msg);
+	}
+}
+
+/***********************************************************/
+GradientMonitor::GradientMonitor(ExternalSequence &seq)
+	: m_seq(seq), m_rasterTime(10.0), m_maxGrad(40e-3*42.576e6)
+{
+	DutyCycleWindow window = { 10.0, 1.0 };
+	m_windows.push_back(window);
+}
+
+/***********************************************************/
+bool GradientMonitor::evaluate(GradientReport &report)
+{
+	report = GradientReport();
+	if (!(m_rasterTime>0)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: invalid raster time " << m_rasterTime);
+		return false;
+	}
+	const double dt = m_rasterTime;
+	const size_t numSamples = GradientRasterizer::GetNumSamples((double)m_seq.GetTotalDuration(), dt);
+
+	// Recursive filters y = a*y + (1-a)*x of the PNS terms, one state per axis and term
+	const size_t numFilters = m_pns.filters.size();
+	std::vector<double> decay(numFilters), state(NUM_GRADS*numFilters, 0.0);
+	for (size_t f=0; f<numFilters; f++)
+		decay[f] = (m_pns.filters[f].tau>0) ? exp(-dt/m_pns.filters[f].tau) : 0.0;
+
+	// Duty cycle windows as ring buffers of bins
+	const size_t binSamples = (size_t)MAX(1.0, floor(BIN_TIME/dt + 0.5));
+	const double binTime = binSamples*dt;
+	std::vector<DutyCycleSweep> sweeps(m_windows.size());
+	for (size_t w=0; w<m_windows.size(); w++) {
+		DutyCycleSweep &sweep = sweeps[w];
+		size_t numBins = (size_t)MAX(1.0, floor(m_windows[w].length*1e6/binTime + 0.5));
+		for (int c=0; c<NUM_GRADS; c++) {
+			sweep.bins[c].assign(numBins, 0.0);
+			sweep.sum[c] = 0.0;
+			sweep.result.peakRms[c] = 0.0;
+		}
+		sweep.next = 0;
+		sweep.result.window = m_windows[w];
+		sweep.result.peakDutyCycle = 0.0;
+		sweep.result.peakStart = 0.0;
+		sweep.result.peakBlock = -1;
+	}
+	double binSum[NUM_GRADS] = { 0.0, 0.0, 0.0 };
+	size_t binCount = 0;
+	auto pushBin = [&](size_t endSample) {
+		const double tEnd = endSample*dt;
+		for (size_t w=0; w<sweeps.size(); w++) {
+			DutyCycleSweep &sweep = sweeps[w];
+			const size_t numBins = sweep.bins[0].size();
+			double meanSquare[NUM_GRADS], duty = 0.0;
+			for (int c=0; c<NUM_GRADS; c++) {
+				sweep.sum[c] += binSum[c] - sweep.bins[c][sweep.next];
+				sweep.bins[c][sweep.next] = binSum[c];
+				meanSquare[c] = MAX(sweep.sum[c], 0.0)/(numBins*binSamples);
+				duty = MAX(duty, meanSquare[c]/(m_maxGrad*m_maxGrad));
+			}
+			sweep.next = (sweep.next+1) % numBins;
+			if (duty>sweep.result.peakDutyCycle) {
+				sweep.result.peakDutyCycle = duty;
+				for (int c=0; c<NUM_GRADS; c++)
+					sweep.result.peakRms[c] = sqrt(meanSquare[c]);
+				sweep.result.peakStart = MAX(tEnd - numBins*binTime, 0.0)*1e-6;
+				sweep.result.peakBlock = m_seq.FindBlockAtTime(tEnd - 0.5*dt);
+			}
+		}
+		for (int c=0; c<NUM_GRADS; c++)
+			binSum[c] = 0.0;
+		binCount = 0;
+	};
+
+	// Render the waveforms chunk by chunk, the gradients are zero before the sequence
+	GradientRasterizer rasterizer(m_seq);
+	std::vector<float> waveform[NUM_GRADS];
+	for (int c=0; c<NUM_GRADS; c++)
+		waveform[c].resize(MIN(numSamples, CHUNK_SAMPLES));
+	double previous[NUM_GRADS] = { 0.0, 0.0, 0.0 };
+	double peakSquare = 0.0;
+	size_t peakSample = 0;
+	for (size_t k0=0; k0<numSamples; k0+=CHUNK_SAMPLES)
+	{
+		const size_t n = MIN(CHUNK_SAMPLES, numSamples-k0);
+		if (!rasterizer.render(k0*dt, dt, n, &waveform[0][0], &waveform[1][0], &waveform[2][0]))
+			return false;
+
+		for (size_t i=0; i<n; i++)
+		{
+			double fraction[NUM_GRADS], square = 0.0;
+			for (int c=0; c<NUM_GRADS; c++) {
+				const double g = waveform[c][i];
+				const double slew = (g-previous[c])/(dt*1e-6);
+				previous[c] = g;
+				binSum[c] += g*g;
+
+				double response = 0.0;
+				double *y = &state[c*numFilters];
+				for (size_t f=0; f<numFilters; f++) {
+					const PnsFilter &filter = m_pns.filters[f];
+					y[f] = decay[f]*y[f] + (1-decay[f])*(filter.rectify ? fabs(slew) : slew);
+					if (fabs(y[f])<1e-30)
+						y[f] = 0.0;		// avoid slow denormals while decaying during long delays
+					response += filter.weight*y[f];
+				}
+				fraction[c] = fabs(response)/m_pns.threshold[c];
+				square += fraction[c]*fraction[c];
+			}
+			if (square>peakSquare) {
+				peakSquare = square;
+				peakSample = k0+i;
+				for (int c=0; c<NUM_GRADS; c++)
+					report.peakPnsAxis[c] = fraction[c];
+			}
+			if (++binCount==binSamples)
+				pushBin(k0+i+1);
+		}
+	}
+	if (binCount>0)
+		pushBin(numSamples);
+
+	report.peakPns = sqrt(peakSquare);
+	if (peakSquare>0) {
+		report.peakPnsTime = (peakSample+0.5)*dt*1e-6;
+		report.peakPnsBlock = m_seq.FindBlockAtTime((peakSample+0.5)*dt);
+	}
+	report.pnsOk = (report.peakPns<=m_pns.limit);
+	for (size_t w=0; w<sweeps.size(); w++) {
+		sweeps[w].result.ok = (sweeps[w].result.peakDutyCycle<=m_windows[w].limit);
+		report.dutyCycles.push_back(sweeps[w].result);
+	}
+	return report.IsOk();
+}
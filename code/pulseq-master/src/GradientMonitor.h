@@ -0,0 +1,213 @@
+/** @file GradientMonitor.h */
+
+#include "ExternalSequence.h"
+
+#ifndef _GRADIENT_MONITOR_H_
+#define _GRADIENT_MONITOR_H_
+
+/**
+ * @brief Exponential filter term of a PNS response model
+ *
+ * The slew rate (optionally rectified) is filtered with the normalized kernel
+ * exp(-t/tau)/tau, so a constant slew rate produces the same response.
+ */
+struct PnsFilter
+{
+	double tau;       /**< @brief Time constant (us) */
+	double weight;    /**< @brief Weight of the term in the response */
+	bool rectify;     /**< @brief Filter the absolute slew rate */
+};
+
+/**
+ * @brief Peripheral nerve stimulation model
+ *
+ * The response of each physical axis is the weighted sum of its filter terms.
+ * Dividing it by the threshold of the axis gives the PNS fraction of the axis,
+ * the PNS fraction of the sequence is the vector sum over the axes.
+ *
+ * PNS limits are given for the rate of change dB/dt of the field in the
+ * patient, which is the slew rate times an effective length of the gradient
+ * coil, so the slew rate thresholds are the dB/dt rheobase divided by the
+ * effective length of each axis (see SetRheobase()).
+ *
+ * The default is a single term with the chronaxie of 360 us and the rheobase
+ * of 20 T/s from IEC 60601-2-33, i.e. a stimulus of duration T stimulates at
+ * dB/dt = 20 T/s*(1+360us/T) approximately, and an effective length of 0.2 m,
+ * the radius of the compliance volume of whole-body coils, for all axes. This
+ * gives thresholds of 100 T/m/s. The effective lengths or the PNS model of the
+ * actual gradient coil should be used. A limit of 0.8 corresponds to the normal
+ * operating mode of IEC 60601-2-33.
+ */
+struct PnsModel
+{
+	static const double IEC_RHEOBASE;            /**< @brief Rheobase of dB/dt from IEC 60601-2-33 (T/s) */
+	static const double IEC_CHRONAXIE;           /**< @brief Chronaxie from IEC 60601-2-33 (us) */
+	static const double IEC_EFFECTIVE_LENGTH;    /**< @brief Radius of the compliance volume of whole-body coils (m) */
+
+	std::vector<PnsFilter> filters;   /**< @brief Filter terms, applied to all axes */
+	double threshold[NUM_GRADS];      /**< @brief Response of 100% PNS of each axis (Hz/m/s) */
+	double limit;                     /**< @brief Maximum PNS fraction (default 1) */
+
+	/**
+	 * @brief Constructor, sets the default model
+	 */
+	PnsModel();
+
+	/**
+	 * @brief Set the thresholds from the dB/dt rheobase and the effective lengths of the coil
+	 *
+	 * @param rheobase        dB/dt of 100% PNS for long stimuli (T/s)
+	 * @param effectiveLength dB/dt per slew rate of each axis (m)
+	 */
+	void SetRheobase(double rheobase, const double effectiveLength[NUM_GRADS]);
+};
+
+/**
+ * @brief Sliding window of the gradient duty cycle
+ */
+struct DutyCycleWindow
+{
+	double length;    /**< @brief Length of the window (s) */
+	double limit;     /**< @brief Maximum duty cycle (Grms/Gmax)^2 of an axis over the window */
+};
+
+/**
+ * @brief Peak duty cycle found for a DutyCycleWindow
+ */
+struct DutyCycleResult
+{
+	DutyCycleWindow window;           /**< @brief Window and limit */
+	double peakRms[NUM_GRADS];        /**< @brief RMS gradient of each axis in the window of maximum duty cycle (Hz/m) */
+	double peakDutyCycle;             /**< @brief Maximum duty cycle over the axes */
+	double peakStart;                 /**< @brief Start of the window of maximum duty cycle (s) */
+	int peakBlock;                    /**< @brief Block at the end of the window of maximum duty cycle */
+	bool ok;                          /**< @brief `true` if the duty cycle is within the limit */
+};
+
+/**
+ * @brief Result of GradientMonitor::evaluate()
+ */
+struct GradientReport
+{
+	double peakPns;                          /**< @brief Maximum PNS fraction */
+	double peakPnsAxis[NUM_GRADS];           /**< @brief PNS fraction of each axis at the maximum */
+	double peakPnsTime;                      /**< @brief Time of the maximum PNS fraction (s) */
+	int peakPnsBlock;                        /**< @brief Block of the maximum PNS fraction (-1: none) */
+	bool pnsOk;                              /**< @brief `true` if the PNS fraction is within the limit */
+	std::vector<DutyCycleResult> dutyCycles; /**< @brief Peak duty cycle of each window */
+
+	/**
+	 * @brief Constructor, creates an empty report
+	 */
+	GradientReport();
+
+	/**
+	 * @brief Return `true` if the PNS and duty cycles are within their limits
+	 */
+	bool IsOk() const;
+
+	/**
+	 * @brief Print the report with ExternalSequence::print_msg()
+	 */
+	void print() const;
+};
+
+
+/**
+ * @brief Predict peripheral nerve stimulation and gradient duty cycles
+ *
+ * The physical gradient waveforms are rendered with a GradientRasterizer in
+ * chunks of CHUNK_SAMPLES samples, and the slew rate is the difference of
+ * consecutive samples. The PNS filters are evaluated as first order recursive
+ * filters, one state per axis and term, and the duty cycles as running sums
+ * of the squared gradients over bins of about 1 ms (the resolution of the
+ * windows). The sequence is processed in O(N) time, the memory depends on the
+ * chunk size and the window lengths only.
+ *
+ * Duty cycle windows extending before the start of the sequence are averaged
+ * over their full length. The default window is 10 s with a limit of 100%.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * PnsModel pns;
+ * const double effectiveLength[NUM_GRADS] = { 0.3, 0.3, 0.25 };    // of the gradient coil (m)
+ * pns.SetRheobase(PnsModel::IEC_RHEOBASE, effectiveLength);
+ * GradientMonitor monitor(seq);
+ * monitor.SetPnsModel(pns);
+ * monitor.SetMaxGradient(40e-3*42.576e6);
+ * GradientReport report;
+ * if (!monitor.evaluate(report))
+ *     report.print();
+ * ~~~~~~~~~~~~~
+ */
+class GradientMonitor
+{
+public:
+	static const size_t CHUNK_SAMPLES = 65536;   /**< @brief Samples rendered at once */
+	static const int BIN_TIME = 1000;            /**< @brief Resolution of the duty cycle windows (us) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the monitor is in use.
+	 */
+	GradientMonitor(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the sampling interval of the waveforms (us, default 10)
+	 */
+	void SetRasterTime(double rasterTime);
+
+	/**
+	 * @brief Set the PNS model
+	 */
+	void SetPnsModel(const PnsModel &model);
+
+	/**
+	 * @brief Set the maximum gradient amplitude, the reference of the duty cycles (Hz/m)
+	 */
+	void SetMaxGradient(double maxGrad);
+
+	/**
+	 * @brief Replace the duty cycle windows and their limits
+	 */
+	void SetDutyCycleWindows(const std::vector<DutyCycleWindow> &windows);
+
+	/**
+	 * @brief Evaluate the PNS and duty cycles of the complete sequence
+	 *
+	 * @return true if all limits are met, false if a limit is exceeded or the
+	 *         gradients cannot be rendered
+	 */
+	bool evaluate(GradientReport &report);
+
+protected:
+	/**
+	 * @brief Sliding sum of the squared gradients over the last bins
+	 */
+	struct DutyCycleSweep
+	{
+		std::vector<double> bins[NUM_GRADS];   /**< @brief Ring buffer of the bin sums */
+		size_t next;                           /**< @brief Position of the oldest bin */
+		double sum[NUM_GRADS];                 /**< @brief Sum over the ring buffer */
+		DutyCycleResult result;                /**< @brief Peak found so far */
+	};
+
+	ExternalSequence &m_seq;                   /**< @brief Sequence to evaluate */
+	double m_rasterTime;                       /**< @brief Sampling interval (us) */
+	PnsModel m_pns;                            /**< @brief PNS model */
+	double m_maxGrad;                          /**< @brief Reference of the duty cycles (Hz/m) */
+	std::vector<DutyCycleWindow> m_windows;    /**< @brief Duty cycle windows */
+};
+
+inline bool GradientReport::IsOk() const {
+	for (size_t i=0; i<dutyCycles.size(); i++)
+		if (!dutyCycles[i].ok) return false;
+	return pnsOk;
+}
+inline void GradientMonitor::SetRasterTime(double rasterTime) { m_rasterTime = rasterTime; }
+inline void GradientMonitor::SetPnsModel(const PnsModel &model) { m_pns = model; }
+inline void GradientMonitor::SetMaxGradient(double maxGrad) { m_maxGrad = maxGrad; }
+inline void GradientMonitor::SetDutyCycleWindows(const std::vector<DutyCycleWindow> &windows) { m_windows = windows; }
+
+#endif	//_GRADIENT_MONITOR_H_
@@ -0,0 +1,189 @@
+#include "GradientRasterizer.h"
+
+#include <math.h>		// ceil, floor
+#include <algorithm>	// std::fill
+#include <thread>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/***********************************************************/
+GradientRasterizer::GradientRasterizer(ExternalSequence &seq) : m_seq(seq), m_numThreads(1) {}
+
+/***********************************************************/
+size_t GradientRasterizer::GetNumSamples(double duration, double rasterTime)
+{
+	if (!(duration>0) || !(rasterTime>0))
+		return 0;
+	return (size_t)ceil(duration/rasterTime - 1e-9);
+}
+
+/** @brief Return the first sample with its centre at or after time t, limited to [kBegin,kEnd] */
+static inline size_t firstSample(double t, double tStart, double rasterTime, size_t kBegin, size_t kEnd)
+{
+	double k = ceil((t-tStart)/rasterTime - 0.5);
+	if (k<=(double)kBegin)
+		return kBegin;
+	if (k>=(double)kEnd)
+		return kEnd;
+	return (size_t)k;
+}
+
+/** @brief Write the linear ramp out[k] = v0 + k*dv for k in [0,n) */
+static void fillRamp(float *out, size_t n, float v0, float dv)
+{
+	size_t k=0;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+	const __m128 start = _mm_set1_ps(v0);
+	const __m128 slope = _mm_set1_ps(dv);
+	const __m128 four = _mm_set1_ps(4.0f);
+	__m128 index = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	for (; k+4<=n; k+=4) {
+		_mm_storeu_ps(out+k, _mm_add_ps(start, _mm_mul_ps(slope, index)));
+		index = _mm_add_ps(index, four);
+	}
+#endif
+	for (; k<n; k++)
+		out[k] = v0 + dv*(float)k;
+}
+
+/***********************************************************/
+bool GradientRasterizer::renderGradient(const GradEvent &grad, double blockStart, double tStart, double rasterTime,
+	size_t kBegin, size_t kEnd, float *out)
+{
+	const double t0 = blockStart + grad.delay;
+
+	if (grad.shape==0)
+	{
+		// Trapezoid: ramp up, flat top and ramp down
+		const double t1 = t0 + grad.rampUpTime;
+		const double t2 = t1 + grad.flatTime;
+		const double t3 = t2 + grad.rampDownTime;
+		size_t k0 = firstSample(t0, tStart, rasterTime, kBegin, kEnd);
+		size_t k1 = firstSample(t1, tStart, rasterTime, kBegin, kEnd);
+		size_t k2 = firstSample(t2, tStart, rasterTime, kBegin, kEnd);
+		size_t k3 = firstSample(t3, tStart, rasterTime, kBegin, kEnd);
+		if (k1>k0) {
+			double t = tStart + (k0+0.5)*rasterTime;
+			fillRamp(out+k0, k1-k0, (float)(grad.amplitude*(t-t0)/grad.rampUpTime),
+				(float)(grad.amplitude*rasterTime/grad.rampUpTime));
+		}
+		std::fill(out+k1, out+k2, grad.amplitude);
+		if (k3>k2) {
+			double t = tStart + (k2+0.5)*rasterTime;
+			fillRamp(out+k2, k3-k2, (float)(grad.amplitude*(t3-t)/grad.rampDownTime),
+				(float)(-grad.amplitude*rasterTime/grad.rampDownTime));
+		}
+		return true;
+	}
+
+	// Arbitrary gradient: each sample is held for one gradient raster interval
+	DecodedShape shape = m_seq.GetDecodedShape(grad.shape, SHAPE_GRADIENT);
+	if (!shape)
+		return false;
+	const std::vector<float> &samples = *shape;
+	double first = floor((tStart + (kBegin+0.5)*rasterTime - t0)/GRAD_RASTER_TIME);
+	for (size_t i=(size_t)MAX(first,0.0); i<samples.size(); i++) {
+		size_t ka = firstSample(t0 + i*GRAD_RASTER_TIME, tStart, rasterTime, kBegin, kEnd);
+		size_t kb = firstSample(t0 + (i+1)*GRAD_RASTER_TIME, tStart, rasterTime, kBegin, kEnd);
+		if (ka>=kEnd)
+			break;
+		std::fill(out+ka, out+kb, grad.amplitude*samples[i]);
+	}
+	return true;
+}
+
+/***********************************************************/
+bool GradientRasterizer::renderRange(double tStart, double rasterTime, size_t kBegin, size_t kEnd, float *out[NUM_GRADS])
+{
+	for (int c=0; c<NUM_GRADS; c++)
+		std::fill(out[c]+kBegin, out[c]+kEnd, 0.0f);
+	if (kBegin>=kEnd)
+		return true;
+
+	// Blocks overlapping the samples, starting with the block active at the first sample
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	double tFirst = tStart + (kBegin+0.5)*rasterTime;
+	int first = (tFirst<0) ? 0 : m_seq.FindBlockAtTime(tFirst);
+	if (first<0)
+		return true;	// after the end of the sequence
+
+	BlockView block;
+	for (int b=first; b<numBlocks; b++)
+	{
+		double blockStart = (double)m_seq.GetBlockStartTime(b);
+		size_t k0 = firstSample(blockStart, tStart, rasterTime, kBegin, kEnd);
+		if (k0>=kEnd)
+			break;
+		m_seq.GetBlock(b, block);
+		size_t k1 = firstSample(blockStart + block.GetDuration(), tStart, rasterTime, kBegin, kEnd);
+		if (k1<=k0)
+			continue;
+
+		for (int c=0; c<NUM_GRADS; c++) {
+			if (block.GetEventIndex((Event)(GX+c))>0 &&
+				!renderGradient(block.GetGradEvent(c), blockStart, tStart, rasterTime, k0, k1, out[c])) {
+				ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to render gradient of block " << b+1);
+				return false;
+			}
+		}
+
+		// Rotate the gradients of this block (row-major rotation matrix)
+		if (block.isRotation()) {
+			const double *R = block.GetControlEvent().rotMatrix;
+			float *gx = out[0], *gy = out[1], *gz = out[2];
+			for (size_t k=k0; k<k1; k++) {
+				double x = gx[k], y = gy[k], z = gz[k];
+				gx[k] = (float)(R[0]*x + R[1]*y + R[2]*z);
+				gy[k] = (float)(R[3]*x + R[4]*y + R[5]*z);
+				gz[k] = (float)(R[6]*x + R[7]*y + R[8]*z);
+			}
+		}
+	}
+	return true;
+}
+
+/***********************************************************/
+bool GradientRasterizer::render(double tStart, double rasterTime, size_t numSamples, float *gx, float *gy, float *gz)
+{
+	if (!(rasterTime>0)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: invalid raster time " << rasterTime);
+		return false;
+	}
+	if (m_seq.IsStreaming()) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: gradients of a streamed sequence cannot be rendered");
+		return false;
+	}
+	float *out[NUM_GRADS] = { gx, gy, gz };
+
+	// Split the window into contiguous ranges of samples, one per thread
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, numSamples/4096));
+	std::vector<unsigned char> ok(numThreads, 1);
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		size_t kBegin = numSamples*i/numThreads;
+		size_t kEnd = numSamples*(i+1)/numThreads;
+		if (i+1<numThreads)
+			threads.push_back(std::thread([=,&ok,&out]() { ok[i] = renderRange(tStart, rasterTime, kBegin, kEnd, out); }));
+		else
+			ok[i] = renderRange(tStart, rasterTime, kBegin, kEnd, out);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	return std::find(ok.begin(), ok.end(), 0)==ok.end();
+}
+
+/***********************************************************/
+bool GradientRasterizer::render(double rasterTime, std::vector<float> &gx, std::vector<float> &gy, std::vector<float> &gz)
+{
+	size_t numSamples = GetNumSamples((double)m_seq.GetTotalDuration(), rasterTime);
+	gx.resize(numSamples);
+	gy.resize(numSamples);
+	gz.resize(numSamples);
+	if (numSamples==0)
+		return (rasterTime>0);
+	return render(0.0, rasterTime, numSamples, &gx[0], &gy[0], &gz[0]);
+}
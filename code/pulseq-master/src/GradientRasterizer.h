@@ -0,0 +1,93 @@
+/** @file GradientRasterizer.h */
+
+#include "ExternalSequence.h"
+
+#ifndef _GRADIENT_RASTERIZER_H_
+#define _GRADIENT_RASTERIZER_H_
+
+/**
+ * @brief Render the gradient waveforms of a sequence on a regular raster
+ *
+ * Produces the GX, GY and GZ waveforms of the complete sequence or of a time
+ * window as contiguous arrays of samples (Hz/m). Sample `k` of a window
+ * starting at `tStart` is the gradient at the centre of the raster interval,
+ * t = tStart + (k+0.5)*rasterTime, which reproduces the waveforms of
+ * Sequence.gradient_waveforms() in MATLAB for the 10 us gradient raster.
+ *
+ * Trapezoids are linear between their corner points, arbitrary gradients hold
+ * each shape sample for one 10 us gradient raster interval. Rotation events
+ * are applied to the gradients of their block. Only the blocks overlapping the
+ * window are rendered, and the window can be split between several threads.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * GradientRasterizer rasterizer(seq);
+ * std::vector<float> gx, gy, gz;
+ * rasterizer.render(10.0, gx, gy, gz);
+ * ~~~~~~~~~~~~~
+ */
+class GradientRasterizer
+{
+public:
+	static const int GRAD_RASTER_TIME = 10;   /**< @brief Duration of an arbitrary gradient sample (us) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the rasterizer is in use.
+	 */
+	GradientRasterizer(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the number of threads used for rendering
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Return the number of samples covering the given duration
+	 */
+	static size_t GetNumSamples(double duration, double rasterTime);
+
+	/**
+	 * @brief Render a time window of the sequence
+	 *
+	 * @param tStart      Start of the window (us)
+	 * @param rasterTime  Sampling interval (us)
+	 * @param numSamples  Number of samples to render
+	 * @param gx,gy,gz    Output arrays of `numSamples` values (Hz/m)
+	 * @return false if the sequence has no timing information or a shape cannot be decoded
+	 */
+	bool render(double tStart, double rasterTime, size_t numSamples, float *gx, float *gy, float *gz);
+
+	/**
+	 * @brief Render the complete sequence
+	 *
+	 * The waveforms are resized to GetNumSamples(GetTotalDuration(),rasterTime).
+	 * @return false on error
+	 */
+	bool render(double rasterTime, std::vector<float> &gx, std::vector<float> &gy, std::vector<float> &gz);
+
+protected:
+	/**
+	 * @brief Render the samples [kBegin,kEnd) of a window
+	 */
+	bool renderRange(double tStart, double rasterTime, size_t kBegin, size_t kEnd, float *out[NUM_GRADS]);
+
+	/**
+	 * @brief Render a single gradient event of a block
+	 *
+	 * @param blockStart Start time of the block (us)
+	 * @param kBegin,kEnd Samples covered by the block
+	 */
+	bool renderGradient(const GradEvent &grad, double blockStart, double tStart, double rasterTime,
+		size_t kBegin, size_t kEnd, float *out);
+
+	ExternalSequence &m_seq;     /**< @brief Sequence to render */
+	int m_numThreads;            /**< @brief Number of rendering threads (0: all cores) */
+};
+
+inline void GradientRasterizer::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+
+#endif	//_GRADIENT_RASTERIZER_H_
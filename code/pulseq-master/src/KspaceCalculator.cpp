@@ -0,0 +1,320 @@
+#include "KspaceCalculator.h"
+
+#include <math.h>		// floor, sqrt, cos, sin, NAN
+#include <algorithm>	// std::lower_bound
+#include <atomic>
+#include <thread>
+
+/***********************************************************/
+bool BlockIntegral::set(ExternalSequence &seq, const BlockView &block)
+{
+	for (int c=0; c<NUM_GRADS; c++)
+	{
+		grad[c] = NULL;
+		shape[c].reset();
+		if (block.GetEventIndex((Event)(GX+c))<=0)
+			continue;
+		grad[c] = &block.GetGradEvent(c);
+		if (grad[c]->shape==0)
+			continue;
+
+		shape[c] = seq.GetDecodedShape(grad[c]->shape, SHAPE_GRADIENT);
+		if (!shape[c])
+			return false;
+		const std::vector<float> &samples = *shape[c];
+		prefix[c].resize(samples.size()+1);
+		prefix[c][0] = 0.0;
+		for (size_t i=0; i<samples.size(); i++)
+			prefix[c][i+1] = prefix[c][i] + samples[i]*GRAD_RASTER_TIME;
+	}
+	rotation = block.isRotation() ? block.GetControlEvent().rotMatrix : NULL;
+	return true;
+}
+
+/***********************************************************/
+void BlockIntegral::at(double t, double area[NUM_GRADS]) const
+{
+	for (int c=0; c<NUM_GRADS; c++)
+	{
+		area[c] = 0.0;
+		if (grad[c]==NULL)
+			continue;
+		const GradEvent &g = *grad[c];
+		double s = t - g.delay;
+		if (s<=0)
+			continue;
+
+		if (g.shape==0)
+		{
+			// Trapezoid: area of the ramp up, flat top and ramp down covered until s
+			double ru = (double)g.rampUpTime, ft = (double)g.flatTime, rd = (double)g.rampDownTime;
+			if (s<ru)
+				area[c] = 0.5*g.amplitude*s*s/ru;
+			else if (s<ru+ft)
+				area[c] = g.amplitude*(0.5*ru + (s-ru));
+			else if (s<ru+ft+rd) {
+				double r = s-ru-ft;
+				area[c] = g.amplitude*(0.5*ru + ft + r - 0.5*r*r/rd);
+			}
+			else
+				area[c] = g.amplitude*(0.5*ru + ft + 0.5*rd);
+		}
+		else
+		{
+			// Arbitrary gradient: each sample is held for one gradient raster interval
+			const std::vector<float> &samples = *shape[c];
+			size_t i = (size_t)floor(s/GRAD_RASTER_TIME);
+			if (i>=samples.size())
+				area[c] = g.amplitude*prefix[c][samples.size()];
+			else
+				area[c] = g.amplitude*(prefix[c][i] + samples[i]*(s - (double)i*GRAD_RASTER_TIME));
+		}
+	}
+
+	if (rotation) {
+		const double *R = rotation;
+		double x = area[0], y = area[1], z = area[2];
+		area[0] = R[0]*x + R[1]*y + R[2]*z;
+		area[1] = R[3]*x + R[4]*y + R[5]*z;
+		area[2] = R[6]*x + R[7]*y + R[8]*z;
+	}
+}
+
+/***********************************************************/
+KspaceCalculator::KspaceCalculator(ExternalSequence &seq)
+	: m_seq(seq), m_numThreads(1), m_trajectoryDelay(0.0), m_refocusingAngle(100.0) {}
+
+/***********************************************************/
+void KspaceCalculator::SetRfUse(int rfId, RfUse use)
+{
+	if (use==RF_AUTO)
+		m_rfUse.erase(rfId);
+	else
+		m_rfUse[rfId] = use;
+}
+
+/***********************************************************/
+double KspaceCalculator::GetRfCenter(const std::vector<float> &magnitude)
+{
+	// Peak of the magnitude without zero-padding, or the middle of a block pulse
+	const std::vector<float> &m = magnitude;
+	const size_t n = m.size();
+	const float PADDING = 1e-6f;
+	size_t first=0, last=n;
+	while (first<n && m[first]<=PADDING)
+		first++;
+	while (last>first && m[last-1]<=PADDING)
+		last--;
+	if (last<=first)
+		return 0.5*n*RF_RASTER_TIME;
+
+	size_t peak = first;
+	float minimum = m[first];
+	for (size_t i=first; i<last; i++) {
+		if (m[i]>m[peak]) peak = i;
+		if (m[i]<minimum) minimum = m[i];
+	}
+	if (m[peak]-minimum<=PADDING)
+		peak = first + (size_t)floor(0.5*(last-first) + 0.5) - 1;
+	return (double)(peak+1)*RF_RASTER_TIME;
+}
+
+/***********************************************************/
+bool KspaceCalculator::classifyRF(int rfId, const RFEvent &rf, RfInfo &info)
+{
+	DecodedShape mag = m_seq.GetDecodedShape(rf.magShape, SHAPE_RF_MAGNITUDE);
+	DecodedShape phase;
+	if (rf.phaseShape>0)
+		phase = m_seq.GetDecodedShape(rf.phaseShape, SHAPE_RF_PHASE);
+	if (!mag || (rf.phaseShape>0 && (!phase || phase->size()!=mag->size()))) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode shapes of RF event " << rfId);
+		return false;
+	}
+	const std::vector<float> &m = *mag;
+	info.center = GetRfCenter(m);
+
+	// Flip angle of the complex pulse
+	double re=0.0, im=0.0;
+	for (size_t i=0; i<m.size(); i++) {
+		double p = phase ? (*phase)[i] : 0.0;
+		re += m[i]*cos(p);
+		im += m[i]*sin(p);
+	}
+	double flipAngle = 360.0*fabs(rf.amplitude)*RF_RASTER_TIME*1e-6*sqrt(re*re + im*im);
+
+	std::map<int,RfUse>::const_iterator it = m_rfUse.find(rfId);
+	if (it!=m_rfUse.end())
+		info.use = it->second;
+	else if (flipAngle==0.0)
+		info.use = RF_IGNORE;
+	else
+		info.use = (flipAngle>=m_refocusingAngle) ? RF_REFOCUSING : RF_EXCITATION;
+	return true;
+}
+
+/***********************************************************/
+bool KspaceCalculator::calculateSegment(const Segment &seg)
+{
+	BlockView block;
+	BlockIntegral integral;
+	double base[NUM_GRADS], area[NUM_GRADS];
+	const double SCALE = 1e-6;   // Hz/m*us -> 1/m
+
+	size_t a = std::lower_bound(m_adcTimes.begin(), m_adcTimes.end(), seg.tStart) - m_adcTimes.begin();
+	for (int b=seg.firstBlock; b<=seg.lastBlock; b++)
+	{
+		m_seq.GetBlock(b, block);
+		if (!integral.set(m_seq, block)) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: failed to decode gradients of block " << b+1);
+			return false;
+		}
+		const double t0 = (double)m_seq.GetBlockStartTime(b);
+		const double t1 = (double)m_seq.GetBlockStartTime(b+1);
+
+		// k(t) = base + area from the start of the block, with k=0 at the excitation
+		if (b==seg.firstBlock) {
+			integral.at(seg.tStart-t0, area);
+			for (int c=0; c<NUM_GRADS; c++)
+				base[c] = -area[c];
+		}
+		if (t0>=seg.tStart) {
+			for (int c=0; c<NUM_GRADS; c++)
+				m_blockK[c][b] = SCALE*base[c];
+		}
+
+		double tRefocusing = INFINITY;
+		if (block.isRF()) {
+			const RfInfo &info = m_rfInfo.find(block.GetEventIndex(RF))->second;
+			if (info.use==RF_REFOCUSING)
+				tRefocusing = t0 + block.GetRFEvent().delay + info.center;
+		}
+
+		// ADC samples in this block, the final segment includes the end of the sequence
+		const bool lastBlock = (b==seg.lastBlock);
+		const double tEnd = lastBlock ? seg.tEnd : t1;
+		for (; a<m_adcTimes.size() && (m_adcTimes[a]<tEnd || (lastBlock && seg.last && m_adcTimes[a]==tEnd)); a++)
+		{
+			const double t = m_adcTimes[a];
+			if (t>=tRefocusing) {
+				integral.at(tRefocusing-t0, area);
+				for (int c=0; c<NUM_GRADS; c++)
+					base[c] = -base[c] - 2.0*area[c];
+				tRefocusing = INFINITY;
+			}
+			integral.at(t-t0, area);
+			for (int c=0; c<NUM_GRADS; c++)
+				m_adcK[c][a] = SCALE*(base[c] + area[c]);
+		}
+		if (tRefocusing<INFINITY) {
+			integral.at(tRefocusing-t0, area);
+			for (int c=0; c<NUM_GRADS; c++)
+				base[c] = -base[c] - 2.0*area[c];
+		}
+
+		if (!lastBlock || seg.last) {
+			integral.at(t1-t0, area);
+			for (int c=0; c<NUM_GRADS; c++)
+				base[c] += area[c];
+		}
+	}
+	if (seg.last) {
+		int numBlocks = m_seq.GetNumberOfBlocks();
+		for (int c=0; c<NUM_GRADS; c++)
+			m_blockK[c][numBlocks] = SCALE*base[c];
+	}
+	return true;
+}
+
+/***********************************************************/
+bool KspaceCalculator::calculate()
+{
+	for (int c=0; c<NUM_GRADS; c++) {
+		m_adcK[c].clear();
+		m_blockK[c].clear();
+	}
+	m_adcTimes.clear();
+	m_excitationTimes.clear();
+	m_excitationBlocks.clear();
+	m_refocusingTimes.clear();
+	m_rfInfo.clear();
+
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	if (m_seq.IsStreaming() || (numBlocks>0 && m_seq.GetBlockStartTime(numBlocks)<0)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: k-space requires a completely loaded sequence");
+		return false;
+	}
+
+	// Collect the RF pulses and ADC samples
+	BlockView block;
+	for (int b=0; b<numBlocks; b++)
+	{
+		m_seq.GetBlock(b, block);
+		const double t0 = (double)m_seq.GetBlockStartTime(b);
+		if (block.isRF()) {
+			int id = block.GetEventIndex(RF);
+			std::map<int,RfInfo>::iterator it = m_rfInfo.find(id);
+			if (it==m_rfInfo.end()) {
+				RfInfo info;
+				if (!classifyRF(id, block.GetRFEvent(), info))
+					return false;
+				it = m_rfInfo.insert(std::make_pair(id, info)).first;
+			}
+			double t = t0 + block.GetRFEvent().delay + it->second.center;
+			if (it->second.use==RF_EXCITATION) {
+				m_excitationTimes.push_back(t);
+				m_excitationBlocks.push_back(b);
+			}
+			else if (it->second.use==RF_REFOCUSING)
+				m_refocusingTimes.push_back(t);
+		}
+		if (block.isADC()) {
+			const ADCEvent &adc = block.GetADCEvent();
+			for (int i=0; i<adc.numSamples; i++)
+				m_adcTimes.push_back(t0 + adc.delay + i*adc.dwellTime*1e-3 + m_trajectoryDelay);
+		}
+	}
+	for (size_t i=1; i<m_adcTimes.size(); i++) {
+		if (m_adcTimes[i]<m_adcTimes[i-1]) {
+			ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: ADC sample " << i+1 << " precedes the previous sample");
+			return false;
+		}
+	}
+
+	for (int c=0; c<NUM_GRADS; c++) {
+		m_adcK[c].assign(m_adcTimes.size(), NAN);
+		m_blockK[c].assign(numBlocks+1, 0.0);
+	}
+	if (numBlocks==0)
+		return true;
+
+	// Every excitation starts a new, independent segment
+	std::vector<Segment> segments(m_excitationTimes.size()+1);
+	for (size_t s=0; s<segments.size(); s++) {
+		Segment &seg = segments[s];
+		seg.tStart     = (s==0) ? 0.0 : m_excitationTimes[s-1];
+		seg.firstBlock = (s==0) ? 0 : m_excitationBlocks[s-1];
+		seg.last       = (s+1==segments.size());
+		seg.tEnd       = seg.last ? (double)m_seq.GetTotalDuration() : m_excitationTimes[s];
+		seg.lastBlock  = seg.last ? numBlocks-1 : m_excitationBlocks[s];
+	}
+
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, segments.size()));
+	std::atomic<size_t> next(0);
+	std::vector<unsigned char> ok(numThreads, 1);
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		auto work = [this,i,&segments,&next,&ok]() {
+			for (size_t s=next++; s<segments.size() && ok[i]; s=next++)
+				ok[i] = calculateSegment(segments[s]);
+		};
+		if (i+1<numThreads)
+			threads.push_back(std::thread(work));
+		else
+			work();
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	return std::find(ok.begin(), ok.end(), 0)==ok.end();
+}
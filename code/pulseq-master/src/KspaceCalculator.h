@@ -0,0 +1,225 @@
+/** @file KspaceCalculator.h */
+
+#include "ExternalSequence.h"
+
+#include <map>
+
+#ifndef _KSPACE_CALCULATOR_H_
+#define _KSPACE_CALCULATOR_H_
+
+/**
+ * @brief Gradient areas within a block
+ *
+ * Returns the area of the gradients from the start of the block to a given
+ * time in the physical coordinate system (Hz/m*us). Trapezoids are integrated
+ * analytically, arbitrary gradients hold each shape sample for one 10 us
+ * gradient raster interval and rotation events are applied.
+ */
+struct BlockIntegral
+{
+	static const int GRAD_RASTER_TIME = 10;  /**< @brief Duration of an arbitrary gradient sample (us) */
+
+	const GradEvent *grad[NUM_GRADS];        /**< @brief Gradient events (NULL if none) */
+	DecodedShape shape[NUM_GRADS];           /**< @brief Samples of arbitrary gradients */
+	std::vector<double> prefix[NUM_GRADS];   /**< @brief Area before every sample of arbitrary gradients */
+	const double *rotation;                  /**< @brief Rotation matrix (NULL if none) */
+
+	/**
+	 * @brief Set up the integrals for the gradients of the given block
+	 * @return false if an arbitrary gradient cannot be decoded
+	 */
+	bool set(ExternalSequence &seq, const BlockView &block);
+
+	/**
+	 * @brief Return the gradient area from the start of the block to time t (us)
+	 */
+	void at(double t, double area[NUM_GRADS]) const;
+};
+
+
+/**
+ * @brief Calculate the k-space trajectory of a sequence
+ *
+ * C++ counterpart of Sequence.calculateKspace() in MATLAB. The gradients are
+ * integrated from the start of the sequence, k is reset to zero at the centre
+ * of every excitation pulse and inverted at the centre of every refocusing
+ * pulse. The trajectory is returned at the ADC sample times and at the block
+ * boundaries (1/m), together with the excitation and refocusing times (us).
+ *
+ * The gradients are integrated with BlockIntegral. ADC sample `i` is taken at
+ * `delay + i*dwellTime` after the start of its block, as in MATLAB.
+ *
+ * Sequence files do not store the purpose of an RF pulse, so pulses are
+ * classified by their flip angle: pulses of at least SetRefocusingFlipAngle()
+ * degrees are refocusing pulses, all others excitation pulses. The purpose of
+ * individual RF events can be set with SetRfUse().
+ *
+ * The excitations split the sequence into independent segments, which can be
+ * calculated by several threads.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * KspaceCalculator kspace(seq);
+ * if (kspace.calculate()) {
+ *     const std::vector<double> &kx = kspace.GetAdcTrajectory(0);
+ *     ...
+ * }
+ * ~~~~~~~~~~~~~
+ */
+class KspaceCalculator
+{
+public:
+	/**
+	 * @brief Effect of an RF pulse on the trajectory
+	 */
+	enum RfUse {
+		RF_AUTO,          /**< @brief Classify by flip angle */
+		RF_EXCITATION,    /**< @brief Reset k to zero */
+		RF_REFOCUSING,    /**< @brief Invert k */
+		RF_IGNORE         /**< @brief No effect (e.g. inversion or saturation pulse) */
+	};
+
+	static const int RF_RASTER_TIME = 1;      /**< @brief Duration of an RF shape sample (us) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the calculator is in use.
+	 */
+	KspaceCalculator(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the number of threads used for the calculation
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Shift the ADC sample times to compensate for gradient delays
+	 *
+	 * @param delay Delay added to all ADC sample times (us)
+	 */
+	void SetTrajectoryDelay(double delay);
+
+	/**
+	 * @brief Set the smallest flip angle of a refocusing pulse (degrees, default 100)
+	 */
+	void SetRefocusingFlipAngle(double flipAngle);
+
+	/**
+	 * @brief Set the purpose of an RF event
+	 *
+	 * @param rfId ID of the event in the [RF] section
+	 * @param use  Purpose of the pulse, RF_AUTO restores the classification by flip angle
+	 */
+	void SetRfUse(int rfId, RfUse use);
+
+	/**
+	 * @brief Calculate the trajectory
+	 *
+	 * @return false if the sequence has no timing information, an RF or
+	 * gradient shape cannot be decoded or the ADC samples overlap
+	 */
+	bool calculate();
+
+	/**
+	 * @brief Return the trajectory at the ADC samples (1/m)
+	 *
+	 * Samples before the start or after the end of the sequence (due to the
+	 * trajectory delay) are NaN.
+	 * @param channel 0: x, 1: y, 2: z
+	 */
+	const std::vector<double>& GetAdcTrajectory(int channel) const;
+
+	/**
+	 * @brief Return the time of every ADC sample (us)
+	 */
+	const std::vector<double>& GetAdcTimes() const;
+
+	/**
+	 * @brief Return the trajectory at the start of every block (1/m)
+	 *
+	 * The last of the GetNumberOfBlocks()+1 values is the trajectory at the
+	 * end of the sequence.
+	 * @param channel 0: x, 1: y, 2: z
+	 */
+	const std::vector<double>& GetBlockTrajectory(int channel) const;
+
+	/**
+	 * @brief Return the centre of every excitation pulse (us)
+	 */
+	const std::vector<double>& GetExcitationTimes() const;
+
+	/**
+	 * @brief Return the centre of every refocusing pulse (us)
+	 */
+	const std::vector<double>& GetRefocusingTimes() const;
+
+	/**
+	 * @brief Return the centre of an RF pulse relative to its start (us)
+	 *
+	 * As mr.calcRfCenter() in MATLAB: the peak of the magnitude without
+	 * zero-padding, or the middle of a block pulse.
+	 */
+	static double GetRfCenter(const std::vector<float> &magnitude);
+
+protected:
+	/**
+	 * @brief Centre and purpose of an RF event
+	 */
+	struct RfInfo
+	{
+		double center;   /**< @brief Centre of the pulse relative to its start (us) */
+		RfUse use;       /**< @brief Purpose of the pulse */
+	};
+
+	/**
+	 * @brief Part of the sequence between two excitations
+	 */
+	struct Segment
+	{
+		double tStart;       /**< @brief Start of the segment (us) */
+		double tEnd;         /**< @brief End of the segment (us) */
+		int firstBlock;      /**< @brief Block containing the start */
+		int lastBlock;       /**< @brief Block containing the end */
+		bool last;           /**< @brief The segment ends with the sequence */
+	};
+
+	/**
+	 * @brief Determine the centre and purpose of an RF event
+	 */
+	bool classifyRF(int rfId, const RFEvent &rf, RfInfo &info);
+
+	/**
+	 * @brief Integrate the gradients of a segment and sample the trajectory
+	 */
+	bool calculateSegment(const Segment &seg);
+
+	ExternalSequence &m_seq;     /**< @brief Sequence to analyse */
+	int m_numThreads;            /**< @brief Number of threads (0: all cores) */
+	double m_trajectoryDelay;    /**< @brief Shift of the ADC sample times (us) */
+	double m_refocusingAngle;    /**< @brief Smallest flip angle of refocusing pulses (degrees) */
+
+	std::map<int,RfUse> m_rfUse;         /**< @brief Purpose of RF events set by the user */
+	std::map<int,RfInfo> m_rfInfo;       /**< @brief Centre and purpose of the RF events in use */
+
+	std::vector<double> m_adcTimes;              /**< @brief Time of every ADC sample */
+	std::vector<double> m_adcK[NUM_GRADS];       /**< @brief Trajectory at the ADC samples */
+	std::vector<double> m_blockK[NUM_GRADS];     /**< @brief Trajectory at the block boundaries */
+	std::vector<double> m_excitationTimes;       /**< @brief Centres of the excitation pulses */
+	std::vector<int> m_excitationBlocks;         /**< @brief Blocks of the excitation pulses */
+	std::vector<double> m_refocusingTimes;       /**< @brief Centres of the refocusing pulses */
+};
+
+inline void KspaceCalculator::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+inline void KspaceCalculator::SetTrajectoryDelay(double delay) { m_trajectoryDelay = delay; }
+inline void KspaceCalculator::SetRefocusingFlipAngle(double flipAngle) { m_refocusingAngle = flipAngle; }
+
+inline const std::vector<double>& KspaceCalculator::GetAdcTrajectory(int channel) const { return m_adcK[channel]; }
+inline const std::vector<double>& KspaceCalculator::GetAdcTimes() const { return m_adcTimes; }
+inline const std::vector<double>& KspaceCalculator::GetBlockTrajectory(int channel) const { return m_blockK[channel]; }
+inline const std::vector<double>& KspaceCalculator::GetExcitationTimes() const { return m_excitationTimes; }
+inline const std::vector<double>& KspaceCalculator::GetRefocusingTimes() const { return m_refocusingTimes; }
+
+#endif	//_KSPACE_CALCULATOR_H_
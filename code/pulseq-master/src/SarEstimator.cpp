@@ -0,0 +1,181 @@
+#include "SarEstimator.h"
+
+#include <math.h>		// sqrt, HUGE_VAL
+
+const double SarEstimator::GAMMA = 42.576;
+
+/***********************************************************/
+SarReport::SarReport()
+	: duration(0), totalEnergy(0), b1rms(0), numPulses(0)
+{
+}
+
+/***********************************************************/
+void SarReport::print() const
+{
+	ExternalSequence::print_msg(NORMAL_MSG, std::ostringstream().flush() << "RF pulses: " << numPulses
+		<< ", energy " << totalEnergy << " uT^2*s in " << duration << " s, B1rms " << b1rms << " uT");
+	for (size_t i=0; i<windows.size(); i++) {
+		const SarWindowResult &result = windows[i];
+		std::ostringstream msg;
+		msg << (result.ok ? "" : "*** ERROR: ") << result.window.length << " s window at " << result.peakStart
+			<< " s: B1rms " << result.peakB1rms << " uT, SAR " << result.peakSar << " W/kg"
+			<< (result.ok ? " within limit " : " exceeds limit ") << result.window.limit << " W/kg";
+		ExternalSequence::print_msg(result.ok ? NORMAL_MSG : ERROR_MSG, msg);
+	}
+}
+
+/***********************************************************/
+SarEstimator::SarEstimator(ExternalSequence &seq, double sarPerB1Squared)
+	: m_seq(seq), m_sarPerB1Squared(sarPerB1Squared)
+{
+	SarWindow shortTerm = { 10.0, 4.0 };
+	SarWindow longTerm = { 360.0, 2.0 };
+	m_windows.push_back(shortTerm);
+	m_windows.push_back(longTerm);
+}
+
+/***********************************************************/
+double SarEstimator::GetShapeEnergy(int shapeId)
+{
+	if (shapeId<=0)
+		return -1.0;
+	if ((size_t)shapeId>=m_shapeEnergy.size())
+		m_shapeEnergy.resize(MAX(shapeId, m_seq.GetNumberOfShapes())+1, -1.0);
+
+	if (m_shapeEnergy[shapeId]<0) {
+		DecodedShape shape = m_seq.GetDecodedShape(shapeId, SHAPE_RF_MAGNITUDE);
+		if (!shape)
+			return -1.0;
+		const std::vector<float> &samples = *shape;
+		double energy = 0.0;
+		for (size_t i=0; i<samples.size(); i++)
+			energy += (double)samples[i]*samples[i];
+		m_shapeEnergy[shapeId] = energy*RF_RASTER_TIME;
+	}
+	return m_shapeEnergy[shapeId];
+}
+
+/***********************************************************/
+void SarEstimator::WindowSweep::reset(double windowLength)
+{
+	length = windowLength;
+	pulses.clear();
+	nextStart = nextEnd = 0;
+	cursor[0] = cursor[1] = 0;
+	total = 0.0;
+	peakEnergy = 0.0;
+	peakStart = 0.0;
+}
+
+/***********************************************************/
+void SarEstimator::WindowSweep::add(const Pulse &pulse)
+{
+	pulses.push_back(pulse);
+	pulses.back().before = total;
+	total += pulse.energy;
+}
+
+/***********************************************************/
+double SarEstimator::WindowSweep::cumulative(int c, double t)
+{
+	// Cursors only move forward, as the candidate windows are visited in order
+	size_t &k = cursor[c];
+	while (k<pulses.size() && pulses[k].end<=t)
+		k++;
+	if (k==pulses.size())
+		return total;
+	const Pulse &pulse = pulses[k];
+	if (t<=pulse.start)
+		return pulse.before;
+	return pulse.before + pulse.energy*(t-pulse.start)/(pulse.end-pulse.start);
+}
+
+/***********************************************************/
+void SarEstimator::WindowSweep::advance(double time)
+{
+	// Evaluate the candidates whose window ends before all unknown pulses
+	for (;;) {
+		double startCandidate = nextStart<pulses.size() ? pulses[nextStart].start : HUGE_VAL;
+		double endCandidate = nextEnd<pulses.size() ? pulses[nextEnd].end-length : HUGE_VAL;
+		double a = MIN(startCandidate, endCandidate);
+		if (a==HUGE_VAL || a+length>time)
+			break;
+		if (startCandidate<=endCandidate)
+			nextStart++;
+		else
+			nextEnd++;
+
+		double energy = cumulative(1, a+length) - cumulative(0, a);
+		if (energy>peakEnergy) {
+			peakEnergy = energy;
+			peakStart = MAX(a, 0.0);	// windows starting earlier contain no more energy than at 0
+		}
+	}
+
+	// Release the pulses passed by all cursors
+	while (!pulses.empty() && nextStart>0 && nextEnd>0 && cursor[0]>0 && cursor[1]>0) {
+		pulses.pop_front();
+		nextStart--;
+		nextEnd--;
+		cursor[0]--;
+		cursor[1]--;
+	}
+}
+
+/***********************************************************/
+bool SarEstimator::estimate(SarReport &report)
+{
+	report = SarReport();
+	m_shapeEnergy.clear();	// the sequence may have been reloaded
+	std::vector<WindowSweep> sweeps(m_windows.size());
+	for (size_t i=0; i<m_windows.size(); i++)
+		sweeps[i].reset(m_windows[i].length*1e6);
+
+	// Single pass over the blocks, time in us
+	BlockStream stream(m_seq);
+	BlockView block;
+	double time = 0.0;
+	while (stream.next(block))
+	{
+		if (block.isRF()) {
+			const RFEvent &rf = block.GetRFEvent();
+			double shapeEnergy = GetShapeEnergy(rf.magShape);
+			if (shapeEnergy<0) {
+				ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: RF shape " << rf.magShape
+					<< " of block " << block.GetIndex()+1 << " cannot be decoded");
+				return false;
+			}
+			double b1 = rf.amplitude/GAMMA;
+			Pulse pulse;
+			pulse.start  = time + rf.delay;
+			pulse.end    = pulse.start + (double)m_seq.GetShapeLength(rf.magShape)*RF_RASTER_TIME;
+			pulse.energy = b1*b1*shapeEnergy*1e-6;
+			pulse.before = 0.0;
+			report.totalEnergy += pulse.energy;
+			report.numPulses++;
+			for (size_t i=0; i<sweeps.size(); i++) {
+				sweeps[i].advance(time);
+				sweeps[i].add(pulse);
+			}
+		}
+		time += (double)block.GetDuration();
+	}
+	if (stream.failed())
+		return false;
+
+	report.duration = time*1e-6;
+	report.b1rms = (time>0) ? sqrt(report.totalEnergy/report.duration) : 0.0;
+	for (size_t i=0; i<sweeps.size(); i++) {
+		sweeps[i].advance(HUGE_VAL);
+		SarWindowResult result;
+		result.window     = m_windows[i];
+		result.peakEnergy = sweeps[i].peakEnergy;
+		result.peakStart  = sweeps[i].peakStart*1e-6;
+		result.peakB1rms  = (m_windows[i].length>0) ? sqrt(result.peakEnergy/m_windows[i].length) : 0.0;
+		result.peakSar    = m_sarPerB1Squared*result.peakB1rms*result.peakB1rms;
+		result.ok         = (result.peakSar<=m_windows[i].limit);
+		report.windows.push_back(result);
+	}
+	return report.IsOk();
+}
@@ -0,0 +1,174 @@
+/** @file SarEstimator.h */
+
+#include "ExternalSequence.h"
+
+#include <deque>
+
+#ifndef _SAR_ESTIMATOR_H_
+#define _SAR_ESTIMATOR_H_
+
+/**
+ * @brief Sliding time window with an SAR limit
+ */
+struct SarWindow
+{
+	double length;   /**< @brief Length of the window (s) */
+	double limit;    /**< @brief Maximum SAR averaged over the window (W/kg) */
+};
+
+/**
+ * @brief Peak RF power found for a SarWindow
+ */
+struct SarWindowResult
+{
+	SarWindow window;      /**< @brief Window and limit */
+	double peakEnergy;     /**< @brief Maximum RF energy within the window (uT^2*s) */
+	double peakStart;      /**< @brief Start of the window with maximum energy (s) */
+	double peakB1rms;      /**< @brief B1 rms averaged over the window of maximum energy (uT) */
+	double peakSar;        /**< @brief SAR averaged over the window of maximum energy (W/kg) */
+	bool ok;               /**< @brief `true` if the SAR is within the limit */
+};
+
+/**
+ * @brief Result of SarEstimator::estimate()
+ */
+struct SarReport
+{
+	double duration;                       /**< @brief Duration of the sequence (s) */
+	double totalEnergy;                    /**< @brief RF energy of the sequence (uT^2*s) */
+	double b1rms;                          /**< @brief B1 rms over the complete sequence (uT) */
+	long long numPulses;                   /**< @brief Number of RF pulses */
+	std::vector<SarWindowResult> windows;  /**< @brief Peak power of each window */
+
+	/**
+	 * @brief Constructor, creates an empty report
+	 */
+	SarReport();
+
+	/**
+	 * @brief Return `true` if the SAR is within the limits of all windows
+	 */
+	bool IsOk() const;
+
+	/**
+	 * @brief Print the report with ExternalSequence::print_msg()
+	 */
+	void print() const;
+};
+
+
+/**
+ * @brief Estimate the RF power deposition of a sequence before playout
+ *
+ * Integrates |B1|^2 of the RF pulses, i.e. the squared magnitude shape scaled
+ * by RFEvent::amplitude (converted from Hz to uT), with one sample per 1 us
+ * RF raster interval. The energy of each magnitude shape is computed once and
+ * cached, so the energy of a pulse only costs a multiplication.
+ *
+ * The SAR is modelled as proportional to the mean B1 power. The coefficient
+ * depends on the coil, the patient and the position, e.g. it is taken from the
+ * SAR model of the scanner for the examination at hand.
+ *
+ * The blocks are read once with a BlockStream, which also works in streaming
+ * mode. The energy within every sliding window is evaluated while the pulses
+ * are read, keeping only the pulses of the last window in memory. The peak is
+ * exact for pulses of uniform power over their duration: it is found among the
+ * windows starting at a pulse or ending at the end of a pulse. Windows longer
+ * than the sequence average its energy over the full window length, the
+ * sequence is not assumed to be repeated.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * SarEstimator sar(seq, 0.08);    // W/kg per uT^2
+ * SarReport report;
+ * if (!sar.estimate(report))
+ *     report.print();
+ * ~~~~~~~~~~~~~
+ */
+class SarEstimator
+{
+public:
+	static const int RF_RASTER_TIME = 1;   /**< @brief Duration of an RF shape sample (us) */
+	static const double GAMMA;             /**< @brief Gyromagnetic ratio of protons (Hz/uT) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * Sets the default windows, the IEC normal operating mode limits of the
+	 * whole-body SAR: 4 W/kg over 10 s and 2 W/kg over 6 min.
+	 *
+	 * @param seq             Loaded sequence, must remain loaded while the estimator is in use
+	 * @param sarPerB1Squared SAR per mean B1 power (W/kg per uT^2)
+	 */
+	SarEstimator(ExternalSequence &seq, double sarPerB1Squared);
+
+	/**
+	 * @brief Replace the sliding windows and their limits
+	 */
+	void SetWindows(const std::vector<SarWindow> &windows);
+
+	/**
+	 * @brief Return the energy of an RF magnitude shape (sum of squared samples times 1 us)
+	 *
+	 * @return the energy in us or a negative value if the shape cannot be decoded
+	 */
+	double GetShapeEnergy(int shapeId);
+
+	/**
+	 * @brief Evaluate the RF power of all blocks
+	 *
+	 * @return true if the SAR is within the limits of all windows, false if a
+	 *         limit is exceeded or a shape cannot be decoded
+	 */
+	bool estimate(SarReport &report);
+
+protected:
+	/**
+	 * @brief RF pulse with uniform power over its duration
+	 */
+	struct Pulse
+	{
+		double start;    /**< @brief Start of the pulse (us) */
+		double end;      /**< @brief End of the pulse (us) */
+		double energy;   /**< @brief Energy of the pulse (uT^2*s) */
+		double before;   /**< @brief Energy of all earlier pulses (uT^2*s) */
+	};
+
+	/**
+	 * @brief Sliding window evaluated while the pulses are read
+	 *
+	 * The energy within [a,a+length] is F(a+length)-F(a), where F is the
+	 * cumulative energy. It is evaluated at the candidate starts `a` (pulse
+	 * starts and pulse ends minus the length) once all pulses before a+length
+	 * are known, and pulses left behind by all cursors are released.
+	 */
+	struct WindowSweep
+	{
+		double length;               /**< @brief Length of the window (us) */
+		std::deque<Pulse> pulses;    /**< @brief Pulses not yet released */
+		size_t nextStart;            /**< @brief Pulse whose start is the next candidate */
+		size_t nextEnd;              /**< @brief Pulse whose end is the next candidate */
+		size_t cursor[2];            /**< @brief First pulse ending after the window start and end */
+		double total;                /**< @brief Energy of all pulses added */
+		double peakEnergy;           /**< @brief Maximum energy found (uT^2*s) */
+		double peakStart;            /**< @brief Start of the window with maximum energy (us) */
+
+		void reset(double windowLength);
+		void add(const Pulse &pulse);
+		double cumulative(int c, double t);
+		void advance(double time);
+	};
+
+	ExternalSequence &m_seq;               /**< @brief Sequence to evaluate */
+	double m_sarPerB1Squared;              /**< @brief SAR per mean B1 power (W/kg per uT^2) */
+	std::vector<SarWindow> m_windows;      /**< @brief Windows and limits */
+	std::vector<double> m_shapeEnergy;     /**< @brief Energy of the magnitude shapes indexed by ID (<0: not computed) */
+};
+
+inline bool SarReport::IsOk() const {
+	for (size_t i=0; i<windows.size(); i++)
+		if (!windows[i].ok) return false;
+	return true;
+}
+inline void SarEstimator::SetWindows(const std::vector<SarWindow> &windows) { m_windows = windows; }
+
+#endif	//_SAR_ESTIMATOR_H_
@@ -0,0 +1,321 @@
+#include "SequenceValidator.h"
+
+#include <math.h>		// fabs, floor
+#include <algorithm>	// std::max
+#include <thread>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/***********************************************************/
+void HardwareLimits::ReadDefinitions(const ExternalSequence &seq)
+{
+	const std::map<std::string, std::vector<double> > &definitions = seq.GetDefinitions();
+	std::map<std::string, std::vector<double> >::const_iterator it;
+	if ((it=definitions.find("GradientRasterTime"))!=definitions.end() && !it->second.empty())
+		gradRasterTime = it->second[0]*1e6;
+	if ((it=definitions.find("RadiofrequencyRasterTime"))!=definitions.end() && !it->second.empty())
+		rfRasterTime = it->second[0]*1e6;
+	if ((it=definitions.find("AdcRasterTime"))!=definitions.end() && !it->second.empty())
+		adcRasterTime = it->second[0]*1e9;
+	if ((it=definitions.find("BlockDurationRaster"))!=definitions.end() && !it->second.empty())
+		blockDurationRaster = it->second[0]*1e6;
+}
+
+/***********************************************************/
+const char* ValidationError::GetCheckName(ValidationCheck check)
+{
+	static const char* names[NUM_VALIDATION_CHECKS] = { "raster", "gradient amplitude", "slew rate",
+		"RF dead time", "ADC dead time", "block duration", "shape" };
+	return (check>=0 && check<NUM_VALIDATION_CHECKS) ? names[check] : "";
+}
+
+/***********************************************************/
+std::string ValidationError::GetDescription() const
+{
+	static const char* eventNames[NUM_EVENTS] = { "block", "RF", "GX", "GY", "GZ", "ADC", "control" };
+	static const char* units[NUM_VALIDATION_CHECKS] = { "us", "Hz/m", "Hz/m/s", "us", "us", "us", "" };
+
+	std::ostringstream out;
+	out << "block " << block+1 << " " << eventNames[event] << ": " << GetCheckName(check);
+	if (check==CHECK_SHAPE)
+		out << " " << (int)value << " cannot be decoded";
+	else if (check==CHECK_RASTER)
+		out << " " << value << " us not on raster " << limit << " us";
+	else
+		out << " " << value << " " << units[check] << " exceeds limit " << limit << " " << units[check];
+	return out.str();
+}
+
+/***********************************************************/
+ValidationReport::ValidationReport()
+	: numBlocks(0), numErrors(0)
+{
+	std::fill(numErrorsByCheck, numErrorsByCheck+NUM_VALIDATION_CHECKS, 0LL);
+	std::fill(maxGradient, maxGradient+NUM_GRADS, 0.0);
+	std::fill(maxSlewRate, maxSlewRate+NUM_GRADS, 0.0);
+}
+
+/***********************************************************/
+void ValidationReport::print() const
+{
+	ExternalSequence::print_msg(NORMAL_MSG, std::ostringstream().flush() << "Checked " << numBlocks << " blocks: "
+		<< numErrors << " errors");
+	for (int i=0; i<NUM_VALIDATION_CHECKS; i++)
+		if (numErrorsByCheck[i]>0)
+			ExternalSequence::print_msg(NORMAL_MSG, std::ostringstream().flush() << "  " << ValidationError::GetCheckName((ValidationCheck)i)
+				<< ": " << numErrorsByCheck[i]);
+	for (size_t i=0; i<errors.size(); i++)
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: " << errors[i].GetDescription());
+	if ((long long)errors.size()<numErrors)
+		ExternalSequence::print_msg(NORMAL_MSG, std::ostringstream().flush() << "  (" << numErrors-(long long)errors.size()
+			<< " more errors not listed)");
+}
+
+/***********************************************************/
+SequenceValidator::SequenceValidator(ExternalSequence &seq, const HardwareLimits &limits)
+	: m_seq(seq), m_limits(limits), m_numThreads(1), m_maxErrors(1000) {}
+
+/** @brief Return `true` if the time t is a multiple of the raster */
+static inline bool onRaster(double t, double raster)
+{
+	if (!(raster>0))
+		return true;
+	double r = t/raster;
+	return fabs(r-floor(r+0.5)) < 1e-6;
+}
+
+/** @brief Compute the maximum absolute sample and difference of consecutive samples */
+static void shapeExtrema(const float *samples, size_t n, float &maxAbs, float &maxStep)
+{
+	maxAbs = 0.0f;
+	maxStep = 0.0f;
+	if (n==0)
+		return;
+	size_t k=1;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 value = _mm_setzero_ps();
+	__m128 step = _mm_setzero_ps();
+	for (; k+4<=n; k+=4) {
+		__m128 current = _mm_loadu_ps(samples+k);
+		__m128 previous = _mm_loadu_ps(samples+k-1);
+		value = _mm_max_ps(value, _mm_andnot_ps(sign, current));
+		step = _mm_max_ps(step, _mm_andnot_ps(sign, _mm_sub_ps(current, previous)));
+	}
+	float v[4], s[4];
+	_mm_storeu_ps(v, value);
+	_mm_storeu_ps(s, step);
+	maxAbs = std::max(std::max(v[0], v[1]), std::max(v[2], v[3]));
+	maxStep = std::max(std::max(s[0], s[1]), std::max(s[2], s[3]));
+#endif
+	maxAbs = std::max(maxAbs, fabsf(samples[0]));
+	for (; k<n; k++) {
+		maxAbs = std::max(maxAbs, fabsf(samples[k]));
+		maxStep = std::max(maxStep, fabsf(samples[k]-samples[k-1]));
+	}
+}
+
+/***********************************************************/
+void SequenceValidator::computeShapeStats(int numThreads)
+{
+	// Shapes of arbitrary gradients
+	const EventLibrary<GradEvent> &gradients = m_seq.GetGradientLibrary();
+	std::vector<int> shapes;
+	m_shapeStats.assign(m_seq.GetNumberOfShapes()+1, ShapeStats());
+	for (int id=1; id<=gradients.maxId(); id++) {
+		int shape = gradients[id].shape;
+		if (gradients.count(id) && shape>0 && shape<(int)m_shapeStats.size() && !m_shapeStats[shape].valid) {
+			m_shapeStats[shape].valid = true;
+			shapes.push_back(shape);
+		}
+	}
+
+	auto computeRange = [this,&shapes](size_t begin, size_t end) {
+		for (size_t i=begin; i<end; i++) {
+			ShapeStats &stats = m_shapeStats[shapes[i]];
+			DecodedShape samples = m_seq.GetDecodedShape(shapes[i], SHAPE_GRADIENT);
+			stats.valid = (bool)samples;
+			if (samples)
+				shapeExtrema(samples->data(), samples->size(), stats.maxAbs, stats.maxStep);
+		}
+	};
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, shapes.size()/16));
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		size_t begin = shapes.size()*i/numThreads;
+		size_t end = shapes.size()*(i+1)/numThreads;
+		if (i+1<numThreads)
+			threads.push_back(std::thread(computeRange, begin, end));
+		else
+			computeRange(begin, end);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+}
+
+/** @brief Count a violation and keep its details if the report is not full */
+static inline void addError(ValidationReport &report, size_t maxErrors, int block, Event event, ValidationCheck check,
+	double value, double limit)
+{
+	report.numErrors++;
+	report.numErrorsByCheck[check]++;
+	if (maxErrors==0 || report.errors.size()<maxErrors) {
+		ValidationError error = { block, event, check, value, limit };
+		report.errors.push_back(error);
+	}
+}
+
+/***********************************************************/
+void SequenceValidator::validateRange(int begin, int end, ValidationReport &report) const
+{
+	const HardwareLimits &lim = m_limits;
+	const double maxGrad = lim.maxGrad*(1+lim.tolerance);
+	const double maxSlew = lim.maxSlew*(1+lim.tolerance);
+	const double eps = 1e-6;
+	report.numBlocks = end-begin;
+
+	BlockView block;
+	for (int b=begin; b<end; b++)
+	{
+		m_seq.GetBlock(b, block);
+		const double duration = (double)block.GetDuration();
+		if (!onRaster(duration, lim.blockDurationRaster))
+			addError(report, m_maxErrors, b, DELAY, CHECK_RASTER, duration, lim.blockDurationRaster);
+
+		if (block.isRF()) {
+			const RFEvent &rf = block.GetRFEvent();
+			double rfEnd = rf.delay + (double)m_seq.GetShapeLength(rf.magShape)*RF_RASTER_TIME;
+			if (!onRaster(rf.delay, lim.rfRasterTime))
+				addError(report, m_maxErrors, b, RF, CHECK_RASTER, rf.delay, lim.rfRasterTime);
+			if (rf.delay<lim.rfDeadTime-eps)
+				addError(report, m_maxErrors, b, RF, CHECK_RF_DEAD_TIME, rf.delay, lim.rfDeadTime);
+			if (rfEnd>duration+eps)
+				addError(report, m_maxErrors, b, RF, CHECK_BLOCK_DURATION, rfEnd, duration);
+			else if (rfEnd+lim.rfRingdownTime>duration+eps)
+				addError(report, m_maxErrors, b, RF, CHECK_RF_DEAD_TIME, duration-rfEnd, lim.rfRingdownTime);
+		}
+
+		for (int c=0; c<NUM_GRADS; c++)
+		{
+			if (block.GetEventIndex((Event)(GX+c))<=0)
+				continue;
+			const Event event = (Event)(GX+c);
+			const GradEvent &grad = block.GetGradEvent(c);
+			const double amplitude = fabs(grad.amplitude);
+			double peak, slew, gradEnd;
+			if (!onRaster(grad.delay, lim.gradRasterTime))
+				addError(report, m_maxErrors, b, event, CHECK_RASTER, grad.delay, lim.gradRasterTime);
+
+			if (grad.shape==0)
+			{
+				// Trapezoid: exact slew rate of the ramps
+				const long times[3] = { grad.rampUpTime, grad.flatTime, grad.rampDownTime };
+				for (int i=0; i<3; i++)
+					if (!onRaster((double)times[i], lim.gradRasterTime))
+						addError(report, m_maxErrors, b, event, CHECK_RASTER, (double)times[i], lim.gradRasterTime);
+				peak = amplitude;
+				slew = 0.0;
+				if (amplitude>0) {
+					long ramp = MIN(grad.rampUpTime, grad.rampDownTime);
+					slew = (ramp>0) ? amplitude/(ramp*1e-6) : HUGE_VAL;
+				}
+				gradEnd = grad.delay + (double)(grad.rampUpTime + grad.flatTime + grad.rampDownTime);
+			}
+			else
+			{
+				// Arbitrary gradient: finite differences between the samples
+				if (grad.shape>=(int)m_shapeStats.size() || !m_shapeStats[grad.shape].valid) {
+					addError(report, m_maxErrors, b, event, CHECK_SHAPE, grad.shape, 0);
+					continue;
+				}
+				const ShapeStats &stats = m_shapeStats[grad.shape];
+				peak = amplitude*stats.maxAbs;
+				slew = amplitude*stats.maxStep/(GRAD_RASTER_TIME*1e-6);
+				gradEnd = grad.delay + (double)m_seq.GetShapeLength(grad.shape)*GRAD_RASTER_TIME;
+			}
+
+			report.maxGradient[c] = MAX(report.maxGradient[c], peak);
+			report.maxSlewRate[c] = MAX(report.maxSlewRate[c], slew);
+			if (peak>maxGrad)
+				addError(report, m_maxErrors, b, event, CHECK_GRADIENT, peak, lim.maxGrad);
+			if (slew>maxSlew)
+				addError(report, m_maxErrors, b, event, CHECK_SLEW_RATE, slew, lim.maxSlew);
+			if (gradEnd>duration+eps)
+				addError(report, m_maxErrors, b, event, CHECK_BLOCK_DURATION, gradEnd, duration);
+		}
+
+		if (block.isADC()) {
+			const ADCEvent &adc = block.GetADCEvent();
+			double adcEnd = adc.delay + adc.numSamples*(double)adc.dwellTime*1e-3;
+			if (!onRaster(adc.delay, lim.rfRasterTime))
+				addError(report, m_maxErrors, b, ADC, CHECK_RASTER, adc.delay, lim.rfRasterTime);
+			if (!onRaster(adc.dwellTime, lim.adcRasterTime))
+				addError(report, m_maxErrors, b, ADC, CHECK_RASTER, adc.dwellTime*1e-3, lim.adcRasterTime*1e-3);
+			if (adc.delay<lim.adcDeadTime-eps)
+				addError(report, m_maxErrors, b, ADC, CHECK_ADC_DEAD_TIME, adc.delay, lim.adcDeadTime);
+			if (adcEnd>duration+eps)
+				addError(report, m_maxErrors, b, ADC, CHECK_BLOCK_DURATION, adcEnd, duration);
+			else if (adcEnd+lim.adcDeadTime>duration+eps)
+				addError(report, m_maxErrors, b, ADC, CHECK_ADC_DEAD_TIME, duration-adcEnd, lim.adcDeadTime);
+		}
+
+		if (block.isTrigger() && block.GetControlEvent().duration>duration+eps)
+			addError(report, m_maxErrors, b, CTRL, CHECK_BLOCK_DURATION, (double)block.GetControlEvent().duration, duration);
+	}
+}
+
+/***********************************************************/
+bool SequenceValidator::validate(ValidationReport &report, int first, int last)
+{
+	report = ValidationReport();
+	int numBlocks = m_seq.GetNumberOfBlocks();
+	if (last<0)
+		last = numBlocks;
+	if (first<0 || first>last || last>numBlocks) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Invalid block range ["
+			<< first << "," << last << ") for " << numBlocks << " blocks");
+		return false;
+	}
+	if (m_seq.IsStreaming() || m_seq.GetBlockStartTimes().size()!=(size_t)numBlocks+1) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: Blocks must be loaded to validate them");
+		return false;
+	}
+
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	computeShapeStats(numThreads);
+
+	// Contiguous ranges of blocks, one report per thread merged in block order
+	const int MIN_BLOCKS_PER_THREAD = 4096;
+	numThreads = MAX(1, MIN(numThreads, (last-first)/MIN_BLOCKS_PER_THREAD));
+	std::vector<ValidationReport> reports(numThreads);
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		int begin = first + (int)((long long)(last-first)*i/numThreads);
+		int end   = first + (int)((long long)(last-first)*(i+1)/numThreads);
+		if (i+1<numThreads)
+			threads.push_back(std::thread([this,&reports,i,begin,end]() { validateRange(begin, end, reports[i]); }));
+		else
+			validateRange(begin, end, reports[i]);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	for (int i=0; i<numThreads; i++) {
+		const ValidationReport &part = reports[i];
+		report.numBlocks += part.numBlocks;
+		report.numErrors += part.numErrors;
+		for (int k=0; k<NUM_VALIDATION_CHECKS; k++)
+			report.numErrorsByCheck[k] += part.numErrorsByCheck[k];
+		for (int c=0; c<NUM_GRADS; c++) {
+			report.maxGradient[c] = MAX(report.maxGradient[c], part.maxGradient[c]);
+			report.maxSlewRate[c] = MAX(report.maxSlewRate[c], part.maxSlewRate[c]);
+		}
+		size_t keep = part.errors.size();
+		if (m_maxErrors>0)
+			keep = MIN(keep, m_maxErrors-MIN(m_maxErrors, report.errors.size()));
+		report.errors.insert(report.errors.end(), part.errors.begin(), part.errors.begin()+keep);
+	}
+	return report.IsOk();
+}
@@ -0,0 +1,202 @@
+/** @file SequenceValidator.h */
+
+#include "ExternalSequence.h"
+
+#ifndef _SEQUENCE_VALIDATOR_H_
+#define _SEQUENCE_VALIDATOR_H_
+
+/**
+ * @brief Hardware limits and raster times of an MR system
+ *
+ * C++ counterpart of mr.opts() in MATLAB, with the same defaults. Times are
+ * in us except the ADC raster (ns), gradients in Hz/m and slew rates in Hz/m/s.
+ */
+struct HardwareLimits
+{
+	double maxGrad = 40e-3*42.576e6;      /**< @brief Maximum gradient amplitude (Hz/m), default 40 mT/m */
+	double maxSlew = 170*42.576e6;        /**< @brief Maximum slew rate (Hz/m/s), default 170 T/m/s */
+	double rfDeadTime = 0;                /**< @brief Minimum time before an RF pulse (us) */
+	double rfRingdownTime = 0;            /**< @brief Minimum time after an RF pulse (us) */
+	double adcDeadTime = 0;               /**< @brief Minimum time before and after an ADC readout (us) */
+	double rfRasterTime = 1;              /**< @brief Raster of RF and ADC delays (us) */
+	double gradRasterTime = 10;           /**< @brief Raster of gradient times (us) */
+	double adcRasterTime = 1;             /**< @brief Raster of the ADC dwell time (ns) */
+	double blockDurationRaster = 10;      /**< @brief Raster of the block durations (us) */
+	double tolerance = 1e-5;              /**< @brief Relative tolerance of the amplitude and slew rate limits */
+
+	/**
+	 * @brief Take the raster times from the definitions of a sequence
+	 *
+	 * Reads GradientRasterTime, RadiofrequencyRasterTime, AdcRasterTime and
+	 * BlockDurationRaster (s) if they are defined.
+	 */
+	void ReadDefinitions(const ExternalSequence &seq);
+};
+
+
+/**
+ * @brief Checks performed by SequenceValidator
+ */
+enum ValidationCheck {
+	CHECK_RASTER,             /**< @brief Time not aligned to its raster */
+	CHECK_GRADIENT,           /**< @brief Gradient amplitude above maxGrad */
+	CHECK_SLEW_RATE,          /**< @brief Slew rate above maxSlew */
+	CHECK_RF_DEAD_TIME,       /**< @brief RF delay or ringdown too short */
+	CHECK_ADC_DEAD_TIME,      /**< @brief ADC delay or dead time after the readout too short */
+	CHECK_BLOCK_DURATION,     /**< @brief Event ends after its block */
+	CHECK_SHAPE,              /**< @brief Shape cannot be decoded */
+	NUM_VALIDATION_CHECKS     // this entry should be last in the list
+};
+
+/**
+ * @brief Violation of a hardware limit or raster by an event
+ */
+struct ValidationError
+{
+	int block;                /**< @brief Index of the block */
+	Event event;              /**< @brief Event type (DELAY for the block itself) */
+	ValidationCheck check;    /**< @brief Failed check */
+	double value;             /**< @brief Offending value */
+	double limit;             /**< @brief Limit or raster the value violates */
+
+	/**
+	 * @brief Return the name of a check
+	 */
+	static const char* GetCheckName(ValidationCheck check);
+
+	/**
+	 * @brief Return a one-line description for reports
+	 */
+	std::string GetDescription() const;
+};
+
+/**
+ * @brief Result of SequenceValidator::validate()
+ *
+ * Every violation is counted. The details of the first violations, in block
+ * order, are kept in `errors` (see SequenceValidator::SetMaxErrors()).
+ */
+struct ValidationReport
+{
+	int numBlocks;                                     /**< @brief Number of blocks checked */
+	long long numErrors;                               /**< @brief Total number of violations */
+	long long numErrorsByCheck[NUM_VALIDATION_CHECKS]; /**< @brief Violations of each check */
+	std::vector<ValidationError> errors;               /**< @brief Details of the first violations */
+	double maxGradient[NUM_GRADS];                     /**< @brief Peak gradient amplitude of each channel (Hz/m) */
+	double maxSlewRate[NUM_GRADS];                     /**< @brief Peak slew rate of each channel (Hz/m/s) */
+
+	/**
+	 * @brief Constructor, creates an empty report
+	 */
+	ValidationReport();
+
+	/**
+	 * @brief Return `true` if no violation was found
+	 */
+	bool IsOk() const;
+
+	/**
+	 * @brief Print the summary and the kept errors with ExternalSequence::print_msg()
+	 */
+	void print() const;
+};
+
+inline bool ValidationReport::IsOk() const { return numErrors==0; }
+
+
+/**
+ * @brief Check a sequence against the hardware limits of a system
+ *
+ * C++ counterpart of mr.checkTiming() and Sequence.checkTiming() in MATLAB,
+ * extended by the amplitude, slew rate and dead time limits. For every block:
+ *  - delays, trapezoid times and block durations must be on their raster,
+ *  - gradient amplitudes must not exceed maxGrad,
+ *  - slew rates must not exceed maxSlew; they are exact for the ramps of
+ *    trapezoids and finite differences between the samples of arbitrary
+ *    gradients (held for 10 us each),
+ *  - RF pulses and ADC readouts must respect their dead times,
+ *  - all events must end within their block.
+ *
+ * Gradients are checked on the logical axes, before rotation events. The
+ * statistics of arbitrary gradient shapes are computed once per shape, and
+ * the blocks are split into contiguous ranges checked by several threads.
+ * All blocks are checked, the validation does not stop at the first error.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * HardwareLimits limits;
+ * limits.maxGrad = 30e-3*42.576e6;
+ * SequenceValidator validator(seq, limits);
+ * ValidationReport report;
+ * if (!validator.validate(report))
+ *     report.print();
+ * ~~~~~~~~~~~~~
+ */
+class SequenceValidator
+{
+public:
+	static const int GRAD_RASTER_TIME = 10;   /**< @brief Duration of an arbitrary gradient sample (us) */
+	static const int RF_RASTER_TIME = 1;      /**< @brief Duration of an RF shape sample (us) */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the validator is in use.
+	 */
+	SequenceValidator(ExternalSequence &seq, const HardwareLimits &limits=HardwareLimits());
+
+	/**
+	 * @brief Set the number of threads used for validation
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Set the number of errors kept in the report (0: unlimited, default 1000)
+	 */
+	void SetMaxErrors(size_t maxErrors);
+
+	/**
+	 * @brief Check the blocks [first,last) of the sequence
+	 *
+	 * @param report Report of the violations found
+	 * @param first  Index of the first block
+	 * @param last   Index past the last block (-1: end of the sequence)
+	 * @return true if the blocks are within all limits, false on violations or
+	 *         if the blocks cannot be checked
+	 */
+	bool validate(ValidationReport &report, int first=0, int last=-1);
+
+protected:
+	/**
+	 * @brief Extreme values of an arbitrary gradient shape
+	 */
+	struct ShapeStats
+	{
+		bool valid;       /**< @brief Shape could be decoded */
+		float maxAbs;     /**< @brief Maximum absolute sample */
+		float maxStep;    /**< @brief Maximum absolute difference of consecutive samples */
+	};
+
+	/**
+	 * @brief Compute the statistics of the gradient shapes used by the sequence
+	 */
+	void computeShapeStats(int numThreads);
+
+	/**
+	 * @brief Check the blocks [begin,end), keeping at most m_maxErrors details
+	 */
+	void validateRange(int begin, int end, ValidationReport &report) const;
+
+	ExternalSequence &m_seq;              /**< @brief Sequence to validate */
+	HardwareLimits m_limits;              /**< @brief Limits of the system */
+	int m_numThreads;                     /**< @brief Number of threads (0: all cores) */
+	size_t m_maxErrors;                   /**< @brief Number of errors kept in the report (0: all) */
+	std::vector<ShapeStats> m_shapeStats; /**< @brief Statistics indexed by shape ID */
+};
+
+inline void SequenceValidator::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+inline void SequenceValidator::SetMaxErrors(size_t maxErrors) { m_maxErrors = maxErrors; }
+
+#endif	//_SEQUENCE_VALIDATOR_H_
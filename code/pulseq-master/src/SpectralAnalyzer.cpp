@@ -0,0 +1,276 @@
+#include "SpectralAnalyzer.h"
+#include "GradientRasterizer.h"
+
+#include <math.h>		// cos, sqrt, floor, ceil
+#include <complex>
+#include <thread>
+
+/**
+ * @brief Radix-2 FFT of real input
+ *
+ * The N real samples are transformed as N/2 complex samples (even samples as
+ * real part, odd samples as imaginary part) and the N/2+1 non-negative
+ * frequencies are separated afterwards.
+ */
+class RealFft
+{
+public:
+	RealFft(size_t n) : m_half(n/2), m_reverse(n/2), m_twiddle(n/4), m_post(n/2+1), m_work(n/2)
+	{
+		int bits = 0;
+		while (((size_t)1<<bits) < m_half)
+			bits++;
+		for (size_t i=0; i<m_half; i++) {
+			size_t r = 0;
+			for (int b=0; b<bits; b++)
+				r |= ((i>>b)&1) << (bits-1-b);
+			m_reverse[i] = r;
+		}
+		for (size_t k=0; k<m_twiddle.size(); k++)
+			m_twiddle[k] = std::polar(1.0, -TWO_PI*k/m_half);
+		for (size_t k=0; k<m_post.size(); k++)
+			m_post[k] = std::polar(1.0, -TWO_PI*k/n);
+	}
+
+	/** @brief Transform n real samples into n/2+1 complex coefficients */
+	void transform(const double *x, std::complex<double> *X)
+	{
+		std::complex<double> *z = &m_work[0];
+		for (size_t i=0; i<m_half; i++)
+			z[m_reverse[i]] = std::complex<double>(x[2*i], x[2*i+1]);
+
+		// Butterflies with explicit complex products (std::complex checks for NaN)
+		for (size_t len=2; len<=m_half; len<<=1) {
+			const size_t step = m_half/len, mid = len/2;
+			for (size_t i=0; i<m_half; i+=len) {
+				for (size_t j=0; j<mid; j++) {
+					const std::complex<double> &w = m_twiddle[j*step];
+					const std::complex<double> v = z[i+j+mid];
+					const double vr = v.real()*w.real() - v.imag()*w.imag();
+					const double vi = v.real()*w.imag() + v.imag()*w.real();
+					const double ur = z[i+j].real(), ui = z[i+j].imag();
+					z[i+j]     = std::complex<double>(ur+vr, ui+vi);
+					z[i+j+mid] = std::complex<double>(ur-vr, ui-vi);
+				}
+			}
+		}
+
+		// Separate the spectra of the even and odd samples
+		for (size_t k=0; k<=m_half; k++) {
+			const std::complex<double> a = z[k % m_half];
+			const std::complex<double> b = std::conj(z[(m_half-k) % m_half]);
+			const double er = 0.5*(a.real()+b.real()), ei = 0.5*(a.imag()+b.imag());
+			const double or_ = 0.5*(a.imag()-b.imag()), oi = -0.5*(a.real()-b.real());
+			const std::complex<double> &w = m_post[k];
+			X[k] = std::complex<double>(er + or_*w.real() - oi*w.imag(), ei + or_*w.imag() + oi*w.real());
+		}
+	}
+
+private:
+	size_t m_half;                              /**< @brief Length of the complex FFT */
+	std::vector<size_t> m_reverse;              /**< @brief Bit-reversed positions */
+	std::vector<std::complex<double> > m_twiddle;  /**< @brief Twiddle factors of the complex FFT */
+	std::vector<std::complex<double> > m_post;  /**< @brief Twiddle factors separating the real spectrum */
+	std::vector<std::complex<double> > m_work;  /**< @brief Complex samples */
+};
+
+/***********************************************************/
+SpectrumReport::SpectrumReport()
+	: frequencyResolution(0), numSegments(0)
+{
+}
+
+/***********************************************************/
+void SpectrumReport::print() const
+{
+	static const char* axes[NUM_GRADS] = { "GX", "GY", "GZ" };
+	ExternalSequence::print_msg(NORMAL_MSG, std::ostringstream().flush() << "Spectra of " << numSegments
+		<< " segments, resolution " << frequencyResolution << " Hz");
+	for (size_t i=0; i<bands.size(); i++) {
+		const BandResult &result = bands[i];
+		for (int c=0; c<NUM_GRADS; c++) {
+			bool ok = (result.rms[c]<=result.band.limit);
+			ExternalSequence::print_msg(ok ? NORMAL_MSG : ERROR_MSG, std::ostringstream().flush() << (ok ? "" : "*** ERROR: ")
+				<< "band " << result.band.fMin << "-" << result.band.fMax << " Hz " << axes[c] << ": RMS " << result.rms[c]
+				<< " Hz/m (peak at " << result.peakFrequency[c] << " Hz, segment maximum " << result.segmentRms[c]
+				<< " Hz/m at " << result.segmentTime[c] << " s)" << (ok ? " within limit " : " exceeds limit ")
+				<< result.band.limit << " Hz/m");
+		}
+	}
+}
+
+/***********************************************************/
+SpectralAnalyzer::SpectralAnalyzer(ExternalSequence &seq)
+	: m_seq(seq), m_rasterTime(10.0), m_segmentLength(DEFAULT_SEGMENT_LENGTH), m_overlap(0.5), m_numThreads(1)
+{
+}
+
+/** @brief Return the range [kBegin,kEnd) of the frequencies k*df within a band */
+static void bandBins(const ForbiddenBand &band, double df, size_t numBins, size_t &kBegin, size_t &kEnd)
+{
+	double lo = MAX(0.0, ceil(band.fMin/df - 1e-9));
+	double hi = MIN(floor(band.fMax/df + 1e-9) + 1, (double)numBins);
+	kBegin = (size_t)MIN(lo, (double)numBins);
+	kEnd = (hi>lo) ? (size_t)hi : kBegin;
+}
+
+/***********************************************************/
+void SpectralAnalyzer::analyzeRange(size_t begin, size_t end, size_t hop, Accumulator &sums)
+{
+	const size_t n = m_segmentLength, numBins = n/2+1;
+	const double dt = m_rasterTime;
+	const double df = 1.0/(n*dt*1e-6);
+
+	// Periodic Hann window, the periodogram is scaled to a one-sided density
+	std::vector<double> window(n);
+	double windowPower = 0.0;
+	for (size_t i=0; i<n; i++) {
+		window[i] = 0.5 - 0.5*cos(TWO_PI*i/n);
+		windowPower += window[i]*window[i];
+	}
+	const double scale = dt*1e-6/windowPower;
+
+	RealFft fft(n);
+	GradientRasterizer rasterizer(m_seq);
+	std::vector<float> waveform[NUM_GRADS];
+	for (int c=0; c<NUM_GRADS; c++)
+		waveform[c].resize(n);
+	std::vector<double> x(n), periodogram(numBins);
+	std::vector<std::complex<double> > spectrum(numBins);
+
+	for (size_t s=begin; s<end; s++)
+	{
+		const double tStart = (double)(s*hop)*dt;
+		if (!rasterizer.render(tStart, dt, n, &waveform[0][0], &waveform[1][0], &waveform[2][0])) {
+			sums.ok = false;
+			return;
+		}
+		for (int c=0; c<NUM_GRADS; c++)
+		{
+			const float *g = &waveform[c][0];
+			bool zero = true;
+			for (size_t i=0; i<n && zero; i++)
+				zero = (g[i]==0.0f);
+			if (zero)
+				continue;
+
+			for (size_t i=0; i<n; i++)
+				x[i] = window[i]*g[i];
+			fft.transform(&x[0], &spectrum[0]);
+			for (size_t k=0; k<numBins; k++) {
+				double p = std::norm(spectrum[k])*scale;
+				periodogram[k] = (k>0 && k<numBins-1) ? 2*p : p;
+				sums.psd[c][k] += periodogram[k];
+			}
+
+			for (size_t b=0; b<m_bands.size(); b++) {
+				size_t kBegin, kEnd;
+				bandBins(m_bands[b], df, numBins, kBegin, kEnd);
+				double power = 0.0;
+				for (size_t k=kBegin; k<kEnd; k++)
+					power += periodogram[k];
+				double rms = sqrt(power*df);
+				if (rms>sums.segmentRms[b*NUM_GRADS+c]) {
+					sums.segmentRms[b*NUM_GRADS+c] = rms;
+					sums.segmentTime[b*NUM_GRADS+c] = tStart;
+				}
+			}
+		}
+	}
+}
+
+/***********************************************************/
+bool SpectralAnalyzer::analyze(SpectrumReport &report)
+{
+	report = SpectrumReport();
+	const size_t n = m_segmentLength;
+	if (n<4 || (n&(n-1))!=0) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: segment length " << n
+			<< " is not a power of two");
+		return false;
+	}
+	if (!(m_rasterTime>0) || !(m_overlap>=0 && m_overlap<1)) {
+		ExternalSequence::print_msg(ERROR_MSG, std::ostringstream().flush() << "*** ERROR: invalid raster time "
+			<< m_rasterTime << " or overlap " << m_overlap);
+		return false;
+	}
+
+	// Segments covering the sequence, the last one is padded with zeros
+	const size_t numSamples = GradientRasterizer::GetNumSamples((double)m_seq.GetTotalDuration(), m_rasterTime);
+	const size_t hop = (size_t)MAX(1.0, floor(n*(1-m_overlap) + 0.5));
+	const size_t numSegments = (numSamples==0) ? 0 : (numSamples<=n) ? 1 : (numSamples-n+hop-1)/hop + 1;
+	const size_t numBins = n/2+1;
+	const double df = 1.0/(n*m_rasterTime*1e-6);
+
+	int numThreads = m_numThreads>0 ? m_numThreads : (int)std::thread::hardware_concurrency();
+	numThreads = (int)MAX(1, MIN((size_t)numThreads, numSegments/4));
+	std::vector<Accumulator> sums(numThreads);
+	for (int i=0; i<numThreads; i++) {
+		for (int c=0; c<NUM_GRADS; c++)
+			sums[i].psd[c].assign(numBins, 0.0);
+		sums[i].segmentRms.assign(m_bands.size()*NUM_GRADS, 0.0);
+		sums[i].segmentTime.assign(m_bands.size()*NUM_GRADS, 0.0);
+		sums[i].ok = true;
+	}
+	std::vector<std::thread> threads;
+	for (int i=0; i<numThreads; i++) {
+		size_t begin = numSegments*i/numThreads;
+		size_t end = numSegments*(i+1)/numThreads;
+		if (i+1<numThreads)
+			threads.push_back(std::thread([this,&sums,i,begin,end,hop]() { analyzeRange(begin, end, hop, sums[i]); }));
+		else
+			analyzeRange(begin, end, hop, sums[i]);
+	}
+	for (size_t i=0; i<threads.size(); i++)
+		threads[i].join();
+
+	// Average the periodograms
+	report.frequencyResolution = df;
+	report.numSegments = (int)numSegments;
+	for (int c=0; c<NUM_GRADS; c++)
+		report.psd[c].assign(numBins, 0.0);
+	for (int i=0; i<numThreads; i++) {
+		if (!sums[i].ok)
+			return false;
+		for (int c=0; c<NUM_GRADS; c++)
+			for (size_t k=0; k<numBins; k++)
+				report.psd[c][k] += sums[i].psd[c][k];
+	}
+	if (numSegments>0)
+		for (int c=0; c<NUM_GRADS; c++)
+			for (size_t k=0; k<numBins; k++)
+				report.psd[c][k] /= numSegments;
+
+	for (size_t b=0; b<m_bands.size(); b++) {
+		BandResult result;
+		result.band = m_bands[b];
+		result.ok = true;
+		size_t kBegin, kEnd;
+		bandBins(m_bands[b], df, numBins, kBegin, kEnd);
+		for (int c=0; c<NUM_GRADS; c++) {
+			double power = 0.0, peak = -1.0;
+			result.peakFrequency[c] = 0.0;
+			for (size_t k=kBegin; k<kEnd; k++) {
+				power += report.psd[c][k];
+				if (report.psd[c][k]>peak) {
+					peak = report.psd[c][k];
+					result.peakFrequency[c] = k*df;
+				}
+			}
+			result.rms[c] = sqrt(power*df);
+			result.ok = result.ok && (result.rms[c]<=m_bands[b].limit);
+
+			// Segment of maximum band energy, the first one of equal maxima
+			result.segmentRms[c] = 0.0;
+			result.segmentTime[c] = 0.0;
+			for (int i=0; i<numThreads; i++) {
+				if (sums[i].segmentRms[b*NUM_GRADS+c]>result.segmentRms[c]) {
+					result.segmentRms[c] = sums[i].segmentRms[b*NUM_GRADS+c];
+					result.segmentTime[c] = sums[i].segmentTime[b*NUM_GRADS+c]*1e-6;
+				}
+			}
+		}
+		report.bands.push_back(result);
+	}
+	return report.IsOk();
+}
@@ -0,0 +1,168 @@
+/** @file SpectralAnalyzer.h */
+
+#include "ExternalSequence.h"
+
+#ifndef _SPECTRAL_ANALYZER_H_
+#define _SPECTRAL_ANALYZER_H_
+
+/**
+ * @brief Frequency band of a mechanical resonance of the gradient coil
+ */
+struct ForbiddenBand
+{
+	double fMin;      /**< @brief Lower edge of the band (Hz) */
+	double fMax;      /**< @brief Upper edge of the band (Hz) */
+	double limit;     /**< @brief Maximum RMS gradient of an axis within the band (Hz/m) */
+};
+
+/**
+ * @brief Gradient energy found in a ForbiddenBand
+ */
+struct BandResult
+{
+	ForbiddenBand band;                 /**< @brief Band and limit */
+	double rms[NUM_GRADS];              /**< @brief RMS gradient within the band of the averaged spectrum (Hz/m) */
+	double peakFrequency[NUM_GRADS];    /**< @brief Frequency of the maximum of the averaged spectrum in the band (Hz) */
+	double segmentRms[NUM_GRADS];       /**< @brief Maximum RMS gradient within the band of a single segment (Hz/m) */
+	double segmentTime[NUM_GRADS];      /**< @brief Start of the segment with the maximum RMS gradient (s) */
+	bool ok;                            /**< @brief `true` if the averaged RMS gradients are within the limit */
+};
+
+/**
+ * @brief Result of SpectralAnalyzer::analyze()
+ */
+struct SpectrumReport
+{
+	double frequencyResolution;         /**< @brief Spacing of the frequencies (Hz) */
+	int numSegments;                    /**< @brief Number of segments averaged */
+	std::vector<double> psd[NUM_GRADS]; /**< @brief One-sided power spectral density of each axis ((Hz/m)^2/Hz) */
+	std::vector<BandResult> bands;      /**< @brief Results of the forbidden bands */
+
+	/**
+	 * @brief Constructor, creates an empty report
+	 */
+	SpectrumReport();
+
+	/**
+	 * @brief Return `true` if no forbidden band exceeds its limit
+	 */
+	bool IsOk() const;
+
+	/**
+	 * @brief Print the band results with ExternalSequence::print_msg()
+	 */
+	void print() const;
+};
+
+
+/**
+ * @brief Power spectra of the gradient waveforms and forbidden frequency bands
+ *
+ * Estimates the power spectral density of the physical GX, GY and GZ waveforms
+ * with Welch's method: the waveforms are rendered by a GradientRasterizer in
+ * overlapping segments, each segment is multiplied by a Hann window and the
+ * periodograms are averaged. The integral of the spectrum is the mean square
+ * gradient, so the energy within a band is given as RMS gradient.
+ *
+ * The spectrum is compared with forbidden bands, e.g. the acoustic resonances
+ * of the gradient coil. Besides the averaged spectrum, the band energy of every
+ * single segment is evaluated to locate short bursts.
+ *
+ * The FFT is built in (radix-2, real input through a complex FFT of half the
+ * length), so the segment length must be a power of two. The segments are
+ * split between threads, segments without gradients are skipped.
+ *
+ * ~~~~~~~~~~~~~{.cpp}
+ * SpectralAnalyzer analyzer(seq);
+ * ForbiddenBand band = { 530, 650, 1e3 };
+ * analyzer.SetForbiddenBands(std::vector<ForbiddenBand>(1, band));
+ * SpectrumReport report;
+ * if (!analyzer.analyze(report))
+ *     report.print();
+ * ~~~~~~~~~~~~~
+ */
+class SpectralAnalyzer
+{
+public:
+	static const size_t DEFAULT_SEGMENT_LENGTH = 4096;   /**< @brief Default number of samples per segment */
+
+	/**
+	 * @brief Constructor
+	 *
+	 * The sequence must be loaded completely (not in streaming mode) and
+	 * remain loaded while the analyzer is in use.
+	 */
+	SpectralAnalyzer(ExternalSequence &seq);
+
+	/**
+	 * @brief Set the sampling interval of the waveforms (us, default 10)
+	 */
+	void SetRasterTime(double rasterTime);
+
+	/**
+	 * @brief Set the number of samples per segment (power of two, default 4096)
+	 */
+	void SetSegmentLength(size_t length);
+
+	/**
+	 * @brief Set the overlap of consecutive segments as a fraction of their length (default 0.5)
+	 */
+	void SetOverlap(double overlap);
+
+	/**
+	 * @brief Set the number of threads
+	 *
+	 * @param numThreads 1: single thread (default), 0: one thread per CPU core
+	 */
+	void SetNumThreads(int numThreads);
+
+	/**
+	 * @brief Set the forbidden frequency bands
+	 */
+	void SetForbiddenBands(const std::vector<ForbiddenBand> &bands);
+
+	/**
+	 * @brief Compute the spectra of the complete sequence and check the bands
+	 *
+	 * @return true if all bands are within their limits, false if a limit is
+	 *         exceeded or the spectra cannot be computed
+	 */
+	bool analyze(SpectrumReport &report);
+
+protected:
+	/**
+	 * @brief Sums accumulated by a thread over its segments
+	 */
+	struct Accumulator
+	{
+		std::vector<double> psd[NUM_GRADS];   /**< @brief Sum of the periodograms */
+		std::vector<double> segmentRms;       /**< @brief Maximum band RMS of a segment, per band and axis */
+		std::vector<double> segmentTime;      /**< @brief Start of that segment (us) */
+		bool ok;                              /**< @brief Segments could be rendered */
+	};
+
+	/**
+	 * @brief Accumulate the periodograms of the segments [begin,end)
+	 */
+	void analyzeRange(size_t begin, size_t end, size_t hop, Accumulator &sums);
+
+	ExternalSequence &m_seq;                  /**< @brief Sequence to analyze */
+	double m_rasterTime;                      /**< @brief Sampling interval (us) */
+	size_t m_segmentLength;                   /**< @brief Samples per segment */
+	double m_overlap;                         /**< @brief Overlap of the segments */
+	int m_numThreads;                         /**< @brief Number of threads (0: all cores) */
+	std::vector<ForbiddenBand> m_bands;       /**< @brief Forbidden bands */
+};
+
+inline bool SpectrumReport::IsOk() const {
+	for (size_t i=0; i<bands.size(); i++)
+		if (!bands[i].ok) return false;
+	return true;
+}
+inline void SpectralAnalyzer::SetRasterTime(double rasterTime) { m_rasterTime = rasterTime; }
+inline void SpectralAnalyzer::SetSegmentLength(size_t length) { m_segmentLength = length; }
+inline void SpectralAnalyzer::SetOverlap(double overlap) { m_overlap = overlap; }
+inline void SpectralAnalyzer::SetNumThreads(int numThreads) { m_numThreads = (numThreads<0) ? 1 : numThreads; }
+inline void SpectralAnalyzer::SetForbiddenBands(const std::vector<ForbiddenBand> &bands) { m_bands = bands; }
+
+#endif	//_SPECTRAL_ANALYZER_H_
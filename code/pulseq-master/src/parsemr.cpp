@@ -8,6 +8,60 @@
  * and ADC events. The sequence is defined according to the specification of
  * the open file format available in the docs directory.
  *
+ * Options select how the sequence is loaded and replace the summary with a
+ * listing of all blocks, which is compared with approved outputs by testparser.py:
+ *
+ *     parsemr [--threads N] [--stream N] [--eager-shapes] [--cache DIR] [--cache-decoded]
+ *             [--cache-verify] [--rewrite text|binary PATH] [--validate] [--gradients] [--sar K [--sar-window S LIMIT]]
+ *             [--band FMIN FMAX LIMIT]
+ *             [--waveforms DT [--window T0 N]] [--kspace] [--bloch PHANTOM]
+ *             [--epg [--tissue T1 T2 B1 DB0]] [--dump] file
+ *
+ *  - `--threads N` parse with N threads (0: one per CPU core), see ExternalSequence::SetLoadThreads()
+ *  - `--stream N` load in streaming mode and read the blocks through a BlockStream
+ *    holding N blocks, see ExternalSequence::SetStreamingMode()
+ *  - `--eager-shapes` parse all shape samples while loading instead of on first
+ *    use, see ExternalSequence::SetLazyShapes()
+ *  - `--cache DIR` use and write cache images in DIR, see ExternalSequence::SetCacheMode().
+ *    Whether the image or the file was read is printed to the standard error.
+ *  - `--cache-decoded` also store the decompressed shapes in the cache images
+ *  - `--cache-verify` also check the hash of the whole cache image before using it
+ *  - `--rewrite FORMAT PATH` write the sequence to PATH in the text or binary format
+ *    with SequenceWriter, read it back and print how its blocks, shapes and
+ *    libraries compare with the original ones
+ *  - `--validate` check the sequence against the default HardwareLimits (with
+ *    the raster times of its definitions) and print the report of
+ *    SequenceValidator, not in streaming mode
+ *  - `--gradients` predict the PNS and gradient duty cycles with the default
+ *    PnsModel and print the report of GradientMonitor, not in streaming mode
+ *  - `--sar K` estimate the RF power with K W/kg per uT^2 and print the report
+ *    of SarEstimator for the default 10 s and 6 min windows
+ *  - `--sar-window S LIMIT` replace the default windows by windows of S seconds
+ *    with a limit of LIMIT W/kg (repeated for several windows)
+ *  - `--band FMIN FMAX LIMIT` compute the spectra of the gradients with
+ *    SpectralAnalyzer (with the threads of `--threads`) and print the RMS
+ *    gradient within the band (repeated for several bands), not in streaming mode
+ *  - `--waveforms DT` render the gradients with GradientRasterizer (with the
+ *    threads of `--threads`) on a raster of DT us and print the time (us) and
+ *    the GX, GY and GZ values (Hz/m) of each sample, not in streaming mode
+ *  - `--window T0 N` render only N samples starting at T0 us
+ *  - `--kspace` calculate the k-space trajectory with KspaceCalculator (with the
+ *    threads of `--threads`) and print the times of the excitation and
+ *    refocusing pulses and the time (us) and k (1/m) of each ADC sample, not
+ *    in streaming mode
+ *  - `--bloch PHANTOM` simulate the sequence with BlochSimulator (with the
+ *    threads of `--threads`) on the phantom file written by mr.writePhantom()
+ *    and print the signal of each ADC sample, not in streaming mode
+ *  - `--epg` simulate the echoes with EpgSimulator (with the threads of
+ *    `--threads`) and print the echo amplitudes of the tissues, one echo per
+ *    line, not in streaming mode
+ *  - `--tissue T1 T2 B1 DB0` add a tissue to the simulation with `--epg`
+ *    (relaxation times in s, B1 scaling, off-resonance in Hz)
+ *  - `--dump` print the definitions, every block with the values of its events and
+ *    a hash of its decoded shapes, and the sizes of the libraries. Messages are
+ *    printed to the standard error, so the listing does not depend on how the
+ *    sequence was loaded.
+ *
  * @author Kelvin Layton <kelvin.layton@uniklinik-freiburg.de>
  */
 
@@ -19,20 +73,532 @@
  * - Constructing an ExternalSequence object.
  * - Setting a custom output function using ExternalSequence::SetPrintFunction such that a # symbol is printed before all messages.
  * - Load a sequence with the ExternalSequence::load member function.
- * - Iterate over sequence blocks and count the occurrence of different events.
+ * - Iterate over sequence blocks with ExternalSequence::blocks() (or a BlockStream in streaming mode) and count the occurrence of different events.
  * - Print a summary of the sequence to the standard output.
  *
  */
 
 #include "ExternalSequence.h"
+#include "SequenceValidator.h"
+#include "GradientMonitor.h"
+#include "SarEstimator.h"
+#include "SpectralAnalyzer.h"
+#include "GradientRasterizer.h"
+#include "KspaceCalculator.h"
+#include "BlochSimulator.h"
+#include "EpgSimulator.h"
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <set>
+
+static std::ostream *msg_stream = &std::cout;   // destination of the messages of ExternalSequence
 
 void custom_print(const std::string &str) {
-	std::cout << "# " << str << std::endl;
+	*msg_stream << "# " << str << std::endl;
+}
+
+/**
+ * @brief Print the length and a hash (FNV-1a of the bit patterns) of the decoded samples of a shape
+ */
+void print_shape(ExternalSequence &seq, int shapeId, ShapeUsage usage)
+{
+	DecodedShape shape = seq.GetDecodedShape(shapeId,usage);
+	if (!shape) {
+		std::cout << " -";
+		return;
+	}
+	unsigned int hash = 2166136261u;
+	for (size_t i=0; i<shape->size(); i++) {
+		unsigned int bits;
+		memcpy(&bits,&(*shape)[i],sizeof(bits));
+		for (int b=0; b<4; b++) {
+			hash ^= (bits>>(8*b)) & 0xff;
+			hash *= 16777619u;
+		}
+	}
+	std::cout << " " << shape->size() << ":" << std::hex << std::setw(8) << std::setfill('0') << hash
+		<< std::dec << std::setfill(' ');
+}
+
+/**
+ * @brief Print the values of the events of a block on one line
+ *
+ * Events are printed by value rather than by ID, so sequences with differently
+ * numbered libraries give the same listing.
+ */
+void print_block(ExternalSequence &seq, const BlockView &block, long long startTime)
+{
+	const char axes[] = "xyz";
+	std::cout << block.GetIndex() << " t=" << startTime << " d=" << block.GetDuration();
+	if (block.isDelay())
+		std::cout << " delay " << block.GetDelay();
+	if (block.isRF()) {
+		const RFEvent &rf = block.GetRFEvent();
+		std::cout << " rf " << rf.amplitude;
+		print_shape(seq,rf.magShape,SHAPE_RF_MAGNITUDE);
+		print_shape(seq,rf.phaseShape,SHAPE_RF_PHASE);
+		std::cout << " " << rf.freqOffset << " " << rf.phaseOffset << " " << rf.delay;
+	}
+	for (int i=0; i<NUM_GRADS; i++) {
+		const GradEvent &grad = block.GetGradEvent(i);
+		if (block.isTrapGradient(i)) {
+			std::cout << " g" << axes[i] << " trap " << grad.amplitude << " " << grad.rampUpTime << " "
+				<< grad.flatTime << " " << grad.rampDownTime << " " << grad.delay;
+		}
+		else if (block.isArbitraryGradient(i)) {
+			std::cout << " g" << axes[i] << " arb " << grad.amplitude;
+			print_shape(seq,grad.shape,SHAPE_GRADIENT);
+			std::cout << " " << grad.delay;
+		}
+	}
+	if (block.isADC()) {
+		const ADCEvent &adc = block.GetADCEvent();
+		std::cout << " adc " << adc.numSamples << " " << adc.dwellTime << " " << adc.delay << " "
+			<< adc.freqOffset << " " << adc.phaseOffset;
+	}
+	if (block.isTrigger()) {
+		const ControlEvent &control = block.GetControlEvent();
+		std::cout << " trigger " << control.triggerType << " " << control.duration;
+	}
+	if (block.isRotation()) {
+		const ControlEvent &control = block.GetControlEvent();
+		std::cout << " rotation";
+		for (int i=0; i<9; i++)
+			std::cout << " " << control.rotMatrix[i];
+	}
+	std::cout << std::endl;
+}
+
+/**
+ * @brief Call `fun` for every block of the sequence
+ *
+ * Blocks of a sequence loaded in streaming mode are read through a BlockStream
+ * holding `windowSize` blocks.
+ *
+ * @return false if the blocks cannot be read
+ */
+template<typename Function>
+bool for_each_block(ExternalSequence &seq, int windowSize, Function fun)
+{
+	if (seq.IsStreaming()) {
+		BlockStream stream(seq,windowSize);
+		BlockView block;
+		while (stream.next(block))
+			fun(block);
+		return !stream.failed();
+	}
+	for (const BlockView &block : seq.blocks())
+		fun(block);
+	return true;
+}
+
+/**
+ * @brief Return the number of defined shapes
+ */
+int count_shapes(const ExternalSequence &seq)
+{
+	int numShapes = 0;
+	for (int id=1; id<=seq.GetNumberOfShapes(); id++)
+		if (seq.GetShapeLength(id)>0)
+			numShapes++;
+	return numShapes;
+}
+
+/**
+ * @brief Print the definitions, all blocks and the sizes of the libraries
+ * @return false if the blocks cannot be read
+ */
+bool dump_sequence(ExternalSequence &seq, int windowSize)
+{
+	std::cout << std::setprecision(9);
+
+	std::cout << "[DEFINITIONS]" << std::endl;
+	const std::map<std::string, std::vector<double> > &definitions = seq.GetDefinitions();
+	for (std::map<std::string, std::vector<double> >::const_iterator it=definitions.begin(); it!=definitions.end(); ++it) {
+		std::cout << it->first;
+		for (size_t i=0; i<it->second.size(); i++)
+			std::cout << " " << it->second[i];
+		std::cout << std::endl;
+	}
+
+	std::cout << "[BLOCKS]" << std::endl;
+	long long startTime = 0;
+	bool ok = for_each_block(seq, windowSize, [&](const BlockView &block) {
+		print_block(seq,block,startTime);
+		startTime += block.GetDuration();
+	});
+	if (!ok)
+		return false;
+
+	std::cout << "[LIBRARIES]" << std::endl;
+	std::cout << "rf " << seq.GetRFLibrary().size() << " grad " << seq.GetGradientLibrary().size()
+		<< " adc " << seq.GetADCLibrary().size() << " delay " << seq.GetDelayLibrary().size()
+		<< " control " << seq.GetControlLibrary().size() << " shapes " << count_shapes(seq) << std::endl;
+	return true;
+}
+
+/**
+ * @brief Add a shape of the sequence to the writer, return its ID in the writer
+ *
+ * The shape is added as decoded samples, so it is compressed again by the writer.
+ */
+int add_shape(SequenceWriter &writer, ExternalSequence &seq, int shapeId)
+{
+	if (shapeId==0)
+		return 0;
+	DecodedShape shape = seq.GetDecodedShape(shapeId,SHAPE_GRADIENT);	// samples in [-1,1] without scaling
+	return shape ? writer.AddShape(*shape) : 0;
+}
+
+/**
+ * @brief Write the sequence with SequenceWriter
+ *
+ * The events and shapes of every block are added again, so the writer has to
+ * find the repeated ones in its libraries. Written libraries of the size of the
+ * original ones show that all duplicates were detected.
+ *
+ * @return false if an event is rejected or the file cannot be written
+ */
+bool rewrite_sequence(ExternalSequence &seq, int windowSize, const std::string &path, SequenceWriter::Format format)
+{
+	SequenceWriter writer;
+	int version = seq.GetVersion();
+	writer.SetVersion(version/1000000, (version/1000)%1000, version%1000);
+	if (!writer.open(path,format))
+		return false;
+	const std::map<std::string, std::vector<double> > &definitions = seq.GetDefinitions();
+	for (std::map<std::string, std::vector<double> >::const_iterator it=definitions.begin(); it!=definitions.end(); ++it)
+		writer.SetDefinition(it->first, it->second);
+
+	bool ok = true;
+	bool read = for_each_block(seq, windowSize, [&](const BlockView &block) {
+		EventIDs events = {};
+		if (block.isDelay())
+			events.id[DELAY] = writer.AddDelay(block.GetDelay());
+		if (block.isRF()) {
+			RFEvent rf = block.GetRFEvent();
+			rf.magShape = add_shape(writer, seq, rf.magShape);
+			rf.phaseShape = add_shape(writer, seq, rf.phaseShape);
+			events.id[RF] = writer.AddRF(rf);
+		}
+		for (int i=0; i<NUM_GRADS; i++) {
+			if (block.GetEventIndex((Event)(GX+i))>0) {
+				GradEvent grad = block.GetGradEvent(i);
+				grad.shape = add_shape(writer, seq, grad.shape);
+				events.id[GX+i] = writer.AddGradient(grad);
+			}
+		}
+		if (block.isADC())
+			events.id[ADC] = writer.AddADC(block.GetADCEvent());
+		if (block.GetEventIndex(CTRL)>0)
+			events.id[CTRL] = writer.AddControl(block.GetControlEvent());
+
+		// Events rejected by the writer have ID 0
+		for (int e=0; e<NUM_EVENTS; e++)
+			ok &= (block.GetEventIndex((Event)e)>0) == (events.id[e]>0);
+		ok &= writer.AddBlock(events);
+	});
+	return writer.close() && read && ok;
+}
+
+/**
+ * @brief Comparison of a sequence with the sequence written by rewrite_sequence()
+ */
+struct Comparison
+{
+	int numBlocks = 0;            // blocks of the original sequence
+	int numDifferingBlocks = 0;   // blocks with differing events or durations
+	int numDifferingShapes = 0;   // pairs of shapes differing by more than SHAPE_TOLERANCE
+	std::set<std::pair<int,int> > shapes;  // compared pairs of shape IDs
+};
+
+const double SHAPE_TOLERANCE = 1e-6;   // compressed shapes are quantized to 1e-8 and summed in single precision
+
+/**
+ * @brief Compare two shapes sample by sample, in the units of the file
+ * @return false if the shapes are not equal within SHAPE_TOLERANCE
+ */
+bool same_shape(ExternalSequence &seq1, int id1, ExternalSequence &seq2, int id2, Comparison &result)
+{
+	if (id1==0 || id2==0)
+		return id1==id2;
+	if (!result.shapes.insert(std::make_pair(id1,id2)).second)
+		return true;	// differing pairs are only counted once
+
+	DecodedShape shape1 = seq1.GetDecodedShape(id1,SHAPE_GRADIENT);
+	DecodedShape shape2 = seq2.GetDecodedShape(id2,SHAPE_GRADIENT);
+	bool same = shape1 && shape2 && shape1->size()==shape2->size();
+	for (size_t i=0; same && i<shape1->size(); i++)
+		same = fabs((*shape1)[i]-(*shape2)[i])<=SHAPE_TOLERANCE;
+	if (!same)
+		result.numDifferingShapes++;
+	return same;
+}
+
+/**
+ * @brief Compare the events of two blocks by value
+ */
+bool same_block(ExternalSequence &seq1, const BlockView &block1, ExternalSequence &seq2, const BlockView &block2, Comparison &result)
+{
+	bool same = block1.GetDuration()==block2.GetDuration() && block1.GetDelay()==block2.GetDelay();
+	for (int e=0; e<NUM_EVENTS; e++)
+		same &= (block1.GetEventIndex((Event)e)>0) == (block2.GetEventIndex((Event)e)>0);
+	if (!same)
+		return false;
+
+	if (block1.isRF()) {
+		const RFEvent &rf1 = block1.GetRFEvent(), &rf2 = block2.GetRFEvent();
+		same &= rf1.amplitude==rf2.amplitude && rf1.freqOffset==rf2.freqOffset && rf1.phaseOffset==rf2.phaseOffset && rf1.delay==rf2.delay;
+		same &= same_shape(seq1,rf1.magShape,seq2,rf2.magShape,result);
+		same &= same_shape(seq1,rf1.phaseShape,seq2,rf2.phaseShape,result);
+	}
+	for (int i=0; i<NUM_GRADS; i++) {
+		const GradEvent &grad1 = block1.GetGradEvent(i), &grad2 = block2.GetGradEvent(i);
+		same &= grad1.amplitude==grad2.amplitude && grad1.delay==grad2.delay && grad1.rampUpTime==grad2.rampUpTime
+			&& grad1.flatTime==grad2.flatTime && grad1.rampDownTime==grad2.rampDownTime;
+		same &= same_shape(seq1,grad1.shape,seq2,grad2.shape,result);
+	}
+	if (block1.isADC()) {
+		const ADCEvent &adc1 = block1.GetADCEvent(), &adc2 = block2.GetADCEvent();
+		same &= adc1.numSamples==adc2.numSamples && adc1.dwellTime==adc2.dwellTime && adc1.delay==adc2.delay
+			&& adc1.freqOffset==adc2.freqOffset && adc1.phaseOffset==adc2.phaseOffset;
+	}
+	if (block1.GetEventIndex(CTRL)>0) {
+		const ControlEvent &control1 = block1.GetControlEvent(), &control2 = block2.GetControlEvent();
+		same &= control1.type==control2.type && (control1.type==ControlEvent::ROTATION ||
+			(control1.triggerType==control2.triggerType && control1.duration==control2.duration));
+		for (int i=0; control1.type==ControlEvent::ROTATION && i<9; i++)
+			same &= control1.rotMatrix[i]==control2.rotMatrix[i];
+	}
+	return same;
+}
+
+/**
+ * @brief Compare a sequence with the sequence written by rewrite_sequence() and print the result
+ *
+ * Besides the blocks and the sizes of the libraries, the shapes of the original
+ * sequence are compressed with ExternalSequence::compressShape() and expanded
+ * again with ExternalSequence::decompressShape().
+ *
+ * @return false if the blocks cannot be read
+ */
+bool compare_sequences(ExternalSequence &seq, int windowSize, ExternalSequence &written)
+{
+	Comparison result;
+	BlockView writtenBlock;
+	bool ok = for_each_block(seq, windowSize, [&](const BlockView &block) {
+		result.numBlocks++;
+		if (!written.GetBlock(block.GetIndex(),writtenBlock) || !same_block(seq,block,written,writtenBlock,result))
+			result.numDifferingBlocks++;
+	});
+	if (!ok)
+		return false;
+
+	int numCompressed = 0, numExpanded = 0;
+	for (int id=1; id<=seq.GetNumberOfShapes(); id++) {
+		DecodedShape shape = seq.GetDecodedShape(id,SHAPE_GRADIENT);
+		if (!shape || shape->empty())
+			continue;
+		CompressedShape compressed;
+		ExternalSequence::compressShape(&(*shape)[0], (int)shape->size(), compressed);
+		numCompressed += compressed.samples.size();
+		std::vector<float> expanded(compressed.numUncompressedSamples);
+		bool same = expanded.size()==shape->size() && ExternalSequence::decompressShape(compressed,&expanded[0]);
+		for (size_t i=0; same && i<expanded.size(); i++)
+			same = fabs(expanded[i]-(*shape)[i])<=SHAPE_TOLERANCE;
+		if (same)
+			numExpanded++;
+	}
+
+	std::cout << std::setw(22) << std::left << "Number of blocks: "     << std::setw(6) << std::right << result.numBlocks << std::endl;
+	std::cout << std::setw(22) << std::left << "Written blocks: "       << std::setw(6) << std::right << written.GetNumberOfBlocks() << std::endl;
+	std::cout << std::setw(22) << std::left << "Differing blocks: "     << std::setw(6) << std::right << result.numDifferingBlocks << std::endl;
+	std::cout << std::setw(22) << std::left << "Compared shapes: "      << std::setw(6) << std::right << result.shapes.size() << std::endl;
+	std::cout << std::setw(22) << std::left << "Differing shapes: "     << std::setw(6) << std::right << result.numDifferingShapes << std::endl;
+	std::cout << std::setw(22) << std::left << "Compressed samples: "   << std::setw(6) << std::right << numCompressed << std::endl;
+	std::cout << std::setw(22) << std::left << "Expanded shapes: "      << std::setw(6) << std::right << numExpanded << std::endl;
+	std::cout << "Library sizes (original/written):" << std::endl;
+	std::cout << std::setw(22) << std::left << "  RF events: "          << std::setw(6) << std::right << seq.GetRFLibrary().size()
+		<< " / " << written.GetRFLibrary().size() << std::endl;
+	std::cout << std::setw(22) << std::left << "  Gradient events: "    << std::setw(6) << std::right << seq.GetGradientLibrary().size()
+		<< " / " << written.GetGradientLibrary().size() << std::endl;
+	std::cout << std::setw(22) << std::left << "  ADC events: "         << std::setw(6) << std::right << seq.GetADCLibrary().size()
+		<< " / " << written.GetADCLibrary().size() << std::endl;
+	std::cout << std::setw(22) << std::left << "  Delays: "             << std::setw(6) << std::right << seq.GetDelayLibrary().size()
+		<< " / " << written.GetDelayLibrary().size() << std::endl;
+	std::cout << std::setw(22) << std::left << "  Control events: "     << std::setw(6) << std::right << seq.GetControlLibrary().size()
+		<< " / " << written.GetControlLibrary().size() << std::endl;
+	std::cout << std::setw(22) << std::left << "  Shapes: "             << std::setw(6) << std::right << count_shapes(seq)
+		<< " / " << count_shapes(written) << std::endl;
+	std::cout << std::endl;
+	return true;
+}
+
+/**
+ * @brief Validate the sequence against the default hardware limits and print the report
+ */
+void validate_sequence(ExternalSequence &seq)
+{
+	HardwareLimits limits;
+	limits.ReadDefinitions(seq);
+	SequenceValidator validator(seq, limits);
+	ValidationReport report;
+	validator.validate(report);
+
+	msg_stream = &std::cout;
+	report.print();
+	for (int c=0; c<NUM_GRADS; c++)
+		std::cout << "Peak G" << "xyz"[c] << ": " << std::setprecision(6) << report.maxGradient[c] << " Hz/m, "
+			<< report.maxSlewRate[c] << " Hz/m/s" << std::endl;
+}
+
+/**
+ * @brief Predict the PNS and duty cycles with the default model and print the report
+ */
+void monitor_gradients(ExternalSequence &seq)
+{
+	GradientMonitor monitor(seq);
+	GradientReport report;
+	monitor.evaluate(report);
+
+	msg_stream = &std::cout;
+	report.print();
+}
+
+/**
+ * @brief Estimate the RF power for the given (or else the default) windows and print the report
+ */
+void estimate_sar(ExternalSequence &seq, double sarPerB1Squared, const std::vector<SarWindow> &windows)
+{
+	SarEstimator sar(seq, sarPerB1Squared);
+	if (!windows.empty())
+		sar.SetWindows(windows);
+	SarReport report;
+	sar.estimate(report);
+
+	msg_stream = &std::cout;
+	report.print();
+}
+
+/**
+ * @brief Compute the spectra of the gradients and print the results of the bands
+ */
+void analyze_spectrum(ExternalSequence &seq, int numThreads, const std::vector<ForbiddenBand> &bands)
+{
+	SpectralAnalyzer analyzer(seq);
+	analyzer.SetNumThreads(numThreads);
+	analyzer.SetForbiddenBands(bands);
+	SpectrumReport report;
+	analyzer.analyze(report);
+
+	msg_stream = &std::cout;
+	report.print();
+}
+
+/**
+ * @brief Render the gradients of the complete sequence (numSamples<0) or of a window and print them
+ */
+bool print_waveforms(ExternalSequence &seq, int numThreads, double rasterTime, double tStart, long long numSamples)
+{
+	GradientRasterizer rasterizer(seq);
+	rasterizer.SetNumThreads(numThreads);
+	std::vector<float> g[NUM_GRADS];
+	if (numSamples<0) {
+		tStart = 0;
+		if (!rasterizer.render(rasterTime, g[0], g[1], g[2]))
+			return false;
+	}
+	else {
+		for (int c=0; c<NUM_GRADS; c++)
+			g[c].resize((size_t)numSamples);
+		if (numSamples>0 && !rasterizer.render(tStart, rasterTime, (size_t)numSamples, &g[0][0], &g[1][0], &g[2][0]))
+			return false;
+	}
+
+	std::cout << std::setprecision(9);
+	for (size_t k=0; k<g[0].size(); k++)
+		std::cout << tStart + (k+0.5)*rasterTime << " " << g[0][k] << " " << g[1][k] << " " << g[2][k] << "\n";
+	std::cout.flush();
+	return true;
+}
+
+/**
+ * @brief Calculate the k-space trajectory and print the RF pulses and the ADC samples
+ */
+bool print_kspace(ExternalSequence &seq, int numThreads)
+{
+	KspaceCalculator calculator(seq);
+	calculator.SetNumThreads(numThreads);
+	if (!calculator.calculate())
+		return false;
+
+	// Times with 9 digits (ADC samples at fractions of a us), k with 6 digits
+	std::cout << std::setprecision(9);
+	const std::vector<double> &excitations = calculator.GetExcitationTimes();
+	const std::vector<double> &refocusings = calculator.GetRefocusingTimes();
+	std::cout << "Excitations:";
+	for (size_t i=0; i<excitations.size(); i++)
+		std::cout << " " << excitations[i];
+	std::cout << std::endl << "Refocusing pulses:";
+	for (size_t i=0; i<refocusings.size(); i++)
+		std::cout << " " << refocusings[i];
+	std::cout << std::endl;
+
+	const std::vector<double> &t = calculator.GetAdcTimes();
+	const std::vector<double> &kx = calculator.GetAdcTrajectory(0);
+	const std::vector<double> &ky = calculator.GetAdcTrajectory(1);
+	const std::vector<double> &kz = calculator.GetAdcTrajectory(2);
+	for (size_t i=0; i<t.size(); i++)
+		std::cout << std::setprecision(9) << t[i] << std::setprecision(6) << " " << kx[i] << " " << ky[i] << " " << kz[i] << "\n";
+	std::cout.flush();
+	return true;
+}
+
+/**
+ * @brief Simulate the sequence on a phantom and print the signal of every ADC sample
+ */
+bool print_signal(ExternalSequence &seq, int numThreads, const std::string &phantomPath)
+{
+	Phantom phantom;
+	if (!phantom.load(phantomPath))
+		return false;
+	BlochSimulator simulator(seq);
+	simulator.SetNumThreads(numThreads);
+	std::vector<std::complex<float> > signal;
+	if (!simulator.simulate(phantom, signal))
+		return false;
+
+	std::cout << std::setprecision(9);
+	for (size_t i=0; i<signal.size(); i++)
+		std::cout << signal[i].real() << " " << signal[i].imag() << "\n";
+	std::cout.flush();
+	return true;
+}
+
+/**
+ * @brief Simulate the echoes of the tissues and print them, one echo per line
+ */
+bool print_echoes(ExternalSequence &seq, int numThreads, const EpgTissues &tissues)
+{
+	EpgSimulator simulator(seq);
+	simulator.SetNumThreads(numThreads);
+	std::vector<std::complex<float> > echoes;
+	if (!simulator.simulate(tissues, echoes))
+		return false;
+
+	std::cout << "Echoes: " << simulator.GetNumEchoes() << " of " << tissues.size() << " tissues, dephasing axis "
+		<< "xyz"[simulator.GetDephasingAxis()] << ", unit " << simulator.GetDephasingUnit() << " 1/m" << std::endl;
+	std::cout << std::setprecision(9);
+	for (size_t i=0; i<echoes.size(); i++)
+		std::cout << echoes[i].real() << " " << echoes[i].imag() << ((i+1)%tissues.size()==0 ? "\n" : "  ");
+	std::cout.flush();
+	return true;
 }
 
 /**
@@ -41,35 +607,209 @@ void custom_print(const std::string &str) {
 int main(int argc, char* argv[])
 {
 	std::string path("");
-	if (argc>1) {
-		path = std::string(argv[1]);
+	int numThreads = 1;
+	int windowSize = 0;
+	bool lazyShapes = true;
+	std::string cacheDirectory;
+	bool cacheDecoded = false;
+	bool cacheVerify = false;
+	std::string rewritePath;
+	SequenceWriter::Format rewriteFormat = SequenceWriter::TEXT;
+	bool validate = false;
+	bool gradients = false;
+	double sarPerB1Squared = 0;
+	std::vector<SarWindow> sarWindows;
+	std::vector<ForbiddenBand> bands;
+	double rasterTime = 0;
+	double windowStart = 0;
+	long long windowSamples = -1;
+	bool kspace = false;
+	std::string phantomPath;
+	bool epg = false;
+	EpgTissues tissues;
+	bool dump = false;
+	for (int i=1; i<argc; i++) {
+		std::string arg(argv[i]);
+		if (arg=="--threads" && i+1<argc)
+			numThreads = atoi(argv[++i]);
+		else if (arg=="--stream" && i+1<argc)
+			windowSize = atoi(argv[++i]);
+		else if (arg=="--eager-shapes")
+			lazyShapes = false;
+		else if (arg=="--cache" && i+1<argc)
+			cacheDirectory = argv[++i];
+		else if (arg=="--cache-decoded")
+			cacheDecoded = true;
+		else if (arg=="--cache-verify")
+			cacheVerify = true;
+		else if (arg=="--rewrite" && i+2<argc && (std::string(argv[i+1])=="text" || std::string(argv[i+1])=="binary")) {
+			rewriteFormat = std::string(argv[++i])=="text" ? SequenceWriter::TEXT : SequenceWriter::BINARY;
+			rewritePath = argv[++i];
+		}
+		else if (arg=="--validate")
+			validate = true;
+		else if (arg=="--gradients")
+			gradients = true;
+		else if (arg=="--sar" && i+1<argc)
+			sarPerB1Squared = atof(argv[++i]);
+		else if (arg=="--sar-window" && i+2<argc) {
+			SarWindow window = { atof(argv[i+1]), atof(argv[i+2]) };
+			sarWindows.push_back(window);
+			i += 2;
+		}
+		else if (arg=="--band" && i+3<argc) {
+			ForbiddenBand band = { atof(argv[i+1]), atof(argv[i+2]), atof(argv[i+3]) };
+			bands.push_back(band);
+			i += 3;
+		}
+		else if (arg=="--waveforms" && i+1<argc)
+			rasterTime = atof(argv[++i]);
+		else if (arg=="--window" && i+2<argc) {
+			windowStart = atof(argv[++i]);
+			windowSamples = atoll(argv[++i]);
+		}
+		else if (arg=="--kspace")
+			kspace = true;
+		else if (arg=="--bloch" && i+1<argc)
+			phantomPath = argv[++i];
+		else if (arg=="--epg")
+			epg = true;
+		else if (arg=="--tissue" && i+4<argc) {
+			tissues.add((float)atof(argv[i+1]), (float)atof(argv[i+2]), (float)atof(argv[i+3]), (float)atof(argv[i+4]));
+			i += 4;
+		}
+		else if (arg=="--dump")
+			dump = true;
+		else if (arg.compare(0,2,"--")!=0 && path.empty())
+			path = arg;
+		else {
+			std::cerr << "Usage: parsemr [--threads N] [--stream N] [--eager-shapes] [--cache DIR] [--cache-decoded]"
+				" [--cache-verify] [--rewrite text|binary PATH] [--validate] [--gradients] [--sar K [--sar-window S LIMIT]]"
+				" [--band FMIN FMAX LIMIT] [--waveforms DT [--window T0 N]] [--kspace] [--bloch PHANTOM]"
+				" [--epg [--tissue T1 T2 B1 DB0]] [--dump] file" << std::endl;
+			return 1;
+		}
+	}
+	if ((validate || gradients || !bands.empty() || rasterTime>0 || kspace || !phantomPath.empty() || epg) && windowSize>0) {
+		std::cerr << "parsemr: --" << (validate ? "validate" : gradients ? "gradients" : !bands.empty() ? "band"
+			: rasterTime>0 ? "waveforms" : kspace ? "kspace" : !phantomPath.empty() ? "bloch" : "epg") << " needs the complete sequence, not --stream" << std::endl;
+		return 1;
 	}
 
 	// Create sequence object and assign output function
 	ExternalSequence seq;
+	if (dump || validate || gradients || sarPerB1Squared>0 || !bands.empty() || rasterTime>0 || kspace || !phantomPath.empty() || epg || !rewritePath.empty())
+		msg_stream = &std::cerr;
 	ExternalSequence::SetPrintFunction(&custom_print);
+	seq.SetLoadThreads(numThreads);
+	seq.SetStreamingMode(windowSize>0);
+	seq.SetLazyShapes(lazyShapes);
+	seq.SetCacheMode(!cacheDirectory.empty(), cacheDirectory, cacheDecoded, cacheVerify);
 
 	// Load sequence file
 	if (!seq.load(path)) {
 		std::cout << "*** ERROR Cannot load external sequence" << std::endl;
 		return 1;
 	}
+	if (!cacheDirectory.empty())
+		std::cerr << (seq.IsCached() ? "Read cache image" : "Parsed sequence file") << std::endl;
+
+	// Write the sequence and compare it with what is read back
+	if (!rewritePath.empty()) {
+		if (!rewrite_sequence(seq,windowSize,rewritePath,rewriteFormat)) {
+			std::cout << "*** ERROR Cannot write external sequence" << std::endl;
+			return 1;
+		}
+		ExternalSequence written;
+		if (!written.load(rewritePath)) {
+			std::cout << "*** ERROR Cannot load written external sequence" << std::endl;
+			return 1;
+		}
+		if (!compare_sequences(seq,windowSize,written)) {
+			std::cout << "*** ERROR Cannot read the blocks of the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (validate) {
+		validate_sequence(seq);
+		return 0;
+	}
+
+	if (gradients) {
+		monitor_gradients(seq);
+		return 0;
+	}
+
+	if (sarPerB1Squared>0) {
+		estimate_sar(seq, sarPerB1Squared, sarWindows);
+		return 0;
+	}
+
+	if (!bands.empty()) {
+		analyze_spectrum(seq, numThreads, bands);
+		return 0;
+	}
+
+	if (rasterTime>0) {
+		if (!print_waveforms(seq, numThreads, rasterTime, windowStart, windowSamples)) {
+			std::cout << "*** ERROR Cannot render the gradients of the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (kspace) {
+		if (!print_kspace(seq, numThreads)) {
+			std::cout << "*** ERROR Cannot calculate the k-space trajectory of the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (!phantomPath.empty()) {
+		if (!print_signal(seq, numThreads, phantomPath)) {
+			std::cout << "*** ERROR Cannot simulate the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (epg) {
+		if (!print_echoes(seq, numThreads, tissues)) {
+			std::cout << "*** ERROR Cannot simulate the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (dump) {
+		if (!dump_sequence(seq,windowSize)) {
+			std::cout << "*** ERROR Cannot read the blocks of the external sequence" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
 
 	// Loop through blocks and count events
-	int numRf=0, numGx=0, numGy=0, numGz=0, numAdc=0, numDelay=0;
-	for (int i=0; i<seq.GetNumberOfBlocks(); i++) {
-		SeqBlock* block = seq.GetBlock(i);
-		if (block->isADC())   numAdc++;
-		if (block->isRF())    numRf++;
-		if (block->isDelay()) numDelay++;
-		if (block->isTrapGradient(0) || block->isArbitraryGradient(0) ) numGx++;
-		if (block->isTrapGradient(1) || block->isArbitraryGradient(1) ) numGy++;
-		if (block->isTrapGradient(2) || block->isArbitraryGradient(2) ) numGz++;
-		delete block;
+	int numBlocks=0, numRf=0, numGx=0, numGy=0, numGz=0, numAdc=0, numDelay=0;
+	bool ok = for_each_block(seq, windowSize, [&](const BlockView &block) {
+		numBlocks++;
+		if (block.isADC())   numAdc++;
+		if (block.isRF())    numRf++;
+		if (block.isDelay()) numDelay++;
+		if (block.isTrapGradient(0) || block.isArbitraryGradient(0) ) numGx++;
+		if (block.isTrapGradient(1) || block.isArbitraryGradient(1) ) numGy++;
+		if (block.isTrapGradient(2) || block.isArbitraryGradient(2) ) numGz++;
+	});
+	if (!ok) {
+		std::cout << "*** ERROR Cannot read the blocks of the external sequence" << std::endl;
+		return 1;
 	}
 
 	// Display summary of sequence events
-	std::cout << std::setw(22) << std::left << "Number of blocks: "     << std::setw(4) << std::right << seq.GetNumberOfBlocks() << std::endl;
+	std::cout << std::setw(22) << std::left << "Number of blocks: "     << std::setw(4) << std::right << numBlocks << std::endl;
 	std::cout << std::setw(22) << std::left << "Number of RF pulses: "  << std::setw(4) << std::right << numRf << std::endl;
 	std::cout << std::setw(22) << std::left << "Number of GX events: "  << std::setw(4) << std::right << numGx << std::endl;
 	std::cout << std::setw(22) << std::left << "Number of GY events: "  << std::setw(4) << std::right << numGy << std::endl;
@@ -80,4 +820,3 @@ int main(int argc, char* argv[])
 
 	return 0;
 }
-
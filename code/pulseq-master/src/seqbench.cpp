@@ -0,0 +1,521 @@
+/**
+ * @file seqbench.cpp
+ *
+ * Benchmark of the sequence parser and decoder
+ * --------------------------------------------
+ *
+ * Generates synthetic sequences of configurable size (or uses the given files)
+ * and measures loading, block iteration, block decoding and shape
+ * decompression separately. The results are written as JSON.
+ */
+
+/** \example seqbench.cpp
+ *
+ * @brief Benchmark of the ExternalSequence class, built and run with `make bench`.
+ *
+ * ~~~~~~~~~~~~~
+ * seqbench [options] [file.seq ...]
+ *   --blocks N          Blocks of the synthetic sequence (default 100000)
+ *   --shape-length N    Samples of the synthetic RF and gradient shapes (default 1000)
+ *   --unique-shapes N   Distinct shapes of the synthetic sequence (default 16)
+ *   --unique-events N   Distinct phase encoding and RF phase values (default 256)
+ *   --threads N         Threads of the parallel loader (0: all cores, default)
+ *   --repeat N          Repetitions of each measurement, the fastest is reported (default 3)
+ *   --dir DIR           Directory for the synthetic files and cache images (default .)
+ *   --keep              Keep the synthetic files and cache images
+ *   --output FILE       Write the report to FILE instead of the standard output
+ * ~~~~~~~~~~~~~
+ *
+ * The synthetic sequence is written in text and in binary format. For every
+ * file the report contains the time, blocks/s, samples/s and MB/s of each
+ * measurement and the peak resident memory of the process so far. Loading is
+ * measured serially, with the parallel parser, in streaming mode and from a
+ * cache image (written to the directory given by --dir). Samples
+ * of `decode_block` are the shape samples of all decoded blocks (shapes are
+ * shared through the cache, which is cleared before the `cold` runs);
+ * `decompress_shape` expands all shapes of the file without the cache.
+ */
+
+#include "ExternalSequence.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#if !defined(VXWORKS) && (defined(__unix__) || defined(__APPLE__))
+#define HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+
+/**
+ * @brief Configuration of the benchmark
+ */
+struct BenchConfig
+{
+	int numBlocks = 100000;       /**< @brief Blocks of the synthetic sequence */
+	int shapeLength = 1000;       /**< @brief Samples of the synthetic shapes */
+	int uniqueShapes = 16;        /**< @brief Distinct shapes of the synthetic sequence */
+	int uniqueEvents = 256;       /**< @brief Distinct phase encoding and RF phase values */
+	int numThreads = 0;           /**< @brief Threads of the parallel loader */
+	int repeat = 3;               /**< @brief Repetitions of each measurement */
+	std::string dir = ".";        /**< @brief Directory for the synthetic files and cache images */
+	bool keep = false;            /**< @brief Keep the synthetic files and cache images */
+	std::string output;           /**< @brief Report file (empty: standard output) */
+	std::vector<std::string> files;  /**< @brief Files to benchmark instead of the synthetic sequence */
+};
+
+/**
+ * @brief Forward errors of the sequence library, discard all other messages
+ */
+void quiet_print(const std::string &str) {
+	if (str.find("ERROR")!=std::string::npos)
+		std::cerr << str << std::endl;
+}
+
+/**
+ * @brief Return the peak resident memory of the process in kB (0 if unknown)
+ */
+long peakRss()
+{
+#ifdef HAVE_GETRUSAGE
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)!=0)
+		return 0;
+#if defined(__APPLE__)
+	return usage.ru_maxrss/1024;   // bytes
+#else
+	return usage.ru_maxrss;        // kB
+#endif
+#else
+	return 0;
+#endif
+}
+
+/**
+ * @brief Run a measurement `repeat` times and return the fastest time in s
+ *
+ * `prepare` is called before every run and not included in the time.
+ */
+double measure(int repeat, const std::function<bool()> &run, const std::function<bool()> &prepare = std::function<bool()>())
+{
+	double best = -1.0;
+	for (int r=0; r<MAX(repeat,1); r++) {
+		if (prepare && !prepare())
+			return -1.0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!run())
+			return -1.0;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+		if (best<0 || seconds<best)
+			best = seconds;
+	}
+	return best;
+}
+
+/**
+ * @brief Write the JSON object of a measurement
+ *
+ * Rates are omitted if the corresponding count is zero.
+ */
+void writeResult(std::ostream &out, double seconds, double blocks, double samples, double bytes, const std::string &extra = "")
+{
+	out << "{\"seconds\": " << seconds;
+	if (blocks>0)
+		out << ", \"blocks\": " << (long long)blocks << ", \"blocks_per_s\": " << blocks/seconds;
+	if (samples>0)
+		out << ", \"samples\": " << (long long)samples << ", \"samples_per_s\": " << samples/seconds;
+	if (bytes>0)
+		out << ", \"mb_per_s\": " << bytes/seconds/1e6;
+	out << extra << "}";
+}
+
+/**
+ * @brief Escape a string for JSON
+ */
+std::string jsonString(const std::string &str)
+{
+	std::string escaped("\"");
+	for (size_t i=0; i<str.size(); i++) {
+		if (str[i]=='"' || str[i]=='\\')
+			escaped += '\\';
+		escaped += str[i];
+	}
+	return escaped + "\"";
+}
+
+/**
+ * @brief Write a synthetic gradient echo-like sequence
+ *
+ * Blocks cycle through: RF pulse with slice selection, phase encoding with
+ * prephasers, readout with ADC, arbitrary gradients and a delay. RF pulses
+ * and arbitrary gradients use distinct shapes of `shapeLength` samples.
+ */
+bool writeSynthetic(const BenchConfig &config, const std::string &path, SequenceWriter::Format format)
+{
+	SequenceWriter writer;
+	if (!writer.open(path, format))
+		return false;
+	std::vector<double> fov(3, 0.25);
+	writer.SetDefinition("FOV", fov);
+
+	// Shapes: one constant phase, RF magnitudes and arbitrary gradients
+	const int L = MAX(config.shapeLength, 2);
+	const int numRfShapes = MAX(1, (config.uniqueShapes-1)/2);
+	const int numGradShapes = MAX(1, config.uniqueShapes-1-numRfShapes);
+	std::vector<float> samples(L);
+	std::vector<int> rfShapes, gradShapes;
+	std::fill(samples.begin(), samples.end(), 0.0f);
+	int phaseShape = writer.AddShape(samples);
+	for (int s=0; s<numRfShapes; s++) {
+		double tbw = 2.0 + s;    // time-bandwidth product of a Hanning-windowed sinc
+		for (int i=0; i<L; i++) {
+			double t = (i+0.5)/L - 0.5;
+			double x = PI*tbw*t;
+			double sinc = (fabs(x)<1e-12) ? 1.0 : sin(x)/x;
+			samples[i] = (float)fabs(sinc*(0.5+0.5*cos(TWO_PI*t)));
+		}
+		rfShapes.push_back(writer.AddShape(samples));
+	}
+	for (int s=0; s<numGradShapes; s++) {
+		for (int i=0; i<L; i++) {
+			double t = (double)i/(L-1);
+			samples[i] = (float)(sin(PI*t)*sin(TWO_PI*(s+1)*t));
+		}
+		gradShapes.push_back(writer.AddShape(samples));
+	}
+
+	const int U = MAX(config.uniqueEvents, 1);
+	EventIDs ids;
+	for (int b=0; b<config.numBlocks; b++) {
+		memset(ids.id, 0, sizeof(ids.id));
+		int tr = b/5;
+		switch (b%5) {
+			case 0: {
+				RFEvent rf;
+				rf.amplitude   = 500.0f;
+				rf.magShape    = rfShapes[tr%numRfShapes];
+				rf.phaseShape  = phaseShape;
+				rf.phaseOffset = (float)(TWO_PI*(tr%U)/U);    // RF spoiling
+				ids.id[RF] = writer.AddRF(rf);
+				GradEvent gz;
+				gz.amplitude = 1e5f;
+				gz.rampUpTime = gz.rampDownTime = 100;
+				gz.flatTime = ((L+9)/10)*10;
+				ids.id[GZ] = writer.AddGradient(gz);
+				break;
+			}
+			case 1: {
+				GradEvent gx, gy, gz;
+				gx.amplitude = -2e5f;
+				gx.rampUpTime = gx.rampDownTime = 200;
+				gx.flatTime = 600;
+				gy.amplitude = 2e5f*((tr%U)-U/2)/MAX(U/2,1);    // phase encoding
+				gy.rampUpTime = gy.rampDownTime = 200;
+				gy.flatTime = 600;
+				gz.amplitude = -1e5f;
+				gz.rampUpTime = gz.rampDownTime = 200;
+				gz.flatTime = 200;
+				ids.id[GX] = writer.AddGradient(gx);
+				ids.id[GY] = writer.AddGradient(gy);
+				ids.id[GZ] = writer.AddGradient(gz);
+				break;
+			}
+			case 2: {
+				GradEvent gx;
+				gx.amplitude = 2e5f;
+				gx.rampUpTime = gx.rampDownTime = 200;
+				gx.flatTime = 2560;
+				ADCEvent adc;
+				adc.numSamples = 256;
+				adc.dwellTime = 10000;
+				adc.delay = 200;
+				ids.id[GX] = writer.AddGradient(gx);
+				ids.id[ADC] = writer.AddADC(adc);
+				break;
+			}
+			case 3: {
+				GradEvent gx, gy;
+				gx.amplitude = 1e5f;
+				gx.shape = gradShapes[tr%numGradShapes];
+				gy.amplitude = -1e5f;
+				gy.shape = gradShapes[(tr+1)%numGradShapes];
+				ids.id[GX] = writer.AddGradient(gx);
+				ids.id[GY] = writer.AddGradient(gy);
+				break;
+			}
+			default:
+				ids.id[DELAY] = writer.AddDelay(1000 + 10*(tr%16));
+				break;
+		}
+		if (!writer.AddBlock(ids))
+			return false;
+	}
+	return writer.close();
+}
+
+/**
+ * @brief Return the size of a file in bytes (0 if unknown)
+ */
+double fileSize(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+	return file.is_open() ? (double)file.tellg() : 0.0;
+}
+
+/**
+ * @brief Benchmark a sequence file and write its JSON report
+ */
+bool benchmarkFile(const BenchConfig &config, const std::string &path, const std::string &origin, std::ostream &out)
+{
+	const int R = config.repeat;
+	const double bytes = fileSize(path);
+	ExternalSequence seq;
+
+	// Loading
+	seq.SetLoadThreads(1);
+	double tSerial = measure(R, [&]() { return seq.load(path); });
+	if (tSerial<0) {
+		std::cerr << "Failed to load " << path << std::endl;
+		return false;
+	}
+	const double numBlocks = seq.GetNumberOfBlocks();
+	const int numShapes = seq.GetNumberOfShapes();
+	long rssLoaded = peakRss();
+
+	int numThreads = config.numThreads>0 ? config.numThreads : (int)std::thread::hardware_concurrency();
+	seq.SetLoadThreads(numThreads);
+	double tParallel = measure(R, [&]() { return seq.load(path); });
+
+	// Streaming: load without the blocks and read them from file
+	bool streamed = false;
+	double tStreaming = measure(R, [&]() {
+		ExternalSequence streaming;
+		streaming.SetStreamingMode(true);
+		if (!streaming.load(path))
+			return false;
+		streamed = streaming.IsStreaming();
+		BlockStream stream(streaming);
+		BlockView view;
+		long long count = 0;
+		while (stream.next(view))
+			count += view.GetDuration();
+		return !stream.failed();
+	});
+
+	// Cache image: the first load writes it, the measured loads map it
+	ExternalSequence cached;
+	cached.SetCacheMode(true, config.dir);
+	const std::string imagePath = ExternalSequence::GetCachePath(path, config.dir);
+	bool fromImage = false;
+	double tCached = !cached.load(path) ? -1.0 : measure(R, [&]() {
+		if (!cached.load(path))
+			return false;
+		fromImage = cached.IsCached();
+		return true;
+	});
+	const double imageBytes = fileSize(imagePath);
+	if (!config.keep)
+		remove(imagePath.c_str());
+
+	// Block iteration (views without allocation, and SeqBlock objects)
+	volatile long long sink = 0;
+	double tViews = measure(R, [&]() {
+		long long sum = 0;
+		for (const BlockView &block : seq.blocks())
+			sum += block.GetDuration() + block.GetEventIndex(ADC);
+		sink = sink + sum;
+		return true;
+	});
+	SeqBlock block;
+	double tGetBlock = measure(R, [&]() {
+		long long sum = 0;
+		for (int i=0; i<(int)numBlocks; i++) {
+			seq.GetBlock(i, block);
+			sum += block.GetDuration() + block.GetADCEvent().numSamples;
+		}
+		sink = sink + sum;
+		return true;
+	});
+
+	// Block decoding: the first pass decompresses the shapes (cold cache), later passes reuse them
+	double decodedSamples = 0;
+	auto decodeAll = [&]() {
+		double samples = 0;
+		for (int i=0; i<(int)numBlocks; i++) {
+			seq.GetBlock(i, block);
+			if (!seq.decodeBlock(&block))
+				return false;
+			samples += block.GetRFLength()*(block.GetRFPhasePtr() ? 2 : 1);
+			for (int c=0; c<NUM_GRADS; c++)
+				samples += block.GetGradientLength(c);
+		}
+		decodedSamples = samples;
+		return true;
+	};
+	double tDecodeCold = measure(R, decodeAll, [&]() { seq.SetShapeCacheSize(1); seq.SetShapeCacheSize(0); return true; });
+	double tDecodeWarm = measure(R, decodeAll);
+	block.free();
+
+	// Shape decompression of all shapes (compressed again from their decoded samples)
+	std::vector<CompressedShape> compressed;
+	double shapeSamples = 0, compressedBytes = 0;
+	for (int id=1; id<=numShapes; id++) {
+		DecodedShape samples = seq.GetDecodedShape(id, SHAPE_GRADIENT);
+		if (!samples || samples->empty())
+			continue;
+		compressed.push_back(CompressedShape());
+		ExternalSequence::compressShape(&(*samples)[0], (int)samples->size(), compressed.back());
+		shapeSamples += samples->size();
+		compressedBytes += compressed.back().samples.size()*sizeof(float);
+	}
+	int passes = (shapeSamples>0) ? (int)MAX(1.0, 1e7/shapeSamples) : 0;
+	std::vector<float> buffer;
+	double tDecompress = measure(R, [&]() {
+		for (int p=0; p<passes; p++) {
+			for (size_t s=0; s<compressed.size(); s++) {
+				buffer.resize(compressed[s].numUncompressedSamples);
+				if (!ExternalSequence::decompressShape(compressed[s], buffer.empty() ? NULL : &buffer[0]))
+					return false;
+			}
+		}
+		return true;
+	});
+
+	std::ostringstream threads, stream, image, shapes;
+	threads << ", \"threads\": " << numThreads;
+	stream << ", \"streamed\": " << (streamed ? "true" : "false");
+	image << ", \"image_bytes\": " << (long long)imageBytes << ", \"from_image\": " << (fromImage ? "true" : "false");
+	shapes << ", \"shapes\": " << compressed.size() << ", \"passes\": " << passes;
+
+	out << "    {\n";
+	out << "      \"path\": " << jsonString(path) << ",\n";
+	out << "      \"origin\": " << jsonString(origin) << ",\n";
+	out << "      \"size_bytes\": " << (long long)bytes << ",\n";
+	out << "      \"blocks\": " << (long long)numBlocks << ",\n";
+	out << "      \"shapes\": " << numShapes << ",\n";
+	out << "      \"load\": {\n";
+	out << "        \"serial\": ";    writeResult(out, tSerial, numBlocks, 0, bytes);   out << ",\n";
+	out << "        \"parallel\": ";  writeResult(out, tParallel, numBlocks, 0, bytes, threads.str()); out << ",\n";
+	out << "        \"streaming\": "; writeResult(out, tStreaming, numBlocks, 0, bytes, stream.str()); out << ",\n";
+	out << "        \"cached\": ";    writeResult(out, tCached, numBlocks, 0, bytes, image.str()); out << "\n";
+	out << "      },\n";
+	out << "      \"iterate_views\": "; writeResult(out, tViews, numBlocks, 0, 0);    out << ",\n";
+	out << "      \"get_block\": ";     writeResult(out, tGetBlock, numBlocks, 0, 0); out << ",\n";
+	out << "      \"decode_block\": {\n";
+	out << "        \"cold\": "; writeResult(out, tDecodeCold, numBlocks, decodedSamples, decodedSamples*sizeof(float)); out << ",\n";
+	out << "        \"warm\": "; writeResult(out, tDecodeWarm, numBlocks, decodedSamples, decodedSamples*sizeof(float)); out << "\n";
+	out << "      },\n";
+	out << "      \"decompress_shape\": ";
+	writeResult(out, tDecompress, 0, passes*shapeSamples, passes*shapeSamples*sizeof(float), shapes.str());
+	out << ",\n";
+	out << "      \"peak_rss_kb_after_load\": " << rssLoaded << ",\n";
+	out << "      \"peak_rss_kb\": " << peakRss() << "\n";
+	out << "    }";
+	return (tParallel>=0 && tStreaming>=0 && tCached>=0 && tDecodeCold>=0 && tDecodeWarm>=0 && tDecompress>=0);
+}
+
+/**
+ * @brief Print the command line options
+ */
+void usage()
+{
+	std::cerr << "Usage: seqbench [options] [file.seq ...]\n"
+		"  --blocks N          Blocks of the synthetic sequence (default 100000)\n"
+		"  --shape-length N    Samples of the synthetic RF and gradient shapes (default 1000)\n"
+		"  --unique-shapes N   Distinct shapes of the synthetic sequence (default 16)\n"
+		"  --unique-events N   Distinct phase encoding and RF phase values (default 256)\n"
+		"  --threads N         Threads of the parallel loader (0: all cores, default)\n"
+		"  --repeat N          Repetitions of each measurement, the fastest is reported (default 3)\n"
+		"  --dir DIR           Directory for the synthetic files and cache images (default .)\n"
+		"  --keep              Keep the synthetic files and cache images\n"
+		"  --output FILE       Write the report to FILE instead of the standard output\n"
+		"Files given on the command line are benchmarked instead of a synthetic sequence.\n";
+}
+
+/**
+ * @brief Entry point for console program
+ */
+int main(int argc, char* argv[])
+{
+	BenchConfig config;
+	for (int i=1; i<argc; i++) {
+		std::string arg(argv[i]);
+		bool hasValue = (i+1<argc);
+		if (arg=="--blocks" && hasValue)             config.numBlocks = atoi(argv[++i]);
+		else if (arg=="--shape-length" && hasValue)  config.shapeLength = atoi(argv[++i]);
+		else if (arg=="--unique-shapes" && hasValue) config.uniqueShapes = atoi(argv[++i]);
+		else if (arg=="--unique-events" && hasValue) config.uniqueEvents = atoi(argv[++i]);
+		else if (arg=="--threads" && hasValue)       config.numThreads = atoi(argv[++i]);
+		else if (arg=="--repeat" && hasValue)        config.repeat = atoi(argv[++i]);
+		else if (arg=="--dir" && hasValue)           config.dir = argv[++i];
+		else if (arg=="--output" && hasValue)        config.output = argv[++i];
+		else if (arg=="--keep")                      config.keep = true;
+		else if (arg=="--help" || arg=="-h" || arg.compare(0,2,"--")==0) {
+			usage();
+			return (arg=="--help" || arg=="-h") ? 0 : 1;
+		}
+		else
+			config.files.push_back(arg);
+	}
+	ExternalSequence::SetPrintFunction(&quiet_print);
+
+	// Files to benchmark and their origin
+	std::vector<std::pair<std::string,std::string> > inputs;
+	std::vector<std::string> generated;
+	if (config.files.empty()) {
+		const char *names[2] = { "seqbench_synthetic.seq", "seqbench_synthetic.bin" };
+		const SequenceWriter::Format formats[2] = { SequenceWriter::TEXT, SequenceWriter::BINARY };
+		for (int f=0; f<2; f++) {
+			std::string path = config.dir + "/" + names[f];
+			if (!writeSynthetic(config, path, formats[f])) {
+				std::cerr << "Failed to write " << path << std::endl;
+				return 1;
+			}
+			generated.push_back(path);
+			inputs.push_back(std::make_pair(path, std::string(formats[f]==SequenceWriter::TEXT ? "synthetic text" : "synthetic binary")));
+		}
+	} else {
+		for (size_t f=0; f<config.files.size(); f++)
+			inputs.push_back(std::make_pair(config.files[f], std::string("file")));
+	}
+
+	std::ofstream file;
+	if (!config.output.empty()) {
+		file.open(config.output.c_str());
+		if (!file.is_open()) {
+			std::cerr << "Failed to write " << config.output << std::endl;
+			return 1;
+		}
+	}
+	std::ostream &out = config.output.empty() ? std::cout : file;
+	out.precision(6);
+
+	out << "{\n";
+	out << "  \"benchmark\": \"seqbench\",\n";
+	out << "  \"config\": {\"blocks\": " << config.numBlocks << ", \"shape_length\": " << config.shapeLength
+		<< ", \"unique_shapes\": " << config.uniqueShapes << ", \"unique_events\": " << config.uniqueEvents
+		<< ", \"threads\": " << config.numThreads << ", \"repeat\": " << config.repeat
+		<< ", \"hardware_threads\": " << std::thread::hardware_concurrency() << "},\n";
+	out << "  \"files\": [\n";
+	bool ok = true;
+	for (size_t f=0; f<inputs.size(); f++) {
+		ok = benchmarkFile(config, inputs[f].first, inputs[f].second, out) && ok;
+		out << ((f+1<inputs.size()) ? ",\n" : "\n");
+	}
+	out << "  ],\n";
+	out << "  \"peak_rss_kb\": " << peakRss() << "\n";
+	out << "}\n";
+
+	if (!config.keep) {
+		for (size_t f=0; f<generated.size(); f++)
+			remove(generated[f].c_str());
+	}
+	return ok ? 0 : 1;
+}
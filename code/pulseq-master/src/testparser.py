@@ -1,7 +1,426 @@
 #!/usr/bin/env python
 
+import math
+import os
+import re
+import shutil
+import struct
+import sys
+import sysconfig
+import tempfile
 from subprocess import call
 
+base_dir = '../examples/'
+approved_dir = '../examples/approved/'
+demo_dir = '../matlab/demoSeq/'
+
+def approved(name):
+    return approved_dir + name + '.out'
+
+def output(name):
+    return base_dir + name + '.out'
+
+# Tissues of the EpgSimulator cases (T1 T2 B1 dB0)
+epg_tissues = ['--tissue', '1', '0.1', '1', '0', '--tissue', '0.8', '0.05', '0.9', '0', '--tissue', '1.5', '0.2', '1', '20']
+
+# Each case runs parsemr with the given options and compares its output with
+# an approved output or, for sequences too large to keep an approved output,
+# with the output of an earlier case. The --dump listings do not depend on how
+# the sequence is loaded, so all loader options share one approved listing.
+# Files written by parsemr go to a temporary directory, '{tmp}' in the options.
+cases = [
+    # name                options               sequence                       reference
+    ('demo_gre',          [],                   demo_dir + 'gre.seq',          approved('demo_gre')),
+    ('demo_gre_nogz',     [],                   demo_dir + 'gre_nogz.seq',     approved('demo_gre_nogz')),
+    ('demo_haste',        [],                   demo_dir + 'haste.seq',        approved('demo_haste')),
+    ('demo_trufi',        [],                   demo_dir + 'trufi.seq',        approved('demo_trufi')),
+    ('demo_tse',          [],                   demo_dir + 'tse.seq',          approved('demo_tse')),
+    ('gre_binary',        [],                   base_dir + 'gre_binary.bin',   approved('gre_binary')),
+
+    ('demo_gre_dump',     ['--dump'],           demo_dir + 'gre.seq',          approved('demo_gre_dump')),
+    ('demo_haste_dump',   ['--dump'],           demo_dir + 'haste.seq',        approved('demo_haste_dump')),
+    ('demo_trufi_dump',   ['--dump'],           demo_dir + 'trufi.seq',        approved('demo_trufi_dump')),
+    ('demo_tse_dump',     ['--dump'],           demo_dir + 'tse.seq',          approved('demo_tse_dump')),
+    ('gre_binary_dump',   ['--dump'],           base_dir + 'gre_binary.bin',   approved('gre_binary_dump')),
+    ('demo_gre_nogz_dump', ['--dump'],          demo_dir + 'gre_nogz.seq',     approved('demo_gre_nogz_dump')),
+    # Version 1.2.1 binary files in the layout of writeBinary.m, with the delays
+    # of RF pulses and gradients. They list as the text files, except for the
+    # non-numeric definition Name, which MATLAB stores as NaN.
+    ('demo_gre_bin_dump', ['--dump'],           demo_dir + 'gre.bin',          approved('demo_gre_bin_dump')),
+    ('demo_trufi_bin_dump', ['--dump'],         demo_dir + 'trufi.bin',        approved('demo_trufi_bin_dump')),
+    ('QSeq_dump',         ['--dump'],           '../QSeq.seq',                 None),
+
+    # Parallel parsing, the [BLOCKS] section of QSeq.seq is split into chunks
+    ('demo_gre_threads',  ['--threads','4','--dump'], demo_dir + 'gre.seq',    approved('demo_gre_dump')),
+    ('demo_tse_threads',  ['--threads','4','--dump'], demo_dir + 'tse.seq',    approved('demo_tse_dump')),
+    ('QSeq_threads',      ['--threads','4','--dump'], '../QSeq.seq',           output('QSeq_dump')),
+
+    # Streaming mode, the window of 64 blocks is refilled several times
+    ('demo_gre_stream',   ['--stream','64','--dump'], demo_dir + 'gre.seq',    approved('demo_gre_dump')),
+    ('demo_trufi_stream', ['--stream','64','--dump'], demo_dir + 'trufi.seq',  approved('demo_trufi_dump')),
+    ('gre_binary_stream', ['--stream','64','--dump'], base_dir + 'gre_binary.bin', approved('gre_binary_dump')),
+    ('QSeq_stream',       ['--stream','64','--dump'], '../QSeq.seq',           output('QSeq_dump')),
+
+    # The listings above decode shapes parsed on first use, these parse all
+    # samples while loading (also in parallel and while streaming)
+    ('demo_haste_eager',  ['--eager-shapes','--dump'], demo_dir + 'haste.seq', approved('demo_haste_dump')),
+    ('demo_trufi_eager',  ['--eager-shapes','--dump'], demo_dir + 'trufi.seq', approved('demo_trufi_dump')),
+    ('demo_tse_eager',    ['--eager-shapes','--threads','4','--dump'], demo_dir + 'tse.seq', approved('demo_tse_dump')),
+    ('demo_tse_eager_stream', ['--eager-shapes','--stream','64','--dump'], demo_dir + 'tse.seq', approved('demo_tse_dump')),
+
+    # SequenceValidator reports with the default hardware limits. The RF pulses
+    # of gre_nogz.seq start after a delay and end with their blocks, only the
+    # 10 us ramps of its spoilers exceed the slew rate.
+    ('demo_gre_validate',      ['--validate'],  demo_dir + 'gre.seq',      approved('demo_gre_validate')),
+    ('demo_gre_nogz_validate', ['--validate'],  demo_dir + 'gre_nogz.seq', approved('demo_gre_nogz_validate')),
+    ('demo_tse_validate',      ['--validate','--threads','4'], demo_dir + 'tse.seq', approved('demo_tse_validate')),
+
+    # GradientMonitor reports with the default PNS model (IEC rheobase and
+    # chronaxie, 0.2 m effective length) and the 10 s duty cycle window. The
+    # short ramps of trufi.seq exceed the PNS limit.
+    ('demo_gre_gradients',     ['--gradients'], demo_dir + 'gre.seq',      approved('demo_gre_gradients')),
+    ('epi_gradients',          ['--gradients'], '../epi.seq',              approved('epi_gradients')),
+    ('demo_trufi_gradients',   ['--gradients'], demo_dir + 'trufi.seq',    approved('demo_trufi_gradients')),
+
+    # SarEstimator reports with 0.08 W/kg per uT^2. The sequences are shorter
+    # than the default 10 s and 6 min windows, which average their energy over
+    # the full length. The short windows of haste.seq start at a pulse.
+    ('demo_tse_sar',           ['--sar','0.08'], demo_dir + 'tse.seq',     approved('demo_tse_sar')),
+    ('demo_tse_sar_stream',    ['--sar','0.08','--stream','64'], demo_dir + 'tse.seq', approved('demo_tse_sar')),
+    ('demo_haste_sar',         ['--sar','0.08'], demo_dir + 'haste.seq',   approved('demo_haste_sar')),
+    ('demo_haste_sar_windows', ['--sar','0.08','--sar-window','0.5','4','--sar-window','0.05','1'],
+     demo_dir + 'haste.seq', approved('demo_haste_sar_windows')),
+
+    # SpectralAnalyzer results of two bands, computed with one thread and with
+    # four. The averaged RMS of GZ exceeds the limit in both bands.
+    ('demo_tse_spectrum',          ['--band','530','650','5000','--band','1000','1300','5000'],
+     demo_dir + 'tse.seq', approved('demo_tse_spectrum')),
+    ('demo_tse_spectrum_threads',  ['--threads','4','--band','530','650','5000','--band','1000','1300','5000'],
+     demo_dir + 'tse.seq', approved('demo_tse_spectrum')),
+
+    # KspaceCalculator trajectories at the ADC samples. The readouts of gre.seq
+    # span kx = -16..15 times 1/FOV, the spokes of gre_rad.seq pass through the
+    # centre. The excitations split the calculation between threads.
+    ('demo_gre_kspace',            ['--kspace'], demo_dir + 'gre.seq',       approved('demo_gre_kspace')),
+    ('demo_gre_rad_kspace',        ['--kspace'], demo_dir + 'gre_rad.seq',   approved('demo_gre_rad_kspace')),
+    ('demo_gre_rad_kspace_threads', ['--kspace','--threads','4'], demo_dir + 'gre_rad.seq', approved('demo_gre_rad_kspace')),
+
+    # BlochSimulator signal of the 5x5 phantom written by examples/phantom.m
+    ('demo_gre_bloch',             ['--bloch', base_dir + 'phantom.bin'], demo_dir + 'gre.seq', approved('demo_gre_bloch')),
+
+    # EpgSimulator echo trains of three tissues, and the number
+    # of echoes without tissues, which returns no amplitudes
+    ('demo_tse_epg',               ['--epg'] + epg_tissues, demo_dir + 'tse.seq',   approved('demo_tse_epg')),
+    ('demo_trufi_epg',             ['--epg'] + epg_tissues, demo_dir + 'trufi.seq', approved('demo_trufi_epg')),
+    ('demo_tse_epg_empty',         ['--epg'],               demo_dir + 'tse.seq',   approved('demo_tse_epg_empty')),
+
+    # Sequences written with SequenceWriter in both formats and read back. All
+    # events are added again for every block, so the written libraries show the
+    # duplicates found. Shapes are compressed again and must match within 1e-6.
+    ('demo_gre_rewrite_text',     ['--rewrite','text','{tmp}/gre.seq'],     demo_dir + 'gre.seq',   approved('demo_gre_rewrite')),
+    ('demo_gre_rewrite_binary',   ['--rewrite','binary','{tmp}/gre.bin'],   demo_dir + 'gre.seq',   approved('demo_gre_rewrite')),
+    ('demo_trufi_rewrite_text',   ['--rewrite','text','{tmp}/trufi.seq'],   demo_dir + 'trufi.seq', approved('demo_trufi_rewrite')),
+    ('demo_trufi_rewrite_binary', ['--rewrite','binary','{tmp}/trufi.bin'], demo_dir + 'trufi.seq', approved('demo_trufi_rewrite')),
+    ('demo_tse_rewrite_text',     ['--rewrite','text','{tmp}/tse.seq'],     demo_dir + 'tse.seq',   approved('demo_tse_rewrite')),
+    ('demo_tse_rewrite_binary',   ['--rewrite','binary','{tmp}/tse.bin'],   demo_dir + 'tse.seq',   approved('demo_tse_rewrite')),
+    ('gre_binary_rewrite_text',   ['--rewrite','text','{tmp}/gre_binary.seq'], base_dir + 'gre_binary.bin', approved('gre_binary_rewrite')),
+    ('QSeq_rewrite_stream',       ['--stream','64','--rewrite','text','{tmp}/QSeq.seq'], '../QSeq.seq', approved('QSeq_rewrite')),
+]
+
+# Cache images of a copy of gre.seq in the temporary directory. Each step
+# changes the copy or its image and lists the sequence with --cache. The listing
+# must equal the approved one whether the image or the file was read, and the
+# image must have been read or (re)written as expected.
+def cache_steps(seq_path, cache_dir):
+    def image():
+        return [os.path.join(cache_dir, f) for f in os.listdir(cache_dir) if f.endswith('.cache')][0]
+    def touch():
+        st = os.stat(seq_path)
+        os.utime(seq_path, ns=(st.st_atime_ns, st.st_mtime_ns + 10**9))
+    def append():
+        with open(seq_path, 'a') as f:
+            f.write('# comment\n')
+    def truncate():
+        with open(image(), 'r+b') as f:
+            f.truncate(os.path.getsize(image()) // 2)
+    def corrupt(offset):
+        def action():
+            with open(image(), 'r+b') as f:
+                f.seek(offset if offset >= 0 else os.path.getsize(image()) + offset)
+                byte = f.read(1)
+                f.seek(-1, 1)
+                f.write(bytes([byte[0] ^ 0x01]))
+        return action
+    def remove():
+        os.remove(image())
+
+    return image, [
+        # name                    action        options              read    written
+        ('cache_new',             None,         [],                  False,  True),
+        ('cache_hit',             None,         [],                  True,   False),
+        ('cache_touched',         touch,        [],                  True,   True),   # same content, rehashed
+        ('cache_touched_hit',     None,         [],                  True,   False),
+        ('cache_verified_hit',    None,         ['--cache-verify'],  True,   False),
+        ('cache_stale',           append,       [],                  False,  True),
+        ('cache_truncated',       truncate,     [],                  False,  True),
+        ('cache_corrupt_header',  corrupt(72),  [],                  False,  True),   # the sequence version
+        ('cache_corrupt_table',   corrupt(120), [],                  False,  True),   # the offset of the blocks
+        ('cache_corrupt_data',    corrupt(-8),  ['--cache-verify'],  False,  True),   # the last shape samples
+        ('cache_decoded_new',     remove,       ['--cache-decoded'], False,  True),
+        ('cache_decoded_hit',     None,         ['--cache-decoded'], True,   False),
+        ('cache_decoded_corrupt', corrupt(-8),  ['--cache-decoded', '--cache-verify'], False,  True),   # the last decoded samples
+    ]
+
+# Malformed copies of gre.seq and gre.bin in the temporary directory. Loading
+# must fail with the given error instead of crashing or dropping data.
+def replace_text(old, new):
+    def change(data):
+        return data.replace(old.encode(), new.encode(), 1)
+    return change
+
+def set_shape_field(offset, value):
+    """Set an int64 field of the first binary shape (20: uncompressed, 28: compressed samples)"""
+    def change(data):
+        data = bytearray(data)
+        start = data.index(struct.pack('<Q', (0xFFFFFFFF << 32) | 8))
+        struct.pack_into('<q', data, start + offset, value)
+        return bytes(data)
+    return change
+
+def truncate(size):
+    def change(data):
+        return data[:-size]
+    return change
+
+malformed = [
+    # name                          sequence   change                                            error
+    ('malformed_negative_text',     'gre.seq', replace_text('num_samples 4020', 'num_samples -5'),
+     "*** ERROR: failed to decode 'numSamples' in line 288"),
+    ('malformed_overflow_text',     'gre.seq', replace_text('num_samples 4020', 'num_samples 4294967301'),
+     "*** ERROR: failed to decode 'numSamples' in line 288"),
+    ('malformed_negative_binary',   'gre.bin', set_shape_field(20, -5),
+     "*** ERROR: shape 1 has an invalid number of samples -5"),
+    ('malformed_overflow_binary',   'gre.bin', set_shape_field(20, 2**31),
+     "*** ERROR: shape 1 has an invalid number of samples 2147483648"),
+    ('malformed_compressed_binary', 'gre.bin', set_shape_field(28, 2**61),
+     "*** ERROR: binary section [SHAPES] is truncated or corrupt"),
+    ('malformed_truncated_binary',  'gre.bin', truncate(100),
+     "*** ERROR: binary section [SHAPES] is truncated or corrupt"),
+]
+
+def test_malformed(tmp_dir):
+    ok = True
+    for name, sequence, change, error in malformed:
+        path = os.path.join(tmp_dir, name + os.path.splitext(sequence)[1])
+        with open(demo_dir + sequence, 'rb') as f:
+            data = change(f.read())
+        with open(path, 'wb') as f:
+            f.write(data)
+        status = run_parsemr(name, ['--dump'], path)
+        with open(base_dir + name + '.log', 'r') as log:
+            same = status == 1 and '# ' + error + '\n' in log.readlines()
+
+        result = "ok" if same else "not ok"
+        print("Comparing output {0}: {1}".format(name,result))
+        ok = ok & same
+    return ok
+
+# Sinusoidal GX of amplitude 1e5 Hz/m at 40 cycles per segment of 4096 samples
+# (976.5625 Hz), covering 16 segments of the default overlap exactly. The RMS
+# of the band around the frequency must be amplitude/sqrt(2), the RMS of a band
+# elsewhere must vanish, with one thread and with four.
+spectrum_samples = 4096 + 15*2048
+spectrum_cycles = 40.0/4096
+
+def write_sine(path):
+    shape = [math.sin(2*math.pi*spectrum_cycles*(i + 0.5)) for i in range(spectrum_samples)]
+    derivative = [shape[0]] + [shape[i] - shape[i-1] for i in range(1, spectrum_samples)]
+    samples = ['{0:.9g}'.format(d) for d in derivative]
+    assert all(samples[i] != samples[i-1] for i in range(1, len(samples)))    # no run-length encoding
+    with open(path, 'w') as f:
+        f.write('[VERSION]\nmajor 1\nminor 2\nrevision 1\n\n')
+        f.write('[BLOCKS]\n1 0 0 1 0 0 0\n\n')
+        f.write('[GRADIENTS]\n1 100000 1 0\n\n')
+        f.write('[SHAPES]\n\nshape_id 1\nnum_samples {0}\n'.format(spectrum_samples))
+        f.write('\n'.join(samples) + '\n')
+
+def test_spectrum(tmp_dir):
+    path = os.path.join(tmp_dir, 'sine.seq')
+    write_sine(path)
+    frequency = spectrum_cycles/10e-6
+    expected = [100000/math.sqrt(2), 0.0]
+    ok = True
+    for threads in ['1', '4']:
+        name = 'spectrum_sine_threads' + threads
+        status = run_parsemr(name, ['--threads', threads, '--band', str(frequency - 100), str(frequency + 100), '1e6',
+                                    '--band', '3000', '4000', '1e6'], path)
+        with open(output(name), 'r') as f:
+            rms = [float(m.group(1)) for m in re.finditer(r'GX: RMS (\S+) Hz/m', f.read())]
+        same = (status == 0 and len(rms) == 2 and abs(rms[0] - expected[0]) < 1e-4*expected[0]
+                and rms[1] < 1e-4*expected[0])
+
+        result = "ok" if same else "not ok"
+        print("Comparing output {0}: {1}".format(name,result))
+        ok = ok & same
+    return ok
+
+# Gradient waveforms rendered with --waveforms. Each window (partly before or
+# after the sequence, and split between threads) must equal the samples of the
+# complete waveforms at the same times, zero outside the sequence.
+windows = [
+    # name                        sequence      threads  start     samples
+    ('waveforms_window',          '../epi.seq', '1',     '12340',  '1000'),
+    ('waveforms_window_threads',  '../epi.seq', '4',     '12340',  '20000'),
+    ('waveforms_window_before',   '../epi.seq', '1',     '-1000',  '300'),
+    ('waveforms_window_after',    '../epi.seq', '1',     '514000', '300'),
+]
+
+# Copy of trufi.seq with the same rotation in every block. Its waveforms must
+# equal the rotated waveforms of the original.
+rotation = [[2/3., -1/3., 2/3.], [2/3., 2/3., -1/3.], [-1/3., 2/3., 2/3.]]
+
+def read_waveforms(name):
+    with open(output(name), 'r') as f:
+        return [[float(v) for v in line.split()] for line in f]
+
+def write_rotated(path):
+    with open(demo_dir + 'trufi.seq', 'r') as f:
+        lines = f.read().split('\n')
+    begin = lines.index('[BLOCKS]') + 1
+    end = lines.index('', begin)
+    lines[begin:end] = [line + ' 1' for line in lines[begin:end]]
+    values = ' '.join('{0:.17g}'.format(v) for row in rotation for v in row)
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines) + '\n[ROTATIONS]\n1 ' + values + '\n')
+
+def test_waveforms(tmp_dir):
+    ok = True
+    full = {}
+    for sequence in set(window[1] for window in windows):
+        name = 'waveforms_' + os.path.splitext(os.path.basename(sequence))[0]
+        status = run_parsemr(name, ['--waveforms', '10'], sequence)
+        full[sequence] = dict((s[0], s[1:]) for s in read_waveforms(name))
+        ok = ok & (status == 0)
+    for name, sequence, threads, start, samples in windows:
+        status = run_parsemr(name, ['--threads', threads, '--waveforms', '10', '--window', start, samples], sequence)
+        window = read_waveforms(name)
+        same = (status == 0 and len(window) == int(samples)
+                and all(s[1:] == full[sequence].get(s[0], [0.0, 0.0, 0.0]) for s in window))
+
+        result = "ok" if same else "not ok"
+        print("Comparing output {0}: {1}".format(name,result))
+        ok = ok & same
+
+    path = os.path.join(tmp_dir, 'trufi_rotated.seq')
+    write_rotated(path)
+    status = run_parsemr('waveforms_trufi', ['--waveforms', '10'], demo_dir + 'trufi.seq')
+    status = status | run_parsemr('waveforms_rotated', ['--waveforms', '10'], path)
+    original = read_waveforms('waveforms_trufi')
+    rotated = read_waveforms('waveforms_rotated')
+    def rotated_equal(a, b):
+        expected = [sum(rotation[i][j]*a[1+j] for j in range(3)) for i in range(3)]
+        scale = max(abs(v) for v in a[1:]) + 1.0
+        return a[0] == b[0] and all(abs(expected[i] - b[1+i]) < 1e-6*scale for i in range(3))
+    same = (status == 0 and len(original) == len(rotated) and any(any(s[1:]) for s in rotated)
+            and all(rotated_equal(a, b) for a, b in zip(original, rotated)))
+
+    result = "ok" if same else "not ok"
+    print("Comparing output {0}: {1}".format('waveforms_rotated',result))
+    return ok & same
+
+# An isochromat simulated alone takes the scalar path of the kernels of
+# BlochSimulator, in a phantom of four isochromats the SIMD path. The other
+# three have no proton density, so the signals must be identical.
+isochromat = (0.03, -0.02, 0.001, 0.9, 0.8, 0.05, 12.5)    # x y z pd t1 t2 dB0
+
+def write_phantom(path, isochromats):
+    """Write isochromats in the format of mr.writePhantom()"""
+    with open(path, 'wb') as f:
+        f.write(b'\x01phantom' + struct.pack('<q', len(isochromats)))
+        for values in zip(*isochromats):
+            f.write(struct.pack('<{0}f'.format(len(values)), *values))
+
+def test_bloch(tmp_dir):
+    empty = (0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0)
+    phantoms = [('bloch_scalar', [isochromat]), ('bloch_simd', [empty, empty, isochromat, empty])]
+    for name, isochromats in phantoms:
+        path = os.path.join(tmp_dir, name + '.bin')
+        write_phantom(path, isochromats)
+        status = run_parsemr(name, ['--bloch', path], demo_dir + 'gre.seq')
+        if status != 0:
+            break
+    same = status == 0 and cmp_lines(output('bloch_simd'), output('bloch_scalar'))
+
+    result = "ok" if same else "not ok"
+    print("Comparing output {0}: {1}".format('bloch_simd',result))
+    return same
+
+def image_id(path):
+    """Identify a version of a file, images are replaced by renaming a new file"""
+    if not os.path.exists(path):
+        return None
+    st = os.stat(path)
+    return (st.st_ino, st.st_mtime_ns, st.st_size)
+
+def test_cache(tmp_dir):
+    seq_path = os.path.join(tmp_dir, 'gre.seq')
+    cache_dir = os.path.join(tmp_dir, 'cache')
+    shutil.copy(demo_dir + 'gre.seq', seq_path)
+    os.mkdir(cache_dir)
+    image, steps = cache_steps(seq_path, cache_dir)
+
+    ok = True
+    previous = None
+    for name, action, options, read, written in steps:
+        if action is not None:
+            action()
+            previous = image_id(image()) if os.listdir(cache_dir) else None
+        status = run_parsemr(name, ['--cache', cache_dir] + options + ['--dump'], seq_path)
+        with open(base_dir + name + '.log', 'r') as log:
+            cached = 'Read cache image\n' in log.readlines()
+        current = image_id(image())
+
+        same = (status == 0 and cmp_lines(output(name), approved('demo_gre_dump'))
+                and cached == read and (current != previous) == written)
+        previous = current
+
+        result = "ok" if same else "not ok"
+        print("Comparing output {0}: {1}".format(name,result))
+        ok = ok & same
+    return ok
+
+def build_module(tmp_dir):
+    """Build the pulseqcpp module in tmp_dir, return False if Python has no headers or the build fails"""
+    include = sysconfig.get_paths()['include']
+    if not os.path.exists(os.path.join(include, 'Python.h')):
+        return False
+    module = os.path.join(tmp_dir, 'pulseqcpp' + sysconfig.get_config_var('EXT_SUFFIX'))
+    command = [os.environ.get('CXX', 'c++'), '-O2', '-std=c++11', '-shared', '-fPIC', '-pthread', '-I.', '-I' + include,
+               '../python/pulseqcpp.cpp', 'ExternalSequence.cpp', 'BlockArrays.cpp', '-o', module]
+    with open(base_dir + 'python_build.log', 'w') as log:
+        return call(command, stdout=log, stderr=log) == 0
+
+def test_python(tmp_dir):
+    if not build_module(tmp_dir):
+        print("Comparing output python: skipped (cannot build the pulseqcpp module)")
+        return True
+    env = dict(os.environ, PYTHONPATH=tmp_dir)
+    scripts = [
+        ('demo_gre_python',   ['test_pulseqcpp.py', demo_dir + 'gre.seq', approved('demo_gre_dump')]),
+        ('demo_trufi_python', ['test_pulseqcpp.py', demo_dir + 'trufi.seq', approved('demo_trufi_dump')]),
+        ('event_index',       ['test_eventindex.py']),
+    ]
+    ok = True
+    for name, arguments in scripts:
+        with open(base_dir + name + '.log', 'w') as log:
+            status = call([sys.executable, '../python/' + arguments[0]] + arguments[1:], stdout=log, stderr=log, env=env)
+        same = status == 0
+
+        result = "ok" if same else "not ok"
+        print("Comparing output {0}: {1}".format(name,result))
+        ok = ok & same
+    return ok
+
 def cmp_lines(path_1, path_2):
     """Compare two files, ignoring line-endings"""
     l1 = l2 = ' '
@@ -14,26 +433,40 @@ def cmp_lines(path_1, path_2):
                     return False
     return True
 
+def run_parsemr(name, options, filename):
+    """Run parsemr writing the output and the messages of a --dump to base_dir"""
+    with open(output(name), 'w') as f:
+        with open(base_dir + name + '.log', 'w') as log:
+            return call(["./parsemr"] + options + [filename],stdout=f,stderr=log)
+
 def main():
     print("Testing parser for open MRI format")
     print("==================================")
 
-    sequences = ['fid','gre','epi_rs']
-    base_dir = '../examples/'
-    approved_dir = '../examples/approved/'
     ok = True
+    tmp_dir = tempfile.mkdtemp()
 
-    for seq in sequences:
-        with open(base_dir + seq + '.out', 'w') as f:
-            call(["./parsemr",base_dir + seq + '.seq'],stdout=f)
+    for name, options, filename, reference in cases:
+        options = [option.format(tmp=tmp_dir) for option in options]
+        status = run_parsemr(name, options, filename)
+        if reference is None:
+            continue
 
-        same = cmp_lines(base_dir + seq + '.out',approved_dir + seq + '.out')
+        same = status == 0 and cmp_lines(output(name), reference)
 
         result = "ok" if same else "not ok"
-        print("Comparing output {0}: {1}".format(seq,result))
+        print("Comparing output {0}: {1}".format(name,result))
 
         ok = ok & same
 
+    ok = ok & test_malformed(tmp_dir)
+    ok = ok & test_spectrum(tmp_dir)
+    ok = ok & test_waveforms(tmp_dir)
+    ok = ok & test_bloch(tmp_dir)
+    ok = ok & test_cache(tmp_dir)
+    ok = ok & test_python(tmp_dir)
+
+    shutil.rmtree(tmp_dir)
     exit(0 if ok else 1)
 
 if __name__ == "__main__":